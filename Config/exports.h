@@ -14,6 +14,8 @@
 #define OPT_RW			4
 #define OPT_REMOVABLE		8
 #define OPT_INSECURE		16
+#define OPT_NO_READAHEAD	32
+#define OPT_DROP_BEHIND		64
 
 #define PASSWORD_MAXLEN   64
 
@@ -21,10 +23,10 @@
 
 extern exports	exports_nfslist;
 /* Options cache */
-extern int	exports_opts;
-extern const char *export_path; 
-extern uint32 	export_fsid;
-extern uint32   export_password_hash;
+extern UNFS3_TLS int	exports_opts;
+extern UNFS3_TLS const char *export_path;
+extern UNFS3_TLS uint32	export_fsid;
+extern UNFS3_TLS uint32	export_password_hash;
 
 extern unsigned char password[PASSWORD_MAXLEN+1];
 
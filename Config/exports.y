@@ -59,6 +59,21 @@ typedef struct {
 	struct e_host	*next;
 } e_host;
 
+/* host entry of an export, sorted by netmask and address */
+typedef struct {
+	uint32		mask;
+	uint32		addr;
+	unsigned int	index; /* position in exports file */
+	e_host		*host;
+} e_match;
+
+/* range of entries with equal netmask */
+typedef struct {
+	uint32		mask;
+	unsigned int	first;
+	unsigned int	count;
+} e_net;
+
 typedef struct {
 	char		path[NFS_MAXPATHLEN];
 	char		orig[NFS_MAXPATHLEN];
@@ -66,17 +81,32 @@ typedef struct {
 	uint32          fsid; /* export point fsid (for removables) */
 	time_t          last_mtime; /* Last returned mtime (for removables) */
 	uint32          dir_hash; /* Hash of dir contents (for removables) */
+	unsigned int	index; /* position in exports file */
+	e_match		*match; /* compiled host list */
+	unsigned int	nmatch;
+	e_net		*nets;
+	unsigned int	nnets;
 	struct e_item	*next;
 } e_item;
 
+/* node of the export tree, one path component */
+typedef struct e_node {
+	char		*name;
+	unsigned int	len;
+	struct e_node	**child; /* sorted by length and name */
+	unsigned int	nchild;
+	e_item		**items; /* exports of this path, in file order */
+	unsigned int	nitems;
+} e_node;
+
 /* export list, item, and host filled during parse */
 static e_item *e_list = NULL;
 static e_item cur_item;
 static e_host cur_host;
 
 /* last looked-up anonuid and anongid */
-static uint32 last_anonuid = ANON_NOTSPECIAL;
-static uint32 last_anongid = ANON_NOTSPECIAL;
+static UNFS3_TLS uint32 last_anonuid = ANON_NOTSPECIAL;
+static UNFS3_TLS uint32 last_anongid = ANON_NOTSPECIAL;
 
 /* mount protocol compatible variants */
 static exports ne_list = NULL;
@@ -414,6 +444,14 @@ static void add_option(const char *opt)
 		cur_host.options |= OPT_INSECURE;
 	else if (strcmp(opt,"secure") == 0)
 		cur_host.options &= ~OPT_INSECURE;
+	else if (strcmp(opt,"no_readahead") == 0)
+		cur_host.options |= OPT_NO_READAHEAD;
+	else if (strcmp(opt,"readahead") == 0)
+		cur_host.options &= ~OPT_NO_READAHEAD;
+	else if (strcmp(opt,"drop_behind") == 0)
+		cur_host.options |= OPT_DROP_BEHIND;
+	else if (strcmp(opt,"no_drop_behind") == 0)
+		cur_host.options &= ~OPT_DROP_BEHIND;
 	else
 		logmsg(LOG_WARNING, "Warning: unknown exports option `%s' ignored",
 			opt);
@@ -512,10 +550,23 @@ opt:
  * C code using yacc parser + access code for exports list
  */
 
-/* effective export list and access flag */
+/* effective export list and tree, and access flag */
 static e_item *export_list = NULL;
+static e_node *export_tree = NULL;
 static volatile int exports_access = FALSE;
 
+/* changed whenever a new export list is in effect */
+static unsigned int exports_gen = 0;
+
+/*
+ * last host lookup, consecutive requests mostly come from the same
+ * client for the same export
+ */
+static UNFS3_TLS unsigned int cache_gen = 0;
+static UNFS3_TLS const e_item *cache_item = NULL;
+static UNFS3_TLS uint32 cache_addr = 0;
+static UNFS3_TLS e_host *cache_host = NULL;
+
 /* mount protocol compatible exports list */
 exports exports_nfslist = NULL;
 
@@ -574,12 +625,191 @@ static void free_list(e_item *item)
 	
 	while (item) {
 		free_hosts(item);
+		free(item->match);
+		free(item->nets);
 		cur = item;
 		item = (e_item *) item->next;
 		free(cur);
 	}
 }
 
+/*
+ * free export tree
+ */
+static void free_tree(e_node *node)
+{
+	unsigned int i;
+
+	if (!node)
+		return;
+
+	for (i = 0; i < node->nchild; i++)
+		free_tree(node->child[i]);
+	free(node->child);
+	free(node->items);
+	free(node->name);
+	free(node);
+}
+
+/*
+ * allocate memory for the export tree or abort
+ */
+static void *tree_alloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		logmsg(LOG_EMERG, "out of memory, aborting");
+		daemon_exit(CRISIS);
+	}
+	return ptr;
+}
+
+/*
+ * get the next component of a path, its length is 0 at the end
+ */
+static const char *next_component(const char *path, unsigned int *len)
+{
+	while (*path == '/')
+		path++;
+	*len = strcspn(path, "/");
+	return path;
+}
+
+/*
+ * find the child of a node for a path component
+ *
+ * if not found, pos is where it belongs
+ */
+static e_node *find_child(e_node *node, const char *name, unsigned int len,
+			  unsigned int *pos)
+{
+	unsigned int lo = 0, hi = node->nchild, mid;
+	e_node *child;
+	int res;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		child = node->child[mid];
+		if (len != child->len)
+			res = len < child->len ? -1 : 1;
+		else
+#ifndef WIN32
+			res = strncmp(name, child->name, len);
+#else
+			res = win_utf8ncasecmp(name, child->name, len);
+#endif
+		if (res == 0)
+			return child;
+		if (res < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (pos)
+		*pos = lo;
+	return NULL;
+}
+
+/*
+ * order host entries by netmask, address, and position in exports file
+ */
+static int match_cmp(const void *a, const void *b)
+{
+	const e_match *x = a, *y = b;
+
+	if (x->mask != y->mask)
+		return x->mask < y->mask ? -1 : 1;
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	if (x->index != y->index)
+		return x->index < y->index ? -1 : 1;
+	return 0;
+}
+
+/*
+ * compile the host list of an export for lookup by address
+ */
+static void compile_hosts(e_item *item)
+{
+	e_host *host;
+	unsigned int i, n;
+
+	for (n = 0, host = item->hosts; host; host = (e_host *) host->next)
+		n++;
+
+	item->match = tree_alloc(NULL, sizeof(e_match) * (n ? n : 1));
+	item->nets = tree_alloc(NULL, sizeof(e_net) * (n ? n : 1));
+
+	for (i = 0, host = item->hosts; host; host = (e_host *) host->next) {
+		item->match[i].mask = host->mask.s_addr;
+		item->match[i].addr = host->addr.s_addr;
+		item->match[i].index = i;
+		item->match[i].host = host;
+		i++;
+	}
+	qsort(item->match, n, sizeof(e_match), match_cmp);
+	item->nmatch = n;
+
+	/* entries with equal netmask are searched by address */
+	item->nnets = 0;
+	for (i = 0; i < n; i++) {
+		if (i == 0 || item->match[i].mask != item->match[i - 1].mask) {
+			item->nets[item->nnets].mask = item->match[i].mask;
+			item->nets[item->nnets].first = i;
+			item->nets[item->nnets].count = 0;
+			item->nnets++;
+		}
+		item->nets[item->nnets - 1].count++;
+	}
+}
+
+/*
+ * build the export tree from an export list
+ */
+static e_node *compile_tree(e_item *list)
+{
+	e_node *root, *node, *child;
+	const char *p;
+	unsigned int len, pos, index = 0;
+
+	root = tree_alloc(NULL, sizeof(e_node));
+	memset(root, 0, sizeof(e_node));
+
+	for (; list; list = (e_item *) list->next) {
+		list->index = index++;
+		compile_hosts(list);
+
+		node = root;
+		for (p = next_component(list->path, &len); len;
+		     p = next_component(p + len, &len)) {
+			child = find_child(node, p, len, &pos);
+			if (!child) {
+				child = tree_alloc(NULL, sizeof(e_node));
+				memset(child, 0, sizeof(e_node));
+				child->name = tree_alloc(NULL, len + 1);
+				memcpy(child->name, p, len);
+				child->name[len] = '\0';
+				child->len = len;
+
+				node->child = tree_alloc(node->child,
+					sizeof(e_node *) * (node->nchild + 1));
+				memmove(&node->child[pos + 1], &node->child[pos],
+					sizeof(e_node *) * (node->nchild - pos));
+				node->child[pos] = child;
+				node->nchild++;
+			}
+			node = child;
+		}
+
+		node->items = tree_alloc(node->items,
+					 sizeof(e_item *) * (node->nitems + 1));
+		node->items[node->nitems++] = list;
+	}
+
+	return root;
+}
+
 /*
  * print out the current exports list (for debugging)
  */
@@ -619,6 +849,25 @@ static void clear_cur(void)
 	clear_item();
 }
 
+/*
+ * put a new export list into effect, freeing the old one
+ */
+static void exports_swap(e_item *list, exports nfslist, e_node *tree)
+{
+	e_item *old_list = export_list;
+	exports old_nfslist = exports_nfslist;
+	e_node *old_tree = export_tree;
+
+	export_list = list;
+	exports_nfslist = nfslist;
+	export_tree = tree;
+	exports_gen++;
+
+	free_tree(old_tree);
+	free_list(old_list);
+	free_nfslist(old_nfslist);
+}
+
 /*
  * parse an exports file
  */
@@ -639,10 +888,7 @@ int exports_parse(void)
 	if (!efile) {
 		logmsg(LOG_CRIT, "could not open '%s', exporting nothing",
 		       opt_exports);
-		free_list(export_list);
-		free_nfslist(exports_nfslist);
-		export_list = NULL;
-		exports_nfslist = NULL;
+		exports_swap(NULL, NULL, NULL);
 		return FALSE;
 	}
 
@@ -654,10 +900,7 @@ int exports_parse(void)
 	if (e_error) {
 		logmsg(LOG_CRIT, "syntax error in '%s', exporting nothing",
 		       opt_exports);
-		free_list(export_list);
-		free_nfslist(exports_nfslist);
-		export_list = NULL;
-		exports_nfslist = NULL;
+		exports_swap(NULL, NULL, NULL);
 		return FALSE;
 	}
 	
@@ -665,40 +908,93 @@ int exports_parse(void)
 	if (!opt_detach)
 		print_list();
 	
-	free_list(export_list);
-	free_nfslist(exports_nfslist);
-	export_list = e_list;
-	exports_nfslist = ne_list;
+	exports_swap(e_list, ne_list, compile_tree(e_list));
 	return TRUE;
 }
 
 /*
  * find a given host inside a host list, return options
+ *
+ * the first matching entry in the exports file wins
  */
 static e_host* find_host(struct in_addr remote, e_item *item,
 		     char **password, uint32 *password_hash)
 {
+	e_match *match, *best = NULL;
+	e_net *net;
 	e_host *host;
+	unsigned int i, lo, hi, mid;
+	uint32 key;
+
+	if (cache_gen == exports_gen && cache_item == item &&
+	    cache_addr == remote.s_addr)
+		host = cache_host;
+	else {
+		for (i = 0; i < item->nnets; i++) {
+			net = &item->nets[i];
+			key = remote.s_addr & net->mask;
+
+			/* first entry with this address */
+			lo = net->first;
+			hi = net->first + net->count;
+			while (lo < hi) {
+				mid = (lo + hi) / 2;
+				if (item->match[mid].addr < key)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
 
-	host = item->hosts;
-	while (host) {
-		if ((remote.s_addr & host->mask.s_addr) == host->addr.s_addr) {
-			if (password != NULL) 
-				*password = host->password;
-			if (password_hash != NULL)
-     			        *password_hash = host->password_hash;
-			return host;
+			match = &item->match[lo];
+			if (lo < net->first + net->count &&
+			    match->addr == key &&
+			    (!best || match->index < best->index))
+				best = match;
 		}
-		host = (e_host *) host->next;
+		host = best ? best->host : NULL;
+
+		cache_gen = exports_gen;
+		cache_item = item;
+		cache_addr = remote.s_addr;
+		cache_host = host;
 	}
-	return NULL;
+
+	if (host) {
+		if (password != NULL) 
+			*password = host->password;
+		if (password_hash != NULL)
+			*password_hash = host->password_hash;
+	}
+	return host;
 }
 
 /* options cache */
-int exports_opts = -1;
-const char *export_path = NULL; 
-uint32 export_fsid = 0;
-uint32 export_password_hash = 0;
+UNFS3_TLS int exports_opts = -1;
+UNFS3_TLS const char *export_path = NULL;
+UNFS3_TLS uint32 export_fsid = 0;
+UNFS3_TLS uint32 export_password_hash = 0;
+
+/*
+ * find the export tree nodes with exports on the way to a path
+ */
+static unsigned int find_exports(const char *path, e_node **found)
+{
+	e_node *node = export_tree;
+	const char *p = path;
+	unsigned int len, n = 0;
+
+	while (node) {
+		if (node->nitems)
+			found[n++] = node;
+		p = next_component(p, &len);
+		if (!len)
+			break;
+		node = find_child(node, p, len, NULL);
+		p += len;
+	}
+
+	return n;
+}
 
 /*
  * given a path, return client's effective options
@@ -706,9 +1002,13 @@ uint32 export_password_hash = 0;
 int exports_options(const char *path, struct svc_req *rqstp,
 		    char **password, uint32 *fsid)
 {
-	e_item *list;
+	e_node *found[NFS_MAXPATHLEN / 2 + 2];
+	unsigned int pos[NFS_MAXPATHLEN / 2 + 2];
+	e_item *item;
+	e_host *host;
 	struct in_addr remote;
-	unsigned int last_len = 0;
+	unsigned int i, n;
+	int k, last = -1;
 	
 	exports_opts = -1;
 	export_path = NULL;
@@ -717,37 +1017,45 @@ int exports_options(const char *path, struct svc_req *rqstp,
 	last_anongid = ANON_NOTSPECIAL;
 
 	/* check for client attempting to use invalid pathname */
-	if (!path || strstr(path, "/../"))
+	if (!path || strstr(path, "/../") || strlen(path) >= NFS_MAXPATHLEN)
 		return exports_opts;
 	
 	remote = get_remote(rqstp);
 
 	/* protect against SIGHUP reloading the list */
 	exports_access = TRUE;
-	
-	list = export_list;
-	while (list) {
+
+	n = find_exports(path, found);
+	memset(pos, 0, sizeof(unsigned int) * n);
+
+	/* visit matching exports in file order */
+	for (;;) {
+		k = -1;
+		for (i = 0; i < n; i++)
+			if (pos[i] < found[i]->nitems &&
+			    (k == -1 || found[i]->items[pos[i]]->index <
+					found[k]->items[pos[k]]->index))
+				k = i;
+		if (k == -1)
+			break;
+		item = found[k]->items[pos[k]++];
+
 		/* longest matching prefix wins */
-		if (strlen(list->path) > last_len    &&
-#ifndef WIN32
-		    strstr(path, list->path) == path) {
-#else
-		    !win_utf8ncasecmp(path, list->path, strlen(list->path))) {
-#endif
-		    e_host* cur_host = find_host(remote, list, password, &export_password_hash);
+		if (k > last) {
+			host = find_host(remote, item, password,
+					 &export_password_hash);
 
 			if (fsid != NULL)
-				*fsid = list->fsid;
-			if (cur_host) {
-				exports_opts = cur_host->options;
-				export_path = list->path;
-				export_fsid = list->fsid;
-				last_len = strlen(list->path);
-				last_anonuid = cur_host->anonuid;
-				last_anongid = cur_host->anongid;
+				*fsid = item->fsid;
+			if (host) {
+				exports_opts = host->options;
+				export_path = item->path;
+				export_fsid = item->fsid;
+				last = k;
+				last_anonuid = host->anonuid;
+				last_anongid = host->anongid;
 			}
 		}
-		list = (e_item *) list->next;
 	}
 	exports_access = FALSE;
 	return exports_opts;
@@ -758,20 +1066,27 @@ int exports_options(const char *path, struct svc_req *rqstp,
  */
 int export_point(const char *path)
 {
-        e_item *list;
+	e_node *found[NFS_MAXPATHLEN / 2 + 2];
+	e_node *node;
+	unsigned int i, n;
+	int res = FALSE;
+
+	if (strlen(path) >= NFS_MAXPATHLEN)
+		return FALSE;
 
 	exports_access = TRUE;
-	list = export_list;
 
-	while (list) {
-	    if (strcmp(path, list->path) == 0) {
-		exports_access = FALSE;
-		return TRUE;
-	    }
-	    list = (e_item *) list->next;
+	/* the deepest export is the only one that can be equal */
+	n = find_exports(path, found);
+	if (n > 0) {
+		node = found[n - 1];
+		for (i = 0; i < node->nitems && !res; i++)
+			if (strcmp(path, node->items[i]->path) == 0)
+				res = TRUE;
 	}
+
 	exports_access = FALSE;
-	return FALSE;
+	return res;
 }
 
 /*
@@ -20,19 +20,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "../nfs.h"
 #include "../daemon.h"
+#include "../user.h"
 #include "../backend.h"
 #include "cluster.h"
 
-/* array of dirents prefixed with master file name */
-static char **cluster_dirents = NULL;
+/*
+ * the names containing $$ in directories below the clustering path are
+ * kept sorted per directory, and are scanned again only when the
+ * directory has changed. Directories changed in the current second are
+ * not kept, since further changes in that second would go unnoticed.
+ */
+
+/* number of directories kept, must be a power of two */
+#define CLUSTER_DIRS	64
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int valid;			/* names still match the directory */
+    int count;			/* number of names */
+    char **names;		/* sorted names, pointing into buf */
+    char *buf;
+} cluster_dir_t;
+
+static cluster_dir_t cluster_dirs[CLUSTER_DIRS];
+
+/* directory of the current master file name */
+static cluster_dir_t *cluster_dir = NULL;
+
+/* tag names matching without master file name */
+#define CLUSTER_SPECIALS 4
+static const char *cluster_specials[CLUSTER_SPECIALS] = {
+    "$$CREATE=IP$$", "$$CREATE=CLIENT$$", "$$ALWAYS=IP$$", "$$ALWAYS=CLIENT$$"
+};
 
-/* number of dirents in above array */
+/*
+ * names of the directory prefixed with master file name are those from
+ * cluster_lo up to cluster_hi, the tag names are at cluster_special or
+ * -1 if not present
+ */
+static int cluster_lo = 0;
+static int cluster_hi = 0;
+static int cluster_special[CLUSTER_SPECIALS];
+
+/* number of names above, -1 on error */
 static int cluster_count = -1;
 
 /*
@@ -76,7 +115,7 @@ int want_cluster(const char *path)
  */
 static char *get_host(struct in_addr remote)
 {
-    static char buf[NFS_MAXPATHLEN];
+    static UNFS3_TLS char buf[NFS_MAXPATHLEN];
     struct hostent *entry;
     char *dot;
 
@@ -111,7 +150,7 @@ int is_host(const char *name)
 char *match_host(const char *hname, const char *entry)
 {
     char buf[NFS_MAXPATHLEN];
-    static char *part;
+    static UNFS3_TLS char *part;
 
     /* check for presence of hostname tag */
     if (!is_host(entry))
@@ -144,7 +183,7 @@ char *match_host(const char *hname, const char *entry)
  */
 char *cluster_dirname(const char *path)
 {
-    static char buf[NFS_MAXPATHLEN];
+    static UNFS3_TLS char buf[NFS_MAXPATHLEN];
 
     strcpy(buf, path);
     return dirname(buf);
@@ -155,43 +194,109 @@ char *cluster_dirname(const char *path)
  */
 char *cluster_basename(const char *path)
 {
-    static char buf[NFS_MAXPATHLEN];
+    static UNFS3_TLS char buf[NFS_MAXPATHLEN];
 
     strcpy(buf, path);
     return basename(buf);
 }
 
 /*
- * free dirent array
+ * compare function for qsort'ing the scandir list
  */
-void cluster_freedir(void)
+int compar(const void *x, const void *y)
 {
-    /* only if it was really allocated before */
-    if (cluster_dirents) {
-	while (cluster_count--)
-	    free(cluster_dirents[cluster_count]);
-	free(cluster_dirents);
-	cluster_dirents = NULL;
-    }
+    return strcmp(*(const char **) x, *(const char **) y);
 }
 
 /*
- * compare function for qsort'ing the scandir list
+ * read the names containing $$ of a directory into a cache entry
+ *
+ * the directory is read twice, to allocate the names in one go
  */
-int compar(const void *x, const void *y)
+static int cluster_readdir(cluster_dir_t * dir, const char *path)
 {
-    return strcmp(*(const char **) x, *(const char **) y);
+    backend_dirstream *scan;
+    struct dirent *entry;
+    size_t size = 0, len, used = 0;
+    int count = 0;
+
+    scan = backend_opendir(path);
+    if (!scan)
+	return FALSE;
+    while ((entry = backend_readdir(scan)))
+	if (strstr(entry->d_name, "$$")) {
+	    count++;
+	    size += strlen(entry->d_name) + 1;
+	}
+    backend_closedir(scan);
+
+    dir->names = malloc((count + 1) * sizeof(char *));
+    dir->buf = malloc(size + 1);
+    if (!dir->names || !dir->buf)
+	return FALSE;
+
+    scan = backend_opendir(path);
+    if (!scan)
+	return FALSE;
+
+    /* names added in between are left out, and the entry not kept */
+    dir->count = 0;
+    while ((entry = backend_readdir(scan)) && dir->count < count) {
+	if (!strstr(entry->d_name, "$$"))
+	    continue;
+
+	len = strlen(entry->d_name) + 1;
+	if (used + len > size)
+	    break;
+	memcpy(dir->buf + used, entry->d_name, len);
+	dir->names[dir->count++] = dir->buf + used;
+	used += len;
+    }
+    backend_closedir(scan);
+
+    qsort(dir->names, dir->count, sizeof(char *), compar);
+    return TRUE;
 }
 
 /*
- * reset euid/egid to specific values
+ * find the cache entry for a directory, reading it if needed
  */
-static void reset_ids(uid_t euid, gid_t egid)
+static cluster_dir_t *cluster_getdir(const char *path)
 {
-    if (backend_setegid(egid) || backend_seteuid(euid)) {
-	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
-	daemon_exit(CRISIS);
+    backend_statstruct buf, after;
+    cluster_dir_t *dir;
+    unsigned int hash;
+
+    if (backend_stat(path, &buf) == -1)
+	return NULL;
+
+    hash = (unsigned int) buf.st_ino * 2654435761u ^ (unsigned int) buf.st_dev;
+    dir = &cluster_dirs[(hash >> 16) & (CLUSTER_DIRS - 1)];
+
+    if (dir->valid && dir->dev == buf.st_dev && dir->ino == buf.st_ino &&
+	dir->mtime == buf.st_mtime)
+	return dir;
+
+    free(dir->names);
+    free(dir->buf);
+    dir->names = NULL;
+    dir->buf = NULL;
+    dir->count = 0;
+    dir->valid = FALSE;
+
+    if (!cluster_readdir(dir, path))
+	return NULL;
+
+    /* keep the names if they match a directory that has settled */
+    if (backend_stat(path, &after) == 0 && after.st_mtime == buf.st_mtime &&
+	buf.st_mtime < time(NULL)) {
+	dir->dev = buf.st_dev;
+	dir->ino = buf.st_ino;
+	dir->mtime = buf.st_mtime;
+	dir->valid = TRUE;
     }
+
+    return dir;
 }
 
 /*
@@ -200,61 +305,71 @@ static void reset_ids(uid_t euid, gid_t egid)
 void cluster_scandir(const char *path)
 {
     char prefix[NFS_MAXPATHLEN];
-    DIR *scan;
-    struct dirent *entry;
-    char **new, *name;
-    uid_t euid;
-    gid_t egid;
+    const char *key;
+    char **found;
+    size_t len;
+    int i, lo, hi, mid;
+    struct svc_req *req;
 
     strcpy(prefix, cluster_basename(path));
+    len = strlen(prefix);
 
     /* 
      * need to read directory as root, temporarily switch back
      */
-    euid = backend_geteuid();
-    egid = backend_getegid();
-    backend_setegid(0);
-    backend_seteuid(0);
+    req = switch_suspend();
+    cluster_dir = cluster_getdir(cluster_dirname(path));
+    switch_resume(req);
 
-    scan = backend_opendir(cluster_dirname(path));
-    if (!scan) {
+    if (!cluster_dir) {
 	cluster_count = -1;
-	reset_ids(euid, egid);
 	return;
     }
 
-    cluster_count = 0;
-    while ((entry = backend_readdir(scan))) {
-	if (strstr(entry->d_name, prefix) != entry->d_name &&
-	    strcmp(entry->d_name, "$$CREATE=IP$$") != 0 &&
-	    strcmp(entry->d_name, "$$CREATE=CLIENT$$") != 0 &&
-	    strcmp(entry->d_name, "$$ALWAYS=IP$$") != 0 &&
-	    strcmp(entry->d_name, "$$ALWAYS=CLIENT$$") != 0)
-	    continue;
+    /* binary search for the first name not sorting before the prefix */
+    lo = 0;
+    hi = cluster_dir->count;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (strcmp(cluster_dir->names[mid], prefix) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    cluster_lo = lo;
+    while (hi < cluster_dir->count &&
+	   strncmp(cluster_dir->names[hi], prefix, len) == 0)
+	hi++;
+    cluster_hi = hi;
+    cluster_count = cluster_hi - cluster_lo;
+
+    for (i = 0; i < CLUSTER_SPECIALS; i++) {
+	key = cluster_specials[i];
+	found = bsearch(&key, cluster_dir->names, cluster_dir->count,
+			sizeof(char *), compar);
+	cluster_special[i] = found ? (int) (found - cluster_dir->names) : -1;
+	if (found)
+	    cluster_count++;
+    }
+}
 
-	name = malloc(strlen(entry->d_name) + 1);
-	new = realloc(cluster_dirents, (cluster_count + 1) * sizeof(char *));
-	if (!new || !name) {
-	    cluster_freedir();
-	    cluster_count = -1;
-	    free(new);
-	    free(name);
-	    backend_closedir(scan);
-	    reset_ids(euid, egid);
-	    return;
-	}
+/*
+ * index of the next name found by cluster_scandir() before the given
+ * one, in alphanumerical order, or -1 if there is none
+ */
+static int cluster_prev(int idx)
+{
+    int i, prev;
 
-	strcpy(name, entry->d_name);
-	cluster_dirents = new;
-	cluster_dirents[cluster_count] = name;
-	cluster_count++;
-    }
+    prev = (idx < cluster_hi ? idx : cluster_hi) - 1;
+    if (prev < cluster_lo)
+	prev = -1;
 
-    backend_closedir(scan);
-    reset_ids(euid, egid);
+    for (i = 0; i < CLUSTER_SPECIALS; i++)
+	if (cluster_special[i] < idx && cluster_special[i] > prev)
+	    prev = cluster_special[i];
 
-    /* list needs to be sorted for cluster_lookup_lowlevel to work */
-    qsort(cluster_dirents, cluster_count, sizeof(char *), compar);
+    return prev;
 }
 
 /*
@@ -314,7 +429,6 @@ int cluster_lookup_lowlevel(char *path, struct svc_req *rqstp)
     char buf[NFS_MAXPATHLEN];
     int i, res = CLU_MASTER;
 
-    cluster_freedir();
     cluster_scandir(path);
 
     if (cluster_count == -1)
@@ -333,9 +447,8 @@ int cluster_lookup_lowlevel(char *path, struct svc_req *rqstp)
      *  CLIENT before ALWAYS, and also subnets are encountered
      *  in the right order
      */
-    i = cluster_count;
-    while (i--) {
-	entry = cluster_dirents[i];
+    for (i = cluster_prev(cluster_dir->count); i != -1; i = cluster_prev(i)) {
+	entry = cluster_dir->names[i];
 
 	/* match specific IP address */
 	sprintf(buf, "$$IP=%s$$", remote);
@@ -401,8 +514,8 @@ int cluster_lookup_lowlevel(char *path, struct svc_req *rqstp)
     }
 
     /* 
-     * dirent array not freed here since cluster_create may need
-     * to look at it afterwards
+     * cluster_create may look at the names afterwards, they are kept
+     * until the next scan
      */
 
     return res;
@@ -472,9 +585,8 @@ void cluster_create(char *path, struct svc_req *rqstp, nfsstat3 * nstat)
     master = cluster_basename(path);
 
     /* look for create tag */
-    i = cluster_count;
-    while (i--) {
-	entry = cluster_dirents[i];
+    for (i = cluster_prev(cluster_dir->count); i != -1; i = cluster_prev(i)) {
+	entry = cluster_dir->names[i];
 
 	/* always create IP file */
 	sprintf(buf, "$$IP=%s$$", inet_ntoa(get_remote(rqstp)));
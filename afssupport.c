@@ -45,13 +45,16 @@
 #ifdef AFS_SUPPORT
 
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <afs/venus.h>
 
 #include "fh.h"
 #include "afssupport.h"
+#include "Config/exports.h"
 
 /* This isn't declared in any AFS public header, so we declare it ourselves
  */
@@ -126,6 +129,113 @@ static int get_afs_fid(const char *path, int follow_or_fd, int32 *cell, uint32 *
     return ret;
 }
 
+/* These are defined in afsgettimes.c
+ */
+time_t afs_get_system_st_atime(struct stat *buf);
+time_t afs_get_system_st_mtime(struct stat *buf);
+time_t afs_get_system_st_ctime(struct stat *buf);
+
+/*
+ * Cache of AFS file IDs
+ *
+ * The server stats the same object several times per request, and every
+ * pioctl() is a round trip to the cache manager. FIDs are therefore kept
+ * in a direct-mapped table, keyed by the path and by whether symlinks
+ * were followed; the device and inode number cannot serve as the key,
+ * since they are not unique (see above). As extra validation, an entry
+ * is only used while the device, inode number, ctime, mtime, size, mode,
+ * and link count that stat() reports still match. Objects changed in the
+ * current second are not cached, since a new object may then carry the
+ * same attributes. Descriptors and long paths are never cached.
+ */
+
+#define AFS_FID_ENTRIES 1024	/* number of cached FIDs */
+#define AFS_FID_PATHLEN 256	/* longest path kept */
+
+struct afs_fid_entry {
+    char      path[AFS_FID_PATHLEN];	/* empty if unused */
+    int       follow;
+    dev_t     dev;
+    ino_t     ino;		/* as reported by stat() */
+    time_t    changed;	/* ctime */
+    time_t    modified;	/* mtime */
+    off_t     size;
+    mode_t    mode;
+    nlink_t   nlink;
+
+    int32     cell;
+    uint32    volume;
+    uint32    vnode;
+    uint32    unique;
+};
+
+static struct afs_fid_entry afs_fid_cache[AFS_FID_ENTRIES];
+
+static struct afs_fid_entry *afs_fid_slot(const char *path, int follow)
+{
+    uint32 key = fnv1a_32(path, follow ? 0x9e3779b1 : 0);
+
+    return &afs_fid_cache[key % AFS_FID_ENTRIES];
+}
+
+/* Get the FID of an object, given the result of stat() for it, from the
+ * cache or else from get_afs_fid(), with the same arguments.
+ *
+ * Returns zero on success, non-zero + errno otherwise.
+ */
+static int get_afs_fid_cached(struct stat *sys_buf, const char *path,
+			      int follow_or_fd, struct stat_plus_afs *buf)
+{
+    struct afs_fid_entry *entry;
+    time_t changed = afs_get_system_st_ctime(sys_buf);
+    time_t modified = afs_get_system_st_mtime(sys_buf);
+
+    if (path == NULL || strlen(path) >= AFS_FID_PATHLEN)
+	return get_afs_fid(path, follow_or_fd, &buf->afs_cell,
+			   &buf->afs_volume, &buf->afs_vnode,
+			   &buf->afs_unique);
+
+    entry = afs_fid_slot(path, follow_or_fd);
+
+    if (entry->follow == follow_or_fd && strcmp(entry->path, path) == 0 &&
+	entry->dev == sys_buf->st_dev && entry->ino == sys_buf->st_ino &&
+	entry->changed == changed && entry->modified == modified &&
+	entry->size == sys_buf->st_size && entry->mode == sys_buf->st_mode &&
+	entry->nlink == sys_buf->st_nlink)
+    {
+	buf->afs_cell   = entry->cell;
+	buf->afs_volume = entry->volume;
+	buf->afs_vnode  = entry->vnode;
+	buf->afs_unique = entry->unique;
+	return 0;
+    }
+
+    if (get_afs_fid(path, follow_or_fd, &buf->afs_cell, &buf->afs_volume,
+		    &buf->afs_vnode, &buf->afs_unique) != 0)
+	return 1;
+
+    if (changed < time(NULL))
+    {
+	strcpy(entry->path, path);
+	entry->follow   = follow_or_fd;
+	entry->dev      = sys_buf->st_dev;
+	entry->ino      = sys_buf->st_ino;
+	entry->changed  = changed;
+	entry->modified = modified;
+	entry->size     = sys_buf->st_size;
+	entry->mode     = sys_buf->st_mode;
+	entry->nlink    = sys_buf->st_nlink;
+	entry->cell     = buf->afs_cell;
+	entry->volume   = buf->afs_volume;
+	entry->vnode    = buf->afs_vnode;
+	entry->unique   = buf->afs_unique;
+    }
+    else
+	entry->path[0] = 0;
+
+    return 0;
+}
+
 uint32 afs_get_gen(struct stat_plus_afs obuf, int fd, const char *path)
 {
     if (obuf.afs_valid)
@@ -134,12 +244,6 @@ uint32 afs_get_gen(struct stat_plus_afs obuf, int fd, const char *path)
     return get_gen(obuf, fd, path);
 }
 
-/* These are defined in afsgettimes.c
- */
-time_t afs_get_system_st_atime(struct stat *buf);
-time_t afs_get_system_st_mtime(struct stat *buf);
-time_t afs_get_system_st_ctime(struct stat *buf);
-
 /* "struct stat_plus_afs" may not have the same layout as "struct stat",
  * so we assign the fields individually instead of all at once
  */
@@ -172,7 +276,7 @@ int afs_stat(const char *path, struct stat_plus_afs *buf)
 
     ASSIGN_STAT_FIELDS(buf, sys_buf);
 
-    buf->afs_valid = 0 == get_afs_fid(path, 1, &buf->afs_cell, &buf->afs_volume, &buf->afs_vnode, &buf->afs_unique);
+    buf->afs_valid = 0 == get_afs_fid_cached(&sys_buf, path, 1, buf);
 
     if (buf->afs_valid)
 	buf->st_ino = MAKE_INODE_NUMBER(buf->afs_volume, buf->afs_vnode);
@@ -192,7 +296,7 @@ int afs_fstat(int fd, struct stat_plus_afs *buf)
 
     ASSIGN_STAT_FIELDS(buf, sys_buf);
 
-    buf->afs_valid = 0 == get_afs_fid(NULL, fd, &buf->afs_cell, &buf->afs_volume, &buf->afs_vnode, &buf->afs_unique);
+    buf->afs_valid = 0 == get_afs_fid_cached(&sys_buf, NULL, fd, buf);
 
     if (buf->afs_valid)
 	buf->st_ino = MAKE_INODE_NUMBER(buf->afs_volume, buf->afs_vnode);
@@ -212,7 +316,7 @@ int afs_lstat(const char *path, struct stat_plus_afs *buf)
 
     ASSIGN_STAT_FIELDS(buf, sys_buf);
 
-    buf->afs_valid = 0 == get_afs_fid(path, 0, &buf->afs_cell, &buf->afs_volume, &buf->afs_vnode, &buf->afs_unique);
+    buf->afs_valid = 0 == get_afs_fid_cached(&sys_buf, path, 0, buf);
 
     if (buf->afs_valid)
 	buf->st_ino = MAKE_INODE_NUMBER(buf->afs_volume, buf->afs_vnode);
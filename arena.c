@@ -0,0 +1,135 @@
+/*
+ * UNFS3 per-request memory arena
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <stdlib.h>
+
+#include "nfs.h"
+#include "arena.h"
+
+/*
+ * the filehandles, names, and paths in the arguments of a request are
+ * decoded into an arena instead of being allocated one by one, and all
+ * of them are released at once after the reply has been sent
+ *
+ * an arena is a chain of blocks, which are filled from the start. A
+ * request that does not fit into the first block gets more; after it,
+ * they are replaced by a single block as large as all of them together,
+ * up to ARENA_KEEP, so that the next such request fits again without
+ * allocating. Every thread handling requests has an arena of its own.
+ */
+
+/* allocations are aligned to this */
+#define ARENA_ALIGN	8
+
+typedef struct arena_block {
+    struct arena_block *next;	/* block filled before this one */
+    size_t size;		/* bytes for allocations */
+    size_t used;		/* bytes allocated */
+} arena_block_t;
+
+/* allocations start after the header */
+#define ARENA_HEAD	((sizeof(arena_block_t) + ARENA_ALIGN - 1) & \
+			 ~(size_t) (ARENA_ALIGN - 1))
+
+static UNFS3_TLS arena_block_t *arena_head = NULL;
+static UNFS3_TLS int arena_on = FALSE;
+
+static arena_block_t *arena_block(size_t size)
+{
+    arena_block_t *block;
+
+    block = malloc(ARENA_HEAD + size);
+    if (!block)
+	return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/*
+ * start allocating for a request
+ */
+void arena_begin(void)
+{
+    arena_on = TRUE;
+}
+
+/*
+ * allocate memory that lives until arena_reset(), returns NULL outside
+ * of requests or if out of memory
+ */
+void *arena_alloc(size_t size)
+{
+    arena_block_t *block;
+    char *ptr;
+
+    if (!arena_on)
+	return NULL;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (!arena_head || arena_head->size - arena_head->used < size) {
+	block = arena_block(size > ARENA_BLOCK ? size : ARENA_BLOCK);
+	if (!block)
+	    return NULL;
+	block->next = arena_head;
+	arena_head = block;
+    }
+
+    ptr = (char *) arena_head + ARENA_HEAD + arena_head->used;
+    arena_head->used += size;
+    return ptr;
+}
+
+/*
+ * check whether memory has been allocated from the arena
+ */
+int arena_owns(const void *ptr)
+{
+    arena_block_t *block;
+    const char *start;
+
+    if (!ptr)
+	return FALSE;
+
+    for (block = arena_head; block; block = block->next) {
+	start = (const char *) block + ARENA_HEAD;
+	if ((const char *) ptr >= start &&
+	    (const char *) ptr < start + block->size)
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * release everything allocated for a request
+ */
+void arena_reset(void)
+{
+    arena_block_t *block, *next;
+    size_t total = 0;
+
+    arena_on = FALSE;
+    if (!arena_head)
+	return;
+
+    arena_head->used = 0;
+    if (!arena_head->next)
+	return;
+
+    /* the request needed more blocks, make room for it in one */
+    for (block = arena_head; block; block = next) {
+	next = block->next;
+	total += block->size;
+	free(block);
+    }
+    arena_head = arena_block(total < ARENA_KEEP ? total : ARENA_KEEP);
+}
@@ -0,0 +1,20 @@
+/*
+ * UNFS3 per-request memory arena
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_ARENA_H
+#define UNFS3_ARENA_H
+
+/* size of the first block of an arena */
+#define ARENA_BLOCK	(16 * 1024)
+
+/* upper limit for the block kept between requests */
+#define ARENA_KEEP	(256 * 1024)
+
+void arena_begin(void);
+void *arena_alloc(size_t size);
+int arena_owns(const void *ptr);
+void arena_reset(void);
+
+#endif
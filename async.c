@@ -0,0 +1,1110 @@
+/*
+ * UNFS3 asynchronous file I/O
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "mount.h"
+#include "xdr.h"
+#include "fh.h"
+#include "attr.h"
+#include "error.h"
+#include "fd_cache.h"
+#include "daemon.h"
+#include "drc.h"
+#include "worker.h"
+#include "zerocopy.h"
+#include "Config/exports.h"
+#include "backend.h"
+#include "stats.h"
+#include "async.h"
+
+#ifdef UNFS3_ASYNC
+
+#ifdef UNFS3_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef UNFS3_SYNC_THREADS
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#endif
+
+/*
+ * with -U, the file I/O of READ, UNSTABLE WRITE, and COMMIT requests
+ * received over TCP is queued on an io_uring instead of being done with
+ * blocking system calls. The request handler returns without a reply,
+ * and the reply is encoded and written to the socket by the server
+ * itself when the kernel reports the I/O as done, so that one slow disk
+ * does not hold up requests for files elsewhere. Data in the page cache
+ * is usually handled by the kernel on submission, without waiting.
+ *
+ * with -Y, the fsync() of COMMIT and stable WRITE requests received over
+ * TCP is done by sync threads in the same way; the data of a stable
+ * WRITE is written by the main thread beforehand. Requests for an fd
+ * that is waiting for a sync thread share its fsync(). A request that
+ * arrives while the fd is being synced waits for the next one, since
+ * the running one may miss data written before the request.
+ *
+ * everything the reply needs is saved with the request: its xid, the
+ * reply verifier, the file attributes known before the I/O, and the
+ * credentials for reporting attributes after it. WRITE data is taken
+ * over from the decoded arguments, READ data goes to a buffer of its
+ * own. The fd stays busy in the fd cache until the I/O is done, and
+ * failures reach the fd cache as for blocking I/O, which changes the
+ * write verifier or keeps pending errors as usual.
+ *
+ * replies are only deferred by the main thread, not with worker threads,
+ * which do their blocking I/O without holding the server lock anyway
+ */
+
+/* record mark, RPC reply header with verifier, and a small result */
+#define ASYNC_HEAD	(4 + 6 * 4 + MAX_AUTH_BYTES + 64 * 4)
+
+/* requests waiting for sync threads at a time */
+#define ASYNC_SYNC_QUEUE 256
+
+/* marker for end of free list */
+#define ASYNC_NONE	(-1)
+
+typedef struct {
+    u_int32_t proc;		/* NFS procedure, 0 if unused */
+    SVCXPRT *xprt;		/* transport for the reply, NULL if gone */
+    u_int32_t xid;		/* transaction id of the request */
+    struct opaque_auth verf;	/* reply verifier */
+    char verf_body[MAX_AUTH_BYTES];
+    struct svc_req req;		/* credentials for post-operation attributes */
+    struct authunix_parms cred;
+    drc_pending_t drc;		/* duplicate request cache entry */
+    unfs3_fh_t fh;		/* file */
+    nfs_fh3 nfh;
+    int fd;			/* fd of the file, busy in the fd cache */
+    struct iovec iov;		/* data to read or write */
+    uint64 offset;		/* file offset */
+    count3 count;		/* bytes asked for or written, or COMMIT range */
+    stable_how stable;		/* how WRITE data is committed */
+    int datasync;		/* sync file data only */
+    pre_op_attr pre;		/* attributes before WRITE or COMMIT */
+    post_op_attr attr;		/* attributes for READ */
+    int next;			/* next entry in free list or sync */
+} async_op_t;
+
+static async_op_t *async_ops = NULL;
+static unsigned int async_size = 0;
+static int async_free = ASYNC_NONE;
+
+#ifdef UNFS3_URING
+
+/* the ring, mapped from the kernel */
+static int async_fd = -1;
+static unsigned int async_entries = 0;
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sq_entries;
+static struct io_uring_cqe *cq_entries;
+
+/* queued entries not yet handed to the kernel */
+static unsigned int async_queued = 0;
+
+static int async_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int async_enter(unsigned int submit)
+{
+    return (int) syscall(__NR_io_uring_enter, async_fd, submit, 0, 0,
+			 NULL, 0);
+}
+
+/*
+ * set up the ring, returns FALSE if not available
+ */
+static int async_ring(unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+    void *sqes;
+
+    memset(&p, 0, sizeof(p));
+    async_fd = async_setup(entries, &p);
+    if (async_fd == -1)
+	return FALSE;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+	sq_len = cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, async_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+	goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	cq = sq;
+    else {
+	cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, async_fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+	    goto fail;
+    }
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, async_fd,
+		IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+	goto fail;
+
+    sq_head = (unsigned int *) (sq + p.sq_off.head);
+    sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned int *) (sq + p.sq_off.array);
+    cq_head = (unsigned int *) (cq + p.cq_off.head);
+    cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    sq_entries = sqes;
+    cq_entries = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* the completion queue is larger, requests never exceed the ring */
+    async_entries = p.sq_entries;
+    return TRUE;
+
+  fail:
+    /* mappings go away with the process */
+    close(async_fd);
+    async_fd = -1;
+    return FALSE;
+}
+
+#endif				       /* UNFS3_URING */
+
+#ifdef UNFS3_SYNC_THREADS
+
+/*
+ * one fsync() for the requests waiting for it
+ *
+ * batches wait for a sync thread in order, and are handed back to the
+ * main thread when synced; the lock protects both lists, and the
+ * waiting batches, which the main thread may still extend
+ */
+typedef struct {
+    int fd;			/* fd to sync */
+    int datasync;		/* sync file data only */
+    int first;			/* requests waiting for the sync */
+    int last;
+    int res;			/* result, 0 or -errno */
+    int next;			/* next batch in list or free list */
+} async_batch_t;
+
+typedef struct {
+    int head;
+    int tail;
+} async_list_t;
+
+static async_batch_t async_batches[ASYNC_SYNC_QUEUE];
+static int async_batch_free = ASYNC_NONE;
+static async_list_t async_waiting = { ASYNC_NONE, ASYNC_NONE };
+static async_list_t async_synced = { ASYNC_NONE, ASYNC_NONE };
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+
+/* wakes up the main thread for synced batches */
+static int async_pipe[2] = { -1, -1 };
+
+static void async_list_add(async_list_t * list, int idx)
+{
+    async_batches[idx].next = ASYNC_NONE;
+    if (list->tail == ASYNC_NONE)
+	list->head = idx;
+    else
+	async_batches[list->tail].next = idx;
+    list->tail = idx;
+}
+
+static int async_list_take(async_list_t * list)
+{
+    int idx = list->head;
+
+    if (idx != ASYNC_NONE) {
+	list->head = async_batches[idx].next;
+	if (list->head == ASYNC_NONE)
+	    list->tail = ASYNC_NONE;
+    }
+    return idx;
+}
+
+/*
+ * sync thread
+ */
+static void *async_sync_main(U(void *arg))
+{
+    async_batch_t *batch;
+    char c = 0;
+    int idx, res;
+
+    pthread_mutex_lock(&async_mutex);
+    for (;;) {
+	while ((idx = async_list_take(&async_waiting)) == ASYNC_NONE)
+	    pthread_cond_wait(&async_cond, &async_mutex);
+	batch = &async_batches[idx];
+	pthread_mutex_unlock(&async_mutex);
+
+	if (batch->datasync)
+	    res = backend_fdatasync(batch->fd);
+	else
+	    res = backend_fsync(batch->fd);
+	batch->res = res == -1 ? -errno : 0;
+
+	pthread_mutex_lock(&async_mutex);
+	async_list_add(&async_synced, idx);
+
+	/* a full pipe will wake up the main thread anyway */
+	if (write(async_pipe[1], &c, 1) == -1)
+	    c = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * start the sync threads, returns FALSE if not possible
+ */
+static int async_threads(unsigned int threads)
+{
+    sigset_t set, old;
+    pthread_t thread;
+    unsigned int i;
+
+    if (pipe(async_pipe) == -1) {
+	logmsg(LOG_WARNING, "unable to create sync pipe: %s",
+	       strerror(errno));
+	async_pipe[0] = async_pipe[1] = -1;
+	return FALSE;
+    }
+    fcntl(async_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(async_pipe[1], F_SETFL, O_NONBLOCK);
+
+    for (i = 0; i < ASYNC_SYNC_QUEUE; i++)
+	async_batches[i].next =
+	    i + 1 < ASYNC_SYNC_QUEUE ? (int) i + 1 : ASYNC_NONE;
+    async_batch_free = 0;
+
+    /* signals are left to the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for (i = 0; i < threads; i++)
+	if (pthread_create(&thread, NULL, async_sync_main, NULL) != 0) {
+	    logmsg(LOG_EMERG, "unable to create sync thread, aborting");
+	    daemon_exit(CRISIS);
+	}
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return TRUE;
+}
+
+/*
+ * queue syncing the fd of a request for the sync threads, returns FALSE
+ * if no batch is free
+ *
+ * the request joins a batch for the same fd that is still waiting
+ */
+static int async_sync_queue(async_op_t * op)
+{
+    async_batch_t *batch;
+    int idx;
+
+    op->next = ASYNC_NONE;
+
+    pthread_mutex_lock(&async_mutex);
+    for (idx = async_waiting.head; idx != ASYNC_NONE;
+	 idx = async_batches[idx].next)
+	if (async_batches[idx].fd == op->fd)
+	    break;
+
+    if (idx != ASYNC_NONE) {
+	batch = &async_batches[idx];
+	async_ops[batch->last].next = op - async_ops;
+	batch->last = op - async_ops;
+	batch->datasync = batch->datasync && op->datasync;
+    } else {
+	idx = async_batch_free;
+	if (idx == ASYNC_NONE) {
+	    pthread_mutex_unlock(&async_mutex);
+	    return FALSE;
+	}
+	batch = &async_batches[idx];
+	async_batch_free = batch->next;
+
+	batch->fd = op->fd;
+	batch->datasync = op->datasync;
+	batch->first = batch->last = op - async_ops;
+	async_list_add(&async_waiting, idx);
+	pthread_cond_signal(&async_cond);
+    }
+    pthread_mutex_unlock(&async_mutex);
+
+    /* the reply is sent on completion */
+    drc_defer(&op->drc);
+    return TRUE;
+}
+
+#endif				       /* UNFS3_SYNC_THREADS */
+
+/*
+ * set up the ring, the sync threads, and their requests, if enabled
+ */
+int async_init(void)
+{
+    unsigned int i;
+
+    if ((opt_io_ring == 0 && opt_sync_threads == 0) || worker_active())
+	return FALSE;
+
+#ifdef UNFS3_URING
+    if (opt_io_ring > 0) {
+	if (async_ring(opt_io_ring)) {
+	    async_size += async_entries;
+	    event_add(async_fd);
+	} else
+	    logmsg(LOG_WARNING, "unable to set up io_uring: %s",
+		   strerror(errno));
+    }
+#endif
+
+#ifdef UNFS3_SYNC_THREADS
+    if (opt_sync_threads > 0 && async_threads(opt_sync_threads)) {
+	async_size += ASYNC_SYNC_QUEUE;
+	event_add(async_pipe[0]);
+    }
+#endif
+
+    if (async_size == 0)
+	return FALSE;
+
+    async_ops = malloc(sizeof(async_op_t) * async_size);
+    if (!async_ops) {
+	logmsg(LOG_EMERG, "unable to allocate I/O requests, aborting");
+	daemon_exit(CRISIS);
+    }
+
+    for (i = 0; i < async_size; i++) {
+	async_ops[i].proc = 0;
+	async_ops[i].next = i + 1 < async_size ? (int) i + 1 : ASYNC_NONE;
+    }
+    async_free = 0;
+
+    return TRUE;
+}
+
+/*
+ * check whether replies to file I/O may be deferred
+ */
+int async_active(void)
+{
+    return async_ops != NULL;
+}
+
+/*
+ * hand queued entries to the kernel
+ */
+void async_submit(void)
+{
+#ifdef UNFS3_URING
+    int res;
+
+    while (async_queued > 0) {
+	res = async_enter(async_queued);
+	if (res == -1 && errno == EINTR)
+	    continue;
+	if (res <= 0) {
+	    /* entries stay queued, and are submitted with the next ones */
+	    if (res == -1 && errno != EAGAIN && errno != EBUSY)
+		logmsg(LOG_CRIT, "unable to submit I/O: %s", strerror(errno));
+	    return;
+	}
+	async_queued -= res;
+    }
+#endif
+}
+
+/*
+ * get a free request for a request handler, NULL if the reply cannot be
+ * deferred
+ */
+static async_op_t *async_get(struct svc_req *rqstp, u_int32_t proc)
+{
+    SVCXPRT *xprt = rqstp->rq_xprt;
+    async_op_t *op;
+    u_int32_t xid;
+
+    if (async_free == ASYNC_NONE)
+	return NULL;
+
+    /* removable exports report attributes relative to the export */
+    if ((exports_opts & OPT_REMOVABLE) ||
+	xprt->xp_verf.oa_length > MAX_AUTH_BYTES || !drc_xid(xprt, &xid) ||
+	get_socket_type(rqstp) != SOCK_STREAM)
+	return NULL;
+
+    op = &async_ops[async_free];
+    async_free = op->next;
+
+    op->proc = proc;
+    op->xprt = xprt;
+    op->xid = xid;
+    op->verf.oa_flavor = xprt->xp_verf.oa_flavor;
+    op->verf.oa_length = xprt->xp_verf.oa_length;
+    op->verf.oa_base = op->verf_body;
+    memcpy(op->verf_body, xprt->xp_verf.oa_base, xprt->xp_verf.oa_length);
+
+    /* get_post_buf() only looks at the credentials */
+    memset(&op->req, 0, sizeof(op->req));
+    memset(&op->cred, 0, sizeof(op->cred));
+    op->req.rq_cred.oa_flavor = rqstp->rq_cred.oa_flavor;
+    if (rqstp->rq_cred.oa_flavor == AUTH_UNIX) {
+	op->cred.aup_uid = ((struct authunix_parms *) rqstp->rq_clntcred)->
+	    aup_uid;
+	op->cred.aup_gid = ((struct authunix_parms *) rqstp->rq_clntcred)->
+	    aup_gid;
+    }
+    op->req.rq_clntcred = (caddr_t) & op->cred;
+
+    op->iov.iov_base = NULL;
+    op->iov.iov_len = 0;
+    op->stable = UNSTABLE;
+    op->datasync = FALSE;
+    return op;
+}
+
+/*
+ * return a request to the free list
+ */
+static void async_put(async_op_t * op)
+{
+    op->proc = 0;
+    op->next = async_free;
+    async_free = op - async_ops;
+}
+
+/*
+ * keep the filehandle of a request
+ */
+static void async_fh(async_op_t * op, nfs_fh3 nfh)
+{
+    memcpy(&op->fh, nfh.data.data_val, nfh.data.data_len);
+    op->nfh.data.data_len = nfh.data.data_len;
+    op->nfh.data.data_val = (char *) &op->fh;
+}
+
+#ifdef UNFS3_URING
+/*
+ * queue an entry for a request, returns FALSE if the ring is full
+ */
+static int async_queue(async_op_t * op, int opcode)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+
+    tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= async_entries)
+	return FALSE;
+
+    sqe = &sq_entries[tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = op->fd;
+    sqe->user_data = op - async_ops;
+
+    if (opcode == IORING_OP_FSYNC) {
+	if (op->datasync)
+	    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else {
+	sqe->addr = (unsigned long) &op->iov;
+	sqe->len = 1;
+	sqe->off = op->offset;
+    }
+
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    async_queued++;
+
+    /* the reply is sent on completion */
+    drc_defer(&op->drc);
+    return TRUE;
+}
+#endif				       /* UNFS3_URING */
+
+/*
+ * queue syncing the fd of a request, preferring the sync threads,
+ * returns FALSE if there is no room
+ */
+static int async_sync(async_op_t * op, int datasync)
+{
+    op->datasync = datasync;
+
+#ifdef UNFS3_SYNC_THREADS
+    if (async_pipe[0] != -1)
+	return async_sync_queue(op);
+#endif
+#ifdef UNFS3_URING
+    if (async_fd != -1)
+	return async_queue(op, IORING_OP_FSYNC);
+#endif
+    return FALSE;
+}
+
+/*
+ * post-operation attributes of the file of a request
+ */
+static post_op_attr async_attr(async_op_t * op)
+{
+    backend_statstruct buf;
+    post_op_attr attr;
+
+    if (backend_fstat(op->fd, &buf) == -1) {
+	attr.attributes_follow = FALSE;
+	return attr;
+    }
+
+    return get_post_buf(buf, &op->req);
+}
+
+/*
+ * write the reply to a request, followed by data, to its connection
+ *
+ * on failure the connection is shut down and the client sends the
+ * request again
+ */
+static void async_reply(async_op_t * op, xdrproc_t proc, caddr_t res,
+			char *data, unsigned int len)
+{
+    static char zero[4] = { 0, 0, 0, 0 };
+    char head[ASYNC_HEAD];
+    struct rpc_msg reply;
+    struct iovec iov[3];
+    unsigned int hlen, pad, n = 0;
+    u_int32_t mark;
+    ssize_t sent;
+    XDR xdrs;
+    int sock;
+
+    /* the reply is kept by the duplicate request cache in any case */
+    drc_resume(&op->drc);
+    drc_done(proc, res);
+
+    if (!op->xprt)
+	return;
+
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    sock = op->xprt->xp_fd;
+#else
+    sock = op->xprt->xp_sock;
+#endif
+
+    reply.rm_xid = op->xid;
+    reply.rm_direction = REPLY;
+    reply.rm_reply.rp_stat = MSG_ACCEPTED;
+    reply.acpted_rply.ar_verf = op->verf;
+    reply.acpted_rply.ar_stat = SUCCESS;
+    reply.acpted_rply.ar_results.where = res;
+    reply.acpted_rply.ar_results.proc = data ? (xdrproc_t) xdr_READ3res_head
+	: proc;
+
+    xdrmem_create(&xdrs, head + 4, sizeof(head) - 4, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, &reply)) {
+	logmsg(LOG_CRIT, "unable to encode RPC reply");
+	xdr_destroy(&xdrs);
+	shutdown(sock, SHUT_RDWR);
+	return;
+    }
+    hlen = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+
+    /* the reply is a single record fragment */
+    pad = data ? (4 - (len & 3)) & 3 : 0;
+    mark = htonl(0x80000000 | (hlen + len + pad));
+    memcpy(head, &mark, 4);
+
+    iov[n].iov_base = head;
+    iov[n++].iov_len = hlen + 4;
+    if (data && len > 0) {
+	iov[n].iov_base = data;
+	iov[n++].iov_len = len;
+    }
+    if (pad > 0) {
+	iov[n].iov_base = zero;
+	iov[n++].iov_len = pad;
+    }
+
+    while (n > 0) {
+	sent = writev(sock, iov, n);
+	if (sent == -1 && errno == EINTR)
+	    continue;
+	if (sent <= 0) {
+	    shutdown(sock, SHUT_RDWR);
+	    return;
+	}
+
+	/* skip what has been written */
+	while (n > 0 && (size_t) sent >= iov[0].iov_len) {
+	    sent -= iov[0].iov_len;
+	    memmove(iov, iov + 1, --n * sizeof(struct iovec));
+	}
+	if (n > 0) {
+	    iov[0].iov_base = (char *) iov[0].iov_base + sent;
+	    iov[0].iov_len -= sent;
+	}
+    }
+}
+
+#ifdef UNFS3_URING
+
+/*
+ * queue the data of a READ, returns TRUE if the reply is deferred
+ *
+ * attr holds the attributes of the file
+ */
+int async_read(struct svc_req *rqstp, READ3args * argp, int fd,
+	       post_op_attr attr)
+{
+    async_op_t *op;
+
+    if (async_fd == -1)
+	return FALSE;
+
+    op = async_get(rqstp, NFSPROC3_READ);
+    if (!op)
+	return FALSE;
+
+    /* read one more to check for eof */
+    op->iov.iov_base = malloc(argp->count + 1);
+    op->iov.iov_len = argp->count + 1;
+    op->fd = fd;
+    op->offset = argp->offset;
+    op->count = argp->count;
+    op->attr = attr;
+
+    if (!op->iov.iov_base || !async_queue(op, IORING_OP_READV)) {
+	free(op->iov.iov_base);
+	async_put(op);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void async_read_done(async_op_t * op, int res)
+{
+    READ3res result;
+
+    fd_close(op->fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
+
+    memset(&result, 0, sizeof(result));
+    result.READ3res_u.resok.file_attributes = op->attr;
+
+    if (res >= 0) {
+	/* eof if we could not read one more */
+	result.READ3res_u.resok.eof = (res <= (int) op->count);
+	if (!result.READ3res_u.resok.eof)
+	    res--;
+
+	result.status = NFS3_OK;
+	result.READ3res_u.resok.count = res;
+	result.READ3res_u.resok.data.data_len = res;
+	result.READ3res_u.resok.data.data_val = op->iov.iov_base;
+	async_reply(op, (xdrproc_t) xdr_READ3res, (caddr_t) & result,
+		    op->iov.iov_base, res);
+    } else {
+	/* EINVAL means unreadable object */
+	result.status = res == -EINVAL ? NFS3ERR_INVAL : NFS3ERR_IO;
+	async_reply(op, (xdrproc_t) xdr_READ3res, (caddr_t) & result, NULL,
+		    0);
+    }
+
+    free(op->iov.iov_base);
+}
+
+/*
+ * queue the data of an UNSTABLE WRITE, returns TRUE if the reply is
+ * deferred
+ *
+ * gathered writes are only copied, and are not worth queueing
+ */
+int async_write(struct svc_req *rqstp, WRITE3args * argp, int fd)
+{
+    async_op_t *op;
+
+    if (async_fd == -1 || argp->stable != UNSTABLE || opt_write_gather > 0)
+	return FALSE;
+
+    op = async_get(rqstp, NFSPROC3_WRITE);
+    if (!op)
+	return FALSE;
+
+    op->iov.iov_base = argp->data.data_val;
+    op->iov.iov_len = argp->data.data_len;
+    op->fd = fd;
+    op->offset = argp->offset;
+    op->count = argp->count;
+    op->pre = get_pre_cached();
+    async_fh(op, argp->file);
+
+    if (!async_queue(op, IORING_OP_WRITEV)) {
+	async_put(op);
+	return FALSE;
+    }
+
+    /* the data is freed when the write is done */
+    argp->data.data_val = NULL;
+    argp->data.data_len = 0;
+    return TRUE;
+}
+
+static void async_write_done(async_op_t * op, int res)
+{
+    WRITE3res result;
+    post_op_attr attr;
+    int res_close;
+
+    attr_cache_inval(op->nfh);
+    attr = async_attr(op);
+    res_close = fd_close(op->fd, UNFS3_FD_WRITE, FD_CLOSE_VIRT);
+
+    memset(&result, 0, sizeof(result));
+    if (res >= 0 && res_close != -1) {
+	result.status = NFS3_OK;
+	result.WRITE3res_u.resok.count = res;
+	result.WRITE3res_u.resok.committed = UNSTABLE;
+	memcpy(result.WRITE3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
+    } else {
+	/* error during write or close */
+	if (res < 0)
+	    errno = -res;
+	result.status = write_write_err();
+    }
+
+    /* overlaps with resfail */
+    result.WRITE3res_u.resok.file_wcc.before = op->pre;
+    result.WRITE3res_u.resok.file_wcc.after = attr;
+
+    async_reply(op, (xdrproc_t) xdr_WRITE3res, (caddr_t) & result, NULL, 0);
+    free(op->iov.iov_base);
+}
+
+#else				       /* UNFS3_URING */
+
+int async_read(U(struct svc_req *rqstp), U(READ3args * argp), U(int fd),
+	       U(post_op_attr attr))
+{
+    return FALSE;
+}
+
+int async_write(U(struct svc_req *rqstp), U(WRITE3args * argp), U(int fd))
+{
+    return FALSE;
+}
+
+#endif				       /* UNFS3_URING */
+
+/*
+ * queue syncing a stable WRITE, whose count bytes have been written,
+ * returns TRUE if the reply is deferred
+ *
+ * otherwise the fd is still to be closed the normal way
+ */
+int async_stable(struct svc_req *rqstp, WRITE3args * argp, int fd,
+		 count3 count)
+{
+    async_op_t *op;
+
+    op = async_get(rqstp, NFSPROC3_WRITE);
+    if (!op)
+	return FALSE;
+
+    op->fd = fd;
+    op->count = count;
+    op->stable = FILE_SYNC;
+    op->pre = get_pre_cached();
+    async_fh(op, argp->file);
+
+    /* we always do fsync(), never fdatasync() */
+    if (!async_sync(op, FALSE)) {
+	async_put(op);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void async_stable_done(async_op_t * op, int res)
+{
+    WRITE3res result;
+    post_op_attr attr;
+
+    STATS_PROBE1(sync__done, res);
+
+    attr = async_attr(op);
+    if (res < 0)
+	errno = -res;
+    res = fd_close_synced(op->fd, res < 0 ? -1 : 0);
+    attr_cache_inval(op->nfh);
+
+    memset(&result, 0, sizeof(result));
+    if (res != -1) {
+	result.status = NFS3_OK;
+	result.WRITE3res_u.resok.count = op->count;
+	result.WRITE3res_u.resok.committed = op->stable;
+	memcpy(result.WRITE3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
+    } else
+	/* error during fsync() or close() */
+	result.status = write_write_err();
+
+    /* overlaps with resfail */
+    result.WRITE3res_u.resok.file_wcc.before = op->pre;
+    result.WRITE3res_u.resok.file_wcc.after = attr;
+
+    async_reply(op, (xdrproc_t) xdr_WRITE3res, (caddr_t) & result, NULL, 0);
+}
+
+/*
+ * queue syncing the data of a file for COMMIT, returns TRUE if the reply
+ * is deferred
+ *
+ * otherwise the file has been synced the normal way, with the result of
+ * fd_sync() in *res
+ */
+int async_commit(struct svc_req *rqstp, COMMIT3args * argp, int *res)
+{
+    async_op_t *op;
+
+    op = async_get(rqstp, NFSPROC3_COMMIT);
+    if (!op) {
+	*res = fd_sync(argp->file, argp->count);
+	return FALSE;
+    }
+
+    op->fd = fd_sync_begin(argp->file, argp->count, TRUE, res);
+    if (op->fd == -1) {
+	/* nothing left to wait for */
+	async_put(op);
+	return FALSE;
+    }
+
+    op->offset = argp->offset;
+    op->count = argp->count;
+    op->pre = get_pre_cached();
+    async_fh(op, argp->file);
+
+    if (!async_sync(op, argp->count > 0)) {
+	async_put(op);
+
+	/* no room, wait for the sync here */
+	if (argp->count > 0)
+	    *res = backend_fdatasync(op->fd);
+	else
+	    *res = backend_fsync(op->fd);
+	*res = fd_sync_end(argp->file, argp->count, *res);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void async_commit_done(async_op_t * op, int res)
+{
+    COMMIT3res result;
+    post_op_attr attr;
+
+    STATS_PROBE1(sync__done, res);
+
+    /* the fd is closed for a COMMIT of the whole file */
+    attr = async_attr(op);
+    if (res < 0)
+	errno = -res;
+    res = fd_sync_end(op->nfh, op->count, res < 0 ? -1 : 0);
+    attr_cache_inval(op->nfh);
+
+    memset(&result, 0, sizeof(result));
+    if (res != -1) {
+	result.status = NFS3_OK;
+	memcpy(result.COMMIT3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
+    } else
+	/* error during fsync() or close() */
+	result.status = NFS3ERR_IO;
+
+    /* overlaps with resfail */
+    result.COMMIT3res_u.resfail.file_wcc.before = op->pre;
+    result.COMMIT3res_u.resfail.file_wcc.after = attr;
+
+    async_reply(op, (xdrproc_t) xdr_COMMIT3res, (caddr_t) & result, NULL,
+		0);
+}
+
+/*
+ * reply to a request whose I/O is done, given its result or -errno, and
+ * free it
+ */
+static void async_done(async_op_t * op, int res)
+{
+    switch (op->proc) {
+#ifdef UNFS3_URING
+	case NFSPROC3_READ:
+	    async_read_done(op, res);
+	    break;
+#endif
+	case NFSPROC3_WRITE:
+#ifdef UNFS3_URING
+	    if (op->stable == UNSTABLE) {
+		async_write_done(op, res);
+		break;
+	    }
+#endif
+	    async_stable_done(op, res);
+	    break;
+	case NFSPROC3_COMMIT:
+	    async_commit_done(op, res);
+	    break;
+    }
+    async_put(op);
+}
+
+/*
+ * handle completed I/O if fd is the ring or the sync pipe, returns FALSE
+ * otherwise
+ */
+int async_ready(int fd)
+{
+#ifdef UNFS3_URING
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+#endif
+#ifdef UNFS3_SYNC_THREADS
+    async_list_t synced;
+    char buf[64];
+    int idx, i, next;
+#endif
+
+    if (!async_ops)
+	return FALSE;
+
+#ifdef UNFS3_URING
+    if (fd == async_fd) {
+	head = *cq_head;
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+	    cqe = &cq_entries[head & *cq_mask];
+	    async_done(&async_ops[cqe->user_data], cqe->res);
+	    __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+	}
+	return TRUE;
+    }
+#endif
+
+#ifdef UNFS3_SYNC_THREADS
+    if (fd == async_pipe[0]) {
+	while (read(async_pipe[0], buf, sizeof(buf)) > 0) ;
+
+	pthread_mutex_lock(&async_mutex);
+	synced = async_synced;
+	async_synced.head = async_synced.tail = ASYNC_NONE;
+	pthread_mutex_unlock(&async_mutex);
+
+	/* synced batches are left alone by the sync threads */
+	while ((idx = async_list_take(&synced)) != ASYNC_NONE) {
+	    for (i = async_batches[idx].first; i != ASYNC_NONE; i = next) {
+		next = async_ops[i].next;
+		async_done(&async_ops[i], async_batches[idx].res);
+	    }
+	    async_batches[idx].next = async_batch_free;
+	    async_batch_free = idx;
+	}
+	return TRUE;
+    }
+#endif
+
+    return FALSE;
+}
+
+/*
+ * forget the transport of requests in progress, it is being destroyed
+ */
+void async_closed(SVCXPRT * xprt)
+{
+    unsigned int i;
+
+    for (i = 0; i < async_size; i++)
+	if (async_ops[i].proc != 0 && async_ops[i].xprt == xprt)
+	    async_ops[i].xprt = NULL;
+}
+
+#else				       /* UNFS3_ASYNC */
+
+int async_init(void)
+{
+    return FALSE;
+}
+
+int async_active(void)
+{
+    return FALSE;
+}
+
+void async_submit(void)
+{
+}
+
+int async_ready(U(int fd))
+{
+    return FALSE;
+}
+
+void async_closed(U(SVCXPRT * xprt))
+{
+}
+
+int async_read(U(struct svc_req *rqstp), U(READ3args * argp), U(int fd),
+	       U(post_op_attr attr))
+{
+    return FALSE;
+}
+
+int async_write(U(struct svc_req *rqstp), U(WRITE3args * argp), U(int fd))
+{
+    return FALSE;
+}
+
+int async_stable(U(struct svc_req *rqstp), U(WRITE3args * argp), U(int fd),
+		 U(count3 count))
+{
+    return FALSE;
+}
+
+int async_commit(U(struct svc_req *rqstp), COMMIT3args * argp, int *res)
+{
+    *res = fd_sync(argp->file, argp->count);
+    return FALSE;
+}
+
+#endif				       /* UNFS3_ASYNC */
@@ -0,0 +1,46 @@
+/*
+ * UNFS3 asynchronous file I/O
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_ASYNC_H
+#define UNFS3_ASYNC_H
+
+#include "event.h"
+
+/* replies are deferred by the event loop */
+#ifdef UNFS3_EPOLL
+#define UNFS3_ASYNC 1
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(UNFS3_ASYNC)
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define UNFS3_URING 1
+#endif
+#endif
+
+#if defined(UNFS3_WORKERS) && defined(UNFS3_ASYNC)
+#define UNFS3_SYNC_THREADS 1
+#endif
+
+/* upper limit of -U */
+#define ASYNC_MAX	4096
+
+/* upper limit of -Y */
+#define ASYNC_THREADS_MAX 64
+
+int async_init(void);
+int async_active(void);
+void async_submit(void);
+int async_ready(int fd);
+void async_closed(SVCXPRT * xprt);
+
+int async_read(struct svc_req *rqstp, READ3args * argp, int fd,
+	       post_op_attr attr);
+int async_write(struct svc_req *rqstp, WRITE3args * argp, int fd);
+int async_stable(struct svc_req *rqstp, WRITE3args * argp, int fd,
+		 count3 count);
+int async_commit(struct svc_req *rqstp, COMMIT3args * argp, int *res);
+
+#endif
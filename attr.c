@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <rpc/rpc.h>
 #include <fcntl.h>
+#include <string.h>
 #include <time.h>
 #ifndef WIN32
 #include <unistd.h>
@@ -28,6 +29,134 @@
 #include "user.h"
 #include "Config/exports.h"
 
+/*
+ * attribute cache
+ *
+ * attributes of recently seen objects are kept for opt_attr_cache
+ * seconds, so that repeated lstat() calls on the same object within one
+ * request and across requests are answered from memory. Entries are
+ * dropped when the object is changed through the server. Changes made
+ * by local processes may show up late, up to the validity time.
+ *
+ * with opt_notify, the filehandle cache holds entries for objects that
+ * it watches for local changes, and those do not expire
+ */
+typedef struct {
+    uint32 dev;			/* device */
+    uint64 ino;			/* inode */
+    unsigned int epoch;		/* epoch at time of entry, 0 if unused */
+    int held;			/* kept until forgotten */
+    time_t time;		/* time of entry */
+    backend_statstruct buf;	/* attributes */
+} attr_cache_t;
+
+static attr_cache_t attr_cache[ATTR_CACHE_ENTRIES];
+
+/* current epoch, incremented to drop all entries */
+static unsigned int attr_cache_epoch = 1;
+
+/*
+ * compute slot for device and inode
+ */
+static attr_cache_t *attr_cache_slot(uint32 dev, uint64 ino)
+{
+    uint32 h;
+
+    h = (uint32) ino ^ (uint32) (ino >> 32) ^ dev * 0x9E3779B1;
+    h ^= h >> 16;
+
+    return &attr_cache[h % ATTR_CACHE_ENTRIES];
+}
+
+/*
+ * find attributes of an object, returns TRUE if found
+ */
+int attr_cache_get(uint32 dev, uint64 ino, backend_statstruct * buf)
+{
+    attr_cache_t *entry;
+
+    if (opt_attr_cache == 0)
+	return FALSE;
+
+    entry = attr_cache_slot(dev, ino);
+    if (entry->epoch != attr_cache_epoch || entry->dev != dev ||
+	entry->ino != ino ||
+	(!entry->held && time(NULL) >= entry->time + opt_attr_cache))
+	return FALSE;
+
+    *buf = entry->buf;
+    return TRUE;
+}
+
+/*
+ * remember attributes of an object
+ */
+void attr_cache_add(backend_statstruct buf)
+{
+    attr_cache_t *entry;
+
+    if (opt_attr_cache == 0)
+	return;
+
+    entry = attr_cache_slot(buf.st_dev, buf.st_ino);
+    entry->dev = buf.st_dev;
+    entry->ino = buf.st_ino;
+    entry->epoch = attr_cache_epoch;
+    entry->held = FALSE;
+    entry->time = time(NULL);
+    entry->buf = buf;
+}
+
+/*
+ * keep attributes of an object until they are forgotten
+ */
+void attr_cache_hold(uint32 dev, uint64 ino)
+{
+    attr_cache_t *entry;
+
+    entry = attr_cache_slot(dev, ino);
+    if (entry->epoch == attr_cache_epoch && entry->dev == dev &&
+	entry->ino == ino)
+	entry->held = TRUE;
+}
+
+/*
+ * forget attributes of an object by device and inode
+ */
+void attr_cache_forget(uint32 dev, uint64 ino)
+{
+    attr_cache_t *entry;
+
+    entry = attr_cache_slot(dev, ino);
+    if (entry->dev == dev && entry->ino == ino)
+	entry->epoch = 0;
+}
+
+/*
+ * forget attributes of an object after it was changed
+ */
+void attr_cache_inval(nfs_fh3 nfh)
+{
+    unfs3_fh_t *fh = (void *) nfh.data.data_val;
+
+    attr_cache_forget(fh->dev, fh->ino);
+}
+
+/*
+ * forget all attributes, changes to the namespace may affect several
+ * objects, such as other links to a removed file
+ */
+void attr_cache_flush(void)
+{
+    attr_cache_epoch++;
+
+    /* skip the epoch of unused entries */
+    if (attr_cache_epoch == 0) {
+	memset(attr_cache, 0, sizeof(attr_cache));
+	attr_cache_epoch = 1;
+    }
+}
+
 /*
  * check whether stat_cache is for a regular file
  *
@@ -229,6 +358,9 @@ static post_op_attr get_post_ll(const char *path, uint32 dev, uint64 ino,
     if (!path)
 	return error_attr;
 
+    if (attr_cache_get(dev, ino, &buf))
+	return get_post_buf(buf, req);
+
     res = backend_lstat(path, &buf);
     if (res == -1)
 	return error_attr;
@@ -237,6 +369,7 @@ static post_op_attr get_post_ll(const char *path, uint32 dev, uint64 ino,
     if (dev != buf.st_dev || ino != buf.st_ino)
 	return error_attr;
 
+    attr_cache_add(buf);
     return get_post_buf(buf, req);
 }
 
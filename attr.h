@@ -7,6 +7,17 @@
 #ifndef NFS_ATTR_H
 #define NFS_ATTR_H
 
+/* number of entries in attribute cache, default validity in seconds */
+#define ATTR_CACHE_ENTRIES	4096
+#define ATTR_CACHE_TIME		1
+
+int  attr_cache_get(uint32 dev, uint64 ino, backend_statstruct *buf);
+void attr_cache_add(backend_statstruct buf);
+void attr_cache_hold(uint32 dev, uint64 ino);
+void attr_cache_forget(uint32 dev, uint64 ino);
+void attr_cache_inval(nfs_fh3 fh);
+void attr_cache_flush(void);
+
 nfsstat3 is_reg(void);
 
 mode_t type_to_mode(ftype3 ftype);
@@ -75,6 +75,25 @@
 #define backend_store_create_verifier store_create_verifier
 #define backend_check_create_verifier check_create_verifier
 
+/*
+ * calls relative to a directory fd, see fd_dir_lstat()
+ */
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_MKDIRAT) && defined(HAVE_UNLINKAT)
+#define BACKEND_AT 1
+#define backend_lstatat(dir, name, buf) fstatat(dir, name, buf, AT_SYMLINK_NOFOLLOW)
+#define backend_mkdirat mkdirat
+#define backend_open_createat openat
+#define backend_unlinkat(dir, name) unlinkat(dir, name, 0)
+#define backend_rmdirat(dir, name) unlinkat(dir, name, AT_REMOVEDIR)
+#endif
+
+#if HAVE_FDATASYNC == 1
+#define backend_fdatasync fdatasync
+#else
+#define backend_fdatasync fsync
+#endif
+
 #if HAVE_LCHOWN == 1
 #define backend_lchown lchown
 #else
@@ -90,6 +109,7 @@
 #  define backend_fstat		afs_fstat
 #  undef  backend_lstat
 #  define backend_lstat		afs_lstat
+#  undef  BACKEND_AT
 #  undef  backend_statstruct
 #  define backend_statstruct	struct stat_plus_afs
 #  include "afssupport.h"
@@ -32,6 +32,7 @@
 #define backend_fchown win_fchown
 #define backend_fstat win_fstat
 #define backend_fsync _commit
+#define backend_fdatasync _commit
 #define backend_ftruncate chsize
 #define backend_getegid() 0
 #define backend_geteuid() 0
@@ -65,6 +66,8 @@
 #define backend_utime win_utime
 #define backend_init win_init
 #define backend_dirstream UNFS3_WIN_DIR
+#define BACKEND_DIRSTAT 1
+#define backend_dirstat win_dirstat
 #define backend_fsinfo_properties FSF3_HOMOGENEOUS | FSF3_CANSETTIME;
 /*
   Note: FAT has different granularities for different times: 1 day for
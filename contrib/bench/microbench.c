@@ -0,0 +1,281 @@
+/*
+ * UNFS3 microbenchmarks
+ * see file LICENSE for license details
+ *
+ * times the filehandle and directory routines of the server directly,
+ * on a synthetic tree built below a scratch directory; linked against
+ * the objects of unfsd
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfs.h"
+#include "fh.h"
+#include "fh_cache.h"
+#include "readdir.h"
+#include "daemon.h"
+#include "backend.h"
+
+/* options */
+static unsigned int bench_files = 2000;
+static unsigned int bench_msec = 1000;
+
+/* synthetic tree */
+static char bench_flat[NFS_MAXPATHLEN];
+static char **bench_file;
+static unfs3_fh_t *bench_fh;
+static char bench_deep[NFS_MAXPATHLEN];
+static unfs3_fh_t bench_deep_fh;
+
+/*
+ * current time in microseconds
+ */
+static uint64 bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * run a benchmark for the given time, cycling through n arguments
+ */
+static void bench_time(const char *name, void (*fn) (unsigned int),
+		       unsigned int n)
+{
+    uint64 start, elapsed;
+    unsigned long ops = 0;
+
+    start = bench_now();
+    do {
+	fn(ops % n);
+	ops++;
+	elapsed = bench_now() - start;
+    } while (elapsed < (uint64) bench_msec * 1000);
+
+    printf("%-20s %10lu calls %12.0f ns/call\n", name, ops,
+	   elapsed * 1e3 / ops);
+}
+
+/*
+ * create a directory if it does not exist
+ */
+static void bench_mkdir(const char *path)
+{
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+	fprintf(stderr, "microbench: cannot create %s: %s\n", path,
+		strerror(errno));
+	exit(1);
+    }
+}
+
+/*
+ * number of components of an absolute path
+ */
+static unsigned int bench_depth(const char *path)
+{
+    unsigned int n = 0;
+
+    for (; *path; path++)
+	if (*path == '/' && path[1] != 0)
+	    n++;
+    return n;
+}
+
+/*
+ * build a flat directory with many files, and a chain of directories
+ * as deep as filehandles can describe
+ */
+static void bench_setup(const char *dir)
+{
+    char top[PATH_MAX];
+    unsigned int i;
+    int fd;
+
+    if (!realpath(dir, top) ||
+	strlen(top) + 32 + 2 * FH_MAXLEN >= NFS_MAXPATHLEN) {
+	fprintf(stderr, "microbench: invalid scratch directory %s\n", dir);
+	exit(1);
+    }
+    strcat(top, "/microbench");
+    bench_mkdir(top);
+
+    sprintf(bench_flat, "%s/flat", top);
+    bench_mkdir(bench_flat);
+
+    bench_file = calloc(bench_files, sizeof(char *));
+    bench_fh = calloc(bench_files, sizeof(unfs3_fh_t));
+    if (!bench_file || !bench_fh) {
+	fprintf(stderr, "microbench: out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < bench_files; i++) {
+	bench_file[i] = malloc(strlen(bench_flat) + 16);
+	if (!bench_file[i]) {
+	    fprintf(stderr, "microbench: out of memory\n");
+	    exit(1);
+	}
+	sprintf(bench_file[i], "%s/f%06u", bench_flat, i);
+	fd = open(bench_file[i], O_WRONLY | O_CREAT, 0644);
+	if (fd == -1) {
+	    fprintf(stderr, "microbench: cannot create %s: %s\n",
+		    bench_file[i], strerror(errno));
+	    exit(1);
+	}
+	close(fd);
+    }
+
+    sprintf(bench_deep, "%s/deep", top);
+    bench_mkdir(bench_deep);
+    while (bench_depth(bench_deep) < FH_MAXLEN) {
+	strcat(bench_deep, "/d");
+	bench_mkdir(bench_deep);
+    }
+
+    printf("tree: %u files, %u directory levels\n", bench_files,
+	   bench_depth(bench_deep));
+}
+
+static void bench_comp_flat(unsigned int i)
+{
+    bench_fh[i] = fh_comp_raw(bench_file[i], NULL, FH_ANY);
+}
+
+static void bench_comp_deep(unsigned int i)
+{
+    (void) i;
+    bench_deep_fh = fh_comp_raw(bench_deep, NULL, FH_DIR);
+}
+
+static void bench_cache(unsigned int i)
+{
+    nfs_fh3 fh;
+
+    fh.data.data_len = fh_length(&bench_fh[i]);
+    fh.data.data_val = (char *) &bench_fh[i];
+    if (!fh_decomp(fh)) {
+	fprintf(stderr, "microbench: %s not found\n", bench_file[i]);
+	exit(1);
+    }
+}
+
+static void bench_rec_flat(unsigned int i)
+{
+    if (!fh_decomp_raw(&bench_fh[i])) {
+	fprintf(stderr, "microbench: %s not resolved\n", bench_file[i]);
+	exit(1);
+    }
+}
+
+static void bench_rec_deep(unsigned int i)
+{
+    (void) i;
+    if (!fh_decomp_raw(&bench_deep_fh)) {
+	fprintf(stderr, "microbench: %s not resolved\n", bench_deep);
+	exit(1);
+    }
+}
+
+/*
+ * read one page of the flat directory, continuing where the previous
+ * page ended like a client does
+ */
+static void bench_readdir(unsigned int i)
+{
+    static cookie3 cookie = 0;
+    static cookieverf3 verf;
+    READDIR3res res;
+    entry3 *entry;
+
+    (void) i;
+
+    /* the server knows the directory from decomposing its filehandle */
+    st_cache_valid = backend_lstat(bench_flat, &st_cache) == 0;
+
+    res = read_dir(bench_flat, cookie, verf, opt_readdir_size);
+    if (res.status != NFS3_OK) {
+	fprintf(stderr, "microbench: cannot read %s\n", bench_flat);
+	exit(1);
+    }
+
+    for (entry = res.READDIR3res_u.resok.reply.entries; entry;
+	 entry = entry->nextentry)
+	cookie = entry->cookie;
+    memcpy(verf, res.READDIR3res_u.resok.cookieverf, NFS3_COOKIEVERFSIZE);
+
+    if (res.READDIR3res_u.resok.reply.eof) {
+	cookie = 0;
+	memset(verf, 0, NFS3_COOKIEVERFSIZE);
+    }
+}
+
+static void bench_usage(const char *prog)
+{
+    printf("Usage: %s [options] <scratch directory>\n", prog);
+    printf("\t-f <num>    files in the flat directory (2000)\n");
+    printf("\t-t <msec>   time to run each benchmark (1000)\n");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:ht:")) != -1) {
+	switch (opt) {
+	    case 'f':
+		bench_files = strtoul(optarg, NULL, 10);
+		break;
+	    case 't':
+		bench_msec = strtoul(optarg, NULL, 10);
+		break;
+	    default:
+		bench_usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || bench_files == 0 || bench_msec == 0)
+	bench_usage(argv[0]);
+
+    bench_setup(argv[optind]);
+
+    /* keep all files in the filehandle cache */
+    if (opt_fh_cache_size < 2 * bench_files)
+	opt_fh_cache_size = 2 * bench_files;
+    if (backend_init() == -1) {
+	fprintf(stderr, "backend initialization failed\n");
+	exit(1);
+    }
+    fh_cache_init();
+
+    bench_time("fh_comp_raw flat", bench_comp_flat, bench_files);
+    bench_time("fh_comp_raw deep", bench_comp_deep, 1);
+    if (!fh_valid(bench_deep_fh)) {
+	fprintf(stderr, "microbench: no filehandle for %s\n", bench_deep);
+	exit(1);
+    }
+
+    for (i = 0; i < bench_files; i++)
+	fh_cache_add(bench_fh[i].dev, bench_fh[i].ino, bench_file[i]);
+    bench_time("fh_cache lookup", bench_cache, bench_files);
+
+    bench_time("fh_rec flat", bench_rec_flat, bench_files);
+    bench_time("fh_rec deep", bench_rec_deep, 1);
+
+    bench_time("read_dir page", bench_readdir, 1);
+
+    return 0;
+}
@@ -0,0 +1,747 @@
+/*
+ * UNFS3 load generator
+ * see file LICENSE for license details
+ *
+ * builds a synthetic tree below an export through NFS, then drives a
+ * mix of NFS procedures against it from several clients at a time and
+ * reports throughput and latency percentiles per procedure
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <rpc/rpc.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nfs.h"
+#include "mount.h"
+#include "xdr.h"
+
+/* procedures driven by the load */
+#define B_GETATTR	0
+#define B_LOOKUP	1
+#define B_READDIR	2
+#define B_READ		3
+#define B_WRITE		4
+#define B_COMMIT	5
+#define B_OPS		6
+
+/* name of the directory holding the synthetic tree */
+#define BENCH_DIR	"nfsbench"
+
+static const char *bench_names[B_OPS] = {
+    "getattr", "lookup", "readdir", "read", "write", "commit"
+};
+
+/* share of each procedure in the load, in percent by default */
+static unsigned int bench_mix[B_OPS] = { 40, 30, 5, 15, 8, 2 };
+
+/* options */
+static int bench_tcp = FALSE;
+static unsigned short bench_nfs_port = 0;
+static unsigned short bench_mount_port = 0;
+static unsigned int bench_clients = 1;
+static unsigned int bench_seconds = 10;
+static unsigned int bench_files = 1000;
+static unsigned int bench_depth = 64;
+static unsigned int bench_size = 8192;
+static int bench_setup_only = FALSE;
+
+static struct sockaddr_in bench_addr;
+
+/* synthetic tree */
+static nfs_fh3 bench_flat;
+static nfs_fh3 *bench_file;
+static char **bench_file_name;
+static nfs_fh3 *bench_deep;
+static unsigned int bench_levels;
+
+/* set when the load has run for long enough */
+static volatile int bench_stop = FALSE;
+
+/* latencies in microseconds */
+typedef struct {
+    uint32 *usec;
+    unsigned int len;
+    unsigned int size;
+} bench_lat_t;
+
+typedef struct {
+    pthread_t thread;
+    CLIENT *clnt;
+    unsigned int seed;
+    char *buf;
+    unsigned long errors;
+    bench_lat_t lat[B_OPS];
+} bench_client_t;
+
+static const struct timeval bench_timeout = { 25, 0 };
+
+/*
+ * current time in microseconds
+ */
+static uint64 bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * record the latency of a call
+ */
+static void bench_record(bench_lat_t * lat, uint64 start)
+{
+    uint32 *usec;
+
+    if (lat->len == lat->size) {
+	usec = realloc(lat->usec, (lat->size * 2 + 1024) * sizeof(uint32));
+	if (!usec)
+	    return;
+	lat->usec = usec;
+	lat->size = lat->size * 2 + 1024;
+    }
+    lat->usec[lat->len++] = bench_now() - start;
+}
+
+/*
+ * connect to an RPC program, asking the portmapper if port is 0
+ */
+static CLIENT *bench_connect(u_long prog, u_long vers, unsigned short port)
+{
+    struct sockaddr_in sin = bench_addr;
+    struct timeval wait = { 1, 0 };
+    int sock = RPC_ANYSOCK;
+    CLIENT *clnt;
+
+    sin.sin_port = htons(port);
+    if (bench_tcp)
+	clnt = clnttcp_create(&sin, prog, vers, &sock, 0, 0);
+    else
+	clnt = clntudp_bufcreate(&sin, prog, vers, wait, &sock,
+				 NFS_MAXDATA_UDP + 1024,
+				 NFS_MAXDATA_UDP + 1024);
+    if (!clnt) {
+	clnt_pcreateerror("nfsbench");
+	exit(1);
+    }
+    clnt->cl_auth = authunix_create_default();
+    return clnt;
+}
+
+/*
+ * make a call that must succeed at the RPC level
+ */
+static void bench_call(CLIENT * clnt, u_long proc, xdrproc_t xargs,
+		       void *args, xdrproc_t xres, void *res)
+{
+    if (clnt_call(clnt, proc, xargs, args, xres, res, bench_timeout) !=
+	RPC_SUCCESS) {
+	clnt_perror(clnt, "nfsbench");
+	exit(1);
+    }
+}
+
+/*
+ * keep a copy of a filehandle
+ */
+static nfs_fh3 bench_keep(nfs_fh3 fh)
+{
+    nfs_fh3 copy;
+
+    copy.data.data_len = fh.data.data_len;
+    copy.data.data_val = malloc(fh.data.data_len);
+    if (!copy.data.data_val) {
+	fprintf(stderr, "nfsbench: out of memory\n");
+	exit(1);
+    }
+    memcpy(copy.data.data_val, fh.data.data_val, fh.data.data_len);
+    return copy;
+}
+
+/*
+ * look up a name, creating a file or directory if it does not exist
+ */
+static nfsstat3 bench_make(CLIENT * clnt, nfs_fh3 dir, char *name, int isdir,
+			   nfs_fh3 * fh)
+{
+    LOOKUP3args largs;
+    LOOKUP3res lres;
+    MKDIR3args margs;
+    MKDIR3res mres;
+    CREATE3args cargs;
+    CREATE3res cres;
+    sattr3 attr;
+    nfsstat3 status;
+
+    largs.what.dir = dir;
+    largs.what.name = name;
+    memset(&lres, 0, sizeof(lres));
+    bench_call(clnt, NFSPROC3_LOOKUP, (xdrproc_t) xdr_LOOKUP3args, &largs,
+	       (xdrproc_t) xdr_LOOKUP3res, &lres);
+    status = lres.status;
+    if (status == NFS3_OK)
+	*fh = bench_keep(lres.LOOKUP3res_u.resok.object);
+    clnt_freeres(clnt, (xdrproc_t) xdr_LOOKUP3res, (caddr_t) & lres);
+    if (status != NFS3ERR_NOENT)
+	return status;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.mode.set_it = TRUE;
+    attr.mode.set_mode3_u.mode = isdir ? 0755 : 0644;
+
+    if (isdir) {
+	margs.where = largs.what;
+	margs.attributes = attr;
+	memset(&mres, 0, sizeof(mres));
+	bench_call(clnt, NFSPROC3_MKDIR, (xdrproc_t) xdr_MKDIR3args, &margs,
+		   (xdrproc_t) xdr_MKDIR3res, &mres);
+	status = mres.status;
+	if (status == NFS3_OK && !mres.MKDIR3res_u.resok.obj.handle_follows)
+	    /* new directory too deep for a filehandle */
+	    status = NFS3ERR_NAMETOOLONG;
+	if (status == NFS3_OK)
+	    *fh = bench_keep(mres.MKDIR3res_u.resok.obj.post_op_fh3_u.handle);
+	clnt_freeres(clnt, (xdrproc_t) xdr_MKDIR3res, (caddr_t) & mres);
+    } else {
+	cargs.where = largs.what;
+	cargs.how.mode = UNCHECKED;
+	cargs.how.createhow3_u.obj_attributes = attr;
+	memset(&cres, 0, sizeof(cres));
+	bench_call(clnt, NFSPROC3_CREATE, (xdrproc_t) xdr_CREATE3args, &cargs,
+		   (xdrproc_t) xdr_CREATE3res, &cres);
+	status = cres.status;
+	if (status == NFS3_OK)
+	    *fh =
+		bench_keep(cres.CREATE3res_u.resok.obj.post_op_fh3_u.handle);
+	clnt_freeres(clnt, (xdrproc_t) xdr_CREATE3res, (caddr_t) & cres);
+    }
+    return status;
+}
+
+/*
+ * fill a file with one block of data
+ */
+static void bench_fill(CLIENT * clnt, nfs_fh3 fh, char *buf)
+{
+    WRITE3args args;
+    WRITE3res res;
+
+    args.file = fh;
+    args.offset = 0;
+    args.count = bench_size;
+    args.stable = FILE_SYNC;
+    args.data.data_len = bench_size;
+    args.data.data_val = buf;
+    memset(&res, 0, sizeof(res));
+    bench_call(clnt, NFSPROC3_WRITE, (xdrproc_t) xdr_WRITE3args, &args,
+	       (xdrproc_t) xdr_WRITE3res, &res);
+    if (res.status != NFS3_OK) {
+	fprintf(stderr, "nfsbench: cannot write file, status %i\n",
+		res.status);
+	exit(1);
+    }
+}
+
+/*
+ * mount the export and build the synthetic tree
+ *
+ * the tree has a flat directory with the given number of files, and a
+ * chain of directories that is as deep as filehandles allow
+ */
+static void bench_setup(char *export)
+{
+    CLIENT *clnt;
+    mountres3 mres;
+    nfs_fh3 root, top, fh;
+    char name[32], *buf;
+    unsigned int i;
+    nfsstat3 status;
+
+    clnt = bench_connect(MOUNTPROG, MOUNTVERS3, bench_mount_port);
+    memset(&mres, 0, sizeof(mres));
+    bench_call(clnt, MOUNTPROC_MNT, (xdrproc_t) xdr_dirpath, &export,
+	       (xdrproc_t) xdr_mountres3, &mres);
+    if (mres.fhs_status != MNT3_OK) {
+	fprintf(stderr, "nfsbench: cannot mount %s, status %i\n", export,
+		mres.fhs_status);
+	exit(1);
+    }
+    root.data.data_len = mres.mountres3_u.mountinfo.fhandle.fhandle3_len;
+    root.data.data_val = mres.mountres3_u.mountinfo.fhandle.fhandle3_val;
+    root = bench_keep(root);
+    clnt_freeres(clnt, (xdrproc_t) xdr_mountres3, (caddr_t) & mres);
+    clnt_destroy(clnt);
+
+    clnt = bench_connect(NFS3_PROGRAM, NFS_V3, bench_nfs_port);
+
+    if (bench_make(clnt, root, BENCH_DIR, TRUE, &top) != NFS3_OK ||
+	bench_make(clnt, top, "flat", TRUE, &bench_flat) != NFS3_OK) {
+	fprintf(stderr, "nfsbench: cannot create %s\n", BENCH_DIR);
+	exit(1);
+    }
+
+    buf = calloc(1, bench_size);
+    bench_file = calloc(bench_files, sizeof(nfs_fh3));
+    bench_file_name = calloc(bench_files, sizeof(char *));
+    bench_deep = calloc(bench_depth + 1, sizeof(nfs_fh3));
+    if (!buf || !bench_file || !bench_file_name || !bench_deep) {
+	fprintf(stderr, "nfsbench: out of memory\n");
+	exit(1);
+    }
+
+    for (i = 0; i < bench_files; i++) {
+	sprintf(name, "f%06u", i);
+	bench_file_name[i] = strdup(name);
+	status = bench_make(clnt, bench_flat, name, FALSE, &bench_file[i]);
+	if (status != NFS3_OK) {
+	    fprintf(stderr, "nfsbench: cannot create %s, status %i\n", name,
+		    status);
+	    exit(1);
+	}
+	bench_fill(clnt, bench_file[i], buf);
+    }
+
+    /* the server refuses to go deeper than its filehandles can describe */
+    if (bench_make(clnt, top, "deep", TRUE, &bench_deep[0]) != NFS3_OK) {
+	fprintf(stderr, "nfsbench: cannot create deep path\n");
+	exit(1);
+    }
+    for (bench_levels = 1; bench_levels <= bench_depth; bench_levels++)
+	if (bench_make(clnt, bench_deep[bench_levels - 1], "d", TRUE, &fh) ==
+	    NFS3_OK)
+	    bench_deep[bench_levels] = fh;
+	else
+	    break;
+
+    printf("tree: %u files of %u bytes, %u directory levels\n",
+	   bench_files, bench_size, bench_levels);
+
+    free(buf);
+    clnt_destroy(clnt);
+}
+
+/*
+ * pick a filehandle of a file or of a directory on the deep path
+ */
+static nfs_fh3 bench_pick(bench_client_t * cl)
+{
+    unsigned int i = rand_r(&cl->seed) % (bench_files + bench_levels);
+
+    if (i < bench_files)
+	return bench_file[i];
+    return bench_deep[i - bench_files];
+}
+
+static nfsstat3 bench_getattr(bench_client_t * cl)
+{
+    GETATTR3args args;
+    GETATTR3res res;
+
+    args.object = bench_pick(cl);
+    memset(&res, 0, sizeof(res));
+    bench_call(cl->clnt, NFSPROC3_GETATTR, (xdrproc_t) xdr_GETATTR3args,
+	       &args, (xdrproc_t) xdr_GETATTR3res, &res);
+    return res.status;
+}
+
+static nfsstat3 bench_lookup(bench_client_t * cl)
+{
+    LOOKUP3args args;
+    LOOKUP3res res;
+    unsigned int i = rand_r(&cl->seed) % (bench_files + bench_levels - 1);
+    nfsstat3 status;
+
+    if (i < bench_files) {
+	args.what.dir = bench_flat;
+	args.what.name = bench_file_name[i];
+    } else {
+	args.what.dir = bench_deep[i - bench_files];
+	args.what.name = "d";
+    }
+    memset(&res, 0, sizeof(res));
+    bench_call(cl->clnt, NFSPROC3_LOOKUP, (xdrproc_t) xdr_LOOKUP3args, &args,
+	       (xdrproc_t) xdr_LOOKUP3res, &res);
+    status = res.status;
+    clnt_freeres(cl->clnt, (xdrproc_t) xdr_LOOKUP3res, (caddr_t) & res);
+    return status;
+}
+
+/*
+ * list the flat directory, recording every page as one call
+ */
+static nfsstat3 bench_readdir(bench_client_t * cl)
+{
+    READDIR3args args;
+    READDIR3res res;
+    entry3 *entry;
+    nfsstat3 status;
+    uint64 start;
+    int eof = FALSE;
+
+    args.dir = bench_flat;
+    args.cookie = 0;
+    memset(args.cookieverf, 0, NFS3_COOKIEVERFSIZE);
+    args.count = NFS_MAXDATA_UDP;
+
+    while (!eof) {
+	start = bench_now();
+	memset(&res, 0, sizeof(res));
+	bench_call(cl->clnt, NFSPROC3_READDIR, (xdrproc_t) xdr_READDIR3args,
+		   &args, (xdrproc_t) xdr_READDIR3res, &res);
+	status = res.status;
+	if (status != NFS3_OK) {
+	    clnt_freeres(cl->clnt, (xdrproc_t) xdr_READDIR3res,
+			 (caddr_t) & res);
+	    return status;
+	}
+	bench_record(&cl->lat[B_READDIR], start);
+
+	for (entry = res.READDIR3res_u.resok.reply.entries; entry;
+	     entry = entry->nextentry)
+	    args.cookie = entry->cookie;
+	memcpy(args.cookieverf, res.READDIR3res_u.resok.cookieverf,
+	       NFS3_COOKIEVERFSIZE);
+	eof = res.READDIR3res_u.resok.reply.eof;
+	clnt_freeres(cl->clnt, (xdrproc_t) xdr_READDIR3res, (caddr_t) & res);
+    }
+    return NFS3_OK;
+}
+
+static nfsstat3 bench_read(bench_client_t * cl)
+{
+    READ3args args;
+    READ3res res;
+
+    args.file = bench_file[rand_r(&cl->seed) % bench_files];
+    args.offset = 0;
+    args.count = bench_size;
+
+    /* decode the data into our own buffer instead of a new one */
+    memset(&res, 0, sizeof(res));
+    res.READ3res_u.resok.data.data_val = cl->buf;
+    bench_call(cl->clnt, NFSPROC3_READ, (xdrproc_t) xdr_READ3args, &args,
+	       (xdrproc_t) xdr_READ3res, &res);
+    return res.status;
+}
+
+static nfsstat3 bench_write(bench_client_t * cl)
+{
+    WRITE3args args;
+    WRITE3res res;
+
+    args.file = bench_file[rand_r(&cl->seed) % bench_files];
+    args.offset = 0;
+    args.count = bench_size;
+    args.stable = UNSTABLE;
+    args.data.data_len = bench_size;
+    args.data.data_val = cl->buf;
+    memset(&res, 0, sizeof(res));
+    bench_call(cl->clnt, NFSPROC3_WRITE, (xdrproc_t) xdr_WRITE3args, &args,
+	       (xdrproc_t) xdr_WRITE3res, &res);
+    return res.status;
+}
+
+static nfsstat3 bench_commit(bench_client_t * cl)
+{
+    COMMIT3args args;
+    COMMIT3res res;
+
+    args.file = bench_file[rand_r(&cl->seed) % bench_files];
+    args.offset = 0;
+    args.count = 0;
+    memset(&res, 0, sizeof(res));
+    bench_call(cl->clnt, NFSPROC3_COMMIT, (xdrproc_t) xdr_COMMIT3args, &args,
+	       (xdrproc_t) xdr_COMMIT3res, &res);
+    return res.status;
+}
+
+/*
+ * drive the load from one client until told to stop
+ */
+static void *bench_run(void *arg)
+{
+    bench_client_t *cl = arg;
+    unsigned int total = 0, pick, op;
+    uint64 start;
+    nfsstat3 status;
+
+    for (op = 0; op < B_OPS; op++)
+	total += bench_mix[op];
+
+    while (!bench_stop) {
+	pick = rand_r(&cl->seed) % total;
+	for (op = 0; pick >= bench_mix[op]; op++)
+	    pick -= bench_mix[op];
+
+	start = bench_now();
+	switch (op) {
+	    case B_GETATTR:
+		status = bench_getattr(cl);
+		break;
+	    case B_LOOKUP:
+		status = bench_lookup(cl);
+		break;
+	    case B_READDIR:
+		/* records its pages itself */
+		if (bench_readdir(cl) != NFS3_OK)
+		    cl->errors++;
+		continue;
+	    case B_READ:
+		status = bench_read(cl);
+		break;
+	    case B_WRITE:
+		status = bench_write(cl);
+		break;
+	    default:
+		status = bench_commit(cl);
+		break;
+	}
+
+	if (status == NFS3_OK)
+	    bench_record(&cl->lat[op], start);
+	else
+	    cl->errors++;
+    }
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *) a, y = *(const uint32 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * latency at a fraction of sorted latencies
+ */
+static uint32 bench_pct(const bench_lat_t * lat, double frac)
+{
+    unsigned int i = lat->len * frac;
+
+    if (lat->len == 0)
+	return 0;
+    if (i >= lat->len)
+	i = lat->len - 1;
+    return lat->usec[i];
+}
+
+/*
+ * print a line of the report
+ */
+static void bench_line(const char *name, bench_lat_t * lat, double secs)
+{
+    uint64 sum = 0;
+    unsigned int i;
+
+    qsort(lat->usec, lat->len, sizeof(uint32), bench_cmp);
+    for (i = 0; i < lat->len; i++)
+	sum += lat->usec[i];
+
+    printf("%-8s %10u %10.1f %8.1f %8u %8u %8u %8u %8u\n", name, lat->len,
+	   lat->len / secs, lat->len ? (double) sum / lat->len : 0.0,
+	   bench_pct(lat, 0.5), bench_pct(lat, 0.9), bench_pct(lat, 0.99),
+	   bench_pct(lat, 0.999), lat->len ? lat->usec[lat->len - 1] : 0);
+}
+
+/*
+ * merge the latencies of all clients for one procedure, or all of them
+ */
+static void bench_merge(bench_client_t * cls, int which, bench_lat_t * all)
+{
+    unsigned int i, op;
+    bench_lat_t *lat;
+
+    all->len = 0;
+    for (i = 0; i < bench_clients; i++)
+	for (op = 0; op < B_OPS; op++) {
+	    if (which != -1 && (int) op != which)
+		continue;
+	    lat = &cls[i].lat[op];
+	    if (all->len + lat->len > all->size) {
+		all->size = all->len + lat->len;
+		all->usec = realloc(all->usec, all->size * sizeof(uint32));
+		if (!all->usec) {
+		    fprintf(stderr, "nfsbench: out of memory\n");
+		    exit(1);
+		}
+	    }
+	    memcpy(all->usec + all->len, lat->usec,
+		   lat->len * sizeof(uint32));
+	    all->len += lat->len;
+	}
+}
+
+/*
+ * parse a mix such as getattr:50,read:50; procedures not named get 0
+ */
+static void bench_parse_mix(char *spec)
+{
+    char *item, *colon;
+    unsigned int op, total = 0;
+
+    memset(bench_mix, 0, sizeof(bench_mix));
+    for (item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+	colon = strchr(item, ':');
+	if (colon)
+	    *colon++ = 0;
+	for (op = 0; op < B_OPS; op++)
+	    if (strcmp(item, bench_names[op]) == 0)
+		break;
+	if (op == B_OPS || !colon) {
+	    fprintf(stderr, "Invalid mix entry `%s'\n", item);
+	    exit(1);
+	}
+	bench_mix[op] = strtoul(colon, NULL, 10);
+	total += bench_mix[op];
+    }
+    if (total == 0) {
+	fprintf(stderr, "Invalid mix\n");
+	exit(1);
+    }
+}
+
+static void bench_usage(const char *prog)
+{
+    printf("Usage: %s [options] host:/export\n", prog);
+    printf("\t-t          use TCP instead of UDP\n");
+    printf("\t-n <port>   port of NFS service, default from portmapper\n");
+    printf("\t-m <port>   port of MOUNT service, default from portmapper\n");
+    printf("\t-c <num>    number of concurrent clients (1)\n");
+    printf("\t-s <sec>    seconds to run the load (10)\n");
+    printf("\t-x <mix>    procedure mix (getattr:40,lookup:30,readdir:5,"
+	   "read:15,write:8,commit:2)\n");
+    printf("\t-f <num>    files in the flat directory (1000)\n");
+    printf("\t-d <num>    maximum depth of the deep path (64)\n");
+    printf("\t-b <size>   READ and WRITE size in bytes (8192)\n");
+    printf("\t-S          only build the tree\n");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    bench_client_t *cls;
+    bench_lat_t all;
+    struct hostent *host;
+    char *export;
+    unsigned int i, op;
+    unsigned long errors = 0;
+    uint64 start;
+    double secs;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:d:f:hm:n:s:Stx:")) != -1) {
+	switch (opt) {
+	    case 'b':
+		bench_size = strtoul(optarg, NULL, 10);
+		break;
+	    case 'c':
+		bench_clients = strtoul(optarg, NULL, 10);
+		break;
+	    case 'd':
+		bench_depth = strtoul(optarg, NULL, 10);
+		break;
+	    case 'f':
+		bench_files = strtoul(optarg, NULL, 10);
+		break;
+	    case 'm':
+		bench_mount_port = strtoul(optarg, NULL, 10);
+		break;
+	    case 'n':
+		bench_nfs_port = strtoul(optarg, NULL, 10);
+		break;
+	    case 's':
+		bench_seconds = strtoul(optarg, NULL, 10);
+		break;
+	    case 'S':
+		bench_setup_only = TRUE;
+		break;
+	    case 't':
+		bench_tcp = TRUE;
+		break;
+	    case 'x':
+		bench_parse_mix(optarg);
+		break;
+	    default:
+		bench_usage(argv[0]);
+	}
+    }
+
+    if (optind != argc - 1 || !strchr(argv[optind], ':'))
+	bench_usage(argv[0]);
+    if (bench_clients == 0 || bench_files == 0 || bench_size == 0 ||
+	bench_size > NFS_MAXDATA_UDP) {
+	fprintf(stderr, "Invalid clients, files, or size\n");
+	exit(1);
+    }
+
+    export = strchr(argv[optind], ':');
+    *export++ = 0;
+    host = gethostbyname(argv[optind]);
+    if (!host || host->h_addrtype != AF_INET) {
+	fprintf(stderr, "Unknown host `%s'\n", argv[optind]);
+	exit(1);
+    }
+    memset(&bench_addr, 0, sizeof(bench_addr));
+    bench_addr.sin_family = AF_INET;
+    memcpy(&bench_addr.sin_addr, host->h_addr, sizeof(bench_addr.sin_addr));
+
+    bench_setup(export);
+    if (bench_setup_only)
+	return 0;
+
+    cls = calloc(bench_clients, sizeof(bench_client_t));
+    if (!cls) {
+	fprintf(stderr, "nfsbench: out of memory\n");
+	exit(1);
+    }
+
+    start = bench_now();
+    for (i = 0; i < bench_clients; i++) {
+	cls[i].clnt = bench_connect(NFS3_PROGRAM, NFS_V3, bench_nfs_port);
+	cls[i].seed = i + 1;
+	cls[i].buf = calloc(1, bench_size);
+	if (!cls[i].buf ||
+	    pthread_create(&cls[i].thread, NULL, bench_run, &cls[i]) != 0) {
+	    fprintf(stderr, "nfsbench: cannot start client\n");
+	    exit(1);
+	}
+    }
+
+    sleep(bench_seconds);
+    bench_stop = TRUE;
+    for (i = 0; i < bench_clients; i++) {
+	pthread_join(cls[i].thread, NULL);
+	errors += cls[i].errors;
+    }
+    secs = (bench_now() - start) / 1e6;
+
+    printf("%s, %u clients, %.1f seconds\n", bench_tcp ? "tcp" : "udp",
+	   bench_clients, secs);
+    printf("%-8s %10s %10s %8s %8s %8s %8s %8s %8s\n", "proc", "calls",
+	   "calls/s", "avg us", "p50", "p90", "p99", "p99.9", "max");
+
+    memset(&all, 0, sizeof(all));
+    for (op = 0; op < B_OPS; op++) {
+	bench_merge(cls, op, &all);
+	if (all.len > 0)
+	    bench_line(bench_names[op], &all, secs);
+    }
+    bench_merge(cls, -1, &all);
+    bench_line("total", &all, secs);
+    if (errors > 0)
+	printf("%lu calls failed\n", errors);
+
+    return errors > 0;
+}
@@ -24,6 +24,7 @@
 #endif				       /* WIN32 */
 
 #include <fcntl.h>
+#include <limits.h>
 #include <memory.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -45,9 +46,20 @@
 #include "mount.h"
 #include "xdr.h"
 #include "fh.h"
+#include "attr.h"
 #include "fh_cache.h"
+#include "fh_index.h"
 #include "fd_cache.h"
+#include "drc.h"
+#include "event.h"
+#include "async.h"
+#include "arena.h"
+#include "udp.h"
+#include "stats.h"
+#include "locate.h"
+#include "readdir.h"
 #include "user.h"
+#include "worker.h"
 #include "daemon.h"
 #include "backend.h"
 #include "Config/exports.h"
@@ -78,6 +90,24 @@ int opt_testconfig = FALSE;
 struct in_addr opt_bind_addr;
 int opt_readable_executables = FALSE;
 char *opt_pid_file = NULL;
+char *opt_fh_index = NULL;
+unsigned int opt_fh_index_size = FH_INDEX_SLOTS;
+char *opt_stats = NULL;
+int opt_kernel_handles = FALSE;
+unsigned int opt_fh_cache_size = FH_CACHE_ENTRIES;
+unsigned int opt_fd_cache_size = FD_CACHE_ENTRIES;
+unsigned int opt_workers = 0;
+unsigned int opt_readdir_size = READDIR_SIZE;
+unsigned int opt_attr_cache = ATTR_CACHE_TIME;
+int opt_notify = FALSE;
+unsigned int opt_max_data = NFS_MAXDATA_TCP;
+unsigned int opt_write_gather = 0;
+unsigned int opt_sockets = 1;
+unsigned int opt_udp_batch = 0;
+unsigned int opt_slow_time = 0;
+unsigned int opt_io_ring = 0;
+unsigned int opt_sync_threads = 0;
+unsigned int opt_fh_threads = 0;
 
 /* Register with portmapper? */
 int opt_portmapper = TRUE;
@@ -206,14 +236,33 @@ static void parse_options(int argc, char **argv)
 {
 
     int opt = 0;
-    char *optstring = "bcC:de:hl:m:n:prstTuwi:";
+    long lval;
+    char *optstring = "a:bB:cC:dD:e:F:g:hH:I:J:kl:L:m:M:n:NprR:sS:tTuU:wW:X:Y:i:";
 
     while (opt != -1) {
 	opt = getopt(argc, argv, optstring);
 	switch (opt) {
+	    case 'a':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > 3600) {
+		    fprintf(stderr, "Invalid attribute cache time\n");
+		    exit(1);
+		}
+		opt_attr_cache = lval;
+		break;
 	    case 'b':
 		opt_brute_force = TRUE;
 		break;
+#ifdef UNFS3_MMSG
+	    case 'B':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > UDP_BATCH_MAX) {
+		    fprintf(stderr, "Invalid UDP batch size\n");
+		    exit(1);
+		}
+		opt_udp_batch = lval;
+		break;
+#endif
 #ifdef WANT_CLUSTER
 	    case 'c':
 		opt_cluster = TRUE;
@@ -226,6 +275,14 @@ static void parse_options(int argc, char **argv)
 		printf(UNFS_NAME);
 		opt_detach = FALSE;
 		break;
+	    case 'D':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < READDIR_MIN || lval > NFS_MAXDATA_TCP) {
+		    fprintf(stderr, "Invalid READDIR reply size\n");
+		    exit(1);
+		}
+		opt_readdir_size = lval;
+		break;
 	    case 'e':
 #ifndef WIN32
 		if (optarg[0] != '/') {
@@ -261,8 +318,112 @@ static void parse_options(int argc, char **argv)
 		printf
 		    ("\t-r          report unreadable executables as readable\n");
 		printf("\t-T          test exports file and exit\n");
+		printf
+		    ("\t-H <num>    number of entries in filehandle cache\n");
+		printf
+		    ("\t-F <num>    number of open files kept in fd cache\n");
+		printf
+		    ("\t-I <file>   keep persistent filehandle index in file\n");
+		printf
+		    ("\t-J <num>    number of slots in filehandle index\n");
+		printf
+		    ("\t-D <size>   maximum size of READDIR replies in bytes\n");
+		printf
+		    ("\t-a <sec>    seconds attributes are cached, 0 disables\n");
+#ifdef HAVE_SYS_INOTIFY_H
+		printf
+		    ("\t-N          keep attributes until local changes are noticed\n");
+#endif
+		printf
+		    ("\t-S <size>   maximum size of READ and WRITE data in bytes\n");
+		printf
+		    ("\t-g <size>   gather UNSTABLE writes per file in bytes\n");
+#ifdef HAVE_NAME_TO_HANDLE_AT
+		printf
+		    ("\t-k          resolve filehandles through kernel handles\n");
+#endif
+#ifdef UNFS3_WORKERS
+		printf
+		    ("\t-W <num>    number of worker threads handling requests\n");
+		printf
+		    ("\t-X <num>    number of threads searching for filehandles\n");
+#endif
+#ifdef SO_REUSEPORT
+		printf
+		    ("\t-R <num>    number of sockets per transport and port\n");
+#endif
+#ifdef UNFS3_MMSG
+		printf
+		    ("\t-B <num>    UDP requests received and answered per call\n");
+#endif
+#ifdef UNFS3_URING
+		printf
+		    ("\t-U <num>    file I/O requests queued on io_uring at a time\n");
+#endif
+#ifdef UNFS3_SYNC_THREADS
+		printf
+		    ("\t-Y <num>    number of threads syncing COMMIT and stable WRITE\n");
+#endif
+#ifndef WIN32
+		printf
+		    ("\t-M <path>   serve statistics on Unix socket\n");
+#endif
+		printf
+		    ("\t-L <msec>   log requests taking longer, 0 disables\n");
 		exit(0);
 		break;
+	    case 'F':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < FD_CACHE_MIN || lval > INT_MAX / 2) {
+		    fprintf(stderr, "Invalid fd cache size\n");
+		    exit(1);
+		}
+		opt_fd_cache_size = lval;
+		break;
+	    case 'g':
+		lval = strtol(optarg, NULL, 10);
+		if (lval != 0 &&
+		    (lval < NFS_MAXDATA_MIN || lval > FD_GATHER_MAX)) {
+		    fprintf(stderr, "Invalid write gather size\n");
+		    exit(1);
+		}
+		opt_write_gather = lval;
+		break;
+	    case 'H':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < FH_CACHE_MIN || lval > INT_MAX / 2) {
+		    fprintf(stderr, "Invalid filehandle cache size\n");
+		    exit(1);
+		}
+		opt_fh_cache_size = lval;
+		break;
+	    case 'I':
+#ifndef WIN32
+		if (optarg[0] != '/') {
+		    fprintf(stderr, "Error: relative path to index file\n");
+		    exit(1);
+		}
+#endif
+		opt_fh_index = optarg;
+		break;
+	    case 'J':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < FH_INDEX_MIN || lval > INT_MAX / 2) {
+		    fprintf(stderr, "Invalid filehandle index size\n");
+		    exit(1);
+		}
+		opt_fh_index_size = lval;
+		break;
+#ifdef HAVE_NAME_TO_HANDLE_AT
+	    case 'k':
+		opt_kernel_handles = TRUE;
+		break;
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+	    case 'N':
+		opt_notify = TRUE;
+		break;
+#endif
 	    case 'l':
 		opt_bind_addr.s_addr = inet_addr(optarg);
 		if (opt_bind_addr.s_addr == (unsigned) -1) {
@@ -270,6 +431,14 @@ static void parse_options(int argc, char **argv)
 		    exit(1);
 		}
 		break;
+	    case 'L':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > 3600000) {
+		    fprintf(stderr, "Invalid slow request time\n");
+		    exit(1);
+		}
+		opt_slow_time = lval;
+		break;
 	    case 'm':
 		opt_mount_port = strtol(optarg, NULL, 10);
 		if (opt_mount_port == 0) {
@@ -277,6 +446,16 @@ static void parse_options(int argc, char **argv)
 		    exit(1);
 		}
 		break;
+#ifndef WIN32
+	    case 'M':
+		if (optarg[0] != '/') {
+		    /* we are changing directory */
+		    fprintf(stderr, "Error: relative path to statistics socket\n");
+		    exit(1);
+		}
+		opt_stats = optarg;
+		break;
+#endif
 	    case 'n':
 		opt_nfs_port = strtol(optarg, NULL, 10);
 		if (opt_nfs_port == 0) {
@@ -301,6 +480,24 @@ static void parse_options(int argc, char **argv)
 		}
 #endif
 		break;
+#ifdef SO_REUSEPORT
+	    case 'R':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 1 || lval > SOCKETS_MAX) {
+		    fprintf(stderr, "Invalid number of sockets\n");
+		    exit(1);
+		}
+		opt_sockets = lval;
+		break;
+#endif
+	    case 'S':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < NFS_MAXDATA_MIN || lval > NFS_MAXDATA_TCP) {
+		    fprintf(stderr, "Invalid maximum transfer size\n");
+		    exit(1);
+		}
+		opt_max_data = lval;
+		break;
 	    case 't':
 		opt_tcponly = TRUE;
 		break;
@@ -311,6 +508,44 @@ static void parse_options(int argc, char **argv)
 		opt_nfs_port = 0;
 		opt_mount_port = 0;
 		break;
+#ifdef UNFS3_URING
+	    case 'U':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > ASYNC_MAX) {
+		    fprintf(stderr, "Invalid number of queued I/O requests\n");
+		    exit(1);
+		}
+		opt_io_ring = lval;
+		break;
+#endif
+#ifdef UNFS3_WORKERS
+	    case 'W':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > WORKER_MAX) {
+		    fprintf(stderr, "Invalid number of worker threads\n");
+		    exit(1);
+		}
+		opt_workers = lval;
+		break;
+	    case 'X':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > FH_THREADS_MAX) {
+		    fprintf(stderr, "Invalid number of search threads\n");
+		    exit(1);
+		}
+		opt_fh_threads = lval;
+		break;
+#endif
+#ifdef UNFS3_SYNC_THREADS
+	    case 'Y':
+		lval = strtol(optarg, NULL, 10);
+		if (lval < 0 || lval > ASYNC_THREADS_MAX) {
+		    fprintf(stderr, "Invalid number of sync threads\n");
+		    exit(1);
+		}
+		opt_sync_threads = lval;
+		break;
+#endif
 	    case 'i':
 		opt_pid_file = optarg;
 		break;
@@ -342,6 +577,8 @@ void daemon_exit(int error)
 	    logmsg(LOG_INFO, "fh cache unused");
 	logmsg(LOG_INFO, "open file descriptors: read %i, write %i",
 	       fd_cache_readers, fd_cache_writers);
+	logmsg(LOG_INFO, "duplicate request cache: hit %i miss %i",
+	       drc_hit, drc_miss);
 	return;
     }
 #endif				       /* WIN32 */
@@ -364,6 +601,7 @@ void daemon_exit(int error)
 	closelog();
 
     remove_pid_file();
+    stats_close();
     backend_shutdown();
 
     exit(1);
@@ -401,6 +639,12 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
     char *result;
     xdrproc_t _xdr_argument, _xdr_result;
     char *(*local) (char *, struct svc_req *);
+    static UNFS3_TLS drc_reply_t replay;
+    int cached;
+
+    STATS_PROBE1(request__start, rqstp->rq_proc);
+    stats_begin();
+    drc_watch(transp);
 
     switch (rqstp->rq_proc) {
 	case NFSPROC3_NULL:
@@ -559,11 +803,33 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	    return;
     }
     memset((char *) &argument, 0, sizeof(argument));
+    arena_begin();
     if (!svc_getargs(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	svcerr_decode(transp);
+	arena_reset();
 	return;
     }
-    result = (*local) ((char *) &argument, rqstp);
+
+    /* arguments are decoded without the server lock */
+    worker_lock();
+
+    /* answer retransmissions from the duplicate request cache */
+    cached = drc_start(rqstp, &replay);
+    if (cached == DRC_REPLAY || cached == DRC_BUSY) {
+	result = NULL;
+	_xdr_result = (xdrproc_t) xdr_drc_reply;
+	if (cached == DRC_REPLAY)
+	    result = (char *) &replay;
+    } else {
+	/* notice local changes before looking at any files */
+	fh_cache_notify();
+	result = (*local) ((char *) &argument, rqstp);
+	if (cached == DRC_NEW)
+	    drc_done(_xdr_result, result);
+    }
+
+    /* result is private to this thread, other requests may proceed */
+    worker_unlock();
     if (result != NULL &&
 	!svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
 	svcerr_systemerr(transp);
@@ -573,6 +839,9 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	logmsg(LOG_CRIT, "unable to free XDR arguments");
     }
+    arena_reset();
+    stats_end(rqstp);
+    STATS_PROBE1(request__done, rqstp->rq_proc);
     return;
 }
 
@@ -641,7 +910,12 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	svcerr_decode(transp);
 	return;
     }
+
+    worker_lock();
     result = (*local) ((char *) &argument, rqstp);
+
+    /* result is private to this thread, other requests may proceed */
+    worker_unlock();
     if (result != NULL &&
 	!svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
 	svcerr_systemerr(transp);
@@ -654,9 +928,10 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
     return;
 }
 
-static void register_nfs_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
+static void register_nfs_service(SVCXPRT * udptransp, SVCXPRT * tcptransp,
+				 int portmapper)
 {
-    if (opt_portmapper) {
+    if (portmapper) {
 	pmap_unset(NFS3_PROGRAM, NFS_V3);
     }
 
@@ -664,28 +939,31 @@ static void register_nfs_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	/* Register NFS service for UDP */
 	if (!svc_register
 	    (udptransp, NFS3_PROGRAM, NFS_V3, nfs3_program_3,
-	     opt_portmapper ? IPPROTO_UDP : 0)) {
+	     portmapper ? IPPROTO_UDP : 0)) {
 	    fprintf(stderr, "%s\n",
 		    "unable to register (NFS3_PROGRAM, NFS_V3, udp).");
 	    daemon_exit(0);
 	}
+	udp_register(NFS3_PROGRAM, NFS_V3, nfs3_program_3);
     }
 
     if (tcptransp != NULL) {
 	/* Register NFS service for TCP */
 	if (!svc_register
 	    (tcptransp, NFS3_PROGRAM, NFS_V3, nfs3_program_3,
-	     opt_portmapper ? IPPROTO_TCP : 0)) {
+	     portmapper ? IPPROTO_TCP : 0)) {
 	    fprintf(stderr, "%s\n",
 		    "unable to register (NFS3_PROGRAM, NFS_V3, tcp).");
 	    daemon_exit(0);
 	}
+	udp_register(NFS3_PROGRAM, NFS_V3, nfs3_program_3);
     }
 }
 
-static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
+static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp,
+				   int portmapper)
 {
-    if (opt_portmapper) {
+    if (portmapper) {
 	pmap_unset(MOUNTPROG, MOUNTVERS1);
 	pmap_unset(MOUNTPROG, MOUNTVERS3);
     }
@@ -694,68 +972,119 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	/* Register MOUNT service (v1) for UDP */
 	if (!svc_register
 	    (udptransp, MOUNTPROG, MOUNTVERS1, mountprog_3,
-	     opt_portmapper ? IPPROTO_UDP : 0)) {
+	     portmapper ? IPPROTO_UDP : 0)) {
 	    fprintf(stderr, "%s\n",
 		    "unable to register (MOUNTPROG, MOUNTVERS1, udp).");
 	    daemon_exit(0);
 	}
+	udp_register(MOUNTPROG, MOUNTVERS1, mountprog_3);
 
 	/* Register MOUNT service (v3) for UDP */
 	if (!svc_register
 	    (udptransp, MOUNTPROG, MOUNTVERS3, mountprog_3,
-	     opt_portmapper ? IPPROTO_UDP : 0)) {
+	     portmapper ? IPPROTO_UDP : 0)) {
 	    fprintf(stderr, "%s\n",
 		    "unable to register (MOUNTPROG, MOUNTVERS3, udp).");
 	    daemon_exit(0);
 	}
+	udp_register(MOUNTPROG, MOUNTVERS3, mountprog_3);
     }
 
     if (tcptransp != NULL) {
 	/* Register MOUNT service (v1) for TCP */
 	if (!svc_register
 	    (tcptransp, MOUNTPROG, MOUNTVERS1, mountprog_3,
-	     opt_portmapper ? IPPROTO_TCP : 0)) {
+	     portmapper ? IPPROTO_TCP : 0)) {
 	    fprintf(stderr, "%s\n",
 		    "unable to register (MOUNTPROG, MOUNTVERS1, tcp).");
 	    daemon_exit(0);
 	}
+	udp_register(MOUNTPROG, MOUNTVERS1, mountprog_3);
 
 	/* Register MOUNT service (v3) for TCP */
 	if (!svc_register
 	    (tcptransp, MOUNTPROG, MOUNTVERS3, mountprog_3,
-	     opt_portmapper ? IPPROTO_TCP : 0)) {
+	     portmapper ? IPPROTO_TCP : 0)) {
 	    fprintf(stderr, "%s\n",
 		    "unable to register (MOUNTPROG, MOUNTVERS3, tcp).");
 	    daemon_exit(0);
 	}
+	udp_register(MOUNTPROG, MOUNTVERS3, mountprog_3);
     }
 }
 
-static SVCXPRT *create_udp_transport(unsigned int port)
+/*
+ * create a socket bound to the given port, or return RPC_ANYSOCK
+ *
+ * with several sockets per port, all are opened with SO_REUSEPORT and
+ * the kernel spreads clients across them; port receives the port bound
+ * by the first socket if it was 0, so that the others join it
+ */
+static int create_socket(int type, unsigned int *port, unsigned int idx)
 {
-    SVCXPRT *transp = NULL;
     struct sockaddr_in sin;
+    socklen_t len = sizeof(struct sockaddr_in);
     int sock;
     const int on = 1;
 
+#if !defined(WIN32) && defined(SO_INCOMING_CPU)
+    long cpus;
+    int cpu;
+#endif
+
+    if (*port == 0 && opt_sockets == 1)
+	return RPC_ANYSOCK;
+
     /* Make sure we null the entire sockaddr_in structure */
     memset(&sin, 0, sizeof(struct sockaddr_in));
 
-    if (port == 0)
-	sock = RPC_ANYSOCK;
-    else {
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = opt_bind_addr.s_addr;
-	sock = socket(PF_INET, SOCK_DGRAM, 0);
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
-	if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
-	    perror("bind");
-	    fprintf(stderr, "Couldn't bind to udp port %d\n", port);
-	    exit(1);
-	}
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(*port);
+    sin.sin_addr.s_addr = opt_bind_addr.s_addr;
+    sock = socket(PF_INET, type, 0);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+
+#ifdef SO_REUSEPORT
+    if (opt_sockets > 1 &&
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *) &on,
+		   sizeof(on)) == -1) {
+	perror("setsockopt");
+	fprintf(stderr, "Couldn't share port between sockets\n");
+	exit(1);
+    }
+#endif
+
+#if !defined(WIN32) && defined(SO_INCOMING_CPU)
+    /* prefer this socket for clients whose packets arrive on this CPU */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt_sockets > 1 && cpus > 0) {
+	cpu = idx % cpus;
+	setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
     }
+#else
+    (void) idx;
+#endif
+
+    if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
+	perror("bind");
+	fprintf(stderr, "Couldn't bind to %s port %d\n",
+		type == SOCK_DGRAM ? "udp" : "tcp", *port);
+	exit(1);
+    }
+
+    if (*port == 0 &&
+	getsockname(sock, (struct sockaddr *) &sin, &len) == 0)
+	*port = ntohs(sin.sin_port);
 
+    return sock;
+}
+
+static SVCXPRT *create_udp_transport(unsigned int *port, unsigned int idx)
+{
+    SVCXPRT *transp = NULL;
+    int sock;
+
+    sock = create_socket(SOCK_DGRAM, port, idx);
     transp = svcudp_bufcreate(sock, NFS_MAX_UDP_PACKET, NFS_MAX_UDP_PACKET);
 
     if (transp == NULL) {
@@ -763,34 +1092,19 @@ static SVCXPRT *create_udp_transport(unsigned int port)
 	daemon_exit(0);
     }
 
+    worker_transport(transp);
+    if (opt_udp_batch)
+	udp_batch(transp, opt_udp_batch);
+
     return transp;
 }
 
-static SVCXPRT *create_tcp_transport(unsigned int port)
+static SVCXPRT *create_tcp_transport(unsigned int *port, unsigned int idx)
 {
     SVCXPRT *transp = NULL;
-    struct sockaddr_in sin;
     int sock;
-    const int on = 1;
-
-    /* Make sure we null the entire sockaddr_in structure */
-    memset(&sin, 0, sizeof(struct sockaddr_in));
-
-    if (port == 0)
-	sock = RPC_ANYSOCK;
-    else {
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = opt_bind_addr.s_addr;
-	sock = socket(PF_INET, SOCK_STREAM, 0);
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
-	if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
-	    perror("bind");
-	    fprintf(stderr, "Couldn't bind to tcp port %d\n", port);
-	    exit(1);
-	}
-    }
 
+    sock = create_socket(SOCK_STREAM, port, idx);
     transp = svctcp_create(sock, 0, 0);
 
     if (transp == NULL) {
@@ -798,9 +1112,61 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
 	daemon_exit(0);
     }
 
+    worker_transport(transp);
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    event_listen(transp->xp_fd);
+#else
+    event_listen(transp->xp_sock);
+#endif
+
     return transp;
 }
 
+#ifdef UNFS3_EPOLL
+/*
+ * event loop with epoll, only sockets with pending requests are looked at
+ */
+static void unfs3_event_run(void)
+{
+    int fds[EVENT_BATCH];
+    int i, n, tick;
+
+    for (;;) {
+	/* brute force searches advance between requests */
+	locate_step();
+
+	/* file I/O queued by the requests just handled */
+	async_submit();
+
+	n = event_wait(fds, EVENT_BATCH, locate_active() ? 0 : -1, &tick);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("unfs3_event_run: epoll_wait failed");
+	    return;
+	}
+
+	if (tick) {
+	    fd_cache_close_inactive();
+	    readdir_close_inactive();
+	    stats_close_inactive();
+	}
+
+	for (i = 0; i < n; i++) {
+	    /* file I/O queued by earlier requests is done */
+	    if (async_ready(fds[i]))
+		continue;
+
+	    udp_getreq(fds[i]);
+
+	    /* pick up the transport of an accepted connection */
+	    if (event_listener(fds[i]))
+		event_sync();
+	}
+    }
+}
+#endif				       /* UNFS3_EPOLL */
+
 /* Run RPC service. This is our own implementation of svc_run(), which
    allows us to handle other events as well. */
 static void unfs3_svc_run(void)
@@ -812,11 +1178,29 @@ static void unfs3_svc_run(void)
     struct timeval tv;
 #endif
 
+    if (worker_active()) {
+	worker_svc_run();
+	return;
+    }
+
+#ifdef UNFS3_EPOLL
+    if (event_init(FALSE)) {
+	async_init();
+	unfs3_event_run();
+	return;
+    }
+#endif
+
     for (;;) {
 	fd_cache_close_inactive();
+	readdir_close_inactive();
+	stats_close_inactive();
+
+	/* brute force searches advance between requests */
+	locate_step();
 
 #ifdef HAVE_SVC_GETREQ_POLL
-	r = poll(svc_pollfd, svc_max_pollfd, 2*1000);
+	r = poll(svc_pollfd, svc_max_pollfd, locate_active() ? 0 : 2*1000);
 	if (r < 0) {
 		if (errno == EINTR) {
 		    continue;
@@ -829,7 +1213,7 @@ static void unfs3_svc_run(void)
 
 #else
 	readfds = svc_fdset;
-	tv.tv_sec = 1;
+	tv.tv_sec = locate_active() ? 0 : 1;
 	tv.tv_usec = 0;
 	/* Note: On Windows, it's not possible to call select with all sets
 	   empty; to use it as a sleep function. In our case, however,
@@ -881,6 +1265,7 @@ void change_readdir_cookie(void)
 int main(int argc, char **argv)
 {
     register SVCXPRT *tcptransp = NULL, *udptransp = NULL;
+    unsigned int udpport, tcpport, i;
     pid_t pid = 0;
 
 #ifndef WIN32
@@ -928,22 +1313,33 @@ int main(int argc, char **argv)
 	setvbuf(stdout, NULL, _IOLBF, 0);
     }
 
-    /* NFS transports */
-    if (!opt_tcponly)
-	udptransp = create_udp_transport(opt_nfs_port);
-    tcptransp = create_tcp_transport(opt_nfs_port);
+    /* NFS transports, the portmapper is told about the first ones */
+    udpport = tcpport = opt_nfs_port;
+    for (i = 0; i < opt_sockets; i++) {
+	if (!opt_tcponly)
+	    udptransp = create_udp_transport(&udpport, i);
+	tcptransp = create_tcp_transport(&tcpport, i);
 
-    register_nfs_service(udptransp, tcptransp);
+	register_nfs_service(udptransp, tcptransp, opt_portmapper && i == 0);
+    }
 
     /* MOUNT transports. If ports are equal, then the MOUNT service can reuse 
        the NFS transports. */
     if (opt_mount_port != opt_nfs_port) {
-	if (!opt_tcponly)
-	    udptransp = create_udp_transport(opt_mount_port);
-	tcptransp = create_tcp_transport(opt_mount_port);
-    }
+	udpport = tcpport = opt_mount_port;
+	for (i = 0; i < opt_sockets; i++) {
+	    if (!opt_tcponly)
+		udptransp = create_udp_transport(&udpport, i);
+	    tcptransp = create_tcp_transport(&tcpport, i);
+
+	    register_mount_service(udptransp, tcptransp,
+				   opt_portmapper && i == 0);
+	}
+    } else
+	register_mount_service(udptransp, tcptransp, opt_portmapper);
 
-    register_mount_service(udptransp, tcptransp);
+    if (opt_stats)
+	stats_listen(opt_stats);
 
 #ifndef WIN32
     if (opt_detach) {
@@ -993,9 +1389,11 @@ int main(int argc, char **argv)
 
 	/* initialize internal stuff */
 	fh_cache_init();
+	fh_search_init();
 	fd_cache_init();
 	get_squash_ids();
 	exports_parse();
+	worker_init();
 
 	unfs3_svc_run();
 	exit(1);
@@ -12,6 +12,9 @@
 /* exit status for internal errors */
 #define CRISIS	99
 
+/* maximum number of sockets per transport and port */
+#define SOCKETS_MAX	32
+
 /* HP-UX does not have seteuid() and setegid() */
 #if HAVE_SETEUID == 0 && HAVE_SETRESUID == 1
 #define seteuid(u) setresuid(-1, u, -1)
@@ -45,5 +48,23 @@ extern char	*opt_cluster_path;
 extern int	opt_singleuser;
 extern int	opt_brute_force;
 extern int	opt_readable_executables;
+extern unsigned int opt_fh_cache_size;
+extern unsigned int opt_fd_cache_size;
+extern char	*opt_fh_index;
+extern unsigned int opt_fh_index_size;
+extern char	*opt_stats;
+extern int	opt_kernel_handles;
+extern unsigned int opt_workers;
+extern unsigned int opt_readdir_size;
+extern unsigned int opt_attr_cache;
+extern int	opt_notify;
+extern unsigned int opt_max_data;
+extern unsigned int opt_write_gather;
+extern unsigned int opt_sockets;
+extern unsigned int opt_udp_batch;
+extern unsigned int opt_slow_time;
+extern unsigned int opt_io_ring;
+extern unsigned int opt_sync_threads;
+extern unsigned int opt_fh_threads;
 
 #endif
@@ -0,0 +1,355 @@
+/*
+ * UNFS3 duplicate request cache
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <netinet/in.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "drc.h"
+#include "async.h"
+
+/*
+ * clients send a request again when the reply does not arrive in time,
+ * which happens easily over UDP or when an operation is slow. Running
+ * a request that changes the filesystem twice does the work twice, and
+ * makes operations such as CREATE, REMOVE, or RENAME fail the second
+ * time. The replies to such requests are therefore kept, identified by
+ * xid, client address and port, and procedure, and retransmissions are
+ * answered from the cache. A retransmission arriving while the original
+ * request is still in progress is dropped.
+ *
+ * the RPC library does not tell the xid of a request, so the receive
+ * function of transports is wrapped to note it; a transport is wrapped
+ * on its first request, which is not cached. The destroy function is
+ * wrapped as well, so that replies of requests still in progress are
+ * not sent to a new connection on the same socket.
+ */
+
+/* replies older than this are not used */
+#define DRC_TIMEOUT	120
+
+/* kinds of transports, with their original and wrapped operations */
+#define DRC_OPS		4
+
+typedef struct {
+    const struct xp_ops *orig;
+    struct xp_ops ops;
+} drc_ops_t;
+
+static drc_ops_t drc_ops[DRC_OPS];
+static unsigned int drc_nops = 0;
+
+/* xid of the request last received by this thread, and its transport */
+static UNFS3_TLS SVCXPRT *drc_xprt = NULL;
+static UNFS3_TLS u_int32_t drc_cur_xid;
+
+typedef struct {
+    u_int32_t xid;		/* transaction id */
+    u_int32_t proc;		/* procedure */
+    struct in_addr addr;	/* client address */
+    short port;			/* client port */
+    time_t time;		/* time of request */
+    unsigned int seq;		/* request number, 0 if unused */
+    int busy;			/* request still in progress */
+    int next;			/* next entry in hash chain, plus one */
+    drc_reply_t reply;		/* encoded reply */
+} drc_entry_t;
+
+static drc_entry_t drc_cache[DRC_ENTRIES];
+
+/* hash chains, index of first entry plus one */
+static int drc_hash[DRC_ENTRIES];
+
+/* next entry to reuse, entries are replaced in order of requests */
+static unsigned int drc_clock = 0;
+static unsigned int drc_seq = 0;
+
+/* entry of the request this thread is handling */
+static UNFS3_TLS int drc_cur = -1;
+static UNFS3_TLS unsigned int drc_cur_seq;
+
+/* statistics */
+int drc_hit = 0;
+int drc_miss = 0;
+
+/*
+ * find the wrapped operations of a transport
+ */
+static drc_ops_t *drc_ops_of(SVCXPRT * xprt)
+{
+    unsigned int i;
+
+    for (i = 0; i < drc_nops; i++)
+	if (xprt->xp_ops == &drc_ops[i].ops)
+	    return &drc_ops[i];
+
+    return NULL;
+}
+
+/*
+ * receive a request, noting its xid
+ */
+static bool_t drc_recv(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    if (!drc_ops_of(xprt)->orig->xp_recv(xprt, msg))
+	return FALSE;
+
+    drc_xprt = xprt;
+    drc_cur_xid = msg->rm_xid;
+    return TRUE;
+}
+
+/*
+ * destroy a transport
+ */
+static void drc_destroy(SVCXPRT * xprt)
+{
+    const struct xp_ops *orig = drc_ops_of(xprt)->orig;
+
+    async_closed(xprt);
+    orig->xp_destroy(xprt);
+}
+
+/*
+ * wrap the receive and destroy functions of a transport
+ */
+void drc_watch(SVCXPRT * xprt)
+{
+    unsigned int i;
+
+    if (drc_ops_of(xprt))
+	return;
+
+    /* the xid noted last on this thread is not for this transport */
+    drc_xprt = NULL;
+
+    for (i = 0; i < drc_nops; i++)
+	if (xprt->xp_ops == drc_ops[i].orig)
+	    break;
+
+    if (i == drc_nops) {
+	if (drc_nops == DRC_OPS)
+	    return;
+	drc_ops[i].orig = xprt->xp_ops;
+	drc_ops[i].ops = *xprt->xp_ops;
+	drc_ops[i].ops.xp_recv = drc_recv;
+	drc_ops[i].ops.xp_destroy = drc_destroy;
+	drc_nops++;
+    }
+
+    xprt->xp_ops = &drc_ops[i].ops;
+}
+
+/*
+ * note the xid of a request received without the RPC library
+ */
+void drc_received(SVCXPRT * xprt, u_int32_t xid)
+{
+    drc_watch(xprt);
+    drc_xprt = xprt;
+    drc_cur_xid = xid;
+}
+
+/*
+ * get the xid of the request being handled on a transport
+ */
+int drc_xid(SVCXPRT * xprt, u_int32_t * xid)
+{
+    if (drc_xprt != xprt || !drc_ops_of(xprt))
+	return FALSE;
+
+    if (xid)
+	*xid = drc_cur_xid;
+    return TRUE;
+}
+
+/*
+ * check whether replies to a procedure are cached
+ *
+ * these procedures fail or do harm when done twice; WRITE can be slow
+ * and is therefore often retransmitted
+ */
+static int drc_wanted(u_int32_t proc)
+{
+    switch (proc) {
+	case NFSPROC3_SETATTR:
+	case NFSPROC3_WRITE:
+	case NFSPROC3_CREATE:
+	case NFSPROC3_MKDIR:
+	case NFSPROC3_SYMLINK:
+	case NFSPROC3_MKNOD:
+	case NFSPROC3_REMOVE:
+	case NFSPROC3_RMDIR:
+	case NFSPROC3_RENAME:
+	case NFSPROC3_LINK:
+	    return TRUE;
+	default:
+	    return FALSE;
+    }
+}
+
+/*
+ * compute hash bucket for a request
+ */
+static unsigned int drc_bucket(u_int32_t xid, struct in_addr addr)
+{
+    u_int32_t h;
+
+    h = xid * 0x9E3779B1 ^ (u_int32_t) addr.s_addr;
+    h ^= h >> 16;
+
+    return h & (DRC_ENTRIES - 1);
+}
+
+/*
+ * remove an entry from its hash chain
+ */
+static void drc_unlink(int idx)
+{
+    int *link;
+
+    link = &drc_hash[drc_bucket(drc_cache[idx].xid, drc_cache[idx].addr)];
+    while (*link) {
+	if (*link == idx + 1) {
+	    *link = drc_cache[idx].next;
+	    break;
+	}
+	link = &drc_cache[*link - 1].next;
+    }
+
+    drc_cache[idx].seq = 0;
+}
+
+/*
+ * look up a request before it is handled
+ *
+ * for DRC_REPLAY, reply holds the cached reply
+ */
+int drc_start(struct svc_req *rqstp, drc_reply_t * reply)
+{
+    struct in_addr addr;
+    short port;
+    u_int32_t xid;
+    unsigned int h;
+    time_t now;
+    int i;
+
+    drc_cur = -1;
+
+    if (!drc_wanted(rqstp->rq_proc) || !drc_xid(rqstp->rq_xprt, &xid))
+	return DRC_NONE;
+
+    addr = get_remote(rqstp);
+    port = get_port(rqstp);
+    now = time(NULL);
+    h = drc_bucket(xid, addr);
+
+    for (i = drc_hash[h]; i; i = drc_cache[i - 1].next) {
+	drc_entry_t *e = &drc_cache[i - 1];
+
+	if (e->xid != xid || e->proc != rqstp->rq_proc ||
+	    e->addr.s_addr != addr.s_addr || e->port != port ||
+	    now >= e->time + DRC_TIMEOUT)
+	    continue;
+
+	drc_hit++;
+	if (e->busy)
+	    return DRC_BUSY;
+
+	reply->len = e->reply.len;
+	memcpy(reply->buf, e->reply.buf, e->reply.len);
+	return DRC_REPLAY;
+    }
+
+    drc_miss++;
+
+    /* replace the oldest entry */
+    i = drc_clock;
+    drc_clock = (drc_clock + 1) & (DRC_ENTRIES - 1);
+    if (drc_cache[i].seq)
+	drc_unlink(i);
+
+    if (++drc_seq == 0)
+	drc_seq = 1;
+
+    drc_cache[i].xid = xid;
+    drc_cache[i].proc = rqstp->rq_proc;
+    drc_cache[i].addr = addr;
+    drc_cache[i].port = port;
+    drc_cache[i].time = now;
+    drc_cache[i].seq = drc_seq;
+    drc_cache[i].busy = TRUE;
+    drc_cache[i].reply.len = 0;
+    drc_cache[i].next = drc_hash[h];
+    drc_hash[h] = i + 1;
+
+    drc_cur = i;
+    drc_cur_seq = drc_seq;
+    return DRC_NEW;
+}
+
+/*
+ * store the reply to the request started with drc_start()
+ */
+void drc_done(xdrproc_t proc, caddr_t result)
+{
+    drc_entry_t *e;
+    XDR xdrs;
+
+    if (drc_cur == -1)
+	return;
+
+    /* entry has been reused in the meantime */
+    e = &drc_cache[drc_cur];
+    drc_cur = -1;
+    if (e->seq != drc_cur_seq)
+	return;
+
+    xdrmem_create(&xdrs, e->reply.buf, DRC_REPLY_MAX, XDR_ENCODE);
+    if (result && proc(&xdrs, result)) {
+	e->reply.len = xdr_getpos(&xdrs);
+	e->busy = FALSE;
+    } else
+	/* reply too large or not sent, handle a retransmission again */
+	drc_unlink(e - drc_cache);
+    xdr_destroy(&xdrs);
+}
+
+/*
+ * take over the entry of the request being handled, whose reply will be
+ * sent after the request handler has returned
+ */
+void drc_defer(drc_pending_t * pending)
+{
+    pending->idx = drc_cur;
+    pending->seq = drc_cur_seq;
+    drc_cur = -1;
+}
+
+/*
+ * make a deferred request current again, for storing its reply with
+ * drc_done()
+ */
+void drc_resume(const drc_pending_t * pending)
+{
+    drc_cur = pending->idx;
+    drc_cur_seq = pending->seq;
+}
+
+/*
+ * encode a cached reply
+ */
+bool_t xdr_drc_reply(XDR * xdrs, drc_reply_t * reply)
+{
+    return xdr_opaque(xdrs, reply->buf, reply->len);
+}
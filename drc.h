@@ -0,0 +1,46 @@
+/*
+ * UNFS3 duplicate request cache
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_DRC_H
+#define UNFS3_DRC_H
+
+/* number of cached replies, must be a power of two */
+#define DRC_ENTRIES	1024
+
+/* largest cached reply, encoded */
+#define DRC_REPLY_MAX	512
+
+/* results of drc_start() */
+#define DRC_NONE	0		/* not cached, just handle request */
+#define DRC_NEW		1		/* handle request, then drc_done() */
+#define DRC_REPLAY	2		/* send the cached reply */
+#define DRC_BUSY	3		/* original still in progress, drop */
+
+typedef struct {
+    unsigned int len;
+    char buf[DRC_REPLY_MAX];
+} drc_reply_t;
+
+/* entry of a request whose reply is sent later, see drc_defer() */
+typedef struct {
+    int idx;
+    unsigned int seq;
+} drc_pending_t;
+
+/* statistics */
+extern int drc_hit;
+extern int drc_miss;
+
+void drc_watch(SVCXPRT * xprt);
+void drc_received(SVCXPRT * xprt, u_int32_t xid);
+int drc_xid(SVCXPRT * xprt, u_int32_t * xid);
+
+int drc_start(struct svc_req *rqstp, drc_reply_t * reply);
+void drc_done(xdrproc_t proc, caddr_t result);
+void drc_defer(drc_pending_t * pending);
+void drc_resume(const drc_pending_t * pending);
+bool_t xdr_drc_reply(XDR * xdrs, drc_reply_t * reply);
+
+#endif
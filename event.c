@@ -0,0 +1,218 @@
+/*
+ * UNFS3 event loop with epoll
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "event.h"
+
+/* listening TCP sockets */
+#define EVENT_LISTEN_MAX	64
+
+static int event_listeners[EVENT_LISTEN_MAX];
+static unsigned int event_nlisteners = 0;
+
+/*
+ * note a TCP listening socket, new transports appear when it is readable
+ */
+void event_listen(int fd)
+{
+    if (event_nlisteners < EVENT_LISTEN_MAX)
+	event_listeners[event_nlisteners++] = fd;
+}
+
+/*
+ * check whether a socket is a TCP listening socket
+ */
+int event_listener(int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < event_nlisteners; i++)
+	if (event_listeners[i] == fd)
+	    return TRUE;
+
+    return FALSE;
+}
+
+#ifdef UNFS3_EPOLL
+
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <sys/timerfd.h>
+
+/*
+ * instead of polling all transports of the RPC library on every
+ * iteration, their sockets are kept in an epoll set, and only sockets
+ * with pending requests are handed to svc_getreq_common()
+ *
+ * the RPC library creates a transport for each accepted connection and
+ * destroys it on its own, closing the socket, which also removes it from
+ * the epoll set; after a connection has been accepted, new sockets are
+ * picked up from svc_pollfd
+ *
+ * with worker threads, transport sockets are armed for one event only,
+ * and the worker arms the socket again when it is done with the transport
+ *
+ * closing inactive files and directories is driven by a timer instead of
+ * being done on every wakeup
+ */
+
+static int event_fd = -1;
+static int event_timer = -1;
+static int event_oneshot = FALSE;
+
+/*
+ * add a socket to the epoll set
+ */
+static void event_ctl(int fd, int oneshot)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (oneshot ? EPOLLONESHOT : 0);
+    ev.data.fd = fd;
+
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST)
+	logmsg(LOG_WARNING, "unable to watch socket %i: %s", fd,
+	       strerror(errno));
+}
+
+/*
+ * set up epoll set and timer, returns FALSE if not available
+ */
+int event_init(int oneshot)
+{
+    struct itimerspec tick;
+
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd == -1)
+	return FALSE;
+
+    event_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (event_timer == -1) {
+	close(event_fd);
+	event_fd = -1;
+	return FALSE;
+    }
+
+    memset(&tick, 0, sizeof(tick));
+    tick.it_value.tv_sec = EVENT_TICK;
+    tick.it_interval.tv_sec = EVENT_TICK;
+    timerfd_settime(event_timer, 0, &tick, NULL);
+
+    event_oneshot = oneshot;
+    event_ctl(event_timer, FALSE);
+    event_sync();
+
+    return TRUE;
+}
+
+/*
+ * watch another file descriptor, such as a pipe
+ */
+void event_add(int fd)
+{
+    event_ctl(fd, FALSE);
+}
+
+/*
+ * add sockets of new transports to the epoll set
+ */
+void event_sync(void)
+{
+    int i, fd;
+
+    for (i = 0; i < svc_max_pollfd; i++) {
+	fd = svc_pollfd[i].fd;
+	if (fd >= 0)
+	    event_ctl(fd, event_oneshot && !event_listener(fd));
+    }
+}
+
+/*
+ * arm a transport socket again after its requests have been handled
+ */
+void event_rearm(int fd)
+{
+    struct epoll_event ev;
+
+    if (!event_oneshot)
+	return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    /* fails if the transport has been destroyed meanwhile */
+    epoll_ctl(event_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * wait for readable sockets, tick is set when the timer expired
+ */
+int event_wait(int *fds, int max, int timeout, int *tick)
+{
+    struct epoll_event ev[EVENT_BATCH];
+    uint64_t expired;
+    int i, n, r;
+
+    *tick = FALSE;
+
+    if (max > EVENT_BATCH)
+	max = EVENT_BATCH;
+
+    r = epoll_wait(event_fd, ev, max, timeout);
+    if (r == -1)
+	return -1;
+
+    for (i = 0, n = 0; i < r; i++) {
+	if (ev[i].data.fd == event_timer) {
+	    if (read(event_timer, &expired, sizeof(expired)) > 0)
+		*tick = TRUE;
+	    continue;
+	}
+	fds[n++] = ev[i].data.fd;
+    }
+
+    return n;
+}
+
+#else				       /* UNFS3_EPOLL */
+
+int event_init(U(int oneshot))
+{
+    return FALSE;
+}
+
+void event_add(U(int fd))
+{
+}
+
+void event_sync(void)
+{
+}
+
+void event_rearm(U(int fd))
+{
+}
+
+int event_wait(U(int *fds), U(int max), U(int timeout), U(int *tick))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif				       /* UNFS3_EPOLL */
@@ -0,0 +1,28 @@
+/*
+ * UNFS3 event loop with epoll
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_EVENT_H
+#define UNFS3_EVENT_H
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H) && \
+    defined(HAVE_SVC_GETREQ_POLL) && defined(HAVE_SVC_GETREQ_COMMON)
+#define UNFS3_EPOLL 1
+#endif
+
+/* maximum number of events handled per wakeup */
+#define EVENT_BATCH	64
+
+/* seconds between closing inactive files and directories */
+#define EVENT_TICK	1
+
+int event_init(int oneshot);
+void event_listen(int fd);
+int event_listener(int fd);
+void event_add(int fd);
+void event_sync(void);
+void event_rearm(int fd);
+int event_wait(int *fds, int max, int timeout, int *tick);
+
+#endif
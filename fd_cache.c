@@ -13,8 +13,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #ifndef WIN32
+#include <sys/resource.h>
 #include <syslog.h>
 #include <unistd.h>
 #endif				       /* WIN32 */
@@ -25,18 +28,25 @@
 #include "daemon.h"
 #include "Config/exports.h"
 #include "fd_cache.h"
+#include "user.h"
+#include "worker.h"
 #include "backend.h"
+#include "attr.h"
 
 /*
  * intention of the file descriptor cache
  *
  * for READ operations, the intent is to open() the file on the first
- * access and to close() it when we hit EOF or after two seconds of
- * inactivity.
+ * access and to close() it after two seconds of inactivity. Hitting EOF
+ * does not close the file, since small files tend to be read again.
  *
  * for WRITE operations, the intent is to open() the file on the first
- * UNSTABLE access and to close() it when COMMIT is called or after
- * two seconds of inactivity. 
+ * UNSTABLE access and to close() it when COMMIT is called for the whole
+ * file or after two seconds of inactivity. The file is opened for reading
+ * as well if possible, and READ operations then use the same fd.
+ *
+ * Cached fds are shared by all users, but another user than the one who
+ * opened an fd has to pass the permission check of a new open() first.
  * 
  * There are three states of an entry:
  * 1) Unused. use == 0. 
@@ -55,17 +65,24 @@
  * COMMITs may succeed even though data has been lost, but since the
  * verifier is changed, clients will notice this and re-send their
  * data. Eventually, with some luck, all clients will get an IO error.
+ *
+ * With worker threads, file I/O is done without holding the server lock.
+ * Entries are marked busy between fd_open() and fd_close() then, and
+ * busy entries are never closed by another thread.
  */
 
-/* number of entries in fd cache */
-#define FD_ENTRIES	256
-
 /* The number of seconds to wait before closing inactive fd */
 #define INACTIVE_TIMEOUT 2
 
 /* The number of seconds to keep pending errors */
 #define PENDING_ERROR_TIMEOUT 7200     /* 2 hours */
 
+/* number of fds left for sockets and other files */
+#define FD_RESERVE	64
+
+/* marker for end of hash chain or list */
+#define FD_CACHE_NONE	(-1)
+
 typedef struct {
     int fd;			/* open file descriptor */
     int kind;			/* read or write */
@@ -73,54 +90,306 @@ typedef struct {
     uint32 dev;			/* device */
     uint64 ino;			/* inode */
     uint32 gen;			/* inode generation */
+    int rdwr;			/* write fd also open for reading */
+    int busy;			/* number of requests using the fd */
+    user_cred_t cred;		/* ids the fd was opened with */
+    uint64 next;		/* end of the highest READ so far */
+    uint64 ahead;		/* end of the range announced to the kernel */
+    uint64 behind;		/* start of the range still in the page cache */
+    int seq;			/* number of sequential READs */
+    char *gbuf;			/* gathered UNSTABLE writes, or NULL */
+    uint64 goff;		/* file offset of gathered data */
+    unsigned int glen;		/* length of gathered data */
+    int werr;			/* errno of failed write of gathered data */
+    int hnext;			/* next entry in fh hash chain */
+    int fnext;			/* next entry in fd hash chain */
+    int lprev;			/* previous (more recently used) entry */
+    int lnext;			/* next (less recently used) entry */
 } fd_cache_t;
 
-static fd_cache_t fd_cache[FD_ENTRIES];
+static fd_cache_t *fd_cache = NULL;
+static unsigned int fd_cache_size = 0;
+
+/* hash chains, indexed by fd_hash_fh() and fd_hash_fd() */
+static int *fd_cache_hbucket = NULL;
+static int *fd_cache_fbucket = NULL;
+static unsigned int fd_cache_mask = 0;
+
+/*
+ * entries are kept on one of three lists:
+ *
+ * - unused entries, chained through lnext
+ * - entries with an open fd, ordered by last use, so that expired
+ *   entries are found at the tail
+ * - entries with a pending error
+ */
+typedef struct {
+    int head;			/* most recently used */
+    int tail;			/* least recently used */
+} fd_list_t;
+
+static int fd_cache_free = FD_CACHE_NONE;
+static fd_list_t fd_cache_open = { FD_CACHE_NONE, FD_CACHE_NONE };
+static fd_list_t fd_cache_errors = { FD_CACHE_NONE, FD_CACHE_NONE };
 
 /* statistics */
 int fd_cache_readers = 0;
 int fd_cache_writers = 0;
 
+/*
+ * compute hash bucket for fh (device, inode, and generation number)
+ */
+static unsigned int fd_hash_fh(uint32 dev, uint64 ino, uint32 gen, int kind)
+{
+    uint32 h;
+
+    h = (uint32) ino ^ (uint32) (ino >> 32) ^ gen * 0x85EBCA6B;
+    h ^= dev * 0x9E3779B1;
+    h ^= h >> 16;
+
+    return (h + kind) & fd_cache_mask;
+}
+
+/*
+ * compute hash bucket for operating system fd number
+ */
+static unsigned int fd_hash_fd(int fd)
+{
+    return (unsigned int) fd & fd_cache_mask;
+}
+
+/*
+ * unlink an entry from a list
+ */
+static void fd_list_unlink(fd_list_t * list, int idx)
+{
+    if (fd_cache[idx].lprev != FD_CACHE_NONE)
+	fd_cache[fd_cache[idx].lprev].lnext = fd_cache[idx].lnext;
+    else
+	list->head = fd_cache[idx].lnext;
+
+    if (fd_cache[idx].lnext != FD_CACHE_NONE)
+	fd_cache[fd_cache[idx].lnext].lprev = fd_cache[idx].lprev;
+    else
+	list->tail = fd_cache[idx].lprev;
+
+    fd_cache[idx].lprev = FD_CACHE_NONE;
+    fd_cache[idx].lnext = FD_CACHE_NONE;
+}
+
+/*
+ * put an entry at the head of a list
+ */
+static void fd_list_head(fd_list_t * list, int idx)
+{
+    fd_cache[idx].lprev = FD_CACHE_NONE;
+    fd_cache[idx].lnext = list->head;
+    if (list->head != FD_CACHE_NONE)
+	fd_cache[list->head].lprev = idx;
+    else
+	list->tail = idx;
+    list->head = idx;
+}
+
+/*
+ * remove an entry from a hash chain
+ */
+static void fd_chain_del(int *link, int idx, int fd_chain)
+{
+    while (*link != FD_CACHE_NONE) {
+	if (*link == idx) {
+	    *link = fd_chain ? fd_cache[idx].fnext : fd_cache[idx].hnext;
+	    return;
+	}
+	link = fd_chain ? &fd_cache[*link].fnext : &fd_cache[*link].hnext;
+    }
+}
+
+/*
+ * make sure that the process may open enough files for the cache
+ */
+static void fd_cache_limit(void)
+{
+#ifndef WIN32
+    struct rlimit rl;
+    rlim_t want = (rlim_t) opt_fd_cache_size + FD_RESERVE;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+	return;
+
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want) {
+	rl.rlim_cur = want;
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+	    rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want) {
+	if (rl.rlim_cur > 2 * FD_RESERVE)
+	    fd_cache_size = rl.rlim_cur - FD_RESERVE;
+	else
+	    fd_cache_size = FD_RESERVE;
+	logmsg(LOG_WARNING,
+	       "open file limit too low, fd cache reduced to %u entries",
+	       fd_cache_size);
+    }
+#endif				       /* WIN32 */
+}
+
 /*
  * initialize the fd cache
  */
 void fd_cache_init(void)
 {
-    int i;
+    unsigned int i, buckets;
+
+    fd_cache_size = opt_fd_cache_size;
+    fd_cache_limit();
+
+    /* hash tables have at least as many buckets as entries */
+    for (buckets = 1; buckets < fd_cache_size; buckets <<= 1);
+    fd_cache_mask = buckets - 1;
 
-    for (i = 0; i < FD_ENTRIES; i++) {
+    fd_cache = malloc(sizeof(fd_cache_t) * fd_cache_size);
+    fd_cache_hbucket = malloc(sizeof(int) * buckets);
+    fd_cache_fbucket = malloc(sizeof(int) * buckets);
+    if (!fd_cache || !fd_cache_hbucket || !fd_cache_fbucket) {
+	logmsg(LOG_EMERG, "unable to allocate fd cache, aborting");
+	daemon_exit(CRISIS);
+    }
+
+    for (i = 0; i < fd_cache_size; i++) {
 	fd_cache[i].fd = -1;
 	fd_cache[i].kind = UNFS3_FD_READ;
 	fd_cache[i].use = 0;
 	fd_cache[i].dev = 0;
 	fd_cache[i].ino = 0;
 	fd_cache[i].gen = 0;
+	fd_cache[i].rdwr = FALSE;
+	fd_cache[i].busy = 0;
+	fd_cache[i].next = 0;
+	fd_cache[i].ahead = 0;
+	fd_cache[i].behind = 0;
+	fd_cache[i].seq = 0;
+	fd_cache[i].gbuf = NULL;
+	fd_cache[i].glen = 0;
+	fd_cache[i].werr = 0;
+	fd_cache[i].hnext = FD_CACHE_NONE;
+	fd_cache[i].fnext = FD_CACHE_NONE;
+	fd_cache[i].lprev = FD_CACHE_NONE;
+	fd_cache[i].lnext = i + 1 < fd_cache_size ? (int) i + 1 : FD_CACHE_NONE;
+    }
+    fd_cache_free = 0;
+
+    for (i = 0; i < buckets; i++) {
+	fd_cache_hbucket[i] = FD_CACHE_NONE;
+	fd_cache_fbucket[i] = FD_CACHE_NONE;
     }
 }
 
 /*
- * find cache index to use for new entry
- * returns an empty slot if found, else return error
+ * write gathering
+ *
+ * with -g, UNSTABLE writes which continue or overlap the data gathered
+ * for a WRITE fd are copied into a buffer instead of being written at
+ * once, so that clients sending many small writes cause few large ones.
+ * The buffer is written out when a write does not fit, before any other
+ * write, before the file is read or its attributes are reported, and on
+ * COMMIT or close. Gathered data has been answered as UNSTABLE, so a
+ * failure to write it is a pending error just like failing fsync/close.
  */
-static int fd_cache_unused(void)
+static unsigned int fd_gather_buffers = 0;
+
+/*
+ * write out gathered data, called with the lock held
+ */
+static int fd_gather_flush(int idx)
 {
-    int i;
-    static time_t last_warning = 0;
+    fd_cache_t *e = &fd_cache[idx];
+    unsigned int done = 0;
+    int res;
 
-    for (i = 0; i < FD_ENTRIES; i++) {
-	if (fd_cache[i].use == 0)
-	    return i;
+    if (e->werr) {
+	errno = e->werr;
+	return -1;
     }
 
-    /* Do not print warning more than once per 10 second */
-    if (time(NULL) > last_warning + 10) {
-	last_warning = time(NULL);
-	logmsg(LOG_INFO,
-	       "fd cache full due to more than %d active files or pending IO errors",
-	       FD_ENTRIES);
+    while (done < e->glen) {
+	res = backend_pwrite(e->fd, e->gbuf + done, e->glen - done,
+			     (off64_t) (e->goff + done));
+	if (res == -1 && errno == EINTR)
+	    continue;
+	if (res <= 0) {
+	    e->werr = res == 0 ? EIO : errno;
+	    e->glen = 0;
+	    errno = e->werr;
+	    return -1;
+	}
+	done += res;
     }
 
-    return -1;
+    if (e->glen > 0) {
+	attr_cache_forget(e->dev, e->ino);
+#ifdef HAVE_SYNC_FILE_RANGE
+	/* start writeback now, leaving less for COMMIT to wait for */
+	sync_file_range(e->fd, e->goff, e->glen, SYNC_FILE_RANGE_WRITE);
+#endif
+    }
+
+    e->glen = 0;
+    return 0;
+}
+
+/*
+ * release the gather buffer of an entry
+ */
+static void fd_gather_free(int idx)
+{
+    if (fd_cache[idx].gbuf) {
+	free(fd_cache[idx].gbuf);
+	fd_cache[idx].gbuf = NULL;
+	fd_gather_buffers--;
+    }
+    fd_cache[idx].glen = 0;
+    fd_cache[idx].werr = 0;
+}
+
+/*
+ * try to gather an UNSTABLE write, returns TRUE if the data was taken
+ */
+static int fd_gather(int idx, const char *buf, unsigned int len,
+		     uint64 offset)
+{
+    fd_cache_t *e = &fd_cache[idx];
+
+    if (len >= opt_write_gather)
+	return FALSE;
+
+    if (e->glen > 0 && offset >= e->goff && offset <= e->goff + e->glen &&
+	offset + len <= e->goff + opt_write_gather) {
+	memcpy(e->gbuf + (offset - e->goff), buf, len);
+	if (offset + len > e->goff + e->glen)
+	    e->glen = offset + len - e->goff;
+	return TRUE;
+    }
+
+    if (!e->gbuf) {
+	if (fd_gather_buffers >= FD_GATHER_BUFFERS)
+	    return FALSE;
+	e->gbuf = malloc(opt_write_gather);
+	if (!e->gbuf)
+	    return FALSE;
+	fd_gather_buffers++;
+    }
+
+    if (fd_gather_flush(idx) == -1)
+	return FALSE;
+
+    memcpy(e->gbuf, buf, len);
+    e->goff = offset;
+    e->glen = len;
+    return TRUE;
 }
 
 /*
@@ -138,10 +407,17 @@ static int fd_cache_del(int idx, int keep_on_error)
     res1 = -1;
 
     if (fd_cache[idx].fd != -1) {
+	fd_list_unlink(&fd_cache_open, idx);
+	fd_chain_del(&fd_cache_fbucket[fd_hash_fd(fd_cache[idx].fd)], idx,
+		     TRUE);
+
 	if (fd_cache[idx].kind == UNFS3_FD_WRITE) {
-	    /* sync file data if writing descriptor */
+	    /* write out gathered data and sync file data */
 	    fd_cache_writers--;
-	    res1 = backend_fsync(fd_cache[idx].fd);
+	    res1 = fd_gather_flush(idx);
+	    if (res1 != -1)
+		res1 = backend_fsync(fd_cache[idx].fd);
+	    fd_gather_free(idx);
 	} else {
 	    fd_cache_readers--;
 	    res1 = 0;
@@ -153,9 +429,16 @@ static int fd_cache_del(int idx, int keep_on_error)
 	if (res1 == -1 || res2 == -1) {
 	    res1 = -1;
 	}
-    } else
+
+	/* entry stays around to report the error */
+	if (res1 == -1 && keep_on_error)
+	    fd_list_head(&fd_cache_errors, idx);
+    } else {
 	/* pending error */
 	errno = EIO;
+	if (!keep_on_error)
+	    fd_list_unlink(&fd_cache_errors, idx);
+    }
 
     if (res1 == -1 && !keep_on_error) {
 	/* The verifier should not be changed until we actually report &
@@ -164,22 +447,64 @@ static int fd_cache_del(int idx, int keep_on_error)
     }
 
     if (res1 != -1 || !keep_on_error) {
+	fd_chain_del(&fd_cache_hbucket[fd_hash_fh(fd_cache[idx].dev,
+						  fd_cache[idx].ino,
+						  fd_cache[idx].gen,
+						  fd_cache[idx].kind)], idx,
+		     FALSE);
+
 	fd_cache[idx].fd = -1;
 	fd_cache[idx].use = 0;
 	fd_cache[idx].dev = 0;
 	fd_cache[idx].ino = 0;
 	fd_cache[idx].gen = 0;
+	fd_cache[idx].lnext = fd_cache_free;
+	fd_cache_free = idx;
     }
 
     return res1;
 }
 
+/*
+ * find cache index to use for new entry
+ * returns an empty slot if found, else return error
+ */
+static int fd_cache_unused(void)
+{
+    int idx;
+    static time_t last_warning = 0;
+
+    /* a READ fd not used for longest can be closed without risk */
+    idx = fd_cache_open.tail;
+    if (fd_cache_free == FD_CACHE_NONE && idx != FD_CACHE_NONE &&
+	fd_cache[idx].kind == UNFS3_FD_READ && fd_cache[idx].busy == 0)
+	fd_cache_del(idx, TRUE);
+
+    if (fd_cache_free != FD_CACHE_NONE) {
+	idx = fd_cache_free;
+	fd_cache_free = fd_cache[idx].lnext;
+	fd_cache[idx].lnext = FD_CACHE_NONE;
+	return idx;
+    }
+
+    /* Do not print warning more than once per 10 second */
+    if (time(NULL) > last_warning + 10) {
+	last_warning = time(NULL);
+	logmsg(LOG_INFO,
+	       "fd cache full due to more than %u active files or pending IO errors",
+	       fd_cache_size);
+    }
+
+    return -1;
+}
+
 /*
  * add an entry to the cache
  */
-static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
+static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind, int rdwr)
 {
     int idx;
+    unsigned int h;
 
     idx = fd_cache_unused();
     if (idx != -1) {
@@ -195,6 +520,26 @@ static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
 	fd_cache[idx].dev = ufh->dev;
 	fd_cache[idx].ino = ufh->ino;
 	fd_cache[idx].gen = ufh->gen;
+	fd_cache[idx].rdwr = rdwr;
+	fd_cache[idx].busy = 1;
+	get_cred(&fd_cache[idx].cred);
+	fd_cache[idx].next = 0;
+	fd_cache[idx].ahead = 0;
+	fd_cache[idx].behind = 0;
+	fd_cache[idx].seq = 0;
+	fd_cache[idx].gbuf = NULL;
+	fd_cache[idx].glen = 0;
+	fd_cache[idx].werr = 0;
+
+	h = fd_hash_fh(ufh->dev, ufh->ino, ufh->gen, kind);
+	fd_cache[idx].hnext = fd_cache_hbucket[h];
+	fd_cache_hbucket[h] = idx;
+
+	h = fd_hash_fd(fd);
+	fd_cache[idx].fnext = fd_cache_fbucket[h];
+	fd_cache_fbucket[h] = idx;
+
+	fd_list_head(&fd_cache_open, idx);
     }
 }
 
@@ -204,14 +549,13 @@ static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
 static int idx_by_fd(int fd, int kind)
 {
     int i;
-    int idx = -1;
 
-    for (i = 0; i < FD_ENTRIES; i++)
-	if (fd_cache[i].fd == fd && fd_cache[i].kind == kind) {
-	    idx = i;
-	    break;
-	}
-    return idx;
+    for (i = fd_cache_fbucket[fd_hash_fd(fd)]; i != FD_CACHE_NONE;
+	 i = fd_cache[i].fnext)
+	if (fd_cache[i].fd == fd && fd_cache[i].kind == kind)
+	    return i;
+
+    return -1;
 }
 
 /*
@@ -220,17 +564,37 @@ static int idx_by_fd(int fd, int kind)
 static int idx_by_fh(unfs3_fh_t * ufh, int kind)
 {
     int i;
-    int idx = -1;
-
-    for (i = 0; i < FD_ENTRIES; i++)
-	if (fd_cache[i].kind == kind) {
-	    if (fd_cache[i].dev == ufh->dev && fd_cache[i].ino == ufh->ino &&
-		fd_cache[i].gen == ufh->gen) {
-		idx = i;
-		break;
-	    }
-	}
-    return idx;
+
+    for (i = fd_cache_hbucket[fd_hash_fh(ufh->dev, ufh->ino, ufh->gen, kind)];
+	 i != FD_CACHE_NONE; i = fd_cache[i].hnext)
+	if (fd_cache[i].kind == kind && fd_cache[i].dev == ufh->dev &&
+	    fd_cache[i].ino == ufh->ino && fd_cache[i].gen == ufh->gen)
+	    return i;
+
+    return -1;
+}
+
+/*
+ * check whether the current ids may use a cached fd opened with other ids
+ *
+ * the kernel only checks permissions on open, so the file is opened once
+ * more with the current ids
+ */
+static int fd_permitted(const char *path, int idx, int kind)
+{
+    user_cred_t cred;
+    int fd;
+
+    get_cred(&cred);
+    if (same_cred(&cred, &fd_cache[idx].cred))
+	return TRUE;
+
+    fd = backend_open(path, kind == UNFS3_FD_READ ? O_RDONLY : O_WRONLY);
+    if (fd == -1)
+	return FALSE;
+
+    backend_close(fd);
+    return TRUE;
 }
 
 /*
@@ -239,25 +603,43 @@ static int idx_by_fh(unfs3_fh_t * ufh, int kind)
  */
 int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
 {
-    int idx, res, fd;
+    int idx, res, fd, rdwr = FALSE;
     backend_statstruct buf;
     unfs3_fh_t *fh = (void *) nfh.data.data_val;
 
+    /* readers see gathered writes */
+    if (kind == UNFS3_FD_READ)
+	fd_flush(nfh);
+
     idx = idx_by_fh(fh, kind);
 
+    /* reading through an fd opened for WRITE */
+    if (idx == -1 && kind == UNFS3_FD_READ) {
+	idx = idx_by_fh(fh, UNFS3_FD_WRITE);
+	if (idx != -1 && (!fd_cache[idx].rdwr || fd_cache[idx].fd == -1))
+	    idx = -1;
+    }
+
     if (idx != -1) {
 	if (fd_cache[idx].fd == -1) {
 	    /* pending error, report to client and remove from cache */
 	    fd_cache_del(idx, FALSE);
 	    return -1;
 	}
+	if (!fd_permitted(path, idx, kind))
+	    return -1;
+	fd_cache[idx].busy++;
 	return fd_cache[idx].fd;
     } else {
 	/* call open to obtain new fd */
 	if (kind == UNFS3_FD_READ)
 	    fd = backend_open(path, O_RDONLY);
-	else
-	    fd = backend_open(path, O_WRONLY);
+	else {
+	    fd = backend_open(path, O_RDWR);
+	    rdwr = fd != -1;
+	    if (fd == -1 && errno == EACCES)
+		fd = backend_open(path, O_WRONLY);
+	}
 	if (fd == -1)
 	    return -1;
 
@@ -283,7 +665,7 @@ int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
 	 * success, add to cache for later use
 	 */
 	if (allow_caching)
-	    fd_cache_add(fd, fh, kind);
+	    fd_cache_add(fd, fh, kind, rdwr);
 	return fd;
     }
 }
@@ -297,9 +679,24 @@ int fd_close(int fd, int kind, int really_close)
     int idx, res1 = 0, res2 = 0;
 
     idx = idx_by_fd(fd, kind);
+
+    /* fd opened for WRITE and used for READ, leave it to the writer */
+    if (idx == -1 && kind == UNFS3_FD_READ) {
+	idx = idx_by_fd(fd, UNFS3_FD_WRITE);
+	if (idx != -1)
+	    really_close = FD_CLOSE_VIRT;
+    }
+
     if (idx != -1) {
 	/* update usage time of cache entry */
 	fd_cache[idx].use = time(NULL);
+	fd_list_unlink(&fd_cache_open, idx);
+	fd_list_head(&fd_cache_open, idx);
+	fd_cache[idx].busy--;
+
+	/* still in use by another thread, only sync */
+	if (really_close == FD_CLOSE_REAL && fd_cache[idx].busy > 0)
+	    return kind == UNFS3_FD_WRITE ? backend_fsync(fd) : 0;
 
 	if (really_close == FD_CLOSE_REAL)
 	    /* delete entry on real close, will close() fd */
@@ -321,19 +718,523 @@ int fd_close(int fd, int kind, int really_close)
 }
 
 /*
- * sync file descriptor data to disk
+ * read-ahead for sequential READs
+ *
+ * clients read a file in chunks of at most the transfer size, and with
+ * several requests in flight or several worker threads they do not arrive
+ * strictly in order, which defeats the read-ahead of the kernel. A READ
+ * is considered sequential when it starts near the end of the highest one
+ * so far. After a few sequential READs, the kernel is asked to load the
+ * next FD_AHEAD_COUNT chunks into the page cache, which is done again
+ * when half of that range has been read. With the drop_behind export
+ * option, the pages behind the stream are dropped from the cache, so that
+ * reading large files once does not push out everything else.
  */
-int fd_sync(nfs_fh3 nfh)
+#ifdef HAVE_POSIX_FADVISE
+
+/* sequential READs before read-ahead starts */
+#define FD_SEQ_MIN	2
+
+/* READs the start of a request may be away from the stream */
+#define FD_SEQ_SLACK	4
+
+/* chunks announced ahead of the stream, and upper limit in bytes */
+#define FD_AHEAD_COUNT	8
+#define FD_AHEAD_MAX	(8 * 1024 * 1024)
+
+/* granularity of dropping pages behind the stream */
+#define FD_BEHIND_ALIGN	(64 * 1024)
+
+void fd_read_ahead(int fd, uint64 offset, count3 count)
+{
+    int idx;
+    uint64 end, window, start;
+    fd_cache_t *e;
+
+    if ((exports_opts & OPT_NO_READAHEAD) || count == 0)
+	return;
+
+    idx = idx_by_fd(fd, UNFS3_FD_READ);
+    if (idx == -1)
+	idx = idx_by_fd(fd, UNFS3_FD_WRITE);
+    if (idx == -1)
+	return;
+
+    e = &fd_cache[idx];
+    end = offset + count;
+    window = (uint64) count * FD_SEQ_SLACK;
+
+    if (offset + window < e->next || offset > e->next + window) {
+	/* random access, start over */
+	e->next = end;
+	e->ahead = end;
+	e->behind = offset;
+	e->seq = 0;
+	return;
+    }
+
+    if (end > e->next)
+	e->next = end;
+    if (e->seq < FD_SEQ_MIN)
+	e->seq++;
+    if (e->seq < FD_SEQ_MIN)
+	return;
+
+    window = (uint64) count * FD_AHEAD_COUNT;
+    if (window > FD_AHEAD_MAX)
+	window = FD_AHEAD_MAX;
+
+    if (e->ahead < e->next + window / 2) {
+	start = e->ahead > e->next ? e->ahead : e->next;
+	posix_fadvise(fd, start, e->next + window - start,
+		      POSIX_FADV_WILLNEED);
+	e->ahead = e->next + window;
+    }
+
+    /* dirty pages of writers would only be written out */
+    if ((exports_opts & OPT_DROP_BEHIND) && e->kind == UNFS3_FD_READ) {
+	start = e->behind & ~((uint64) FD_BEHIND_ALIGN - 1);
+	end = offset & ~((uint64) FD_BEHIND_ALIGN - 1);
+	if (end > start + window) {
+	    posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+	    e->behind = end;
+	}
+    }
+}
+
+#else				       /* HAVE_POSIX_FADVISE */
+
+void fd_read_ahead(U(int fd), U(uint64 offset), U(count3 count))
+{
+}
+
+#endif				       /* HAVE_POSIX_FADVISE */
+
+/*
+ * write data through a WRITE fd, gathering UNSTABLE writes if enabled
+ * and the fd is in the cache
+ */
+int fd_write(int fd, const char *buf, unsigned int len, uint64 offset,
+	     int unstable)
+{
+    int idx, res;
+
+    idx = idx_by_fd(fd, UNFS3_FD_WRITE);
+    if (idx != -1) {
+	if (unstable && opt_write_gather > 0 && !fd_cache[idx].werr &&
+	    fd_gather(idx, buf, len, offset))
+	    return len;
+
+	/* gathered data goes first, a failure to write it is reported */
+	if (fd_gather_flush(idx) == -1) {
+	    fd_cache[idx].werr = 0;
+	    regenerate_write_verifier();
+	    return -1;
+	}
+    }
+
+    worker_unlock();
+    res = backend_pwrite(fd, buf, len, (off64_t) offset);
+    worker_lock();
+    switch_restore();
+
+    return res;
+}
+
+/*
+ * write out data gathered for a file, before it is read or its
+ * attributes are used, returns TRUE if there was any
+ *
+ * errors are reported by the next WRITE or COMMIT
+ */
+int fd_flush(nfs_fh3 nfh)
 {
     int idx;
     unfs3_fh_t *fh = (void *) nfh.data.data_val;
 
+    if (opt_write_gather == 0)
+	return FALSE;
+
     idx = idx_by_fh(fh, UNFS3_FD_WRITE);
-    if (idx != -1)
-	/* delete entry, will fsync() and close() the fd */
-	return fd_cache_del(idx, FALSE);
-    else
+    if (idx == -1 || fd_cache[idx].fd == -1 || fd_cache[idx].glen == 0)
+	return FALSE;
+
+    fd_gather_flush(idx);
+    return TRUE;
+}
+
+/*
+ * extend size in attributes to cover data gathered for a file
+ */
+void fd_gather_attr(nfs_fh3 nfh, post_op_attr * attr)
+{
+    int idx;
+    uint64 end;
+    unfs3_fh_t *fh = (void *) nfh.data.data_val;
+
+    if (opt_write_gather == 0 || !attr->attributes_follow)
+	return;
+
+    idx = idx_by_fh(fh, UNFS3_FD_WRITE);
+    if (idx == -1 || fd_cache[idx].glen == 0)
+	return;
+
+    end = fd_cache[idx].goff + fd_cache[idx].glen;
+    if (attr->post_op_attr_u.attributes.size < end)
+	attr->post_op_attr_u.attributes.size = end;
+}
+
+/*
+ * start syncing file descriptor data to disk
+ *
+ * returns the fd to sync and marks it busy, or -1 if nothing is left to
+ * wait for, with the result of the COMMIT in *res; elsewhere is TRUE if
+ * the caller does not hold up other requests while syncing
+ */
+int fd_sync_begin(nfs_fh3 nfh, count3 count, int elsewhere, int *res)
+{
+    int idx;
+    unfs3_fh_t *fh = (void *) nfh.data.data_val;
+
+    *res = 0;
+    idx = idx_by_fh(fh, UNFS3_FD_WRITE);
+    if (idx == -1)
+	return -1;
+
+    /* 
+     * with worker threads or a sync elsewhere, most of the data is
+     * written out without holding up other requests, leaving little for
+     * the fsync() on delete; an fd used by other requests must not be
+     * closed
+     */
+    if ((worker_active() || elsewhere || fd_cache[idx].busy > 0 ||
+	 count > 0) && fd_cache[idx].fd != -1) {
+	if (fd_gather_flush(idx) != -1) {
+	    fd_cache[idx].busy++;
+	    return fd_cache[idx].fd;
+	}
+
+	fd_cache[idx].werr = 0;
+	if (fd_cache[idx].busy == 0)
+	    fd_cache_del(idx, FALSE);
+	regenerate_write_verifier();
+	*res = -1;
+	return -1;
+    }
+
+    /* delete entry, will fsync() and close() the fd */
+    *res = fd_cache_del(idx, FALSE);
+    return -1;
+}
+
+/*
+ * finish syncing file descriptor data, given the result of the sync
+ *
+ * a COMMIT for the whole file closes the fd; a COMMIT for a range keeps
+ * it open, since the client is likely to write more
+ */
+int fd_sync_end(nfs_fh3 nfh, count3 count, int res)
+{
+    int idx;
+    unfs3_fh_t *fh = (void *) nfh.data.data_val;
+
+    idx = idx_by_fh(fh, UNFS3_FD_WRITE);
+    if (idx == -1 || fd_cache[idx].fd == -1)
+	return res;
+
+    fd_cache[idx].busy--;
+
+    if (res == -1) {
+	fd_cache[idx].werr = 0;
+	if (fd_cache[idx].busy == 0)
+	    fd_cache_del(idx, FALSE);
+	regenerate_write_verifier();
+	return -1;
+    }
+
+    /* another request is still writing, leave the fd open */
+    if (fd_cache[idx].busy > 0 || count > 0)
 	return 0;
+
+    /* delete entry, will fsync() and close() the fd */
+    return fd_cache_del(idx, FALSE);
+}
+
+/*
+ * sync file descriptor data to disk
+ */
+int fd_sync(nfs_fh3 nfh, count3 count)
+{
+    int fd, res;
+
+    fd = fd_sync_begin(nfh, count, FALSE, &res);
+    if (fd == -1)
+	return res;
+
+    worker_unlock();
+    if (count > 0)
+	res = backend_fdatasync(fd);
+    else
+	res = backend_fsync(fd);
+    worker_lock();
+    switch_restore();
+
+    return fd_sync_end(nfh, count, res);
+}
+
+/*
+ * close a WRITE fd for real after its data has been synced, given the
+ * result of the sync
+ *
+ * a failed sync is handled like a failed fsync() on close, an fd from
+ * the cache is deleted once unused and the write verifier is changed
+ */
+int fd_close_synced(int fd, int res)
+{
+    int idx, err, res_close;
+
+    idx = idx_by_fd(fd, UNFS3_FD_WRITE);
+    if (idx == -1) {
+	/* not in cache, nothing left to sync */
+	err = errno;
+	res_close = backend_close(fd);
+	if (res == -1) {
+	    errno = err;
+	    return -1;
+	}
+	return res_close;
+    }
+
+    if (res != -1)
+	return fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_REAL);
+
+    err = errno;
+    fd_cache[idx].use = time(NULL);
+    fd_list_unlink(&fd_cache_open, idx);
+    fd_list_head(&fd_cache_open, idx);
+    fd_cache[idx].busy--;
+    fd_cache[idx].werr = 0;
+    if (fd_cache[idx].busy == 0)
+	fd_cache_del(idx, FALSE);
+    regenerate_write_verifier();
+    errno = err;
+    return -1;
+}
+
+/*
+ * directory fds
+ *
+ * LOOKUP, CREATE, MKDIR, REMOVE, and RMDIR work on one name in a directory
+ * that fh_decomp has just resolved. Where *at() calls are available, the
+ * name is resolved relative to an fd for that directory, so the kernel does
+ * not walk the whole path again. Directory fds are kept for the same time
+ * as READ fds, so filesystems can still be unmounted.
+ *
+ * Opening the directory checked search permission on all of its parents
+ * with the ids of the request, and names looked up relative to the fd are
+ * only checked against the directory itself, so an fd is only used again
+ * by requests with the same ids.
+ */
+#ifdef BACKEND_AT
+
+#define FD_DIR_ENTRIES	32
+
+/* the fd is only used to look up names */
+#ifdef O_PATH
+#define FD_DIR_FLAGS	(O_PATH | O_DIRECTORY)
+#else
+#define FD_DIR_FLAGS	(O_RDONLY | O_DIRECTORY)
+#endif
+
+typedef struct {
+    int fd;			/* open directory fd */
+    uint32 dev;			/* device */
+    uint64 ino;			/* inode */
+    user_cred_t cred;		/* ids the directory was opened with */
+    time_t use;			/* last use, 0 if unused */
+} fd_dir_t;
+
+static fd_dir_t fd_dirs[FD_DIR_ENTRIES];
+
+/*
+ * return fd for the directory with a given fh and path, -1 if none
+ *
+ * fh_decomp has checked that path currently is the directory
+ */
+static int fd_dir_get(nfs_fh3 dir, const char *path)
+{
+    unfs3_fh_t *fh = (void *) dir.data.data_val;
+    backend_statstruct buf;
+    time_t now = time(NULL);
+    user_cred_t cred;
+    int i, fd, old = 0;
+
+    get_cred(&cred);
+
+    for (i = 0; i < FD_DIR_ENTRIES; i++) {
+	if (fd_dirs[i].use != 0 && fd_dirs[i].dev == fh->dev &&
+	    fd_dirs[i].ino == fh->ino && same_cred(&fd_dirs[i].cred, &cred)) {
+	    fd_dirs[i].use = now;
+	    return fd_dirs[i].fd;
+	}
+	if (fd_dirs[i].use < fd_dirs[old].use)
+	    old = i;
+    }
+
+    fd = backend_open(path, FD_DIR_FLAGS);
+    if (fd == -1)
+	return -1;
+
+    /* handles of removable exports carry no device number */
+    if (backend_fstat(fd, &buf) == -1 || (uint32) buf.st_dev != fh->dev ||
+	buf.st_ino != fh->ino) {
+	backend_close(fd);
+	return -1;
+    }
+
+    if (fd_dirs[old].use != 0)
+	backend_close(fd_dirs[old].fd);
+
+    fd_dirs[old].fd = fd;
+    fd_dirs[old].dev = fh->dev;
+    fd_dirs[old].ino = fh->ino;
+    fd_dirs[old].cred = cred;
+    fd_dirs[old].use = now;
+    return fd;
+}
+
+/*
+ * find directory fd and name for an object in the directory, -1 if none
+ *
+ * cluster extensions may change the object name, so the object is only
+ * handled relative to the directory if it is still a direct child
+ */
+static int fd_dir_at(nfs_fh3 dir, const char *path, const char *obj,
+		     const char **name)
+{
+    size_t len = strlen(path);
+
+    if (strncmp(obj, path, len) != 0)
+	return -1;
+
+    obj += len;
+    if (len == 0 || path[len - 1] != '/') {
+	if (*obj != '/')
+	    return -1;
+	obj++;
+    }
+
+    if (*obj == 0 || strchr(obj, '/') != NULL)
+	return -1;
+
+    *name = obj;
+    return fd_dir_get(dir, path);
+}
+
+/*
+ * close inactive directory fds
+ */
+static void fd_dir_close_inactive(time_t now)
+{
+    int i;
+
+    for (i = 0; i < FD_DIR_ENTRIES; i++)
+	if (fd_dirs[i].use != 0 && fd_dirs[i].use + INACTIVE_TIMEOUT < now) {
+	    backend_close(fd_dirs[i].fd);
+	    fd_dirs[i].use = 0;
+	}
+}
+
+#endif				       /* BACKEND_AT */
+
+/*
+ * lstat an object in the directory dir with path path
+ */
+int fd_dir_lstat(U(nfs_fh3 dir), U(const char *path), const char *obj,
+		 backend_statstruct * buf)
+{
+#ifdef BACKEND_AT
+    const char *name;
+    int fd;
+
+    if ((fd = fd_dir_at(dir, path, obj, &name)) != -1)
+	return backend_lstatat(fd, name, buf);
+#endif
+    return backend_lstat(obj, buf);
+}
+
+/*
+ * create and open an object in a directory
+ */
+int fd_dir_open_create(U(nfs_fh3 dir), U(const char *path), const char *obj,
+		       int flags, mode_t mode)
+{
+#ifdef BACKEND_AT
+    const char *name;
+    int fd;
+
+    if ((fd = fd_dir_at(dir, path, obj, &name)) != -1)
+	return backend_open_createat(fd, name, flags, mode);
+#endif
+    return backend_open_create(obj, flags, mode);
+}
+
+/*
+ * create a directory in a directory
+ */
+int fd_dir_mkdir(U(nfs_fh3 dir), U(const char *path), const char *obj,
+		 mode_t mode)
+{
+#ifdef BACKEND_AT
+    const char *name;
+    int fd;
+
+    if ((fd = fd_dir_at(dir, path, obj, &name)) != -1)
+	return backend_mkdirat(fd, name, mode);
+#endif
+    return backend_mkdir(obj, mode);
+}
+
+/*
+ * remove an object from a directory, like remove()
+ */
+int fd_dir_remove(U(nfs_fh3 dir), U(const char *path), const char *obj)
+{
+#ifdef BACKEND_AT
+    const char *name;
+    int fd, err;
+
+    if ((fd = fd_dir_at(dir, path, obj, &name)) != -1) {
+	if (backend_unlinkat(fd, name) == 0)
+	    return 0;
+	if (errno != EISDIR && errno != EPERM)
+	    return -1;
+
+	/* directories cannot be unlinked, EPERM may also be genuine */
+	err = errno;
+	if (backend_rmdirat(fd, name) == 0)
+	    return 0;
+	if (errno == ENOTDIR)
+	    errno = err;
+	return -1;
+    }
+#endif
+    return backend_remove(obj);
+}
+
+/*
+ * remove a directory from a directory
+ */
+int fd_dir_rmdir(U(nfs_fh3 dir), U(const char *path), const char *obj)
+{
+#ifdef BACKEND_AT
+    const char *name;
+    int fd;
+
+    if ((fd = fd_dir_at(dir, path, obj, &name)) != -1)
+	return backend_rmdirat(fd, name);
+#endif
+    return backend_rmdir(obj);
 }
 
 /*
@@ -341,10 +1242,10 @@ int fd_sync(nfs_fh3 nfh)
  */
 void fd_cache_purge(void)
 {
-    int i;
+    unsigned int i;
 
     /* close any open file descriptors we still have */
-    for (i = 0; i < FD_ENTRIES; i++) {
+    for (i = 0; i < fd_cache_size; i++) {
 	if (fd_cache[i].use != 0) {
 	    if (fd_cache_del(i, TRUE) == -1)
 		logmsg(LOG_CRIT,
@@ -361,38 +1262,38 @@ void fd_cache_purge(void)
 void fd_cache_close_inactive(void)
 {
     time_t now;
-    int i;
-    int found_error = 0;
-    int active_error = 0;
+    int idx, prev;
 
     now = time(NULL);
-    for (i = 0; i < FD_ENTRIES; i++) {
-	/* Check for inactive open fds */
-	if (fd_cache[i].use && fd_cache[i].fd != -1 &&
-	    fd_cache[i].use + INACTIVE_TIMEOUT < now) {
-	    fd_cache_del(i, TRUE);
-	}
 
-	/* Check for inactive pending errors */
-	if (fd_cache[i].use && fd_cache[i].fd == -1) {
-	    found_error = 1;
-	    if (fd_cache[i].use + PENDING_ERROR_TIMEOUT > now)
-		active_error = 1;
-	}
+    /* Check for inactive open fds, least recently used come first */
+    for (idx = fd_cache_open.tail;
+	 idx != FD_CACHE_NONE && fd_cache[idx].use + INACTIVE_TIMEOUT < now;
+	 idx = prev) {
+	prev = fd_cache[idx].lprev;
+	if (fd_cache[idx].busy == 0)
+	    fd_cache_del(idx, TRUE);
     }
 
-    if (found_error && !active_error) {
+    /* Check for inactive pending errors */
+    for (idx = fd_cache_errors.head; idx != FD_CACHE_NONE;
+	 idx = fd_cache[idx].lnext)
+	if (fd_cache[idx].use + PENDING_ERROR_TIMEOUT > now)
+	    break;
+
+    if (fd_cache_errors.head != FD_CACHE_NONE && idx == FD_CACHE_NONE) {
 	/* All pending errors are old. Delete them all from the table and
 	   generate new verifier. This is done to prevent the table from
 	   filling up with old pending errors, perhaps for files that never
 	   will be written again. In this case, we throw away the errors, and 
 	   change the server verifier. If clients has pending COMMITs, they
 	   will notify the changed verifier and re-send. */
-	for (i = 0; i < FD_ENTRIES; i++) {
-	    if (fd_cache[i].use && fd_cache[i].fd == -1) {
-		fd_cache_del(i, FALSE);
-	    }
-	}
+	while (fd_cache_errors.head != FD_CACHE_NONE)
+	    fd_cache_del(fd_cache_errors.head, FALSE);
 	regenerate_write_verifier();
     }
+
+#ifdef BACKEND_AT
+    fd_dir_close_inactive(now);
+#endif
 }
@@ -7,10 +7,20 @@
 #ifndef UNFS3_FD_CACHE_H
 #define UNFS3_FD_CACHE_H
 
+#include "backend.h"
+
 /* FD_READ and FD_WRITE are already defined on Win32 */
 #define UNFS3_FD_READ  0			/* fd for READ */
 #define UNFS3_FD_WRITE 1			/* fd for WRITE */
 
+/* default and minimum number of entries in fd cache */
+#define FD_CACHE_ENTRIES	256
+#define FD_CACHE_MIN		16
+
+/* upper limit of -g, and number of files gathering writes at a time */
+#define FD_GATHER_MAX		(16 * 1024 * 1024)
+#define FD_GATHER_BUFFERS	32
+
 #define FD_CLOSE_VIRT 0		/* virtually close the fd */
 #define FD_CLOSE_REAL 1		/* really close the fd */
 
@@ -22,8 +32,25 @@ void fd_cache_init(void);
 
 int fd_open(const char *path, nfs_fh3 fh, int kind, int allow_caching);
 int fd_close(int fd, int kind, int really_close);
-int fd_sync(nfs_fh3 nfh);
+void fd_read_ahead(int fd, uint64 offset, count3 count);
+int fd_write(int fd, const char *buf, unsigned int len, uint64 offset,
+	     int unstable);
+int fd_flush(nfs_fh3 nfh);
+void fd_gather_attr(nfs_fh3 nfh, post_op_attr * attr);
+int fd_sync_begin(nfs_fh3 nfh, count3 count, int elsewhere, int *res);
+int fd_sync_end(nfs_fh3 nfh, count3 count, int res);
+int fd_sync(nfs_fh3 nfh, count3 count);
+int fd_close_synced(int fd, int res);
 void fd_cache_purge(void);
 void fd_cache_close_inactive(void);
 
+int fd_dir_lstat(nfs_fh3 dir, const char *path, const char *obj,
+		 backend_statstruct * buf);
+int fd_dir_open_create(nfs_fh3 dir, const char *path, const char *obj,
+		       int flags, mode_t mode);
+int fd_dir_mkdir(nfs_fh3 dir, const char *path, const char *obj,
+		 mode_t mode);
+int fd_dir_remove(nfs_fh3 dir, const char *path, const char *obj);
+int fd_dir_rmdir(nfs_fh3 dir, const char *path, const char *obj);
+
 #endif
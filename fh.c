@@ -15,10 +15,12 @@
 #endif				       /* WIN32 */
 #include <rpc/rpc.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #if HAVE_LINUX_EXT2_FS_H == 1
@@ -35,9 +37,16 @@
 #include "mount.h"
 #include "daemon.h"
 #include "fh.h"
+#include "fh_cache.h"
+#include "user.h"
 #include "backend.h"
 #include "Config/exports.h"
 
+#ifdef UNFS3_WORKERS
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 /*
  * hash function for inode numbers
  */
@@ -46,8 +55,8 @@
 /*
  * stat cache
  */
-int st_cache_valid = FALSE;
-backend_statstruct st_cache;
+UNFS3_TLS int st_cache_valid = FALSE;
+UNFS3_TLS backend_statstruct st_cache;
 
 /*
  * --------------------------------
@@ -55,6 +64,204 @@ backend_statstruct st_cache;
  * --------------------------------
  */
 
+/*
+ * -------------------------
+ * KERNEL FILEHANDLE SUPPORT
+ * -------------------------
+ */
+
+#ifdef HAVE_NAME_TO_HANDLE_AT
+
+/*
+ * on Linux, a filesystem using handles made from a 32 bit inode number and
+ * the generation number lets us build the kernel handle for an object from
+ * our own filehandle, and open_by_handle_at then finds the object without
+ * searching for it
+ *
+ * the handle format is verified for every device before it is used, and
+ * an fd on the device is kept open for open_by_handle_at
+ */
+
+#define FH_KDEVS	32		/* number of devices remembered */
+#define FH_KTYPE	1		/* FILEID_INO32_GEN */
+
+typedef struct {
+    uint32 dev;
+    int fd;			/* fd on device, -1 if handles not usable */
+} fh_kdev_t;
+
+static fh_kdev_t fh_kdevs[FH_KDEVS];
+static int fh_kdev_count = 0;
+
+typedef struct {
+    struct file_handle head;
+    uint32 words[MAX_HANDLE_SZ / sizeof(uint32)];
+} fh_khandle_t;
+
+/*
+ * get the generation number from the kernel handle for a path
+ */
+static int fh_khandle_gen(const char *path, uint64 ino, uint32 *gen)
+{
+    fh_khandle_t handle;
+    int mount_id;
+
+    handle.head.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(AT_FDCWD, path, &handle.head, &mount_id, 0) == -1)
+	return FALSE;
+
+    if (handle.head.handle_type != FH_KTYPE ||
+	handle.head.handle_bytes != 2 * sizeof(uint32) ||
+	ino > 0xFFFFFFFF || handle.words[0] != (uint32) ino) {
+	errno = EOPNOTSUPP;
+	return FALSE;
+    }
+
+    *gen = handle.words[1];
+    return TRUE;
+}
+
+/*
+ * open an object given device, inode, and generation number
+ */
+static int fh_khandle_open(int mount_fd, uint64 ino, uint32 gen, int flags)
+{
+    fh_khandle_t handle;
+
+    handle.head.handle_bytes = 2 * sizeof(uint32);
+    handle.head.handle_type = FH_KTYPE;
+    handle.words[0] = (uint32) ino;
+    handle.words[1] = gen;
+
+    return open_by_handle_at(mount_fd, &handle.head, flags);
+}
+
+/*
+ * find a device in the table
+ */
+static fh_kdev_t *fh_kdev_find(uint32 dev)
+{
+    int i;
+
+    for (i = 0; i < fh_kdev_count; i++)
+	if (fh_kdevs[i].dev == dev)
+	    return &fh_kdevs[i];
+
+    return NULL;
+}
+
+/*
+ * check whether kernel handles can be used for a device, given a
+ * directory on it
+ *
+ * must be called as root, since open_by_handle_at needs privileges
+ */
+static void fh_kdev_probe(const char *path, backend_statstruct buf)
+{
+    fh_kdev_t *kdev;
+    uint32 gen;
+    int fd;
+
+    if (!opt_kernel_handles || fh_kdev_count == FH_KDEVS ||
+	!S_ISDIR(buf.st_mode) || backend_geteuid() != 0 ||
+	fh_kdev_find(buf.st_dev))
+	return;
+
+    kdev = &fh_kdevs[fh_kdev_count++];
+    kdev->dev = buf.st_dev;
+    kdev->fd = -1;
+
+    if (!fh_khandle_gen(path, buf.st_ino, &gen))
+	return;
+
+    fd = backend_open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+	return;
+
+    /* check that we are allowed to open objects by handle */
+    kdev->fd = fh_khandle_open(fd, buf.st_ino, gen, O_PATH);
+    if (kdev->fd == -1) {
+	close(fd);
+	return;
+    }
+    close(kdev->fd);
+    kdev->fd = fd;
+}
+
+#if !defined(HAVE_STRUCT_STAT_ST_GEN) && defined(HAVE_LINUX_EXT2_FS_H)
+
+/* devices whose kernel handles are not of our format */
+static uint32 fh_kforeign[FH_KDEVS];
+static int fh_kforeign_count = 0;
+
+/*
+ * get the generation number from the kernel handle for an object,
+ * unless the kernel handles of its device are known not to hold it
+ */
+static int fh_kgen(const char *path, backend_statstruct buf, uint32 *gen)
+{
+    int i;
+
+    for (i = 0; i < fh_kforeign_count; i++)
+	if (fh_kforeign[i] == buf.st_dev)
+	    return FALSE;
+
+    if (fh_khandle_gen(path, buf.st_ino, gen))
+	return TRUE;
+
+    if (errno == EOPNOTSUPP && fh_kforeign_count < FH_KDEVS)
+	fh_kforeign[fh_kforeign_count++] = buf.st_dev;
+    return FALSE;
+}
+
+#endif
+
+/*
+ * resolve a filehandle into a path by opening it by handle
+ */
+char *fh_decomp_handle(const unfs3_fh_t * fh)
+{
+    static UNFS3_TLS char result[NFS_MAXPATHLEN];
+    char link[32];
+    backend_statstruct buf;
+    fh_kdev_t *kdev;
+    int fd, res;
+
+    kdev = fh_kdev_find(fh->dev);
+    if (!kdev || kdev->fd == -1 || fh->ino > 0xFFFFFFFF)
+	return NULL;
+
+    fd = fh_khandle_open(kdev->fd, fh->ino, fh->gen, O_PATH | O_NOFOLLOW);
+    if (fd == -1)
+	return NULL;
+
+    sprintf(link, "/proc/self/fd/%i", fd);
+    res = readlink(link, result, NFS_MAXPATHLEN - 1);
+    close(fd);
+    if (res <= 0 || result[0] != '/')
+	return NULL;
+    result[res] = 0;
+
+    /* unlinked objects and paths not visible to us */
+    res = backend_lstat(result, &buf);
+    if (res == -1 || buf.st_dev != fh->dev || buf.st_ino != fh->ino)
+	return NULL;
+
+    st_cache_valid = TRUE;
+    st_cache = buf;
+
+    return result;
+}
+
+#else
+
+char *fh_decomp_handle(U(const unfs3_fh_t * fh))
+{
+    return NULL;
+}
+
+#endif				       /* HAVE_NAME_TO_HANDLE_AT */
+
 /*
  * obtain inode generation number if possible
  *
@@ -66,49 +273,73 @@ backend_statstruct st_cache;
  */
 uint32 get_gen(backend_statstruct obuf, U(int fd), U(const char *path))
 {
+#ifdef HAVE_NAME_TO_HANDLE_AT
+    fh_kdev_t *kdev;
+    uint32 kgen;
+    struct svc_req *kreq;
+    int kres;
+
+    /* kernel handles must agree with our generation numbers */
+    kdev = fh_kdev_find(obuf.st_dev);
+    if (kdev && kdev->fd != -1) {
+	if (fh_khandle_gen(path, obuf.st_ino, &kgen))
+	    return kgen;
+
+	/* client may not be allowed to search all parent directories */
+	kreq = switch_suspend();
+	kres = fh_khandle_gen(path, obuf.st_ino, &kgen);
+	switch_resume(kreq);
+
+	if (kres)
+	    return kgen;
+    }
+#endif
+
 #ifdef HAVE_STRUCT_STAT_ST_GEN
     return obuf.st_gen;
 #endif
 
 #if !defined(HAVE_STRUCT_STAT_ST_GEN) && defined(HAVE_LINUX_EXT2_FS_H)
+    struct svc_req *req;
     int newfd, res;
     uint32 gen;
-    uid_t euid;
-    gid_t egid;
 
     if (!S_ISREG(obuf.st_mode) && !S_ISDIR(obuf.st_mode))
 	return 0;
 
-    euid = backend_geteuid();
-    egid = backend_getegid();
-    backend_setegid(0);
-    backend_seteuid(0);
+    if (fh_cache_gen(&obuf, &gen))
+	return gen;
 
-    if (fd != FD_NONE) {
+#ifdef HAVE_NAME_TO_HANDLE_AT
+    /* kernel handles of ext2/3/4 hold the generation number, so the
+       object need not be opened */
+    if (fd == FD_NONE && fh_kgen(path, obuf, &gen)) {
+	fh_cache_set_gen(&obuf, gen);
+	return gen;
+    }
+#endif
+
+    if (fd != FD_NONE)
+	/* the ioctl needs no privileges, only opening the object may */
 	res = ioctl(fd, EXT2_IOC_GETVERSION, &gen);
-	if (res == -1)
-	    gen = 0;
-    } else {
+    else {
+	req = switch_suspend();
+
 	newfd = backend_open(path, O_RDONLY);
 	if (newfd == -1)
-	    gen = 0;
+	    res = -1;
 	else {
 	    res = ioctl(newfd, EXT2_IOC_GETVERSION, &gen);
 	    close(newfd);
-
-	    if (res == -1)
-		gen = 0;
 	}
-    }
-
-    backend_setegid(egid);
-    backend_seteuid(euid);
 
-    if (backend_geteuid() != euid || backend_getegid() != egid) {
-	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
-	daemon_exit(CRISIS);
+	switch_resume(req);
     }
 
+    if (res == -1)
+	return 0;
+
+    fh_cache_set_gen(&obuf, gen);
     return gen;
 #endif
 
@@ -216,6 +447,10 @@ unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
     if (need_dir != 0 && !S_ISDIR(buf.st_mode))
 	return invalid_fh;
 
+#ifdef HAVE_NAME_TO_HANDLE_AT
+    fh_kdev_probe(path, buf);
+#endif
+
     fh.dev = buf.st_dev;
     fh.ino = buf.st_ino;
     fh.gen = backend_get_gen(buf, FD_NONE, path);
@@ -266,7 +501,7 @@ u_int fh_length(const unfs3_fh_t * fh)
  */
 unfs3_fh_t *fh_extend(nfs_fh3 nfh, uint32 dev, uint64 ino, uint32 gen)
 {
-    static unfs3_fh_t new;
+    static UNFS3_TLS unfs3_fh_t new;
     unfs3_fh_t *fh = (void *) nfh.data.data_val;
 
     memcpy(&new, fh, fh_length(fh));
@@ -363,81 +598,490 @@ post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type)
  */
 
 /*
- * recursive directory search
- * fh:     filehandle being resolved
- * pos:    position in filehandles path inode array
- * lead:   current directory for search
- * result: where to store path if seach is complete
+ * the search looks at one directory at a time, the directories that are
+ * still to be searched are queued as tasks; with -X, searcher threads
+ * take tasks from the queue while the thread resolving the filehandle
+ * works on them as well, and the first match found ends the search
+ *
+ * the children of the directories searched are remembered along with
+ * the hashes of their inode numbers, so that searching a directory
+ * again only looks at the children that can matter; a directory is
+ * read again when its mtime changes, and not remembered if it has
+ * changed in the current second
+ */
+
+#define FH_MEMO_DIRS	64		/* must be a power of two */
+#define FH_NONE		(-1)
+
+typedef struct {
+    uint32 dev;
+    uint64 ino;
+    int next;			/* next child with same hash, FH_NONE at end */
+    char *name;
+} fh_child_t;
+
+typedef struct {
+    int valid;			/* children known */
+    uint32 dev;			/* device of directory */
+    uint64 ino;			/* inode of directory */
+    time_t mtime;		/* mtime of directory when read */
+    int count;			/* number of children */
+    fh_child_t *children;	/* children in directory order */
+    char *names;		/* names of children */
+    int first[256];		/* first child for each hash */
+} fh_memo_t;
+
+static fh_memo_t fh_memo[FH_MEMO_DIRS];
+
+typedef struct {
+    const unfs3_fh_t *fh;	/* filehandle being resolved */
+    int pending;		/* tasks queued or being worked on */
+    volatile int found;		/* search is complete */
+    int matches;		/* objects found in the same directory */
+    char *result;		/* path of object */
+    backend_statstruct buf;	/* attributes of object */
+} fh_search_t;
+
+typedef struct fh_task {
+    struct fh_task *next;	/* next task in queue */
+    fh_search_t *search;
+    int pos;			/* position in filehandles path inode array */
+    char lead[NFS_MAXPATHLEN];	/* directory to search */
+} fh_task_t;
+
+/* tasks waiting, the one queued last first */
+static fh_task_t *fh_tasks = NULL;
+
+#ifdef UNFS3_WORKERS
+static pthread_mutex_t fh_search_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fh_search_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fh_search_idle = PTHREAD_COND_INITIALIZER;
+
+#define FH_LOCK()	pthread_mutex_lock(&fh_search_mutex)
+#define FH_UNLOCK()	pthread_mutex_unlock(&fh_search_mutex)
+#else
+#define FH_LOCK()	do { } while (0)
+#define FH_UNLOCK()	do { } while (0)
+#endif
+
+static void fh_memo_free(fh_memo_t * memo)
+{
+    free(memo->children);
+    free(memo->names);
+    memo->children = NULL;
+    memo->names = NULL;
+    memo->valid = FALSE;
+}
+
+/*
+ * read the children of a directory, gives up if the search completes
  */
-static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
-		  char *result)
+static int fh_memo_read(const char *lead, fh_memo_t * memo,
+			fh_search_t * search)
 {
-    backend_dirstream *search;
+    backend_dirstream *dir;
     struct dirent *entry;
     backend_statstruct buf;
-    int res, rec;
+    fh_child_t *child;
     char obj[NFS_MAXPATHLEN];
+    size_t len, used = 0, size = 0;
+    int i, max = 0, res;
+    unsigned char hash;
+    void *new;
 
-    /* There's a slight risk of multiple files with the same st_ino on
-       Windows. Take extra care and make sure that there are no collisions */
-    unsigned short matches = 0;
+    memo->count = 0;
+    memo->children = NULL;
+    memo->names = NULL;
 
-    /* went in too deep? */
-    if (pos == fh->len)
+    dir = backend_opendir(lead);
+    if (!dir)
 	return FALSE;
 
-    search = backend_opendir(lead);
-    if (!search)
+    while ((entry = backend_readdir(dir)) && !search->found) {
+	len = strlen(entry->d_name) + 1;
+	if (strlen(lead) + len >= NFS_MAXPATHLEN)
+	    continue;
+
+	sprintf(obj, "%s/%s", lead, entry->d_name);
+	res = -1;
+#ifdef BACKEND_DIRSTAT
+	res = backend_dirstat(dir, entry->d_name, &buf);
+#endif
+	if (res == -1 && backend_lstat(obj, &buf) == -1)
+	    continue;
+
+	if (memo->count == max) {
+	    max = max ? max * 2 : 64;
+	    new = realloc(memo->children, max * sizeof(fh_child_t));
+	    if (!new)
+		break;
+	    memo->children = new;
+	}
+	if (used + len > size) {
+	    size = size ? size * 2 : 1024;
+	    if (size < used + len)
+		size = used + len;
+	    new = realloc(memo->names, size);
+	    if (!new)
+		break;
+	    memo->names = new;
+	}
+
+	child = &memo->children[memo->count++];
+	child->dev = buf.st_dev;
+	child->ino = buf.st_ino;
+	/* offset until the names stop moving */
+	child->name = (char *) used;
+	memcpy(memo->names + used, entry->d_name, len);
+	used += len;
+    }
+    backend_closedir(dir);
+
+    if (entry) {
+	fh_memo_free(memo);
 	return FALSE;
+    }
 
-    entry = backend_readdir(search);
+    for (i = 0; i < 256; i++)
+	memo->first[i] = FH_NONE;
+    for (i = memo->count - 1; i >= 0; i--) {
+	child = &memo->children[i];
+	child->name = memo->names + (size_t) child->name;
+	hash = FH_HASH(child->ino);
+	child->next = memo->first[hash];
+	memo->first[hash] = i;
+    }
 
-    while (entry) {
-	if (strlen(lead) + strlen(entry->d_name) + 1 < NFS_MAXPATHLEN) {
+    memo->valid = TRUE;
+    return TRUE;
+}
 
-	    sprintf(obj, "%s/%s", lead, entry->d_name);
+/*
+ * copy the children with either of two hashes, in directory order
+ *
+ * the names are stored behind the children, in the same allocation
+ */
+static int fh_memo_pick(const fh_memo_t * memo, unsigned char h1,
+			unsigned char h2, fh_child_t ** result)
+{
+    fh_child_t *picked;
+    char *name;
+    size_t size = 0;
+    int i, j, n = 0;
+
+    i = memo->first[h1];
+    j = h2 != h1 ? memo->first[h2] : FH_NONE;
+    while (i != FH_NONE || j != FH_NONE) {
+	if (j == FH_NONE || (i != FH_NONE && i < j)) {
+	    size += strlen(memo->children[i].name) + 1;
+	    i = memo->children[i].next;
+	} else {
+	    size += strlen(memo->children[j].name) + 1;
+	    j = memo->children[j].next;
+	}
+	n++;
+    }
 
-	    res = backend_lstat(obj, &buf);
-	    if (res == -1) {
-		buf.st_dev = 0;
-		buf.st_ino = 0;
-	    }
+    *result = NULL;
+    if (n == 0)
+	return 0;
 
-	    if (buf.st_dev == fh->dev && buf.st_ino == fh->ino) {
-		/* found the object */
-		sprintf(result, "%s/%s", lead + 1, entry->d_name);
-		/* update stat cache */
-		st_cache_valid = TRUE;
-		st_cache = buf;
-		matches++;
-#ifndef WIN32
-		break;
-#endif
-	    }
+    picked = malloc(n * sizeof(fh_child_t) + size);
+    if (!picked)
+	return -1;
+    name = (char *) (picked + n);
+
+    n = 0;
+    i = memo->first[h1];
+    j = h2 != h1 ? memo->first[h2] : FH_NONE;
+    while (i != FH_NONE || j != FH_NONE) {
+	if (j == FH_NONE || (i != FH_NONE && i < j)) {
+	    picked[n] = memo->children[i];
+	    i = memo->children[i].next;
+	} else {
+	    picked[n] = memo->children[j];
+	    j = memo->children[j].next;
+	}
+	strcpy(name, picked[n].name);
+	picked[n].name = name;
+	name += strlen(name) + 1;
+	n++;
+    }
+
+    *result = picked;
+    return n;
+}
+
+/*
+ * children of a directory that can be the object or lead to it, returns
+ * their number or -1 on failure
+ */
+static int fh_children(fh_task_t * task, fh_child_t ** result)
+{
+    const unfs3_fh_t *fh = task->search->fh;
+    backend_statstruct buf;
+    fh_memo_t *memo, new;
+    unsigned int hash;
+    unsigned char h1, h2;
+    int n;
+
+    if (backend_lstat(task->lead, &buf) == -1)
+	return -1;
+
+    h1 = fh->inos[task->pos];
+    h2 = FH_HASH(fh->ino);
+
+    hash = (unsigned int) buf.st_ino * 2654435761u ^ (unsigned int) buf.st_dev;
+    memo = &fh_memo[(hash >> 16) & (FH_MEMO_DIRS - 1)];
+
+    FH_LOCK();
+    if (memo->valid && memo->dev == buf.st_dev && memo->ino == buf.st_ino &&
+	memo->mtime == buf.st_mtime) {
+	n = fh_memo_pick(memo, h1, h2, result);
+	FH_UNLOCK();
+	return n;
+    }
+    FH_UNLOCK();
+
+    if (!fh_memo_read(task->lead, &new, task->search))
+	return -1;
+    new.dev = buf.st_dev;
+    new.ino = buf.st_ino;
+    new.mtime = buf.st_mtime;
+    n = fh_memo_pick(&new, h1, h2, result);
+
+    if (buf.st_mtime >= time(NULL)) {
+	fh_memo_free(&new);
+	return n;
+    }
+
+    FH_LOCK();
+    fh_memo_free(memo);
+    *memo = new;
+    FH_UNLOCK();
+
+    return n;
+}
+
+/*
+ * search a directory, queueing tasks for the directories below it that
+ * may lead to the object
+ */
+static void fh_search_dir(fh_task_t * task)
+{
+    fh_search_t *search = task->search;
+    const unfs3_fh_t *fh = search->fh;
+    fh_child_t *children;
+    fh_task_t *sub, *subs = NULL;
+    backend_statstruct buf;
+    char obj[NFS_MAXPATHLEN];
+    int i, n, matches = 0;
 
-	    if (strcmp(entry->d_name, "..") != 0 &&
-		strcmp(entry->d_name, ".") != 0 &&
-		FH_HASH(buf.st_ino) == fh->inos[pos]) {
-		/* 
-		 * might be directory we're looking for,
-		 * try descending into it
-		 */
-		rec = fh_rec(fh, pos + 1, obj, result);
-		if (rec) {
-		    /* object was found in dir */
-		    backend_closedir(search);
-		    return TRUE;
+    /* went in too deep? */
+    if (task->pos == fh->len)
+	return;
+
+    n = fh_children(task, &children);
+    if (n <= 0)
+	return;
+
+    for (i = 0; i < n && !search->found; i++) {
+	sprintf(obj, "%s/%s", task->lead, children[i].name);
+
+	if (children[i].dev == fh->dev && children[i].ino == fh->ino &&
+	    backend_lstat(obj, &buf) == 0 && buf.st_dev == fh->dev &&
+	    buf.st_ino == fh->ino) {
+	    /* found the object */
+	    if (matches++ == 0) {
+		FH_LOCK();
+		if (!search->found) {
+		    sprintf(search->result, "%s/%s", task->lead + 1,
+			    children[i].name);
+		    search->buf = buf;
 		}
+		FH_UNLOCK();
 	    }
+	    /* There's a slight risk of multiple files with the same st_ino
+	       on Windows. Take extra care and make sure that there are no
+	       collisions */
+#ifndef WIN32
+	    break;
+#endif
+	}
+
+	if (strcmp(children[i].name, "..") != 0 &&
+	    strcmp(children[i].name, ".") != 0 &&
+	    FH_HASH(children[i].ino) == fh->inos[task->pos]) {
+	    /* 
+	     * might be directory we're looking for,
+	     * queue descending into it
+	     */
+	    sub = malloc(sizeof(fh_task_t));
+	    if (!sub)
+		continue;
+	    sub->search = search;
+	    sub->pos = task->pos + 1;
+	    strcpy(sub->lead, obj);
+	    sub->next = subs;
+	    subs = sub;
+	}
+    }
+    free(children);
+
+    /* subs are in reverse order, the first one will be taken first */
+    FH_LOCK();
+    if (matches && !search->found) {
+	search->found = TRUE;
+	search->matches = matches;
+    }
+    while (subs) {
+	sub = subs;
+	subs = sub->next;
+	if (search->found) {
+	    free(sub);
+	    continue;
+	}
+	sub->next = fh_tasks;
+	fh_tasks = sub;
+	search->pending++;
+    }
+#ifdef UNFS3_WORKERS
+    pthread_cond_broadcast(&fh_search_work);
+    pthread_cond_broadcast(&fh_search_idle);
+#endif
+    FH_UNLOCK();
+}
+
+/*
+ * take the next task, of a given search or of any search
+ */
+static fh_task_t *fh_task_take(const fh_search_t * search)
+{
+    fh_task_t **prev, *task;
+
+    for (prev = &fh_tasks; (task = *prev); prev = &task->next)
+	if (!search || task->search == search) {
+	    *prev = task->next;
+	    return task;
 	}
-	entry = backend_readdir(search);
+
+    return NULL;
+}
+
+#ifdef UNFS3_WORKERS
+/*
+ * searcher thread
+ */
+static void *fh_search_main(U(void *arg))
+{
+    fh_task_t *task;
+
+    FH_LOCK();
+    for (;;) {
+	while (!(task = fh_task_take(NULL)))
+	    pthread_cond_wait(&fh_search_work, &fh_search_mutex);
+	FH_UNLOCK();
+
+	fh_search_dir(task);
+
+	FH_LOCK();
+	task->search->pending--;
+	pthread_cond_broadcast(&fh_search_idle);
+	free(task);
     }
 
-    backend_closedir(search);
-    switch (matches) {
+    return NULL;
+}
+
+/*
+ * start the searcher threads
+ */
+void fh_search_init(void)
+{
+    sigset_t set, old;
+    pthread_t thread;
+    unsigned int i;
+
+    /* signals are left to the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for (i = 0; i < opt_fh_threads; i++)
+	if (pthread_create(&thread, NULL, fh_search_main, NULL) != 0) {
+	    logmsg(LOG_EMERG, "unable to create search thread, aborting");
+	    daemon_exit(CRISIS);
+	}
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#else
+void fh_search_init(void)
+{
+}
+#endif				       /* UNFS3_WORKERS */
+
+/*
+ * search the directory structure from the root for an object
+ * result: where to store path if search is complete
+ */
+static int fh_search(const unfs3_fh_t * fh, char *result)
+{
+    fh_search_t search;
+    fh_task_t *task;
+
+    task = malloc(sizeof(fh_task_t));
+    if (!task)
+	return FALSE;
+
+    search.fh = fh;
+    search.pending = 1;
+    search.found = FALSE;
+    search.matches = 0;
+    search.result = result;
+
+    task->search = &search;
+    task->pos = 0;
+    strcpy(task->lead, "/");
+
+    FH_LOCK();
+    task->next = fh_tasks;
+    fh_tasks = task;
+
+    /* work on the search along with the searcher threads */
+    while (search.pending > 0 && !search.found) {
+	task = fh_task_take(&search);
+	if (task) {
+	    FH_UNLOCK();
+	    fh_search_dir(task);
+	    FH_LOCK();
+	    search.pending--;
+	    free(task);
+	}
+#ifdef UNFS3_WORKERS
+	else
+	    pthread_cond_wait(&fh_search_idle, &fh_search_mutex);
+#endif
+    }
+
+    /* drop the tasks not started yet, and wait for the others */
+    while ((task = fh_task_take(&search))) {
+	search.pending--;
+	free(task);
+    }
+#ifdef UNFS3_WORKERS
+    while (search.pending > 0)
+	pthread_cond_wait(&fh_search_idle, &fh_search_mutex);
+#endif
+    FH_UNLOCK();
+
+    switch (search.found ? search.matches : 0) {
 	case 0:
 	    return FALSE;
 	case 1:
+	    /* update stat cache */
+	    st_cache_valid = TRUE;
+	    st_cache = search.buf;
 	    return TRUE;
 	default:
 #ifdef WIN32
@@ -452,8 +1096,7 @@ static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
  */
 char *fh_decomp_raw(const unfs3_fh_t * fh)
 {
-    int rec = 0;
-    static char result[NFS_MAXPATHLEN];
+    static UNFS3_TLS char result[NFS_MAXPATHLEN];
 
     /* valid fh? */
     if (!fh)
@@ -463,9 +1106,7 @@ char *fh_decomp_raw(const unfs3_fh_t * fh)
     if (fh->len == 0)
 	return "/";
 
-    rec = fh_rec(fh, 0, "/", result);
-
-    if (rec)
+    if (fh_search(fh, result))
 	return result;
 
     /* could not find object */
@@ -42,8 +42,11 @@ typedef struct {
 
 #define FD_NONE (-1)			/* used for get_gen */
 
-extern int st_cache_valid;		/* stat value is valid */
-extern backend_statstruct st_cache;	/* cached stat value */
+/* maximum number of threads searching for filehandles */
+#define FH_THREADS_MAX 64
+
+extern UNFS3_TLS int st_cache_valid;		/* stat value is valid */
+extern UNFS3_TLS backend_statstruct st_cache;	/* cached stat value */
 
 uint32 get_gen(backend_statstruct obuf, int fd, const char *path);
 
@@ -57,6 +60,8 @@ unfs3_fh_t *fh_extend(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen);
 post_op_fh3 fh_extend_post(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen);
 post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type);
 
+void fh_search_init(void);
 char *fh_decomp_raw(const unfs3_fh_t *fh);
+char *fh_decomp_handle(const unfs3_fh_t *fh);
 
 #endif
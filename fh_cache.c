@@ -10,113 +10,811 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <rpc/rpc.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "nfs.h"
 #include "fh.h"
+#include "attr.h"
 #include "locate.h"
 #include "fh_cache.h"
+#include "fh_index.h"
 #include "mount.h"
 #include "daemon.h"
 #include "Config/exports.h"
 #include "readdir.h"
 #include "backend.h"
+#include "stats.h"
+#include "user.h"
 
-/* number of entries in fh cache */
-#define CACHE_ENTRIES	4096
+/*
+ * the cache is a tree of directory entries: every entry holds a single
+ * name component and a reference to the entry of its parent directory,
+ * so common path prefixes are stored only once
+ *
+ * entries which are known to refer to a <dev,ino> pair are additionally
+ * indexed by that pair; entries without a <dev,ino> pair only exist to
+ * hold path prefixes for entries further down in the tree
+ */
+
+/* marker for end of hash chain or list */
+#define CACHE_NONE	(-1)
+
+/* entry for the root directory, never evicted */
+#define CACHE_ROOT	0
+
+/* number of buffers for returned paths, see fh_cache_path() */
+#define CACHE_PATHS	4
 
 typedef struct {
-    uint32 dev;			/* device */
     uint64 ino;			/* inode */
-    char path[NFS_MAXPATHLEN];	/* pathname */
-    unsigned int use;		/* last use */
+    uint32 dev;			/* device */
+    int parent;			/* entry of parent directory */
+    int children;		/* number of entries naming us as parent */
+    char *name;			/* name component */
+    int hnext;			/* next entry in <dev,ino> hash chain */
+    int dnext;			/* next entry in <parent,name> hash chain */
+    int lprev;			/* previous (more recently used) entry */
+    int lnext;			/* next (less recently used) entry */
+    int wd;			/* inotify watch, -1 if none */
+    int wnext;			/* next entry in watch hash chain */
+    int has_gen;		/* generation number is known */
+    uint32 gen;			/* generation number */
+    time_t ctime;		/* inode change time when gen was known */
+    long ctime_nsec;
 } unfs3_cache_t;
 
-static unfs3_cache_t fh_cache[CACHE_ENTRIES];
+static unfs3_cache_t *fh_cache = NULL;
+static unsigned int fh_cache_size = 0;
+
+/* hash chains, indexed by fh_cache_hash() and fh_cache_dhash() */
+static int *fh_cache_bucket = NULL;
+static int *fh_cache_dbucket = NULL;
+static unsigned int fh_cache_mask = 0;
+
+/*
+ * LRU list, head is most recently used and tail least recently used
+ *
+ * unused entries are kept on a separate list, chained through lnext
+ */
+static int fh_cache_head = CACHE_NONE;
+static int fh_cache_tail = CACHE_NONE;
+static int fh_cache_free = CACHE_NONE;
 
 /* statistics */
 int fh_cache_max = 0;
 int fh_cache_use = 0;
 int fh_cache_hit = 0;
-
-/* counter for LRU */
-static unsigned int fh_cache_time = 0;
+int fh_cache_miss[FH_MISS_KINDS];
 
 /*
  * last returned entry
  *
- * this entry must not be overwritten before the next lookup, because
- * operations such as CREATE may still be needing the path inside the
- * entry for getting directory attributes
+ * this entry must not be evicted before the next lookup, because
+ * operations such as CREATE may still be needing the entry for adding
+ * objects below it
  *
- * this is needed since fh_cache_time can roll around to 0, thus
- * making the entry evictable
+ * this is needed since the entry may have drifted to the tail of the
+ * LRU list, thus making it evictable
  */
 static int fh_last_entry = -1;
 
 /*
- * return next pseudo-time value for LRU counter
+ * ----------
+ * NAME ARENA
+ * ----------
+ */
+
+/*
+ * names are carved out of large chunks and recycled through free lists
+ * for each size class, avoiding the overhead of one malloc per name
+ */
+#define NAME_CHUNK	65536
+#define NAME_ALIGN	8
+#define NAME_CLASSES	(NFS_MAXPATHLEN / NAME_ALIGN + 1)
+
+static char *name_chunk = NULL;
+static unsigned int name_chunk_left = 0;
+static char *name_free[NAME_CLASSES];
+
+/*
+ * size of the arena block needed for a name of given length
  */
-static unsigned int fh_cache_next(void)
+static unsigned int name_size(unsigned int len)
 {
-    return ++fh_cache_time;
+    return (len + NAME_ALIGN) & ~(NAME_ALIGN - 1);
 }
 
+/*
+ * store a name in the arena
+ * returns NULL if out of memory
+ */
+static char *name_alloc(const char *name, unsigned int len)
+{
+    unsigned int size = name_size(len);
+    char *res;
+
+    if (name_free[size / NAME_ALIGN]) {
+	res = name_free[size / NAME_ALIGN];
+	name_free[size / NAME_ALIGN] = *(char **) res;
+    } else {
+	if (name_chunk_left < size) {
+	    name_chunk = malloc(NAME_CHUNK);
+	    if (!name_chunk) {
+		name_chunk_left = 0;
+		return NULL;
+	    }
+	    name_chunk_left = NAME_CHUNK;
+	}
+	res = name_chunk;
+	name_chunk += size;
+	name_chunk_left -= size;
+    }
+
+    memcpy(res, name, len);
+    res[len] = 0;
+    return res;
+}
+
+/*
+ * give a name back to the arena
+ */
+static void name_release(char *name)
+{
+    unsigned int size = name_size(strlen(name));
+
+    *(char **) name = name_free[size / NAME_ALIGN];
+    name_free[size / NAME_ALIGN] = name;
+}
+
+/*
+ * --------------------
+ * HASH CHAINS AND LIST
+ * --------------------
+ */
+
+/*
+ * compute hash bucket for device and inode number
+ */
+static unsigned int fh_cache_hash(uint32 dev, uint64 ino)
+{
+    uint32 h;
+
+    h = (uint32) ino ^ (uint32) (ino >> 32);
+    h ^= dev * 0x9E3779B1;
+    h ^= h >> 16;
+
+    return h & fh_cache_mask;
+}
+
+/*
+ * compute hash bucket for a name inside a directory
+ */
+static unsigned int fh_cache_dhash(int parent, const char *name)
+{
+    return fnv1a_32(name, (uint32) parent * 0x9E3779B1) & fh_cache_mask;
+}
+
+/*
+ * unlink an entry from the LRU list
+ */
+static void fh_cache_lru_unlink(int idx)
+{
+    if (fh_cache[idx].lprev != CACHE_NONE)
+	fh_cache[fh_cache[idx].lprev].lnext = fh_cache[idx].lnext;
+    else
+	fh_cache_head = fh_cache[idx].lnext;
+
+    if (fh_cache[idx].lnext != CACHE_NONE)
+	fh_cache[fh_cache[idx].lnext].lprev = fh_cache[idx].lprev;
+    else
+	fh_cache_tail = fh_cache[idx].lprev;
+
+    fh_cache[idx].lprev = CACHE_NONE;
+    fh_cache[idx].lnext = CACHE_NONE;
+}
+
+/*
+ * put an entry at the head of the LRU list (most recently used)
+ */
+static void fh_cache_lru_head(int idx)
+{
+    fh_cache[idx].lprev = CACHE_NONE;
+    fh_cache[idx].lnext = fh_cache_head;
+    if (fh_cache_head != CACHE_NONE)
+	fh_cache[fh_cache_head].lprev = idx;
+    else
+	fh_cache_tail = idx;
+    fh_cache_head = idx;
+}
+
+/*
+ * mark an entry and all of its parents as most recently used
+ *
+ * parents are moved after their children, so that they never end up
+ * closer to the tail of the LRU list
+ */
+static void fh_cache_touch(int idx)
+{
+    while (idx != CACHE_ROOT) {
+	if (fh_cache_head != idx) {
+	    fh_cache_lru_unlink(idx);
+	    fh_cache_lru_head(idx);
+	}
+	idx = fh_cache[idx].parent;
+    }
+}
+
+/*
+ * insert an entry into its <dev,ino> hash chain
+ */
+static void fh_cache_hash_add(int idx)
+{
+    unsigned int h = fh_cache_hash(fh_cache[idx].dev, fh_cache[idx].ino);
+
+    fh_cache[idx].hnext = fh_cache_bucket[h];
+    fh_cache_bucket[h] = idx;
+}
+
+/*
+ * remove an entry from its <dev,ino> hash chain
+ */
+static void fh_cache_hash_del(int idx)
+{
+    int *link;
+
+    link = &fh_cache_bucket[fh_cache_hash(fh_cache[idx].dev,
+					  fh_cache[idx].ino)];
+    while (*link != CACHE_NONE) {
+	if (*link == idx) {
+	    *link = fh_cache[idx].hnext;
+	    break;
+	}
+	link = &fh_cache[*link].hnext;
+    }
+    fh_cache[idx].hnext = CACHE_NONE;
+}
+
+/*
+ * insert an entry into its <parent,name> hash chain
+ */
+static void fh_cache_dhash_add(int idx)
+{
+    unsigned int h = fh_cache_dhash(fh_cache[idx].parent, fh_cache[idx].name);
+
+    fh_cache[idx].dnext = fh_cache_dbucket[h];
+    fh_cache_dbucket[h] = idx;
+}
+
+/*
+ * remove an entry from its <parent,name> hash chain
+ */
+static void fh_cache_dhash_del(int idx)
+{
+    int *link;
+
+    link = &fh_cache_dbucket[fh_cache_dhash(fh_cache[idx].parent,
+					    fh_cache[idx].name)];
+    while (*link != CACHE_NONE) {
+	if (*link == idx) {
+	    *link = fh_cache[idx].dnext;
+	    break;
+	}
+	link = &fh_cache[*link].dnext;
+    }
+    fh_cache[idx].dnext = CACHE_NONE;
+}
+
+/*
+ * check whether an entry knows its <dev,ino> pair
+ */
+static int fh_cache_has_inode(int idx)
+{
+    return fh_cache[idx].dev != 0 || fh_cache[idx].ino != 0;
+}
+
+/*
+ * assemble the path of an entry into a buffer
+ * returns FALSE if the path does not fit into NFS_MAXPATHLEN
+ */
+static int fh_cache_build(int idx, char *buf)
+{
+    char *pos;
+    unsigned int len;
+
+    if (idx == CACHE_ROOT) {
+	strcpy(buf, "/");
+	return TRUE;
+    }
+
+    /* assemble components backwards from the end of the buffer */
+    pos = buf + NFS_MAXPATHLEN - 1;
+    *pos = 0;
+    while (idx != CACHE_ROOT) {
+	len = strlen(fh_cache[idx].name);
+	if ((unsigned int) (pos - buf) < len + 1)
+	    return FALSE;
+	pos -= len;
+	memcpy(pos, fh_cache[idx].name, len);
+	*--pos = '/';
+	idx = fh_cache[idx].parent;
+    }
+
+    memmove(buf, pos, buf + NFS_MAXPATHLEN - pos);
+    return TRUE;
+}
+
+static int fh_cache_child(int parent, const char *name);
+
+/*
+ * -------------
+ * LOCAL CHANGES
+ * -------------
+ */
+
+/*
+ * with opt_notify, directories in the cache are watched with inotify,
+ * and the attributes found when checking a cache hit are kept in the
+ * attribute cache until a local process changes the object, instead of
+ * calling lstat again each time they expire
+ *
+ * attributes are only kept while all directories on the path of the
+ * object are watched up to its export point, and entries below the
+ * export point are only watched while their parent is; a reported
+ * change forgets the attributes of the directory and of the name
+ * involved, and changes that move paths drop everything
+ */
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define NOTIFY_MASK	(IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+			 IN_MOVE_SELF | IN_ONLYDIR)
+
+/* inotify instance, -1 if not watching */
+static int notify_fd = -1;
+
+/* hash chains of watched entries, indexed by watch */
+static int *fh_cache_wbucket = NULL;
+
+/*
+ * start watching with a new inotify instance
+ */
+static void fh_cache_notify_open(void)
+{
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd == -1)
+	logmsg(LOG_WARNING, "unable to watch for local changes: %s",
+	       strerror(errno));
+}
+
+/*
+ * drop all watches and attributes depending on them
+ */
+static void fh_cache_notify_reset(void)
+{
+    unsigned int i;
+
+    attr_cache_flush();
+
+    close(notify_fd);
+    for (i = 0; i <= fh_cache_mask; i++)
+	fh_cache_wbucket[i] = CACHE_NONE;
+    for (i = 0; i < fh_cache_size; i++)
+	fh_cache[i].wd = -1;
+
+    fh_cache_notify_open();
+}
+
+/*
+ * check whether local changes are watched
+ */
+static int fh_cache_watching(void)
+{
+    return notify_fd >= 0;
+}
+
+/*
+ * find the entry watched by a watch
+ */
+static int fh_cache_wd(int wd)
+{
+    int i;
+
+    for (i = fh_cache_wbucket[wd & fh_cache_mask]; i != CACHE_NONE;
+	 i = fh_cache[i].wnext)
+	if (fh_cache[i].wd == wd)
+	    return i;
+
+    return CACHE_NONE;
+}
+
+/*
+ * remove an entry from its watch hash chain
+ */
+static void fh_cache_wd_del(int idx)
+{
+    int *link;
+
+    link = &fh_cache_wbucket[fh_cache[idx].wd & fh_cache_mask];
+    while (*link != CACHE_NONE) {
+	if (*link == idx) {
+	    *link = fh_cache[idx].wnext;
+	    break;
+	}
+	link = &fh_cache[*link].wnext;
+    }
+    fh_cache[idx].wd = -1;
+}
+
+/*
+ * watch an entry, watching the directories above it first
+ * returns TRUE if the entry is watched
+ */
+static int fh_cache_watch(int idx)
+{
+    char path[NFS_MAXPATHLEN];
+    int top, wd;
+
+    if (notify_fd < 0)
+	return FALSE;
+
+    while (fh_cache[idx].wd == -1) {
+	/* find topmost entry not watched yet, up to the export point */
+	top = idx;
+	for (;;) {
+	    if (!fh_cache_build(top, path))
+		return FALSE;
+	    if (top == CACHE_ROOT || fh_cache[fh_cache[top].parent].wd != -1 ||
+		export_point(path))
+		break;
+	    top = fh_cache[top].parent;
+	}
+
+	/* bind mounts may show the same directory at two places */
+	wd = inotify_add_watch(notify_fd, path, NOTIFY_MASK);
+	if (wd == -1 || fh_cache_wd(wd) != CACHE_NONE)
+	    return FALSE;
+
+	fh_cache[top].wd = wd;
+	fh_cache[top].wnext = fh_cache_wbucket[wd & fh_cache_mask];
+	fh_cache_wbucket[wd & fh_cache_mask] = top;
+    }
+
+    return TRUE;
+}
+
+/*
+ * stop watching an entry whose path or <dev,ino> pair goes away
+ */
+static void fh_cache_unwatch(int idx)
+{
+    if (notify_fd < 0)
+	return;
+
+    /* attributes could no longer be forgotten on changes */
+    if (fh_cache_has_inode(idx))
+	attr_cache_forget(fh_cache[idx].dev, fh_cache[idx].ino);
+
+    if (fh_cache[idx].wd == -1)
+	return;
+
+    /* entries below rely on the watch */
+    if (fh_cache[idx].children > 0) {
+	fh_cache_notify_reset();
+	return;
+    }
+
+    inotify_rm_watch(notify_fd, fh_cache[idx].wd);
+    fh_cache_wd_del(idx);
+}
+
+/*
+ * handle a reported change
+ * returns FALSE if all watches need to be dropped
+ */
+static int fh_cache_event(struct inotify_event *ev)
+{
+    int idx, child;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+	return FALSE;
+
+    /* watch may already have been removed */
+    idx = fh_cache_wd(ev->wd);
+    if (idx == CACHE_NONE)
+	return TRUE;
+
+    /* paths below a moved directory have changed */
+    if ((ev->mask & IN_MOVE_SELF) ||
+	((ev->mask & IN_ISDIR) && (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO))))
+	return FALSE;
+
+    if (ev->mask & IN_IGNORED) {
+	/* directory was removed, or its filesystem unmounted */
+	if (fh_cache[idx].children > 0)
+	    return FALSE;
+	fh_cache_wd_del(idx);
+    }
+
+    if (fh_cache_has_inode(idx))
+	attr_cache_forget(fh_cache[idx].dev, fh_cache[idx].ino);
+
+    if (ev->len > 0) {
+	child = fh_cache_child(idx, ev->name);
+	if (child != CACHE_NONE && fh_cache_has_inode(child))
+	    attr_cache_forget(fh_cache[child].dev, fh_cache[child].ino);
+    }
+
+    return TRUE;
+}
+
+/*
+ * handle changes reported since the last call
+ * called before handling an NFS request
+ */
+void fh_cache_notify(void)
+{
+    union {
+	struct inotify_event ev;
+	char buf[4096];
+    } u;
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    if (notify_fd < 0)
+	return;
+
+    while ((len = read(notify_fd, u.buf, sizeof(u.buf))) > 0)
+	for (p = u.buf; p < u.buf + len;
+	     p += sizeof(struct inotify_event) + ev->len) {
+	    ev = (struct inotify_event *) p;
+	    if (!fh_cache_event(ev)) {
+		fh_cache_notify_reset();
+		return;
+	    }
+	}
+}
+#else
+static int fh_cache_watching(void)
+{
+    return FALSE;
+}
+
+static int fh_cache_watch(U(int idx))
+{
+    return FALSE;
+}
+
+static void fh_cache_unwatch(U(int idx))
+{
+}
+
+void fh_cache_notify(void)
+{
+}
+#endif				       /* HAVE_SYS_INOTIFY_H */
+
+/*
+ * remove the <dev,ino> pair of an entry
+ */
+static void fh_cache_clear(int idx)
+{
+    fh_cache_unwatch(idx);
+    fh_cache_hash_del(idx);
+    fh_cache[idx].dev = 0;
+    fh_cache[idx].ino = 0;
+    fh_cache[idx].has_gen = FALSE;
+}
+
+/*
+ * -------------------
+ * ENTRY MANAGEMENT
+ * -------------------
+ */
+
 /*
  * initialize cache
  */
 void fh_cache_init(void)
 {
-    memset(fh_cache, 0, sizeof(unfs3_cache_t) * CACHE_ENTRIES);
+    unsigned int i, buckets;
+
+    fh_cache_size = opt_fh_cache_size;
+
+    /* hash tables have at least as many buckets as entries */
+    for (buckets = 1; buckets < fh_cache_size; buckets <<= 1);
+    fh_cache_mask = buckets - 1;
+
+    fh_cache = malloc(sizeof(unfs3_cache_t) * fh_cache_size);
+    fh_cache_bucket = malloc(sizeof(int) * buckets);
+    fh_cache_dbucket = malloc(sizeof(int) * buckets);
+    if (!fh_cache || !fh_cache_bucket || !fh_cache_dbucket) {
+	logmsg(LOG_EMERG, "unable to allocate fh cache, aborting");
+	daemon_exit(CRISIS);
+    }
+
+    memset(fh_cache, 0, sizeof(unfs3_cache_t) * fh_cache_size);
+    for (i = 0; i < buckets; i++) {
+	fh_cache_bucket[i] = CACHE_NONE;
+	fh_cache_dbucket[i] = CACHE_NONE;
+    }
+
+    /* chain all entries except the root into the free list */
+    for (i = CACHE_ROOT + 1; i < fh_cache_size; i++)
+	fh_cache[i].lnext = i + 1 < fh_cache_size ? (int) i + 1 : CACHE_NONE;
+    fh_cache_free = CACHE_ROOT + 1;
+
+    fh_cache_head = CACHE_NONE;
+    fh_cache_tail = CACHE_NONE;
+
+    fh_cache[CACHE_ROOT].parent = CACHE_NONE;
+    fh_cache[CACHE_ROOT].hnext = CACHE_NONE;
+    fh_cache[CACHE_ROOT].dnext = CACHE_NONE;
+    fh_cache[CACHE_ROOT].name = "";
+    fh_cache[CACHE_ROOT].wd = -1;
+    fh_cache_max = 1;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    if (opt_notify) {
+	fh_cache_wbucket = malloc(sizeof(int) * buckets);
+	if (!fh_cache_wbucket) {
+	    logmsg(LOG_EMERG, "unable to allocate fh cache, aborting");
+	    daemon_exit(CRISIS);
+	}
+	for (i = 0; i < buckets; i++)
+	    fh_cache_wbucket[i] = CACHE_NONE;
+	fh_cache_notify_open();
+    }
+#endif
+
+    fh_index_init();
 }
 
 /*
- * find cache index to use for new entry
- * returns either an empty slot or the least recently used slot if no
- * empty slot is present
+ * return an entry to the free list
+ *
+ * parents which are left without children and have no <dev,ino> pair of
+ * their own are no longer needed and returned as well
+ */
+static void fh_cache_release(int idx)
+{
+    int parent;
+
+    while (idx != CACHE_ROOT) {
+	parent = fh_cache[idx].parent;
+
+	fh_cache_unwatch(idx);
+	if (fh_cache_has_inode(idx))
+	    fh_cache_hash_del(idx);
+	fh_cache_dhash_del(idx);
+	fh_cache_lru_unlink(idx);
+	name_release(fh_cache[idx].name);
+
+	fh_cache[idx].dev = 0;
+	fh_cache[idx].ino = 0;
+	fh_cache[idx].name = NULL;
+	fh_cache[idx].lnext = fh_cache_free;
+	fh_cache_free = idx;
+	fh_cache_max--;
+
+	if (idx == fh_last_entry)
+	    fh_last_entry = -1;
+
+	fh_cache[parent].children--;
+	if (fh_cache[parent].children > 0 || fh_cache_has_inode(parent))
+	    break;
+	idx = parent;
+    }
+}
+
+/*
+ * find an entry to reuse for a new entry
+ * returns either an unused entry or the least recently used entry
+ * without children
  */
 static int fh_cache_lru(void)
 {
-    unsigned int best = UINT_MAX;
-    int best_idx = 0;
-    int i;
+    int idx;
 
-    /* if cache is not full, we simply hand out the next slot */
-    if (fh_cache_max < CACHE_ENTRIES - 1)
-	return fh_cache_max++;
+    if (fh_cache_free == CACHE_NONE) {
+	/* avoid stomping over last returned entry */
+	idx = fh_cache_tail;
+	while (idx != CACHE_NONE &&
+	       (idx == fh_last_entry || fh_cache[idx].children > 0))
+	    idx = fh_cache[idx].lprev;
 
-    for (i = 0; i < CACHE_ENTRIES; i++) {
-	if (i == fh_last_entry)
-	    continue;
-	if (fh_cache[i].use == 0)
-	    return i;
-	if (fh_cache[i].use < best) {
-	    best = fh_cache[i].use;
-	    best_idx = i;
-	}
+	if (idx == CACHE_NONE)
+	    return CACHE_NONE;
+
+	fh_cache_release(idx);
     }
 
-    /* avoid stomping over last returned entry */
-    if (best_idx == 0 && fh_last_entry == 0)
-	best_idx = 1;
+    idx = fh_cache_free;
+    fh_cache_free = fh_cache[idx].lnext;
+    fh_cache_max++;
 
-    return best_idx;
+    return idx;
 }
 
 /*
- * invalidate (clear) a cache entry
+ * find a name inside a directory entry
  */
-static void fh_cache_inval(int idx)
+static int fh_cache_child(int parent, const char *name)
 {
+    int i;
+
+    for (i = fh_cache_dbucket[fh_cache_dhash(parent, name)]; i != CACHE_NONE;
+	 i = fh_cache[i].dnext)
+	if (fh_cache[i].parent == parent && strcmp(fh_cache[i].name, name) == 0)
+	    return i;
+
+    return CACHE_NONE;
+}
+
+/*
+ * create a new entry for a name inside a directory entry
+ */
+static int fh_cache_new(int parent, const char *name)
+{
+    int idx;
+    char *copy;
+
+    /* protect parent from being evicted for the new entry */
+    fh_cache[parent].children++;
+
+    idx = fh_cache_lru();
+    if (idx == CACHE_NONE) {
+	fh_cache[parent].children--;
+	return CACHE_NONE;
+    }
+
+    copy = name_alloc(name, strlen(name));
+    if (!copy) {
+	fh_cache[parent].children--;
+	fh_cache[idx].lnext = fh_cache_free;
+	fh_cache_free = idx;
+	fh_cache_max--;
+	return CACHE_NONE;
+    }
+
     fh_cache[idx].dev = 0;
     fh_cache[idx].ino = 0;
-    fh_cache[idx].use = 0;
-    fh_cache[idx].path[0] = 0;
+    fh_cache[idx].parent = parent;
+    fh_cache[idx].children = 0;
+    fh_cache[idx].name = copy;
+    fh_cache[idx].hnext = CACHE_NONE;
+    fh_cache[idx].wd = -1;
+    fh_cache[idx].has_gen = FALSE;
+    fh_cache_dhash_add(idx);
+    fh_cache_lru_head(idx);
+
+    return idx;
+}
+
+/*
+ * invalidate an entry, removing its <dev,ino> pair
+ *
+ * entries still holding the path prefix of other entries are kept
+ */
+static void fh_cache_inval(int idx)
+{
+    if (fh_cache_has_inode(idx))
+	fh_cache_clear(idx);
+
+    if (idx != CACHE_ROOT && fh_cache[idx].children == 0)
+	fh_cache_release(idx);
 }
 
 /*
@@ -124,15 +822,230 @@ static void fh_cache_inval(int idx)
  */
 static int fh_cache_index(uint32 dev, uint64 ino)
 {
-    int i, res = -1;
+    int i;
 
-    for (i = 0; i < fh_cache_max + 1; i++)
-	if (fh_cache[i].dev == dev && fh_cache[i].ino == ino) {
-	    res = i;
-	    break;
+    for (i = fh_cache_bucket[fh_cache_hash(dev, ino)]; i != CACHE_NONE;
+	 i = fh_cache[i].hnext)
+	if (fh_cache[i].dev == dev && fh_cache[i].ino == ino)
+	    return i;
+
+    return -1;
+}
+
+/*
+ * assemble the path of an entry
+ *
+ * a request may hold on to the paths of two filehandles (RENAME and
+ * LINK), and each fh_decomp can use two buffers, so the returned
+ * buffer is only valid until a few more paths have been handed out
+ *
+ * returns NULL if the path does not fit into NFS_MAXPATHLEN
+ */
+static char *fh_cache_path(int idx)
+{
+    static UNFS3_TLS char paths[CACHE_PATHS][NFS_MAXPATHLEN];
+    static UNFS3_TLS int next = 0;
+    char *buf;
+
+    buf = paths[next];
+    next = (next + 1) % CACHE_PATHS;
+
+    if (!fh_cache_build(idx, buf))
+	return NULL;
+    return buf;
+}
+
+/*
+ * return a copy of a path in one of the buffers used by fh_cache_path
+ */
+static char *fh_cache_copy(const char *path)
+{
+    char *buf = fh_cache_path(CACHE_ROOT);
+
+    strcpy(buf, path);
+    return buf;
+}
+
+/*
+ * find the entry for a path, creating missing entries if requested
+ */
+static int fh_cache_walk(const char *path, int create)
+{
+    char name[NFS_MAXPATHLEN];
+    const char *pos, *end;
+    int idx = CACHE_ROOT, child;
+
+    pos = path;
+    while (*pos) {
+	/* skip slashes, for the first and repeated ones */
+	if (*pos == '/') {
+	    pos++;
+	    continue;
 	}
 
-    return res;
+	end = strchr(pos, '/');
+	if (!end)
+	    end = pos + strlen(pos);
+
+	memcpy(name, pos, end - pos);
+	name[end - pos] = 0;
+
+	child = fh_cache_child(idx, name);
+	if (child == CACHE_NONE && !create)
+	    return CACHE_NONE;
+	if (child == CACHE_NONE)
+	    child = fh_cache_new(idx, name);
+	if (child == CACHE_NONE) {
+	    /* drop entries created so far if they are now useless */
+	    if (idx != CACHE_ROOT && fh_cache[idx].children == 0 &&
+		!fh_cache_has_inode(idx))
+		fh_cache_release(idx);
+	    return CACHE_NONE;
+	}
+
+	idx = child;
+	pos = end;
+    }
+
+    return idx;
+}
+
+/*
+ * check whether an entry lies below another entry in the tree
+ */
+static int fh_cache_below(int idx, int dir)
+{
+    while (idx != CACHE_ROOT) {
+	idx = fh_cache[idx].parent;
+	if (idx == dir)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * remove an entry together with all entries below it
+ *
+ * entries do not know their children, so this needs a scan over the
+ * whole cache; it is only used when a directory is replaced
+ */
+static void fh_cache_drop(int idx)
+{
+    unsigned int i;
+
+    if (fh_cache[idx].children > 0) {
+	for (i = 1; i < fh_cache_size; i++)
+	    if (fh_cache[i].name && fh_cache_has_inode(i) &&
+		fh_cache_below(i, idx))
+		fh_cache_clear(i);
+
+	/* releasing the leaves takes all path-only parents with them */
+	for (i = 1; i < fh_cache_size; i++)
+	    if (fh_cache[i].name && fh_cache[i].children == 0 &&
+		fh_cache_below(i, idx))
+		fh_cache_release(i);
+    }
+
+    /* idx may already be gone if it had no <dev,ino> pair */
+    if (fh_cache[idx].name)
+	fh_cache_inval(idx);
+}
+
+/*
+ * update the cache after a successful rename
+ *
+ * the entry for the old name is moved to its new place in the tree, so
+ * that all entries below it stay valid without having to be resolved
+ * again
+ */
+void fh_cache_rename(const char *from, const char *to)
+{
+    char dir[NFS_MAXPATHLEN];
+    const char *name;
+    char *copy;
+    int src, dst, parent, old;
+
+    if (strlen(to) + 1 > NFS_MAXPATHLEN)
+	return;
+
+    /* whatever was named by the new name has been replaced */
+    dst = fh_cache_walk(to, FALSE);
+    if (dst != CACHE_NONE && dst != CACHE_ROOT)
+	fh_cache_drop(dst);
+
+    src = fh_cache_walk(from, FALSE);
+    if (src == CACHE_NONE || src == CACHE_ROOT)
+	return;
+
+    name = strrchr(to, '/');
+    if (!name || name[1] == 0) {
+	fh_cache_drop(src);
+	return;
+    }
+    memcpy(dir, to, name - to);
+    dir[name - to] = 0;
+    name++;
+
+    /* protect entry while finding the new parent */
+    fh_cache[src].children++;
+    parent = fh_cache_walk(dir, TRUE);
+    fh_cache[src].children--;
+
+    copy = NULL;
+    if (parent != CACHE_NONE && parent != src && !fh_cache_below(parent, src))
+	copy = name_alloc(name, strlen(name));
+    if (!copy) {
+	fh_cache_drop(src);
+	return;
+    }
+
+    old = fh_cache[src].parent;
+    fh_cache_dhash_del(src);
+    name_release(fh_cache[src].name);
+    fh_cache[src].name = copy;
+    fh_cache[src].parent = parent;
+    fh_cache[parent].children++;
+    fh_cache_dhash_add(src);
+    fh_cache_touch(src);
+
+    if (fh_cache_has_inode(src))
+	fh_index_store(fh_cache[src].dev, fh_cache[src].ino, to);
+
+    /* old parent may only have been holding the path prefix */
+    fh_cache[old].children--;
+    if (old != CACHE_ROOT && fh_cache[old].children == 0 &&
+	!fh_cache_has_inode(old))
+	fh_cache_release(old);
+}
+
+/*
+ * set the <dev,ino> pair of an entry
+ */
+static void fh_cache_set(int idx, uint32 dev, uint64 ino)
+{
+    int old;
+
+    /* protect entry while removing any previous entry for <dev,ino> */
+    fh_cache[idx].children++;
+
+    old = fh_cache_index(dev, ino);
+    if (old != -1 && old != idx)
+	fh_cache_inval(old);
+
+    /* name may have referred to a different object until now */
+    if (fh_cache_has_inode(idx) &&
+	(fh_cache[idx].dev != dev || fh_cache[idx].ino != ino))
+	fh_cache_clear(idx);
+
+    if (!fh_cache_has_inode(idx)) {
+	fh_cache[idx].dev = dev;
+	fh_cache[idx].ino = ino;
+	fh_cache_hash_add(idx);
+    }
+
+    fh_cache[idx].children--;
+    fh_cache_touch(idx);
 }
 
 /*
@@ -142,20 +1055,212 @@ char *fh_cache_add(uint32 dev, uint64 ino, const char *path)
 {
     int idx;
 
-    /* if we already have a matching entry, overwrite that */
-    idx = fh_cache_index(dev, ino);
+    if (strlen(path) + 1 > NFS_MAXPATHLEN)
+	return NULL;
+
+    fh_index_store(dev, ino, path);
+
+    idx = fh_cache_walk(path, TRUE);
+    if (idx != CACHE_NONE)
+	fh_cache_set(idx, dev, ino);
+
+    return fh_cache_copy(path);
+}
+
+/*
+ * nanoseconds of the inode change time, if known
+ */
+static long fh_cache_ctime_nsec(const backend_statstruct * buf)
+{
+#ifdef HAVE_STRUCT_STAT_ST_CTIM
+    return buf->st_ctim.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * look up the generation number of an object in the cache
+ *
+ * the generation number only changes when the inode is reused for a
+ * new object, which also changes the inode change time
+ */
+int fh_cache_gen(const backend_statstruct * buf, uint32 * gen)
+{
+    int idx;
+
+    idx = fh_cache_index(buf->st_dev, buf->st_ino);
+    if (idx == -1 || !fh_cache[idx].has_gen ||
+	fh_cache[idx].ctime != buf->st_ctime ||
+	fh_cache[idx].ctime_nsec != fh_cache_ctime_nsec(buf))
+	return FALSE;
+
+    *gen = fh_cache[idx].gen;
+    return TRUE;
+}
 
-    /* otherwise overwrite least recently used entry */
+/*
+ * remember the generation number of an object in the cache
+ */
+void fh_cache_set_gen(const backend_statstruct * buf, uint32 gen)
+{
+    int idx;
+
+    idx = fh_cache_index(buf->st_dev, buf->st_ino);
     if (idx == -1)
-	idx = fh_cache_lru();
+	return;
+
+    fh_cache[idx].has_gen = TRUE;
+    fh_cache[idx].gen = gen;
+    fh_cache[idx].ctime = buf->st_ctime;
+    fh_cache[idx].ctime_nsec = fh_cache_ctime_nsec(buf);
+}
+
+/*
+ * negative entries: names recently looked up in a directory and found
+ * missing, so that repeated lookups of them can fail without touching
+ * the filesystem
+ *
+ * an entry is only valid as long as the directory has the same inode
+ * change time, which every creation of a name in it updates; entries
+ * are replaced on hash collision
+ */
+
+/* number of negative entries, and longest name kept */
+#define ABSENT_ENTRIES	1024
+#define ABSENT_NAMELEN	64
+
+typedef struct {
+    uint64 ino;			/* inode of directory */
+    uint32 dev;			/* device of directory */
+    time_t ctime;		/* inode change time of directory */
+    long ctime_nsec;
+    user_cred_t cred;		/* ids of the user who looked up the name */
+    char name[ABSENT_NAMELEN];	/* missing name, empty if unused */
+} unfs3_absent_t;
+
+static unfs3_absent_t fh_absent[ABSENT_ENTRIES];
+
+/*
+ * compute slot for a name inside a directory
+ */
+static unsigned int fh_absent_slot(uint32 dev, uint64 ino, const char *name)
+{
+    uint32 h;
+
+    h = (uint32) ino ^ (uint32) (ino >> 32);
+    h ^= dev * 0x9E3779B1;
+
+    return fnv1a_32(name, h) % ABSENT_ENTRIES;
+}
+
+/*
+ * check whether a name is known to be missing from a directory
+ *
+ * st_cache must hold the attributes of the directory; the ids including
+ * the auxiliary groups are part of the key, since a user without search
+ * permission must not learn about names from another user's lookups
+ */
+int fh_cache_absent(const char *name)
+{
+    unfs3_absent_t *ent;
+    user_cred_t cred;
+
+    if (!st_cache_valid || !S_ISDIR(st_cache.st_mode))
+	return FALSE;
+
+    get_cred(&cred);
+    ent = &fh_absent[fh_absent_slot(st_cache.st_dev, st_cache.st_ino, name)];
+    return ent->dev == (uint32) st_cache.st_dev &&
+	ent->ino == st_cache.st_ino && ent->ctime == st_cache.st_ctime &&
+	ent->ctime_nsec == fh_cache_ctime_nsec(&st_cache) &&
+	same_cred(&ent->cred, &cred) && strcmp(ent->name, name) == 0;
+}
+
+/*
+ * remember that a name is missing from a directory
+ *
+ * st_cache must hold the attributes of the directory; directories
+ * changed during the current second are skipped since a change by
+ * another process might not be visible in their inode change time
+ */
+void fh_cache_add_absent(const char *name)
+{
+    unfs3_absent_t *ent;
+
+    if (!st_cache_valid || !S_ISDIR(st_cache.st_mode) ||
+	strlen(name) >= ABSENT_NAMELEN || st_cache.st_ctime >= time(NULL))
+	return;
+
+    ent = &fh_absent[fh_absent_slot(st_cache.st_dev, st_cache.st_ino, name)];
+    ent->dev = st_cache.st_dev;
+    ent->ino = st_cache.st_ino;
+    ent->ctime = st_cache.st_ctime;
+    ent->ctime_nsec = fh_cache_ctime_nsec(&st_cache);
+    get_cred(&ent->cred);
+    strcpy(ent->name, name);
+}
+
+/*
+ * forget that a name is missing from a directory, after creating it
+ */
+void fh_cache_del_absent(nfs_fh3 dir, const char *name)
+{
+    unfs3_fh_t *fh = (void *) dir.data.data_val;
+    unfs3_absent_t *ent;
+
+    ent = &fh_absent[fh_absent_slot(fh->dev, fh->ino, name)];
+    if (ent->dev == fh->dev && ent->ino == fh->ino &&
+	strcmp(ent->name, name) == 0)
+	ent->name[0] = 0;
+}
+
+/*
+ * add the entries of a READDIRPLUS reply to the filehandle cache
+ *
+ * the directory is looked up only once for all of its entries
+ */
+void fh_cache_add_dir(const char *path, entryplus3 *entries)
+{
+    char obj[NFS_MAXPATHLEN];
+    unfs3_fh_t *fh;
+    entryplus3 *this;
+    int dir, idx;
+
+    dir = fh_cache_walk(path, TRUE);
+    if (dir == CACHE_NONE)
+	return;
+
+    /* protect directory while adding entries below it */
+    fh_cache[dir].children++;
+
+    for (this = entries; this; this = this->nextentry) {
+	if (!this->name_handle.handle_follows)
+	    continue;
+	if (strlen(path) + strlen(this->name) + 2 > NFS_MAXPATHLEN)
+	    continue;
 
-    fh_cache[idx].dev = dev;
-    fh_cache[idx].ino = ino;
-    fh_cache[idx].use = fh_cache_next();
+	fh = (void *) this->name_handle.post_op_fh3_u.handle.data.data_val;
 
-    strcpy(fh_cache[idx].path, path);
+	strcpy(obj, path);
+	if (strcmp(path, "/") != 0)
+	    strcat(obj, "/");
+	strcat(obj, this->name);
+	fh_index_store(fh->dev, fh->ino, obj);
 
-    return fh_cache[idx].path;
+	idx = fh_cache_child(dir, this->name);
+	if (idx == CACHE_NONE)
+	    idx = fh_cache_new(dir, this->name);
+	if (idx == CACHE_NONE)
+	    break;
+
+	fh_cache_set(idx, fh->dev, fh->ino);
+    }
+
+    fh_cache[dir].children--;
+    if (dir != CACHE_ROOT && fh_cache[dir].children == 0 &&
+	!fh_cache_has_inode(dir))
+	fh_cache_release(dir);
 }
 
 /*
@@ -163,31 +1268,59 @@ char *fh_cache_add(uint32 dev, uint64 ino, const char *path)
  */
 static char *fh_cache_lookup(uint32 dev, uint64 ino)
 {
-    int i, res;
+    int i, res, watched;
     backend_statstruct buf;
+    char *path;
 
     i = fh_cache_index(dev, ino);
 
     if (i != -1) {
-	/* check whether path to <dev,ino> relation still holds */
-	res = backend_lstat(fh_cache[i].path, &buf);
-	if (res == -1) {
-	    /* object does not exist any more */
+	path = fh_cache_path(i);
+	if (!path) {
+	    /* path has grown too long */
 	    fh_cache_inval(i);
 	    return NULL;
 	}
+
+	/* check whether path to <dev,ino> relation still holds,
+	   recently seen attributes are trusted */
+	if (!attr_cache_get(dev, ino, &buf)) {
+	    /* watch directories above before looking at the object */
+	    watched = fh_cache_watching() &&
+		(i == CACHE_ROOT || export_point(path) ||
+		 fh_cache_watch(fh_cache[i].parent));
+	    res = backend_lstat(path, &buf);
+	    if (res != -1 && watched && S_ISDIR(buf.st_mode) &&
+		fh_cache[i].wd == -1) {
+		/* directories are watched themselves, look again after that */
+		watched = fh_cache_watch(i);
+		if (watched)
+		    res = backend_lstat(path, &buf);
+	    }
+	    if (res == -1) {
+		/* object does not exist any more */
+		fh_cache_inval(i);
+		return NULL;
+	    }
+	    attr_cache_add(buf);
+
+	    /* changes through other hard links would go unnoticed */
+	    if (watched && buf.st_dev == dev && buf.st_ino == ino &&
+		(S_ISDIR(buf.st_mode) || buf.st_nlink == 1))
+		attr_cache_hold(dev, ino);
+	}
 	if (buf.st_dev == dev && buf.st_ino == ino) {
-	    /* cache hit, update time on cache entry */
-	    fh_cache[i].use = fh_cache_next();
+	    /* cache hit, move entry to head of LRU list */
+	    fh_cache_touch(i);
 
 	    /* update stat cache */
 	    st_cache_valid = TRUE;
 	    st_cache = buf;
 
-	    /* prevent next fh_cache_add from overwriting entry */
+	    /* prevent next fh_cache_add from evicting entry */
 	    fh_last_entry = i;
 
-	    return fh_cache[i].path;
+	    return path;
 	} else {
 	    /* path to <dev,ino> relation has changed */
 	    fh_cache_inval(i);
@@ -208,6 +1341,10 @@ char *fh_decomp(nfs_fh3 fh)
     unfs3_fh_t *obj = (void *) fh.data.data_val;
     time_t *last_mtime;
     uint32 *dir_hash, new_dir_hash;
+    uint64 start;
+    int miss;
+
+    locate_deferred = FALSE;
 
     if (!nfh_valid(fh)) {
 	st_cache_valid = FALSE;
@@ -283,6 +1420,7 @@ char *fh_decomp(nfs_fh3 fh)
 		st_cache.st_mtime = *last_mtime;
 	    }
 
+	    stats_resolved(STATS_EXPORT, result);
 	    return result;
 	}
     }
@@ -292,12 +1430,38 @@ char *fh_decomp(nfs_fh3 fh)
     fh_cache_use++;
 
     if (!result) {
-	/* not found, resolve the hard way */
-	result = fh_decomp_raw(obj);
+	start = stats_now();
+	STATS_PROBE2(resolve__start, obj->dev, obj->ino);
+
+	/* not found, try opening the object by kernel handle */
+	result = fh_decomp_handle(obj);
+	miss = FH_MISS_HANDLE;
+
+	/* try the path recorded in the index */
+	if (!result) {
+	    result = fh_index_lookup(obj->dev, obj->ino);
+	    miss = FH_MISS_INDEX;
+	}
+
+	/* resolve the hard way */
+	if (!result) {
+	    result = fh_decomp_raw(obj);
+	    miss = FH_MISS_SEARCH;
+	}
 
 	/* if still not found, do full recursive search) */
-	if (!result)
+	if (!result) {
 	    result = backend_locate_file(obj->dev, obj->ino);
+	    miss = FH_MISS_LOCATE;
+	}
+
+	if (!result)
+	    miss = FH_MISS_FAILED;
+	fh_cache_miss[miss]++;
+
+	STATS_PROBE2(resolve__done, miss, result);
+	stats_phase(STATS_RESOLVE, start);
+	stats_resolved(miss, result);
 
 	if (result)
 	    /* add to cache for later use if resolution ok */
@@ -305,9 +1469,11 @@ char *fh_decomp(nfs_fh3 fh)
 	else
 	    /* could not resolve in any way */
 	    st_cache_valid = FALSE;
-    } else
+    } else {
 	/* found, update cache hit statistic */
 	fh_cache_hit++;
+	stats_resolved(STATS_CACHED, result);
+    }
 
     return result;
 }
@@ -337,7 +1503,7 @@ unfs3_fh_t fh_comp(const char *path, struct svc_req * rqstp, int need_dir)
 unfs3_fh_t *fh_comp_ptr(const char *path, struct svc_req * rqstp,
 			int need_dir)
 {
-    static unfs3_fh_t res;
+    static UNFS3_TLS unfs3_fh_t res;
 
     res = fh_comp(path, rqstp, need_dir);
     if (fh_valid(res))
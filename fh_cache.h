@@ -7,10 +7,23 @@
 #ifndef UNFS3_FH_CACHE_H
 #define UNFS3_FH_CACHE_H
 
+/* default and minimum number of entries in fh cache */
+#define FH_CACHE_ENTRIES	4096
+#define FH_CACHE_MIN		1024
+
+/* ways of resolving cache misses, see fh_decomp */
+#define FH_MISS_HANDLE	0	/* kernel handle */
+#define FH_MISS_INDEX	1	/* persistent filehandle index */
+#define FH_MISS_SEARCH	2	/* search below the export */
+#define FH_MISS_LOCATE	3	/* brute force search */
+#define FH_MISS_FAILED	4	/* not resolved */
+#define FH_MISS_KINDS	5
+
 /* statistics */
 extern int fh_cache_max;
 extern int fh_cache_use;
 extern int fh_cache_hit;
+extern int fh_cache_miss[FH_MISS_KINDS];
 
 void fh_cache_init(void);
 
@@ -19,5 +32,15 @@ unfs3_fh_t fh_comp(const char *path, struct svc_req *rqstp, int need_dir);
 unfs3_fh_t *fh_comp_ptr(const char *path, struct svc_req *rqstp, int need_dir);
 
 char *fh_cache_add(uint32 dev, uint64 ino, const char *path);
+void fh_cache_add_dir(const char *path, entryplus3 *entries);
+void fh_cache_rename(const char *from, const char *to);
+
+int fh_cache_gen(const backend_statstruct *buf, uint32 *gen);
+void fh_cache_set_gen(const backend_statstruct *buf, uint32 gen);
+
+int fh_cache_absent(const char *name);
+void fh_cache_add_absent(const char *name);
+void fh_cache_del_absent(nfs_fh3 dir, const char *name);
+void fh_cache_notify(void);
 
 #endif
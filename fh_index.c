@@ -0,0 +1,239 @@
+/*
+ * UNFS3 persistent filehandle index
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "fh.h"
+#include "fh_index.h"
+#include "daemon.h"
+#include "backend.h"
+
+/*
+ * the index is an optional file mapped into memory which maps <dev,ino>
+ * pairs to the last path under which the object was found
+ *
+ * it is updated whenever an object enters the filehandle cache, so after
+ * a restart filehandles held by clients can be resolved with one lstat
+ * instead of a directory search; stale slots are detected by the same
+ * check used for the filehandle cache and simply cleared
+ *
+ * the file is a header followed by a hash table of fixed size records,
+ * using linear probing over a few slots
+ */
+
+#ifndef WIN32
+
+#define INDEX_MAGIC	"unfs3ix1"
+#define INDEX_RECLEN	256
+#define INDEX_PATHLEN	(INDEX_RECLEN - 16)
+#define INDEX_PROBES	8
+
+typedef struct {
+    char magic[8];
+    uint32 slots;		/* number of records after header */
+    uint32 reclen;		/* size of header and each record */
+} fh_index_header;
+
+typedef struct {
+    uint64 ino;
+    uint32 dev;
+    uint32 len;			/* length of path, 0 if slot unused */
+    char path[INDEX_PATHLEN];
+} fh_index_rec;
+
+static fh_index_rec *fh_index = NULL;
+static unsigned int fh_index_mask = 0;
+
+/*
+ * compute first slot for device and inode number
+ */
+static unsigned int fh_index_hash(uint32 dev, uint64 ino)
+{
+    uint32 h;
+
+    h = (uint32) ino ^ (uint32) (ino >> 32);
+    h ^= dev * 0x9E3779B1;
+    h ^= h >> 15;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+
+    return h & fh_index_mask;
+}
+
+/*
+ * open or create the index file and map it into memory
+ */
+void fh_index_init(void)
+{
+    fh_index_header *head, old;
+    unsigned int slots;
+    off_t size;
+    struct stat buf;
+    void *map;
+    int fd;
+
+    if (!opt_fh_index || fh_index)
+	return;
+
+    for (slots = 1; slots < opt_fh_index_size; slots <<= 1);
+    size = (off_t) (slots + 1) * INDEX_RECLEN;
+
+    fd = open(opt_fh_index, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || fstat(fd, &buf) == -1) {
+	logmsg(LOG_WARNING, "failed to open filehandle index `%s'",
+	       opt_fh_index);
+	if (fd != -1)
+	    close(fd);
+	return;
+    }
+
+    /*
+     * start over if file was created for a different size or is no
+     * index at all; truncating leaves a sparse file reading as zeroes
+     */
+    if (buf.st_size != size ||
+	pread(fd, &old, sizeof(old), 0) != sizeof(old) ||
+	memcmp(old.magic, INDEX_MAGIC, sizeof(old.magic)) != 0 ||
+	old.slots != slots || old.reclen != INDEX_RECLEN) {
+	if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+	    logmsg(LOG_WARNING, "failed to size filehandle index `%s'",
+		   opt_fh_index);
+	    close(fd);
+	    return;
+	}
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	logmsg(LOG_WARNING, "failed to map filehandle index `%s'",
+	       opt_fh_index);
+	return;
+    }
+
+    head = map;
+    if (memcmp(head->magic, INDEX_MAGIC, sizeof(head->magic)) != 0) {
+	memcpy(head->magic, INDEX_MAGIC, sizeof(head->magic));
+	head->slots = slots;
+	head->reclen = INDEX_RECLEN;
+    }
+
+    /* record 0 is the header */
+    fh_index = (fh_index_rec *) map + 1;
+    fh_index_mask = slots - 1;
+}
+
+/*
+ * find the path last recorded for a <dev,ino> pair
+ * fills the stat cache if the path is still valid
+ */
+char *fh_index_lookup(uint32 dev, uint64 ino)
+{
+    static UNFS3_TLS char path[INDEX_PATHLEN];
+    backend_statstruct buf;
+    fh_index_rec *rec;
+    unsigned int h, i;
+
+    if (!fh_index)
+	return NULL;
+
+    h = fh_index_hash(dev, ino);
+    for (i = 0; i < INDEX_PROBES; i++) {
+	rec = &fh_index[(h + i) & fh_index_mask];
+	if (rec->len == 0 || rec->dev != dev || rec->ino != ino)
+	    continue;
+
+	/* the file may have been damaged by a crash while writing */
+	if (rec->len >= INDEX_PATHLEN || rec->path[rec->len] != 0)
+	    break;
+
+	memcpy(path, rec->path, rec->len + 1);
+	if (backend_lstat(path, &buf) == -1 || buf.st_dev != dev ||
+	    buf.st_ino != ino)
+	    break;
+
+	st_cache_valid = TRUE;
+	st_cache = buf;
+	return path;
+    }
+
+    if (i < INDEX_PROBES)
+	rec->len = 0;
+
+    return NULL;
+}
+
+/*
+ * record the path for a <dev,ino> pair
+ */
+void fh_index_store(uint32 dev, uint64 ino, const char *path)
+{
+    fh_index_rec *rec, *use = NULL;
+    unsigned int h, i, len;
+
+    if (!fh_index)
+	return;
+
+    len = strlen(path);
+    if (len == 0 || len >= INDEX_PATHLEN)
+	return;
+
+    h = fh_index_hash(dev, ino);
+    for (i = 0; i < INDEX_PROBES; i++) {
+	rec = &fh_index[(h + i) & fh_index_mask];
+	if (rec->len != 0 && rec->dev == dev && rec->ino == ino) {
+	    /* avoid dirtying the page if nothing changed */
+	    if (rec->len == len && memcmp(rec->path, path, len) == 0)
+		return;
+	    use = rec;
+	    break;
+	}
+	if (rec->len == 0 && !use)
+	    use = rec;
+    }
+
+    /* all slots taken, replace the first one */
+    if (!use)
+	use = &fh_index[h];
+
+    use->len = 0;
+    memcpy(use->path, path, len + 1);
+    use->dev = dev;
+    use->ino = ino;
+    use->len = len;
+}
+
+#else				       /* WIN32 */
+
+void fh_index_init(void)
+{
+    if (opt_fh_index)
+	logmsg(LOG_WARNING, "filehandle index not supported on this platform");
+}
+
+char *fh_index_lookup(U(uint32 dev), U(uint64 ino))
+{
+    return NULL;
+}
+
+void fh_index_store(U(uint32 dev), U(uint64 ino), U(const char *path))
+{
+}
+
+#endif				       /* WIN32 */
@@ -0,0 +1,18 @@
+/*
+ * UNFS3 persistent filehandle index
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_FH_INDEX_H
+#define UNFS3_FH_INDEX_H
+
+/* default and minimum number of index slots */
+#define FH_INDEX_SLOTS	65536
+#define FH_INDEX_MIN	1024
+
+void fh_index_init(void);
+
+char *fh_index_lookup(uint32 dev, uint64 ino);
+void fh_index_store(uint32 dev, uint64 ino, const char *path);
+
+#endif
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAVE_MNTENT_H
@@ -26,7 +27,11 @@
 
 #include "nfs.h"
 #include "fh.h"
+#include "fh_cache.h"
+#include "locate.h"
+#include "user.h"
 #include "daemon.h"
+#include "backend.h"
 
 /*
  * these are the brute-force file searching routines that are used
@@ -37,73 +42,55 @@
  *
  * these routines are slow, but better than returning ESTALE to
  * clients
+ *
+ * a search walks the whole filesystem the object lives on, so it is
+ * not done while the request waits; instead, the object is queued and
+ * the client is told to retry later with NFS3ERR_JUKEBOX, while the main
+ * loop advances the search a few directory entries at a time
+ *
+ * one walk over a filesystem looks for all objects queued for it, and
+ * objects found are entered into the filehandle cache, where the retried
+ * request will find them
  */
 
-#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
-
-/*
- * locate file given prefix, device, and inode number
- */
-static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
-{
-    char path[NFS_MAXPATHLEN];
-    backend_dirstream *search;
-    struct dirent *ent;
-    backend_statstruct buf;
-    int res;
+/* set when the last call to locate_file queued a search */
+UNFS3_TLS int locate_deferred = FALSE;
 
-    search = opendir(pfx);
-    if (!search)
-	return FALSE;
+#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
 
-    while ((ent = readdir(search))) {
-	if (strlen(pfx) + strlen(ent->d_name) + 2 >= NFS_MAXPATHLEN)
-	    continue;
+#define LOCATE_TARGETS	16		/* objects searched for at once */
+#define LOCATE_BATCH	256		/* entries examined per step */
+#define LOCATE_MISSING	60		/* seconds to remember failed searches */
+#define LOCATE_DEPTH	(NFS_MAXPATHLEN / 2)
 
-	sprintf(path, "%s/%s", pfx, ent->d_name);
+#define TARGET_FREE	0		/* slot unused */
+#define TARGET_WAIT	1		/* search queued or running */
+#define TARGET_MISSING	2		/* search finished without result */
 
-	res = backend_lstat(path, &buf);
-	if (res != 0)
-	    continue;
+typedef struct {
+    uint32 dev;
+    uint64 ino;
+    int state;
+    time_t time;		/* when the search failed */
+} locate_target;
 
-	/* check for matching object */
-	if (buf.st_dev == dev && buf.st_ino == ino) {
-	    strcpy(result, path);
-	    st_cache = buf;
-	    st_cache_valid = TRUE;
-	    closedir(search);
-	    return TRUE;
-	}
-
-	/* descend into directories with same dev */
-	if (buf.st_dev == dev && S_ISDIR(buf.st_mode) &&
-	    strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-	    res = locate_pfx(path, dev, ino, result);
-	    if (res == TRUE) {
-		closedir(search);
-		return TRUE;
-	    }
-	}
-    }
+static locate_target locate_targets[LOCATE_TARGETS];
 
-    closedir(search);
-    return FALSE;
-}
-#endif
+/* state of the running search, locate_depth is -1 if there is none */
+static uint32 locate_dev;
+static int locate_depth = -1;
+static DIR *locate_dirs[LOCATE_DEPTH];
+static unsigned int locate_lens[LOCATE_DEPTH];
+static char locate_path[NFS_MAXPATHLEN];
 
 /*
- * locate file given device and inode number
- *
- * slow fallback in case other filehandle resolution functions fail
+ * find mount point for a device
  */
-char *locate_file(U(uint32 dev), U(uint64 ino))
+static int locate_mount(uint32 dev, char *result)
 {
-#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
-    static char path[NFS_MAXPATHLEN];
     FILE *mtab;
     struct stat buf;
     int res;
-#endif
 
 #ifdef HAVE_MNTENT_H
     struct mntent *ent;
@@ -111,16 +98,12 @@ char *locate_file(U(uint32 dev), U(uint64 ino))
 
 #ifdef HAVE_SYS_MNTTAB_H
     struct mnttab ent;
-    int found = FALSE;
 #endif
 
-    if (!opt_brute_force)
-	return NULL;
-
 #ifdef HAVE_MNTENT_H
     mtab = setmntent("/etc/mtab", "r");
     if (!mtab)
-	return NULL;
+	return FALSE;
 
     /* 
      * look for mtab entry with matching device
@@ -128,23 +111,20 @@ char *locate_file(U(uint32 dev), U(uint64 ino))
     while ((ent = getmntent(mtab))) {
 	res = lstat(ent->mnt_dir, &buf);
 
-	if (res == 0 && buf.st_dev == dev)
-	    break;
+	if (res == 0 && buf.st_dev == dev &&
+	    strlen(ent->mnt_dir) < NFS_MAXPATHLEN) {
+	    strcpy(result, ent->mnt_dir);
+	    endmntent(mtab);
+	    return TRUE;
+	}
     }
     endmntent(mtab);
-
-    /* found matching entry? */
-    if (ent) {
-	res = locate_pfx(ent->mnt_dir, dev, ino, path);
-	if (res == TRUE)
-	    return path;
-    }
 #endif
 
 #ifdef HAVE_SYS_MNTTAB_H
     mtab = fopen("/etc/mnttab", "r");
     if (!mtab)
-	return NULL;
+	return FALSE;
 
     /* 
      * look for mnttab entry with matching device
@@ -152,20 +132,226 @@ char *locate_file(U(uint32 dev), U(uint64 ino))
     while (getmntent(mtab, &ent) == 0) {
 	res = lstat(ent.mnt_mountp, &buf);
 
-	if (res == 0 && buf.st_dev == dev) {
-	    found = TRUE;
-	    break;
+	if (res == 0 && buf.st_dev == dev &&
+	    strlen(ent.mnt_mountp) < NFS_MAXPATHLEN) {
+	    strcpy(result, ent.mnt_mountp);
+	    fclose(mtab);
+	    return TRUE;
 	}
     }
     fclose(mtab);
+#endif
 
-    /* found matching entry? */
-    if (found) {
-	res = locate_pfx(ent.mnt_mountp, dev, ino, path);
-	if (res == TRUE)
-	    return path;
+    return FALSE;
+}
+
+/*
+ * give up on all objects still searched for on the current device
+ */
+static void locate_fail(uint32 dev)
+{
+    int i;
+
+    for (i = 0; i < LOCATE_TARGETS; i++)
+	if (locate_targets[i].state == TARGET_WAIT &&
+	    locate_targets[i].dev == dev) {
+	    locate_targets[i].state = TARGET_MISSING;
+	    locate_targets[i].time = time(NULL);
+	}
+}
+
+/*
+ * start a search for the first queued object
+ */
+static void locate_start(void)
+{
+    int i;
+
+    while (locate_depth == -1) {
+	for (i = 0; i < LOCATE_TARGETS; i++)
+	    if (locate_targets[i].state == TARGET_WAIT)
+		break;
+	if (i == LOCATE_TARGETS)
+	    return;
+
+	locate_dev = locate_targets[i].dev;
+	if (locate_mount(locate_dev, locate_path) &&
+	    (locate_dirs[0] = opendir(locate_path)) != NULL) {
+	    locate_lens[0] = strlen(locate_path);
+	    locate_depth = 0;
+	} else
+	    locate_fail(locate_dev);
+    }
+}
+
+/*
+ * end the running search and start the next one
+ */
+static void locate_finish(void)
+{
+    while (locate_depth >= 0)
+	closedir(locate_dirs[locate_depth--]);
+
+    locate_fail(locate_dev);
+    locate_start();
+}
+
+/*
+ * check a directory entry against the queued objects
+ * returns TRUE if there are objects left to search for on this device
+ */
+static int locate_match(uint64 ino)
+{
+    int i, left = FALSE;
+
+    for (i = 0; i < LOCATE_TARGETS; i++) {
+	if (locate_targets[i].state != TARGET_WAIT ||
+	    locate_targets[i].dev != locate_dev)
+	    continue;
+
+	if (locate_targets[i].ino == ino) {
+	    fh_cache_add(locate_dev, ino, locate_path);
+	    locate_targets[i].state = TARGET_FREE;
+	} else
+	    left = TRUE;
     }
-#endif
 
+    return left;
+}
+
+/*
+ * advance the running search by a few directory entries
+ */
+void locate_step(void)
+{
+    struct dirent *ent;
+    backend_statstruct buf;
+    unsigned int len, n;
+    DIR *dir;
+
+    if (locate_depth == -1)
+	return;
+
+    switch_to_root();
+
+    for (n = 0; n < LOCATE_BATCH && locate_depth >= 0; n++) {
+	len = locate_lens[locate_depth];
+	locate_path[len] = 0;
+
+	ent = readdir(locate_dirs[locate_depth]);
+	if (!ent) {
+	    closedir(locate_dirs[locate_depth--]);
+	    if (locate_depth == -1)
+		locate_finish();
+	    continue;
+	}
+
+	if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+	    continue;
+	if (len + strlen(ent->d_name) + 2 >= NFS_MAXPATHLEN)
+	    continue;
+
+	sprintf(locate_path + len, "/%s", ent->d_name);
+
+	if (backend_lstat(locate_path, &buf) != 0 || buf.st_dev != locate_dev)
+	    continue;
+
+	/* check for matching object */
+	if (!locate_match(buf.st_ino)) {
+	    locate_finish();
+	    continue;
+	}
+
+	/* descend into directories with same dev */
+	if (S_ISDIR(buf.st_mode) && locate_depth + 1 < LOCATE_DEPTH) {
+	    dir = opendir(locate_path);
+	    if (dir) {
+		locate_dirs[++locate_depth] = dir;
+		locate_lens[locate_depth] = strlen(locate_path);
+	    }
+	}
+    }
+}
+
+/*
+ * check whether a search is running
+ */
+int locate_active(void)
+{
+    return locate_depth >= 0;
+}
+
+/*
+ * locate file given device and inode number
+ *
+ * slow fallback in case other filehandle resolution functions fail
+ *
+ * never finds the file right away, but queues a search and sets
+ * locate_deferred; the path ends up in the filehandle cache once found
+ */
+char *locate_file(uint32 dev, uint64 ino)
+{
+    locate_target *free = NULL;
+    time_t now;
+    int i;
+
+    locate_deferred = FALSE;
+
+    if (!opt_brute_force)
+	return NULL;
+
+    now = time(NULL);
+    for (i = 0; i < LOCATE_TARGETS; i++) {
+	if (locate_targets[i].state == TARGET_MISSING &&
+	    now - locate_targets[i].time > LOCATE_MISSING)
+	    locate_targets[i].state = TARGET_FREE;
+
+	if (locate_targets[i].state == TARGET_FREE) {
+	    if (!free)
+		free = &locate_targets[i];
+	    continue;
+	}
+
+	if (locate_targets[i].dev == dev && locate_targets[i].ino == ino) {
+	    /* recently searched for without success */
+	    if (locate_targets[i].state == TARGET_MISSING)
+		return NULL;
+
+	    locate_deferred = TRUE;
+	    return NULL;
+	}
+    }
+
+    /* too many searches pending */
+    if (!free)
+	return NULL;
+
+    free->dev = dev;
+    free->ino = ino;
+    free->state = TARGET_WAIT;
+
+    locate_start();
+
+    /* search may have failed without a mount point */
+    locate_deferred = free->state == TARGET_WAIT;
+    return NULL;
+}
+
+#else
+
+void locate_step(void)
+{
+}
+
+int locate_active(void)
+{
+    return FALSE;
+}
+
+char *locate_file(U(uint32 dev), U(uint64 ino))
+{
+    locate_deferred = FALSE;
     return NULL;
 }
+
+#endif
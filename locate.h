@@ -8,6 +8,10 @@
 #ifndef UNFS3_LOCATE_H
 #define UNFS3_LOCATE_H
 
+extern UNFS3_TLS int locate_deferred;
+
 char *locate_file(uint32 dev, uint64 ino);
+void locate_step(void);
+int locate_active(void);
 
 #endif
@@ -143,9 +143,9 @@ void *mountproc_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
 mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
 {
     char buf[PATH_MAX];
-    static unfs3_fh_t fh;
-    static mountres3 result;
-    static int auth = AUTH_UNIX;
+    static UNFS3_TLS unfs3_fh_t fh;
+    static UNFS3_TLS mountres3 result;
+    static UNFS3_TLS int auth = AUTH_UNIX;
     int authenticated = 0;
     char *password;
 
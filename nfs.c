@@ -28,6 +28,7 @@
 #ifndef WIN32
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <syslog.h>
 #endif				       /* WIN32 */
 
 #if HAVE_STATVFS == 1
@@ -40,13 +41,18 @@
 #include "mount.h"
 #include "fh.h"
 #include "fh_cache.h"
+#include "locate.h"
 #include "attr.h"
 #include "readdir.h"
 #include "user.h"
 #include "error.h"
 #include "fd_cache.h"
 #include "daemon.h"
+#include "worker.h"
+#include "zerocopy.h"
+#include "async.h"
 #include "backend.h"
+#include "stats.h"
 #include "Config/exports.h"
 #include "Extras/cluster.h"
 
@@ -62,6 +68,8 @@
                           memset(&result, 0, sizeof(result));	\
                           if (p)				\
                               result.status = NFS3ERR_ACCES;	\
+                          else if (locate_deferred)		\
+                              result.status = NFS3ERR_JUKEBOX;	\
                           else					\
                               result.status = NFS3ERR_STALE;	\
                           return &result;			\
@@ -131,12 +139,17 @@ void *nfsproc3_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
 GETATTR3res *nfsproc3_getattr_3_svc(GETATTR3args * argp,
 				    struct svc_req * rqstp)
 {
-    static GETATTR3res result;
+    static UNFS3_TLS GETATTR3res result;
     char *path;
     post_op_attr post;
 
     PREP(path, argp->object);
-    post = get_post_cached(rqstp);
+
+    /* size and times change when gathered writes are written out */
+    if (fd_flush(argp->object))
+	post = get_post_stat(path, rqstp);
+    else
+	post = get_post_cached(rqstp);
 
     result.status = NFS3_OK;
     result.GETATTR3res_u.resok.obj_attributes =
@@ -166,7 +179,7 @@ static nfsstat3 in_sync(sattrguard3 guard, pre_op_attr pre)
 SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
 				    struct svc_req * rqstp)
 {
-    static SETATTR3res result;
+    static UNFS3_TLS SETATTR3res result;
     pre_op_attr pre;
     char *path;
 
@@ -174,8 +187,11 @@ SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
     pre = get_pre_cached();
     result.status = join(in_sync(argp->guard, pre), exports_rw());
 
-    if (result.status == NFS3_OK)
+    if (result.status == NFS3_OK) {
+	fd_flush(argp->object);
 	result.status = set_attr(path, argp->object, argp->new_attributes);
+	attr_cache_inval(argp->object);
+    }
 
     /* overlaps with resfail */
     result.SETATTR3res_u.resok.obj_wcc.before = pre;
@@ -186,7 +202,7 @@ SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
 
 LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 {
-    static LOOKUP3res result;
+    static UNFS3_TLS LOOKUP3res result;
     unfs3_fh_t *fh;
     char *path;
     char obj[NFS_MAXPATHLEN];
@@ -199,11 +215,21 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 
     cluster_lookup(obj, rqstp, &result.status);
 
+    /* cluster_lookup may pick a different name for each client */
+    if (result.status == NFS3_OK && !opt_cluster &&
+	fh_cache_absent(argp->what.name)) {
+	result.status = NFS3ERR_NOENT;
+	result.LOOKUP3res_u.resok.dir_attributes = get_post_cached(rqstp);
+	return &result;
+    }
+
     if (result.status == NFS3_OK) {
-	res = backend_lstat(obj, &buf);
-	if (res == -1)
+	res = fd_dir_lstat(argp->what.dir, path, obj, &buf);
+	if (res == -1) {
 	    result.status = lookup_err();
-	else {
+	    if (result.status == NFS3ERR_NOENT && !opt_cluster)
+		fh_cache_add_absent(argp->what.name);
+	} else {
 	    if (strcmp(argp->what.name, ".") == 0 ||
 		strcmp(argp->what.name, "..") == 0) {
 		fh = fh_comp_ptr(obj, rqstp, 0);
@@ -211,6 +237,7 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 		gen = backend_get_gen(buf, FD_NONE, obj);
 		fh = fh_extend(argp->what.dir, buf.st_dev, buf.st_ino, gen);
 		fh_cache_add(buf.st_dev, buf.st_ino, obj);
+		fh_cache_set_gen(&buf, gen);
 	    }
 
 	    if (fh) {
@@ -234,14 +261,19 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 
 ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
 {
-    static ACCESS3res result;
+    static UNFS3_TLS ACCESS3res result;
     char *path;
     post_op_attr post;
     mode_t mode;
     int newaccess = 0;
 
     PREP(path, argp->object);
-    post = get_post_cached(rqstp);
+
+    /* size and times change when gathered writes are written out */
+    if (fd_flush(argp->object))
+	post = get_post_stat(path, rqstp);
+    else
+	post = get_post_cached(rqstp);
     mode = post.post_op_attr_u.attributes.mode;
 
     if (access(path, R_OK) != -1)
@@ -279,9 +311,9 @@ ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
 READLINK3res *nfsproc3_readlink_3_svc(READLINK3args * argp,
 				      struct svc_req * rqstp)
 {
-    static READLINK3res result;
+    static UNFS3_TLS READLINK3res result;
     char *path;
-    static char buf[NFS_MAXPATHLEN];
+    static UNFS3_TLS char buf[NFS_MAXPATHLEN];
     int res;
 
     PREP(path, argp->symlink);
@@ -304,18 +336,49 @@ READLINK3res *nfsproc3_readlink_3_svc(READLINK3args * argp,
     return &result;
 }
 
+/*
+ * maximum size of READ and WRITE data on a transport
+ */
+static unsigned int data_max(int socktype)
+{
+    if (socktype != SOCK_STREAM && opt_max_data > NFS_MAXDATA_UDP)
+	return NFS_MAXDATA_UDP;
+
+    return opt_max_data;
+}
+
+/*
+ * return READ buffer of this thread with room for size bytes
+ */
+static char *read_buffer(unsigned int size)
+{
+    static UNFS3_TLS char *buf = NULL;
+    static UNFS3_TLS unsigned int buf_size = 0;
+    char *new;
+
+    if (size > buf_size) {
+	new = realloc(buf, size);
+	if (!new) {
+	    logmsg(LOG_CRIT, "unable to allocate READ buffer");
+	    return NULL;
+	}
+	buf = new;
+	buf_size = size;
+    }
+
+    return buf;
+}
+
 READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 {
-    static READ3res result;
-    char *path;
-    int fd, res;
-    static char buf[NFS_MAXDATA_TCP + 1];
+    static UNFS3_TLS READ3res result;
+    char *path, *buf = NULL;
+    int fd, res, socktype;
+    backend_statstruct fbuf;
     unsigned int maxdata;
 
-    if (get_socket_type(rqstp) == SOCK_STREAM)
-	maxdata = NFS_MAXDATA_TCP;
-    else
-	maxdata = NFS_MAXDATA_UDP;
+    socktype = get_socket_type(rqstp);
+    maxdata = data_max(socktype);
 
     PREP(path, argp->file);
     result.status = is_reg();
@@ -332,20 +395,64 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 
     if (result.status == NFS3_OK) {
 	fd = fd_open(path, argp->file, UNFS3_FD_READ, TRUE);
+	if (fd != -1)
+	    fd_read_ahead(fd, argp->offset, argp->count);
+
+	/* the reply is sent when the data has been read */
+	if (fd != -1 && async_read(rqstp, argp, fd,
+				   get_post_stat(path, rqstp)))
+	    return NULL;
+
+	if (fd != -1 && socktype == SOCK_STREAM &&
+	    zerocopy_ready(rqstp, argp->count) &&
+	    backend_fstat(fd, &fbuf) != -1) {
+	    /* send the data from the file to the socket directly */
+	    if ((uint64) fbuf.st_size <= argp->offset)
+		res = 0;
+	    else if (fbuf.st_size - argp->offset > argp->count)
+		res = argp->count;
+	    else
+		res = fbuf.st_size - argp->offset;
+
+	    result.READ3res_u.resok.file_attributes =
+		get_post_buf(fbuf, rqstp);
+	    result.READ3res_u.resok.count = res;
+	    result.READ3res_u.resok.eof =
+		(argp->offset + res >= (uint64) fbuf.st_size);
+	    result.READ3res_u.resok.data.data_len = res;
+
+	    worker_unlock();
+	    zerocopy_read(rqstp, &result, fd, (off64_t)argp->offset);
+	    worker_lock();
+	    switch_restore();
+
+	    fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
+
+	    /* reply has been sent */
+	    return NULL;
+	}
+
+	/* the buffer fits the largest READ on this thread's transports */
+	if (fd != -1 && !(buf = read_buffer(maxdata + 1))) {
+	    fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
+	    fd = -1;
+	    errno = ENOMEM;
+	}
+
 	if (fd != -1) {
 	    /* read one more to check for eof */
+	    worker_unlock();
 	    res = backend_pread(fd, buf, argp->count + 1, (off64_t)argp->offset);
+	    worker_lock();
+	    switch_restore();
 
 	    /* eof if we could not read one more */
 	    result.READ3res_u.resok.eof = (res <= (int64) argp->count);
 
-	    /* close for real when hitting eof */
-	    if (result.READ3res_u.resok.eof)
-		fd_close(fd, UNFS3_FD_READ, FD_CLOSE_REAL);
-	    else {
-		fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
+	    /* keep fd open at eof, small files are often read again */
+	    fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
+	    if (!result.READ3res_u.resok.eof)
 		res--;
-	    }
 
 	    if (res >= 0) {
 		result.READ3res_u.resok.count = res;
@@ -373,9 +480,10 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 
 WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
 {
-    static WRITE3res result;
+    static UNFS3_TLS WRITE3res result;
     char *path;
     int fd, res, res_close;
+    uint64 start;
 
     PREP(path, argp->file);
     result.status = join(is_reg(), exports_rw());
@@ -392,16 +500,31 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
 	 */
 	fd = fd_open(path, argp->file, UNFS3_FD_WRITE,
 		     (argp->stable == UNSTABLE));
+
+	/* the reply is sent when the data has been written */
+	if (fd != -1 && async_write(rqstp, argp, fd))
+	    return NULL;
+
 	if (fd != -1) {
-	    res =
-		backend_pwrite(fd, argp->data.data_val, argp->data.data_len,
-			       (off64_t)argp->offset);
+	    res = fd_write(fd, argp->data.data_val, argp->data.data_len,
+			   argp->offset, argp->stable == UNSTABLE);
+	    attr_cache_inval(argp->file);
 
 	    /* close for real if not UNSTABLE write */
 	    if (argp->stable == UNSTABLE)
 		res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_VIRT);
-	    else
+	    else {
+		start = stats_now();
+		STATS_PROBE1(sync__start, path);
+
+		/* the reply is sent when the data is on disk */
+		if (res != -1 && async_stable(rqstp, argp, fd, res))
+		    return NULL;
+
 		res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_REAL);
+		STATS_PROBE1(sync__done, res_close);
+		stats_phase(STATS_SYNC, start);
+	    }
 
 	    /* we always do fsync(), never fdatasync() */
 	    if (argp->stable == DATA_SYNC)
@@ -424,6 +547,7 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
     /* overlaps with resfail */
     result.WRITE3res_u.resok.file_wcc.before = get_pre_cached();
     result.WRITE3res_u.resok.file_wcc.after = get_post_stat(path, rqstp);
+    fd_gather_attr(argp->file, &result.WRITE3res_u.resok.file_wcc.after);
 
     return &result;
 }
@@ -457,7 +581,7 @@ static int check_create_verifier(backend_statstruct * buf, createverf3 verf)
 
 CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 {
-    static CREATE3res result;
+    static UNFS3_TLS CREATE3res result;
     char *path;
     char obj[NFS_MAXPATHLEN];
     sattr3 new_attr;
@@ -483,14 +607,18 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
     /* Try to open the file */
     if (result.status == NFS3_OK) {
 	if (argp->how.mode != EXCLUSIVE) {
-	    fd = backend_open_create(obj, flags, create_mode(new_attr));
+	    fd = fd_dir_open_create(argp->where.dir, path, obj, flags,
+				    create_mode(new_attr));
 	} else {
-	    fd = backend_open_create(obj, flags, create_mode(new_attr));
+	    fd = fd_dir_open_create(argp->where.dir, path, obj, flags,
+				    create_mode(new_attr));
 	}
     }
 
     if (fd != -1) {
-	/* Successful open */
+	/* Successful open, may have truncated an existing file */
+	attr_cache_flush();
+	fh_cache_del_absent(argp->where.dir, argp->where.name);
 	res = backend_fstat(fd, &buf);
 	if (res != -1) {
 	    /* Successful stat */
@@ -563,7 +691,7 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 
 MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
 {
-    static MKDIR3res result;
+    static UNFS3_TLS MKDIR3res result;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -579,10 +707,13 @@ MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
     cluster_create(obj, rqstp, &result.status);
 
     if (result.status == NFS3_OK) {
-	res = backend_mkdir(obj, create_mode(argp->attributes));
+	res = fd_dir_mkdir(argp->where.dir, path, obj,
+			   create_mode(argp->attributes));
 	if (res == -1)
 	    result.status = mkdir_err();
 	else {
+	    attr_cache_flush();
+	    fh_cache_del_absent(argp->where.dir, argp->where.name);
 	    result.MKDIR3res_u.resok.obj =
 		fh_extend_type(argp->where.dir, obj, S_IFDIR);
 	    result.MKDIR3res_u.resok.obj_attributes = get_post_cached(rqstp);
@@ -601,7 +732,7 @@ MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
 SYMLINK3res *nfsproc3_symlink_3_svc(SYMLINK3args * argp,
 				    struct svc_req * rqstp)
 {
-    static SYMLINK3res result;
+    static UNFS3_TLS SYMLINK3res result;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -633,6 +764,8 @@ SYMLINK3res *nfsproc3_symlink_3_svc(SYMLINK3args * argp,
 	if (res == -1)
 	    result.status = symlink_err();
 	else {
+	    attr_cache_flush();
+	    fh_cache_del_absent(argp->where.dir, argp->where.name);
 	    result.SYMLINK3res_u.resok.obj =
 		fh_extend_type(argp->where.dir, obj, S_IFLNK);
 	    result.SYMLINK3res_u.resok.obj_attributes =
@@ -724,7 +857,7 @@ static nfsstat3 mknod_args(mknoddata3 what, const char *obj, mode_t * mode,
 
 MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
 {
-    static MKNOD3res result;
+    static UNFS3_TLS MKNOD3res result;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -752,6 +885,8 @@ MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
 	if (res == -1) {
 	    result.status = mknod_err();
 	} else {
+	    attr_cache_flush();
+	    fh_cache_del_absent(argp->where.dir, argp->where.name);
 	    result.MKNOD3res_u.resok.obj =
 		fh_extend_type(argp->where.dir, obj,
 			       type_to_mode(argp->what.type));
@@ -770,7 +905,7 @@ MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
 
 REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
 {
-    static REMOVE3res result;
+    static UNFS3_TLS REMOVE3res result;
     char *path;
     char obj[NFS_MAXPATHLEN];
     int res;
@@ -783,9 +918,11 @@ REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
 
     if (result.status == NFS3_OK) {
         change_readdir_cookie();
-	res = backend_remove(obj);
+	res = fd_dir_remove(argp->object.dir, path, obj);
 	if (res == -1)
 	    result.status = remove_err();
+	else
+	    attr_cache_flush();
     }
 
     /* overlaps with resfail */
@@ -797,7 +934,7 @@ REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
 
 RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
 {
-    static RMDIR3res result;
+    static UNFS3_TLS RMDIR3res result;
     char *path;
     char obj[NFS_MAXPATHLEN];
     int res;
@@ -810,9 +947,11 @@ RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
 
     if (result.status == NFS3_OK) {
         change_readdir_cookie();
-	res = backend_rmdir(obj);
+	res = fd_dir_rmdir(argp->object.dir, path, obj);
 	if (res == -1)
 	    result.status = rmdir_err();
+	else
+	    attr_cache_flush();
     }
 
     /* overlaps with resfail */
@@ -824,7 +963,7 @@ RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
 
 RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
 {
-    static RENAME3res result;
+    static UNFS3_TLS RENAME3res result;
     char *from;
     char *to;
     char from_obj[NFS_MAXPATHLEN];
@@ -854,6 +993,11 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
 	    res = backend_rename(from_obj, to_obj);
 	    if (res == -1)
 		result.status = rename_err();
+	    else {
+		attr_cache_flush();
+		fh_cache_rename(from_obj, to_obj);
+		fh_cache_del_absent(argp->to.dir, argp->to.name);
+	    }
 	}
     }
 
@@ -870,7 +1014,7 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
 
 LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
 {
-    static LINK3res result;
+    static UNFS3_TLS LINK3res result;
     char *path, *old;
     pre_op_attr pre;
     post_op_attr post;
@@ -892,6 +1036,10 @@ LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
 	    res = backend_link(old, obj);
 	    if (res == -1)
 		result.status = link_err();
+	    else {
+		attr_cache_flush();
+		fh_cache_del_absent(argp->link.dir, argp->link.name);
+	    }
 	}
     } else if (!old)
 	result.status = NFS3ERR_STALE;
@@ -906,39 +1054,57 @@ LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
     return &result;
 }
 
+/*
+ * maximum size of READDIR replies on the transport of a request
+ */
+static count3 readdir_max(struct svc_req *rqstp)
+{
+    unsigned int maxdata;
+
+    if (get_socket_type(rqstp) == SOCK_STREAM)
+	maxdata = NFS_MAXDATA_TCP;
+    else
+	maxdata = NFS_MAXDATA_UDP;
+
+    return opt_readdir_size < maxdata ? opt_readdir_size : maxdata;
+}
+
 READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp,
 				    struct svc_req * rqstp)
 {
-    static READDIR3res result;
+    static UNFS3_TLS READDIR3res result;
     char *path;
+    count3 max = readdir_max(rqstp);
 
     PREP(path, argp->dir);
 
-    result = read_dir(path, argp->cookie, argp->cookieverf, argp->count);
+    result = read_dir(path, argp->cookie, argp->cookieverf,
+		      argp->count < max ? argp->count : max);
     result.READDIR3res_u.resok.dir_attributes = get_post_stat(path, rqstp);
 
     return &result;
 }
 
-READDIRPLUS3res *nfsproc3_readdirplus_3_svc(U(READDIRPLUS3args * argp),
-					    U(struct svc_req * rqstp))
+READDIRPLUS3res *nfsproc3_readdirplus_3_svc(READDIRPLUS3args * argp,
+					    struct svc_req * rqstp)
 {
-    static READDIRPLUS3res result;
+    static UNFS3_TLS READDIRPLUS3res result;
+    char *path;
+    count3 max = readdir_max(rqstp);
 
-    /* 
-     * we don't do READDIRPLUS since it involves filehandle and
-     * attribute getting which is impossible to do atomically
-     * from user-space
-     */
-    result.status = NFS3ERR_NOTSUPP;
-    result.READDIRPLUS3res_u.resfail.dir_attributes.attributes_follow = FALSE;
+    PREP(path, argp->dir);
+
+    result = read_dirplus(path, argp->dir, argp->cookie, argp->cookieverf,
+			  argp->dircount < max ? argp->dircount : max,
+			  argp->maxcount < max ? argp->maxcount : max, rqstp);
+    result.READDIRPLUS3res_u.resok.dir_attributes = get_post_stat(path, rqstp);
 
     return &result;
 }
 
 FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, struct svc_req * rqstp)
 {
-    static FSSTAT3res result;
+    static UNFS3_TLS FSSTAT3res result;
     char *path;
     backend_statvfsstruct buf;
     int res;
@@ -984,14 +1150,11 @@ FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, struct svc_req * rqstp)
 
 FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
 {
-    static FSINFO3res result;
+    static UNFS3_TLS FSINFO3res result;
     char *path;
     unsigned int maxdata;
 
-    if (get_socket_type(rqstp) == SOCK_STREAM)
-	maxdata = NFS_MAXDATA_TCP;
-    else
-	maxdata = NFS_MAXDATA_UDP;
+    maxdata = data_max(get_socket_type(rqstp));
 
     PREP(path, argp->fsroot);
 
@@ -1004,7 +1167,7 @@ FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
     result.FSINFO3res_u.resok.wtmax = maxdata;
     result.FSINFO3res_u.resok.wtpref = maxdata;
     result.FSINFO3res_u.resok.wtmult = 4096;
-    result.FSINFO3res_u.resok.dtpref = 4096;
+    result.FSINFO3res_u.resok.dtpref = readdir_max(rqstp);
     result.FSINFO3res_u.resok.maxfilesize = ~0ULL;
     result.FSINFO3res_u.resok.time_delta.seconds = backend_time_delta_seconds;
     result.FSINFO3res_u.resok.time_delta.nseconds = 0;
@@ -1016,7 +1179,7 @@ FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
 PATHCONF3res *nfsproc3_pathconf_3_svc(PATHCONF3args * argp,
 				      struct svc_req * rqstp)
 {
-    static PATHCONF3res result;
+    static UNFS3_TLS PATHCONF3res result;
     char *path;
 
     PREP(path, argp->object);
@@ -1037,15 +1200,25 @@ PATHCONF3res *nfsproc3_pathconf_3_svc(PATHCONF3args * argp,
 
 COMMIT3res *nfsproc3_commit_3_svc(COMMIT3args * argp, struct svc_req * rqstp)
 {
-    static COMMIT3res result;
+    static UNFS3_TLS COMMIT3res result;
     char *path;
     int res;
+    uint64 start;
 
     PREP(path, argp->file);
     result.status = join(is_reg(), exports_rw());
 
     if (result.status == NFS3_OK) {
-	res = fd_sync(argp->file);
+	start = stats_now();
+	STATS_PROBE1(sync__start, path);
+
+	/* the reply is sent when the data is on disk */
+	if (async_commit(rqstp, argp, &res))
+	    return NULL;
+
+	STATS_PROBE1(sync__done, res);
+	stats_phase(STATS_SYNC, start);
+	attr_cache_inval(argp->file);
 	if (res != -1)
 	    memcpy(result.COMMIT3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
 	else
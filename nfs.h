@@ -13,6 +13,15 @@
 #define U(x) x
 #endif
 
+/* worker threads need thread local storage for per-request state */
+#if defined(__GNUC__) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_SVC_GETREQ_POLL) && defined(HAVE_SVC_GETREQ_COMMON)
+#define UNFS3_WORKERS 1
+#define UNFS3_TLS __thread
+#else
+#define UNFS3_TLS
+#endif
+
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
@@ -22,7 +31,8 @@
 #define UNIX_PATH_MAX 108
 
 #define NFS_PORT 2049
-#define NFS_MAXDATA_TCP 524288
+#define NFS_MAXDATA_TCP 1048576	/* upper limit of -S */
+#define NFS_MAXDATA_MIN 4096
 #define NFS_MAXDATA_UDP 32768
 #define NFS_MAX_UDP_PACKET (NFS_MAXDATA_UDP + 4096) /* The extra 4096 bytes are for the RPC header */
 #define NFS_MAXPATHLEN 1024
@@ -16,22 +16,33 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "nfs.h"
 #include "mount.h"
 #include "fh.h"
+#include "fh_cache.h"
+#include "attr.h"
 #include "readdir.h"
 #include "backend.h"
+#include "user.h"
 #include "Config/exports.h"
 #include "daemon.h"
 #include "error.h"
 
 /*
- * maximum number of entries in readdir results
+ * maximum number of entries in readdir results of a given size
  *
- * this is 4096 / 28 (the minimum size of an entry3)
+ * 28 is the minimum size of an entry3, one more entry is read before
+ * noticing that it does not fit
  */
-#define MAX_ENTRIES 143
+#define MAX_ENTRIES(count) ((count) / 28 + 1)
 
 /*
  * static READDIR3resok size with XDR overhead
@@ -55,7 +66,198 @@
  */
 #define NAME_SIZE(x) (((strlen((x))+3)/4)*4)
 
-uint32 directory_hash(const char *path)
+/*
+ * on Unix, READDIR takes file ids straight from the directory entries and
+ * READDIRPLUS looks up entries relative to the open directory, instead of
+ * going through the full path of every entry
+ *
+ * like the kernel NFS server, this reports the id of the directory that
+ * is mounted over for a mount point
+ */
+#if !defined(WIN32) && !defined(AFS_SUPPORT)
+#ifdef HAVE_STRUCT_DIRENT_D_INO
+#define DIR_INO 1
+#endif
+#if defined(HAVE_FSTATAT) && defined(HAVE_DIRFD)
+#define DIR_STATAT 1
+#endif
+#endif
+
+#if defined(WIN32) || defined(AFS_SUPPORT)
+/* See comment in attr.c:get_post_buf */
+#define FILEID(ino) (((ino) >> 32) ^ ((ino) & 0xffffffff))
+#else
+#define FILEID(ino) (ino)
+#endif
+
+/*
+ * entryplus3 size in addition to entry3 with XDR overhead
+ *
+ * 88 bytes attributes, 4 bytes handle_follows, 4 bytes handle length,
+ * followed by the handle itself
+ */
+#define PLUS_SIZE(fhlen) (96 + (((fhlen)+3)/4)*4)
+
+/*
+ * buffers for results, grown to fit the largest request seen by a thread
+ *
+ * every name takes at most one byte more than it accounts for in the
+ * reply, except for the one entry that does not fit anymore
+ */
+static UNFS3_TLS unsigned int dir_max = 0;
+static UNFS3_TLS unsigned int dir_plus_max = 0;
+static UNFS3_TLS entry3 *dir_entry = NULL;
+static UNFS3_TLS char *dir_names = NULL;
+static UNFS3_TLS entryplus3 *dir_plus = NULL;
+static UNFS3_TLS unfs3_fh_t *dir_fh = NULL;
+
+/* attributes of the entries returned by the last read_dir_entries */
+static UNFS3_TLS backend_statstruct *dir_stat = NULL;
+
+/*
+ * directory streams kept open after a READDIR, so that the request for
+ * the next part of the directory can continue reading where the last one
+ * stopped instead of skipping all entries already returned
+ *
+ * a stream is found by the directory and the cookie of the last entry
+ * returned; since the upper part of the cookie changes with rcookie,
+ * streams are no longer found once entries may have disappeared
+ *
+ * the read permission for the directory was checked on opendir with the
+ * ids of the request that opened the stream, so streams are only used
+ * again by requests with the same ids
+ */
+#define DIR_STREAMS 16
+
+/* seconds after which an unused stream is closed, as for the fd cache */
+#define DIR_STREAM_TIMEOUT 2
+
+typedef struct {
+    backend_dirstream *search;	/* open stream, NULL if slot unused */
+    struct dirent *next;	/* next entry to return, already read */
+    uint32 dev;			/* device of directory */
+    uint64 ino;			/* inode of directory */
+    cookie3 cookie;		/* cookie of last entry returned */
+    user_cred_t cred;		/* ids of the request that opened it */
+    time_t use;			/* last use */
+} dir_stream_t;
+
+static dir_stream_t dir_streams[DIR_STREAMS];
+
+/*
+ * hashes of the names in removable export points
+ *
+ * an unchanged hash is checked on every access to the export point, so
+ * hashes are kept and only computed again when inotify reports a change
+ * of names in the directory, or when something else has been mounted
+ * there; without inotify, a hash is trusted for DIR_HASH_TIMEOUT seconds
+ */
+#define DIR_HASHES 16
+#define DIR_HASH_TIMEOUT 2
+
+typedef struct {
+    char path[NFS_MAXPATHLEN];	/* directory, empty if slot unused */
+    uint64 dev;			/* device of directory when hashed */
+    uint64 ino;			/* inode of directory when hashed */
+    int wd;			/* inotify watch, -1 if none */
+    int dirty;			/* names changed since hashed */
+    uint32 hash;		/* hash of names */
+    time_t time;		/* time of hashing */
+    time_t use;			/* last use */
+} dir_hash_t;
+
+static dir_hash_t dir_hashes[DIR_HASHES];
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* inotify instance, -1 before first use, -2 if not available */
+static int dir_notify = -1;
+
+/*
+ * mark directories changed according to pending notifications
+ */
+static void dir_hash_events(void)
+{
+    union {
+	struct inotify_event ev;
+	char buf[4096];
+    } u;
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int i;
+
+    if (dir_notify == -1) {
+	dir_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (dir_notify == -1)
+	    dir_notify = -2;
+    }
+    if (dir_notify < 0)
+	return;
+
+    while ((len = read(dir_notify, u.buf, sizeof(u.buf))) > 0)
+	for (p = u.buf; p < u.buf + len;
+	     p += sizeof(struct inotify_event) + ev->len) {
+	    ev = (struct inotify_event *) p;
+	    for (i = 0; i < DIR_HASHES; i++) {
+		if (ev->mask & IN_Q_OVERFLOW)
+		    dir_hashes[i].dirty = TRUE;
+		else if (dir_hashes[i].wd == ev->wd) {
+		    dir_hashes[i].dirty = TRUE;
+		    if (ev->mask & IN_IGNORED)
+			dir_hashes[i].wd = -1;
+		}
+	    }
+	}
+}
+
+/*
+ * watch a directory for changes of names
+ */
+static void dir_hash_watch(dir_hash_t * e)
+{
+    if (dir_notify >= 0 && e->wd == -1)
+	e->wd = inotify_add_watch(dir_notify, e->path,
+				  IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+				  IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+				  IN_ONLYDIR);
+}
+
+/*
+ * stop watching a directory
+ */
+static void dir_hash_unwatch(dir_hash_t * e)
+{
+    int i;
+
+    if (e->wd == -1)
+	return;
+
+    /* watches of the same directory are shared */
+    for (i = 0; i < DIR_HASHES; i++)
+	if (&dir_hashes[i] != e && dir_hashes[i].wd == e->wd)
+	    break;
+    if (i == DIR_HASHES)
+	inotify_rm_watch(dir_notify, e->wd);
+    e->wd = -1;
+}
+#else
+static void dir_hash_events(void)
+{
+}
+
+static void dir_hash_watch(U(dir_hash_t * e))
+{
+}
+
+static void dir_hash_unwatch(U(dir_hash_t * e))
+{
+}
+#endif				       /* HAVE_SYS_INOTIFY_H */
+
+/*
+ * hash the names in a directory
+ */
+static uint32 dir_hash_scan(const char *path)
 {
     backend_dirstream *search;
     struct dirent *this;
@@ -74,25 +276,248 @@ uint32 directory_hash(const char *path)
     return hval;
 }
 
+uint32 directory_hash(const char *path)
+{
+    backend_statstruct buf;
+    dir_hash_t *e = NULL;
+    time_t now;
+    int i;
+
+    if (backend_stat(path, &buf) == -1 || strlen(path) >= NFS_MAXPATHLEN)
+	return dir_hash_scan(path);
+
+    dir_hash_events();
+    now = time(NULL);
+
+    for (i = 0; i < DIR_HASHES; i++)
+	if (strcmp(dir_hashes[i].path, path) == 0) {
+	    e = &dir_hashes[i];
+	    break;
+	}
+
+    if (e && e->dev == buf.st_dev && e->ino == buf.st_ino && !e->dirty &&
+	(e->wd != -1 || (now >= e->time && now < e->time + DIR_HASH_TIMEOUT))) {
+	e->use = now;
+	return e->hash;
+    }
+
+    if (!e) {
+	/* replace least recently used entry */
+	e = &dir_hashes[0];
+	for (i = 1; i < DIR_HASHES; i++)
+	    if (dir_hashes[i].use < e->use)
+		e = &dir_hashes[i];
+	if (e->path[0])
+	    dir_hash_unwatch(e);
+	else
+	    e->wd = -1;
+	strcpy(e->path, path);
+    } else if (e->dev != buf.st_dev || e->ino != buf.st_ino)
+	/* another filesystem has been mounted, or the directory replaced */
+	dir_hash_unwatch(e);
+
+    /* watch before reading, changes while reading are noticed later */
+    dir_hash_watch(e);
+    e->dev = buf.st_dev;
+    e->ino = buf.st_ino;
+    e->dirty = FALSE;
+    e->hash = dir_hash_scan(path);
+    e->time = now;
+    e->use = now;
+
+    return e->hash;
+}
+
 /*
- * perform a READDIR operation
+ * take the stream positioned after a given cookie out of the cache
+ */
+static backend_dirstream *dir_stream_get(uint32 dev, uint64 ino,
+					 cookie3 cookie, struct dirent **next)
+{
+    int i;
+    backend_dirstream *search;
+    user_cred_t cred;
+
+    get_cred(&cred);
+
+    for (i = 0; i < DIR_STREAMS; i++)
+	if (dir_streams[i].search && dir_streams[i].cookie == cookie &&
+	    dir_streams[i].dev == dev && dir_streams[i].ino == ino &&
+	    same_cred(&dir_streams[i].cred, &cred)) {
+	    search = dir_streams[i].search;
+	    *next = dir_streams[i].next;
+	    dir_streams[i].search = NULL;
+	    return search;
+	}
+
+    return NULL;
+}
+
+/*
+ * put a stream into the cache, replacing the least recently used one
+ */
+static void dir_stream_put(uint32 dev, uint64 ino, cookie3 cookie,
+			   backend_dirstream *search, struct dirent *next)
+{
+    int i, idx = 0;
+
+    for (i = 0; i < DIR_STREAMS; i++) {
+	if (!dir_streams[i].search) {
+	    idx = i;
+	    break;
+	}
+	if (dir_streams[i].use < dir_streams[idx].use)
+	    idx = i;
+    }
+
+    if (dir_streams[idx].search)
+	backend_closedir(dir_streams[idx].search);
+
+    dir_streams[idx].search = search;
+    dir_streams[idx].next = next;
+    dir_streams[idx].dev = dev;
+    dir_streams[idx].ino = ino;
+    dir_streams[idx].cookie = cookie;
+    get_cred(&dir_streams[idx].cred);
+    dir_streams[idx].use = time(NULL);
+}
+
+/*
+ * close directory streams which have not been used for a while
+ */
+void readdir_close_inactive(void)
+{
+    int i;
+    time_t now = time(NULL);
+
+    for (i = 0; i < DIR_STREAMS; i++)
+	if (dir_streams[i].search &&
+	    dir_streams[i].use + DIR_STREAM_TIMEOUT < now) {
+	    backend_closedir(dir_streams[i].search);
+	    dir_streams[i].search = NULL;
+	}
+}
+
+/*
+ * resize a result buffer
+ */
+static int dir_grow(void *buf, size_t size)
+{
+    void *new;
+
+    new = realloc(*(void **) buf, size);
+    if (!new) {
+	logmsg(LOG_CRIT, "read_dir: Unable to allocate memory");
+	return FALSE;
+    }
+
+    *(void **) buf = new;
+    return TRUE;
+}
+
+/*
+ * make room for a given number of entries in READDIR results
+ */
+static int dir_buffers(unsigned int max)
+{
+    if (max <= dir_max)
+	return TRUE;
+
+    if (!dir_grow(&dir_entry, sizeof(entry3) * max) ||
+	!dir_grow(&dir_stat, sizeof(backend_statstruct) * max) ||
+	!dir_grow(&dir_names, 29 * max + NFS_MAXPATHLEN))
+	return FALSE;
+
+    dir_max = max;
+    return TRUE;
+}
+
+/*
+ * make room for a given number of entries in READDIRPLUS results
+ */
+static int dir_plus_buffers(unsigned int max)
+{
+    if (max <= dir_plus_max)
+	return TRUE;
+
+    if (!dir_grow(&dir_plus, sizeof(entryplus3) * max) ||
+	!dir_grow(&dir_fh, sizeof(unfs3_fh_t) * max))
+	return FALSE;
+
+    dir_plus_max = max;
+    return TRUE;
+}
+
+/*
+ * get attributes of a directory entry
+ */
+static int dir_lstat(U(backend_dirstream *search), U(const char *path),
+		     const char *name, backend_statstruct *buf)
+{
+#ifdef DIR_STATAT
+    return fstatat(dirfd(search), name, buf, AT_SYMLINK_NOFOLLOW);
+#else
+    char scratch[NFS_MAXPATHLEN];
+
+#ifdef BACKEND_DIRSTAT
+    /* attributes may have been read along with the entry */
+    if (backend_dirstat(search, name, buf) == 0)
+	return 0;
+#endif
+
+    if (strcmp(path, "/") == 0)
+	sprintf(scratch, "/%s", name);
+    else
+	sprintf(scratch, "%s/%s", path, name);
+
+    return backend_lstat(scratch, buf);
+#endif
+}
+
+/*
+ * get file id of a directory entry
+ */
+static int dir_fileid(U(backend_dirstream *search), U(const char *path),
+		      struct dirent *this, fileid3 *fileid)
+{
+#ifdef DIR_INO
+    *fileid = this->d_ino;
+    return 0;
+#else
+    backend_statstruct buf;
+
+    if (dir_lstat(search, path, this->d_name, &buf) == -1)
+	return -1;
+
+    *fileid = FILEID(buf.st_ino);
+    return 0;
+#endif
+}
+
+/*
+ * read directory entries, leaving their attributes in dir_stat if
+ * requested
  *
- * fh_decomp must be called directly before to fill the stat cache
+ * count limits the size of the entry3 list, maxcount the size of the
+ * reply if every entry is accompanied by extra bytes
  */
-READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
-		     count3 count)
+static READDIR3res read_dir_entries(const char *path, cookie3 cookie,
+				    cookieverf3 verf, count3 count,
+				    count3 maxcount, count3 extra, int attrs)
 {
     READDIR3res result;
     READDIR3resok resok;
     cookie3 upper;
-    static entry3 entry[MAX_ENTRIES];
-    backend_statstruct buf;
+    entry3 *entry;
+    char *name;
     int res;
     backend_dirstream *search;
     struct dirent *this;
-    count3 i, real_count;
-    static char obj[NFS_MAXPATHLEN * MAX_ENTRIES];
-    char scratch[NFS_MAXPATHLEN];
+    count3 i, real_count, real_max;
+    int keep = st_cache_valid;
+    uint32 dev = st_cache.st_dev;
+    uint64 ino = st_cache.st_ino;
+    entry3 *last;
 
     /* check upper part of cookie */
     upper = cookie & 0xFFFFFFFF00000000ULL;
@@ -102,12 +527,16 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
     }
     cookie &= 0xFFFFFFFFULL;
 
-    /* we refuse to return more than 4k from READDIR */
-    if (count > 4096)
-	count = 4096;
+    if (!dir_buffers(MAX_ENTRIES(count))) {
+	result.status = NFS3ERR_IO;
+	return result;
+    }
+    entry = dir_entry;
+    name = dir_names;
 
     /* account for size of information heading resok structure */
     real_count = RESOK_SIZE;
+    real_max = RESOK_SIZE;
 
     /* We are always returning zero as a cookie verifier. One reason for this 
        is that stat() on Windows seems to return cached st_mtime values,
@@ -120,67 +549,70 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
        in the cookieverifier field." */
     memset(verf, 0, NFS3_COOKIEVERFSIZE);
 
-    search = backend_opendir(path);
+    /* continue a previous READDIR if possible */
+    search = NULL;
+    if (cookie != 0 && keep)
+	search = dir_stream_get(dev, ino, cookie | rcookie, &this);
+
     if (!search) {
-	if ((exports_opts & OPT_REMOVABLE) && (export_point(path))) {
-	    /* Removable media export point; probably no media inserted.
-	       Return empty directory. */
-	    memset(resok.cookieverf, 0, NFS3_COOKIEVERFSIZE);
-	    resok.reply.entries = NULL;
-	    resok.reply.eof = TRUE;
-	    result.status = NFS3_OK;
-	    result.READDIR3res_u.resok = resok;
-	    return result;
-	} else {
-	    result.status = readdir_err();
-	    return result;
+	search = backend_opendir(path);
+	if (!search) {
+	    if ((exports_opts & OPT_REMOVABLE) && (export_point(path))) {
+		/* Removable media export point; probably no media inserted.
+		   Return empty directory. */
+		memset(resok.cookieverf, 0, NFS3_COOKIEVERFSIZE);
+		resok.reply.entries = NULL;
+		resok.reply.eof = TRUE;
+		result.status = NFS3_OK;
+		result.READDIR3res_u.resok = resok;
+		return result;
+	    } else {
+		result.status = readdir_err();
+		return result;
+	    }
 	}
-    }
 
-    this = backend_readdir(search);
-    /* We cannot use telldir()/seekdir(), since the value from telldir() is
-       not valid after closedir(). */
-    for (i = 0; i < cookie; i++)
-	if (this)
-	    this = backend_readdir(search);
+	this = backend_readdir(search);
+	/* We cannot use telldir()/seekdir(), since the value from telldir()
+	   is not valid after closedir(). */
+	for (i = 0; i < cookie; i++)
+	    if (this)
+		this = backend_readdir(search);
+    }
 
     i = 0;
     entry[0].name = NULL;
-    while (this && real_count < count && i < MAX_ENTRIES) {
+    while (this && real_count < count && real_max < maxcount &&
+	   i < MAX_ENTRIES(count)) {
 	if (i > 0)
 	    entry[i - 1].nextentry = &entry[i];
 
 	if (strlen(path) + strlen(this->d_name) + 1 < NFS_MAXPATHLEN) {
 
-	    if (strcmp(path, "/") == 0)
-		sprintf(scratch, "/%s", this->d_name);
-	    else
-		sprintf(scratch, "%s/%s", path, this->d_name);
+	    if (attrs) {
+		res = dir_lstat(search, path, this->d_name, &dir_stat[i]);
+		entry[i].fileid = FILEID(dir_stat[i].st_ino);
+	    } else
+		res = dir_fileid(search, path, this, &entry[i].fileid);
 
-	    res = backend_lstat(scratch, &buf);
 	    if (res == -1) {
 		result.status = readdir_err();
 		backend_closedir(search);
 		return result;
 	    }
 
-	    strcpy(&obj[i * NFS_MAXPATHLEN], this->d_name);
-
-#if defined(WIN32) || defined(AFS_SUPPORT)
-	    /* See comment in attr.c:get_post_buf */
-	    entry[i].fileid = (buf.st_ino >> 32) ^ (buf.st_ino & 0xffffffff);
-#else
-	    entry[i].fileid = buf.st_ino;
-#endif
-	    entry[i].name = &obj[i * NFS_MAXPATHLEN];
+	    strcpy(name, this->d_name);
+	    entry[i].name = name;
+	    name += strlen(name) + 1;
 	    entry[i].cookie = (cookie + 1 + i) | rcookie;
 	    entry[i].nextentry = NULL;
 
 	    /* account for entry size */
 	    real_count += ENTRY_SIZE + NAME_SIZE(this->d_name);
+	    real_max += ENTRY_SIZE + NAME_SIZE(this->d_name) + extra;
 
 	    /* whoops, overflowed the maximum size */
-	    if (real_count > count && i > 0)
+	    if ((real_count > count || real_max > maxcount) && i > 0)
 		entry[i - 1].nextentry = NULL;
 	    else {
 		/* advance to next entry */
@@ -194,13 +626,20 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
 	    return result;
 	}
     }
-    backend_closedir(search);
 
     if (entry[0].name)
 	resok.reply.entries = &entry[0];
     else
 	resok.reply.entries = NULL;
 
+    /* keep stream open for the next part of the directory */
+    if (this && keep && resok.reply.entries) {
+	for (last = resok.reply.entries; last->nextentry;
+	     last = last->nextentry);
+	dir_stream_put(dev, ino, last->cookie, search, this);
+    } else
+	backend_closedir(search);
+
     if (this)
 	resok.reply.eof = FALSE;
     else
@@ -213,3 +652,110 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
 
     return result;
 }
+
+/*
+ * perform a READDIR operation
+ *
+ * fh_decomp must be called directly before to fill the stat cache
+ * count must be limited to the largest reply the transport can handle
+ */
+READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
+		     count3 count)
+{
+    return read_dir_entries(path, cookie, verf, count, count, 0, FALSE);
+}
+
+/*
+ * perform a READDIRPLUS operation
+ *
+ * the attributes come from read_dir_entries, handles are built by extending the directory handle
+ *
+ * maxcount must be limited to the largest reply the transport can handle
+ */
+READDIRPLUS3res read_dirplus(const char *path, nfs_fh3 dir, cookie3 cookie,
+			     cookieverf3 verf, count3 dircount,
+			     count3 maxcount, struct svc_req *req)
+{
+    READDIRPLUS3res result;
+    READDIR3res res;
+    entryplus3 *plus;
+    unfs3_fh_t *fh;
+    entry3 *this;
+    entryplus3 *last = NULL;
+    char scratch[NFS_MAXPATHLEN];
+    uint32 gen;
+    int i;
+
+    if (!dir_plus_buffers(MAX_ENTRIES(dircount))) {
+	result.status = NFS3ERR_IO;
+	return result;
+    }
+    plus = dir_plus;
+
+    /* handles of entries are one level deeper than the directory handle */
+    fh = (void *) dir.data.data_val;
+    res = read_dir_entries(path, cookie, verf, dircount, maxcount,
+			   PLUS_SIZE(fh->len ? fh_length(fh) + 1 :
+				     sizeof(unfs3_fh_t)), TRUE);
+
+    result.status = res.status;
+    if (res.status != NFS3_OK)
+	return result;
+
+    result.READDIRPLUS3res_u.resok.reply.entries = NULL;
+    for (this = res.READDIR3res_u.resok.reply.entries; this;
+	 this = this->nextentry) {
+	i = this - res.READDIR3res_u.resok.reply.entries;
+
+	plus[i].fileid = this->fileid;
+	plus[i].name = this->name;
+	plus[i].cookie = this->cookie;
+	plus[i].name_attributes = get_post_buf(dir_stat[i], req);
+	attr_cache_add(dir_stat[i]);
+	plus[i].name_handle.handle_follows = FALSE;
+	plus[i].nextentry = NULL;
+
+	/* clients resolve . and .. themselves */
+	if (strcmp(this->name, ".") != 0 && strcmp(this->name, "..") != 0) {
+	    if (strcmp(path, "/") == 0)
+		sprintf(scratch, "/%s", this->name);
+	    else
+		sprintf(scratch, "%s/%s", path, this->name);
+
+	    gen = backend_get_gen(dir_stat[i], FD_NONE, scratch);
+	    fh = fh_extend(dir, dir_stat[i].st_dev, dir_stat[i].st_ino,
+			   gen);
+	    if (fh) {
+		memcpy(&dir_fh[i], fh, fh_length(fh));
+		plus[i].name_handle.handle_follows = TRUE;
+		plus[i].name_handle.post_op_fh3_u.handle.data.data_len =
+		    fh_length(fh);
+		plus[i].name_handle.post_op_fh3_u.handle.data.data_val =
+		    (char *) &dir_fh[i];
+	    }
+	}
+
+	if (last)
+	    last->nextentry = &plus[i];
+	else
+	    result.READDIRPLUS3res_u.resok.reply.entries = &plus[i];
+	last = &plus[i];
+    }
+
+    fh_cache_add_dir(path, result.READDIRPLUS3res_u.resok.reply.entries);
+
+    /* remember generation numbers of the entries now in the cache */
+    for (this = res.READDIR3res_u.resok.reply.entries; this;
+	 this = this->nextentry) {
+	i = this - res.READDIR3res_u.resok.reply.entries;
+	if (plus[i].name_handle.handle_follows)
+	    fh_cache_set_gen(&dir_stat[i], dir_fh[i].gen);
+    }
+
+    result.READDIRPLUS3res_u.resok.reply.eof =
+	res.READDIR3res_u.resok.reply.eof;
+    memcpy(result.READDIRPLUS3res_u.resok.cookieverf,
+	   res.READDIR3res_u.resok.cookieverf, NFS3_COOKIEVERFSIZE);
+
+    return result;
+}
@@ -7,8 +7,16 @@
 #ifndef UNFS3_READDIR_H
 #define UNFS3_READDIR_H
 
+/* default and minimum size of READDIR replies */
+#define READDIR_SIZE	NFS_MAXDATA_UDP
+#define READDIR_MIN	1024
+
 READDIR3res
 read_dir(const char *path, cookie3 cookie, cookieverf3 verf, count3 count);
+READDIRPLUS3res
+read_dirplus(const char *path, nfs_fh3 dir, cookie3 cookie, cookieverf3 verf,
+	     count3 dircount, count3 maxcount, struct svc_req *req);
 uint32 directory_hash(const char *path);
+void readdir_close_inactive(void);
 
 #endif
@@ -0,0 +1,567 @@
+/*
+ * UNFS3 server statistics
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "drc.h"
+#include "fd_cache.h"
+#include "fh.h"
+#include "fh_cache.h"
+#include "event.h"
+#include "worker.h"
+#include "stats.h"
+
+/*
+ * every NFS request is timed from the start of its dispatch until its
+ * reply has been sent, and counted in a latency histogram of its
+ * procedure; the histograms and the counters of the caches are served
+ * in the Prometheus text format on a Unix socket
+ *
+ * requests taking longer than the slow request threshold are logged
+ * along with the time spent resolving filehandles and flushing data
+ *
+ * all counters are updated with the server lock held
+ */
+
+/* upper bound of the first latency bucket in microseconds, others grow
+   by a factor of 4 */
+#define STATS_FIRST	8
+
+static const char *stats_names[STATS_PROCS] = {
+    "null", "getattr", "setattr", "lookup", "access", "readlink", "read",
+    "write", "create", "mkdir", "symlink", "mknod", "remove", "rmdir",
+    "rename", "link", "readdir", "readdirplus", "fsstat", "fsinfo",
+    "pathconf", "commit"
+};
+
+/* ways of resolving filehandles, from STATS_EXPORT to FH_MISS_FAILED */
+static const char *stats_ways[FH_MISS_KINDS - STATS_EXPORT] = {
+    "export", "cache", "handle", "index", "search", "locate", "failed"
+};
+
+static uint64 stats_count[STATS_PROCS];
+static uint64 stats_usec[STATS_PROCS];
+static uint64 stats_bucket[STATS_PROCS][STATS_BUCKETS];
+
+/* requests are only timed while statistics are served or slow requests
+   are logged */
+static int stats_fd = -1;
+
+/* request being handled by this thread */
+static UNFS3_TLS uint64 stats_start;
+static UNFS3_TLS uint64 stats_phases[STATS_PHASES];
+
+/* slowest way a filehandle of the request was resolved, and its path */
+static UNFS3_TLS int stats_way;
+static UNFS3_TLS char stats_way_path[NFS_MAXPATHLEN];
+
+/*
+ * current time in microseconds, 0 if requests are not timed
+ */
+uint64 stats_now(void)
+{
+    struct timeval now;
+
+    if (stats_fd < 0 && opt_slow_time == 0)
+	return 0;
+
+    gettimeofday(&now, NULL);
+    return (uint64) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/*
+ * microseconds passed since a time returned by stats_now
+ */
+static uint64 stats_since(uint64 start)
+{
+    uint64 now = stats_now();
+
+    /* the clock may have been set back */
+    return now > start ? now - start : 0;
+}
+
+/*
+ * note the start of a request
+ */
+void stats_begin(void)
+{
+    stats_start = stats_now();
+    if (stats_start == 0)
+	return;
+
+    memset(stats_phases, 0, sizeof(stats_phases));
+    stats_way = STATS_EXPORT - 1;
+    stats_way_path[0] = 0;
+}
+
+/*
+ * add the time since start to a phase of the current request
+ */
+void stats_phase(int phase, uint64 start)
+{
+    if (start != 0)
+	stats_phases[phase] += stats_since(start);
+}
+
+/*
+ * note how a filehandle of the current request was resolved
+ */
+void stats_resolved(int how, const char *path)
+{
+    if (stats_start == 0 || how <= stats_way)
+	return;
+
+    stats_way = how;
+    if (path) {
+	strncpy(stats_way_path, path, NFS_MAXPATHLEN - 1);
+	stats_way_path[NFS_MAXPATHLEN - 1] = 0;
+    } else
+	strcpy(stats_way_path, "?");
+}
+
+/*
+ * log a request taking longer than the slow request threshold
+ */
+static void stats_slow(struct svc_req *rqstp, uint64 usec)
+{
+    const char *proc = stats_names[rqstp->rq_proc];
+    const char *host = inet_ntoa(get_remote(rqstp));
+
+    if (stats_way < STATS_EXPORT)
+	logmsg(LOG_NOTICE, "slow %s from %s: %.3f ms, sync %.3f ms", proc,
+	       host, usec / 1e3, stats_phases[STATS_SYNC] / 1e3);
+    else
+	logmsg(LOG_NOTICE,
+	       "slow %s from %s: %.3f ms, %s resolved by %s in %.3f ms, "
+	       "sync %.3f ms", proc, host, usec / 1e3, stats_way_path,
+	       stats_ways[stats_way - STATS_EXPORT],
+	       stats_phases[STATS_RESOLVE] / 1e3,
+	       stats_phases[STATS_SYNC] / 1e3);
+}
+
+/*
+ * count a finished request of an NFS procedure
+ *
+ * called after the reply has been sent, without the server lock
+ */
+void stats_end(struct svc_req *rqstp)
+{
+    u_long proc = rqstp->rq_proc;
+    uint64 usec, bound;
+    unsigned int i;
+
+    if (stats_start == 0 || proc >= STATS_PROCS)
+	return;
+
+    usec = stats_since(stats_start);
+
+    if (opt_slow_time > 0 && usec >= (uint64) opt_slow_time * 1000)
+	stats_slow(rqstp, usec);
+
+    if (stats_fd < 0)
+	return;
+
+    for (i = 0, bound = STATS_FIRST; i < STATS_BUCKETS - 1 && usec > bound;
+	 i++)
+	bound *= 4;
+
+    worker_lock();
+    stats_count[proc]++;
+    stats_usec[proc] += usec;
+    stats_bucket[proc][i]++;
+    worker_unlock();
+}
+
+#ifndef WIN32
+
+/* time to wait for the request of an HTTP client, in milliseconds */
+#define STATS_WAIT	100
+
+/* clients waiting for their request or for STATS_WAIT to pass */
+#define STATS_CLIENTS	16
+
+/* socket path, removed on exit */
+static const char *stats_path = NULL;
+
+/* statistics being formatted */
+static char *stats_buf = NULL;
+static unsigned int stats_len = 0;
+static unsigned int stats_size = 0;
+
+/*
+ * append to the statistics being formatted
+ */
+static void stats_printf(const char *fmt, ...)
+{
+    va_list args;
+    char *buf;
+    int n;
+
+    for (;;) {
+	va_start(args, fmt);
+	n = vsnprintf(stats_buf + stats_len, stats_size - stats_len, fmt,
+		      args);
+	va_end(args);
+
+	if (n < 0)
+	    return;
+	if ((unsigned int) n < stats_size - stats_len) {
+	    stats_len += n;
+	    return;
+	}
+
+	buf = realloc(stats_buf, stats_size * 2 + n + 1);
+	if (!buf)
+	    return;
+	stats_buf = buf;
+	stats_size = stats_size * 2 + n + 1;
+    }
+}
+
+/*
+ * format a metric without labels
+ */
+static void stats_metric(const char *name, const char *type,
+			 const char *help, unsigned long long value)
+{
+    stats_printf("# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name,
+		 type, name, value);
+}
+
+/*
+ * format all statistics
+ */
+static void stats_format(void)
+{
+    static const char *misses[FH_MISS_KINDS] = {
+	"handle", "index", "search", "locate", "failed"
+    };
+    unsigned long long sum;
+    unsigned int i, j, queued, busy;
+    uint64 bound;
+
+    stats_len = 0;
+
+    stats_printf("# HELP unfs3_nfs_request_duration_seconds "
+		 "Time from dispatching NFS requests to sending their replies.\n"
+		 "# TYPE unfs3_nfs_request_duration_seconds histogram\n");
+    for (i = 0; i < STATS_PROCS; i++) {
+	sum = 0;
+	bound = STATS_FIRST;
+	for (j = 0; j < STATS_BUCKETS - 1; j++) {
+	    sum += stats_bucket[i][j];
+	    stats_printf("unfs3_nfs_request_duration_seconds_bucket"
+			 "{proc=\"%s\",le=\"%.6f\"} %llu\n", stats_names[i],
+			 bound / 1e6, sum);
+	    bound *= 4;
+	}
+	stats_printf("unfs3_nfs_request_duration_seconds_bucket"
+		     "{proc=\"%s\",le=\"+Inf\"} %llu\n", stats_names[i],
+		     (unsigned long long) stats_count[i]);
+	stats_printf("unfs3_nfs_request_duration_seconds_sum"
+		     "{proc=\"%s\"} %.6f\n", stats_names[i],
+		     stats_usec[i] / 1e6);
+	stats_printf("unfs3_nfs_request_duration_seconds_count"
+		     "{proc=\"%s\"} %llu\n", stats_names[i],
+		     (unsigned long long) stats_count[i]);
+    }
+
+    stats_metric("unfs3_fh_cache_entries", "gauge",
+		 "Entries in the filehandle cache.", fh_cache_max);
+    stats_metric("unfs3_fh_cache_lookups_total", "counter",
+		 "Filehandles looked up in the filehandle cache.",
+		 fh_cache_use);
+    stats_metric("unfs3_fh_cache_hits_total", "counter",
+		 "Filehandles found in the filehandle cache.", fh_cache_hit);
+
+    stats_printf("# HELP unfs3_fh_cache_misses_total "
+		 "Filehandles not found in the filehandle cache, "
+		 "by way of resolving them.\n"
+		 "# TYPE unfs3_fh_cache_misses_total counter\n");
+    for (i = 0; i < FH_MISS_KINDS; i++)
+	stats_printf("unfs3_fh_cache_misses_total{resolved=\"%s\"} %i\n",
+		     misses[i], fh_cache_miss[i]);
+
+    stats_printf("# HELP unfs3_fd_cache_open "
+		 "Files kept open by the fd cache.\n"
+		 "# TYPE unfs3_fd_cache_open gauge\n"
+		 "unfs3_fd_cache_open{mode=\"read\"} %i\n"
+		 "unfs3_fd_cache_open{mode=\"write\"} %i\n",
+		 fd_cache_readers, fd_cache_writers);
+
+    stats_metric("unfs3_drc_hits_total", "counter",
+		 "Retransmitted requests found in the duplicate request cache.",
+		 drc_hit);
+    stats_metric("unfs3_drc_misses_total", "counter",
+		 "Requests entered into the duplicate request cache.",
+		 drc_miss);
+
+    worker_stats(&queued, &busy);
+    stats_metric("unfs3_worker_queued_requests", "gauge",
+		 "Requests waiting for a worker.", queued);
+    stats_metric("unfs3_worker_busy_threads", "gauge",
+		 "Worker threads handling requests.", busy);
+}
+
+/*
+ * send the statistics to a client and close its socket
+ *
+ * the socket does not block, the reply normally fits into its buffer;
+ * what does not fit is dropped rather than waited for
+ */
+static void stats_send(int fd, int http)
+{
+    static const char header[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: text/plain; version=0.0.4\r\n"
+	"Connection: close\r\n\r\n";
+    struct iovec iov[2];
+    int n = 0;
+
+    stats_format();
+
+    if (http) {
+	iov[n].iov_base = (char *) header;
+	iov[n++].iov_len = sizeof(header) - 1;
+    }
+    iov[n].iov_base = stats_buf;
+    iov[n++].iov_len = stats_len;
+
+    if (writev(fd, iov, n) == -1 && errno == EAGAIN)
+	logmsg(LOG_INFO, "statistics reply does not fit into socket buffer");
+    close(fd);
+}
+
+static bool_t stats_getargs(U(SVCXPRT * xprt), U(xdrproc_t proc),
+			    U(void *args))
+{
+    return FALSE;
+}
+
+static bool_t stats_reply(U(SVCXPRT * xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+static bool_t stats_freeargs(U(SVCXPRT * xprt), U(xdrproc_t proc),
+			     U(void *args))
+{
+    return TRUE;
+}
+
+static enum xprt_stat stats_stat(U(SVCXPRT * xprt))
+{
+    return XPRT_IDLE;
+}
+
+static void stats_destroy(U(SVCXPRT * xprt))
+{
+}
+
+/*
+ * accepted clients are registered with the RPC library as well, so the
+ * event loops tell when their request has arrived; clients that send
+ * nothing get the plain statistics once STATS_WAIT has passed, on the
+ * next round of closing inactive files
+ */
+static struct {
+    SVCXPRT xprt;		       /* xp_fd is -1 if unused */
+    uint64 since;		       /* time of accepting the client */
+} stats_clients[STATS_CLIENTS];
+
+/*
+ * serve a waiting client and forget about it
+ */
+static void stats_serve(SVCXPRT * xprt, int http)
+{
+    int fd = xprt->xp_fd;
+
+    xprt_unregister(xprt);
+    xprt->xp_fd = -1;
+    stats_send(fd, http);
+}
+
+/*
+ * read the request of a waiting client
+ *
+ * called by the RPC library when the socket is readable; no RPC request
+ * is returned
+ */
+static bool_t stats_client_recv(SVCXPRT * xprt, U(struct rpc_msg *msg))
+{
+    char req[512];
+    ssize_t n;
+
+    n = read(xprt->xp_fd, req, sizeof(req));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	return FALSE;
+
+    /* HTTP clients send a request first, others just read */
+    stats_serve(xprt, n >= 4 && memcmp(req, "GET ", 4) == 0);
+    return FALSE;
+}
+
+static const struct xp_ops stats_client_ops = {
+    stats_client_recv, stats_stat, stats_getargs, stats_reply,
+    stats_freeargs, stats_destroy
+};
+
+/*
+ * accept a client of the socket
+ *
+ * called by the RPC library when the socket is readable, which means
+ * that a client is waiting to be accepted; no RPC request is returned
+ */
+static bool_t stats_recv(SVCXPRT * xprt, U(struct rpc_msg *msg))
+{
+    unsigned int i;
+    int fd;
+
+    fd = accept(xprt->xp_fd, NULL, NULL);
+    if (fd == -1)
+	return FALSE;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    for (i = 0; i < STATS_CLIENTS; i++)
+	if (stats_clients[i].xprt.xp_fd == -1)
+	    break;
+
+    /* too many clients waiting, do not wait for this one */
+    if (i == STATS_CLIENTS) {
+	stats_send(fd, FALSE);
+	return FALSE;
+    }
+
+    stats_clients[i].xprt.xp_fd = fd;
+    stats_clients[i].since = stats_now();
+    xprt_register(&stats_clients[i].xprt);
+    return FALSE;
+}
+
+static const struct xp_ops stats_ops = {
+    stats_recv, stats_stat, stats_getargs, stats_reply, stats_freeargs,
+    stats_destroy
+};
+
+/*
+ * serve clients that did not send a request within STATS_WAIT
+ */
+void stats_close_inactive(void)
+{
+    unsigned int i;
+    uint64 now;
+
+    if (stats_fd < 0)
+	return;
+
+    now = stats_now();
+    for (i = 0; i < STATS_CLIENTS; i++)
+	if (stats_clients[i].xprt.xp_fd != -1 &&
+	    now - stats_clients[i].since >= STATS_WAIT * 1000)
+	    stats_serve(&stats_clients[i].xprt, FALSE);
+}
+
+/*
+ * serve statistics on a Unix socket
+ *
+ * the socket is registered with the RPC library like a transport, so
+ * that all event loops watch it without knowing about it; like a TCP
+ * listening socket, it is only accepted from by the main thread
+ */
+void stats_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    SVCXPRT *xprt;
+    unsigned int i;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "statistics socket path too long\n");
+	daemon_exit(0);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* remove socket left over from an earlier run */
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+	|| listen(fd, SOMAXCONN) == -1) {
+	fprintf(stderr, "cannot create statistics socket %s: %s\n", path,
+		strerror(errno));
+	daemon_exit(0);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    xprt = calloc(1, sizeof(SVCXPRT));
+    if (!xprt) {
+	fprintf(stderr, "cannot create statistics socket %s\n", path);
+	daemon_exit(0);
+    }
+    xprt->xp_fd = fd;
+    xprt->xp_ops = &stats_ops;
+    xprt_register(xprt);
+    worker_listen(fd);
+    event_listen(fd);
+
+    for (i = 0; i < STATS_CLIENTS; i++) {
+	stats_clients[i].xprt.xp_fd = -1;
+	stats_clients[i].xprt.xp_ops = &stats_client_ops;
+    }
+
+    stats_fd = fd;
+    stats_path = path;
+}
+
+/*
+ * remove the statistics socket
+ */
+void stats_close(void)
+{
+    if (stats_path)
+	unlink(stats_path);
+}
+
+#else				       /* WIN32 */
+
+void stats_listen(U(const char *path))
+{
+}
+
+void stats_close(void)
+{
+}
+
+void stats_close_inactive(void)
+{
+}
+
+#endif				       /* WIN32 */
@@ -0,0 +1,48 @@
+/*
+ * UNFS3 server statistics
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_STATS_H
+#define UNFS3_STATS_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+/* number of NFS procedures */
+#define STATS_PROCS	22
+
+/* number of latency buckets, the last one is unbounded */
+#define STATS_BUCKETS	12
+
+/* ways of resolving filehandles besides the FH_MISS_* ones */
+#define STATS_EXPORT	-2		       /* export point */
+#define STATS_CACHED	-1		       /* filehandle cache */
+
+/* phases of requests timed for tracing slow requests */
+#define STATS_RESOLVE	0		       /* resolving missed filehandles */
+#define STATS_SYNC	1		       /* flushing data to disk */
+#define STATS_PHASES	2
+
+/* USDT probes for the unfs3 provider */
+#ifdef HAVE_SYS_SDT_H
+#define STATS_PROBE1(name, a) DTRACE_PROBE1(unfs3, name, a)
+#define STATS_PROBE2(name, a, b) DTRACE_PROBE2(unfs3, name, a, b)
+#else
+#define STATS_PROBE1(name, a)
+#define STATS_PROBE2(name, a, b)
+#endif
+
+void stats_begin(void);
+void stats_end(struct svc_req *rqstp);
+
+uint64 stats_now(void);
+void stats_phase(int phase, uint64 start);
+void stats_resolved(int how, const char *path);
+
+void stats_listen(const char *path);
+void stats_close(void);
+void stats_close_inactive(void);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * UNFS3 batched UDP transport
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "daemon.h"
+#include "drc.h"
+#include "udp.h"
+
+#ifdef HAVE_SVC_GETREQ_COMMON
+
+#include <sys/uio.h>
+
+/*
+ * the RPC library reads every UDP request with its own system call and
+ * sends every reply with another one, which is most of the work for small
+ * requests such as GETATTR or ACCESS
+ *
+ * batched UDP sockets are instead drained with recvmmsg(), the requests
+ * are decoded and dispatched here, and the replies are encoded into
+ * memory and sent together with sendmmsg()
+ *
+ * requests are dispatched on a copy of the transport of the RPC library,
+ * whose operations decode arguments from and encode replies to the
+ * datagrams of the batch; the original transport is only used for
+ * registering the services. Worker threads dispatch the requests they
+ * are handed in the same way, see worker.c.
+ */
+
+/* registered programs and versions */
+#define UDP_PROGRAMS	8
+
+static struct {
+    u_long prog;
+    u_long vers;
+    udp_dispatch_t dispatch;
+} udp_programs[UDP_PROGRAMS];
+static unsigned int udp_nprograms = 0;
+
+/* raw credentials and verifier, followed by decoded credentials */
+#define UDP_CRED_SIZE	(2 * MAX_AUTH_BYTES + 512)
+
+/*
+ * note a program that may be dispatched with udp_call()
+ */
+void udp_register(u_long prog, u_long vers, udp_dispatch_t dispatch)
+{
+    unsigned int i;
+
+    for (i = 0; i < udp_nprograms; i++)
+	if (udp_programs[i].prog == prog && udp_programs[i].vers == vers)
+	    return;
+
+    if (udp_nprograms == UDP_PROGRAMS)
+	return;
+
+    udp_programs[i].prog = prog;
+    udp_programs[i].vers = vers;
+    udp_programs[i].dispatch = dispatch;
+    udp_nprograms++;
+}
+
+/*
+ * answer requests on a UDP socket from the address they were sent to
+ */
+void udp_pktinfo_on(int fd)
+{
+#ifdef IP_PKTINFO
+    const int on = 1;
+
+    setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+#else
+    (void) fd;
+#endif
+}
+
+/*
+ * keep the destination address of a request for the reply
+ */
+void udp_pktinfo(struct msghdr *in, struct msghdr *out)
+{
+#ifdef IP_PKTINFO
+    struct cmsghdr *cmsg;
+    struct in_pktinfo *info;
+
+    cmsg = CMSG_FIRSTHDR(in);
+    if (cmsg && cmsg->cmsg_level == IPPROTO_IP &&
+	cmsg->cmsg_type == IP_PKTINFO &&
+	cmsg->cmsg_len >= CMSG_LEN(sizeof(struct in_pktinfo))) {
+	info = (struct in_pktinfo *) CMSG_DATA(cmsg);
+	info->ipi_ifindex = 0;
+	out->msg_control = in->msg_control;
+	out->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+	return;
+    }
+#endif
+    (void) in;
+    out->msg_control = NULL;
+    out->msg_controllen = 0;
+}
+
+/*
+ * decode a request and dispatch it, like svc_getreq_common() does
+ *
+ * the operations of xprt decode the arguments from xdrs, which holds the
+ * request, and send the reply; the xid is stored before the dispatch
+ */
+void udp_call(SVCXPRT * xprt, XDR * xdrs, u_int32_t * xid)
+{
+    struct rpc_msg msg;
+    struct svc_req r;
+    char cred[UDP_CRED_SIZE];
+    enum auth_stat why;
+    u_long low = ~0UL, high = 0;
+    unsigned int k;
+    int found = FALSE;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.rm_call.cb_cred.oa_base = cred;
+    msg.rm_call.cb_verf.oa_base = cred + MAX_AUTH_BYTES;
+
+    if (!xdr_callmsg(xdrs, &msg))
+	return;
+
+    *xid = msg.rm_xid;
+    drc_received(xprt, msg.rm_xid);
+
+    memset(&r, 0, sizeof(r));
+    r.rq_xprt = xprt;
+    r.rq_prog = msg.rm_call.cb_prog;
+    r.rq_vers = msg.rm_call.cb_vers;
+    r.rq_proc = msg.rm_call.cb_proc;
+    r.rq_cred = msg.rm_call.cb_cred;
+    r.rq_clntcred = cred + 2 * MAX_AUTH_BYTES;
+
+    /* other flavors need state kept with the original transport */
+    if (r.rq_cred.oa_flavor != AUTH_NONE && r.rq_cred.oa_flavor != AUTH_UNIX)
+	why = AUTH_REJECTEDCRED;
+    else
+	why = _authenticate(&r, &msg);
+
+    if (why != AUTH_OK) {
+	svcerr_auth(xprt, why);
+	return;
+    }
+
+    for (k = 0; k < udp_nprograms; k++) {
+	if (udp_programs[k].prog != r.rq_prog)
+	    continue;
+	if (udp_programs[k].vers == r.rq_vers) {
+	    udp_programs[k].dispatch(&r, xprt);
+	    return;
+	}
+	found = TRUE;
+	if (udp_programs[k].vers < low)
+	    low = udp_programs[k].vers;
+	if (udp_programs[k].vers > high)
+	    high = udp_programs[k].vers;
+    }
+
+    if (found)
+	svcerr_progvers(xprt, low, high);
+    else
+	svcerr_noprog(xprt);
+}
+
+#endif				       /* HAVE_SVC_GETREQ_COMMON */
+
+#ifdef UNFS3_MMSG
+
+typedef struct {
+    SVCXPRT xprt;		/* copy of the transport, must be first */
+    unsigned int size;		/* datagrams per batch */
+    unsigned int cur;		/* datagram being handled */
+    u_int32_t xid;		/* of the request being handled */
+    XDR xdrs;			/* decodes the request being handled */
+    struct mmsghdr in[UDP_BATCH_MAX];
+    struct mmsghdr out[UDP_BATCH_MAX];
+    struct iovec iniov[UDP_BATCH_MAX];
+    struct iovec outiov[UDP_BATCH_MAX];
+    struct sockaddr_in addr[UDP_BATCH_MAX];
+    char ctl[UDP_BATCH_MAX][UDP_CTL_SIZE];
+    char *buf;			/* requests, then replies */
+} udp_batch_t;
+
+static udp_batch_t *udp_batches[FD_SETSIZE];
+
+static bool_t udp_recv(U(SVCXPRT * xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+static enum xprt_stat udp_stat(U(SVCXPRT * xprt))
+{
+    return XPRT_IDLE;
+}
+
+static bool_t udp_getargs(SVCXPRT * xprt, xdrproc_t proc, void *args)
+{
+    udp_batch_t *b = (udp_batch_t *) xprt;
+
+    return proc(&b->xdrs, args);
+}
+
+/*
+ * encode a reply into the buffer of the datagram being handled
+ */
+static bool_t udp_reply(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    udp_batch_t *b = (udp_batch_t *) xprt;
+    XDR xdrs;
+    bool_t res;
+
+    msg->rm_xid = b->xid;
+    xdrmem_create(&xdrs, b->outiov[b->cur].iov_base, NFS_MAX_UDP_PACKET,
+		  XDR_ENCODE);
+    res = xdr_replymsg(&xdrs, msg);
+    b->outiov[b->cur].iov_len = res ? xdr_getpos(&xdrs) : 0;
+    xdr_destroy(&xdrs);
+
+    return res;
+}
+
+static bool_t udp_freeargs(U(SVCXPRT * xprt), xdrproc_t proc, void *args)
+{
+    xdr_free(proc, args);
+    return TRUE;
+}
+
+static void udp_destroy(U(SVCXPRT * xprt))
+{
+}
+
+/* shared by all batched transports */
+static const struct xp_ops udp_ops = {
+    udp_recv, udp_stat, udp_getargs, udp_reply, udp_freeargs, udp_destroy
+};
+
+/*
+ * batch requests on a UDP transport
+ */
+void udp_batch(SVCXPRT * transp, unsigned int size)
+{
+    udp_batch_t *b;
+    unsigned int i;
+    int fd;
+
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    fd = transp->xp_fd;
+#else
+    fd = transp->xp_sock;
+#endif
+
+    if (fd < 0 || fd >= FD_SETSIZE || size == 0)
+	return;
+
+    if (size > UDP_BATCH_MAX)
+	size = UDP_BATCH_MAX;
+
+    b = malloc(sizeof(udp_batch_t));
+    if (b)
+	b->buf = malloc(2 * size * NFS_MAX_UDP_PACKET);
+    if (!b || !b->buf) {
+	logmsg(LOG_WARNING, "unable to allocate UDP batch buffers");
+	free(b);
+	return;
+    }
+
+    b->xprt = *transp;
+    b->xprt.xp_ops = &udp_ops;
+    b->size = size;
+    for (i = 0; i < size; i++) {
+	b->iniov[i].iov_base = b->buf + i * NFS_MAX_UDP_PACKET;
+	b->outiov[i].iov_base = b->buf + (size + i) * NFS_MAX_UDP_PACKET;
+    }
+
+    udp_pktinfo_on(fd);
+
+    /* the xid of requests is noted for the duplicate request cache */
+    drc_watch(&b->xprt);
+
+    udp_batches[fd] = b;
+}
+
+/*
+ * decode a datagram of the batch and dispatch it
+ */
+static void udp_handle(udp_batch_t * b, unsigned int i)
+{
+    b->cur = i;
+    b->outiov[i].iov_len = 0;
+
+    if (b->in[i].msg_len < 4 * sizeof(u_int32_t))
+	return;
+
+    memcpy(&b->xprt.xp_raddr, &b->addr[i], sizeof(struct sockaddr_in));
+    b->xprt.xp_addrlen = b->in[i].msg_hdr.msg_namelen;
+
+    xdrmem_create(&b->xdrs, b->iniov[i].iov_base, b->in[i].msg_len,
+		  XDR_DECODE);
+    udp_call(&b->xprt, &b->xdrs, &b->xid);
+    xdr_destroy(&b->xdrs);
+}
+
+/*
+ * handle requests on a transport socket, in batches for UDP sockets
+ */
+void udp_getreq(int fd)
+{
+    udp_batch_t *b;
+    unsigned int i, n;
+    int r, sent;
+
+    if (fd < 0 || fd >= FD_SETSIZE || !udp_batches[fd]) {
+	svc_getreq_common(fd);
+	return;
+    }
+    b = udp_batches[fd];
+
+    for (i = 0; i < b->size; i++) {
+	memset(&b->in[i], 0, sizeof(struct mmsghdr));
+	b->iniov[i].iov_len = NFS_MAX_UDP_PACKET;
+	b->in[i].msg_hdr.msg_name = &b->addr[i];
+	b->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	b->in[i].msg_hdr.msg_iov = &b->iniov[i];
+	b->in[i].msg_hdr.msg_iovlen = 1;
+	b->in[i].msg_hdr.msg_control = b->ctl[i];
+	b->in[i].msg_hdr.msg_controllen = UDP_CTL_SIZE;
+    }
+
+    do
+	r = recvmmsg(fd, b->in, b->size, MSG_DONTWAIT, NULL);
+    while (r == -1 && errno == EINTR);
+    if (r <= 0)
+	return;
+
+    /* replies are collected in order of requests */
+    for (i = 0, n = 0; i < (unsigned int) r; i++) {
+	udp_handle(b, i);
+	if (b->outiov[i].iov_len == 0)
+	    continue;
+
+	memset(&b->out[n], 0, sizeof(struct mmsghdr));
+	b->out[n].msg_hdr.msg_name = &b->addr[i];
+	b->out[n].msg_hdr.msg_namelen = b->in[i].msg_hdr.msg_namelen;
+	b->out[n].msg_hdr.msg_iov = &b->outiov[i];
+	b->out[n].msg_hdr.msg_iovlen = 1;
+	udp_pktinfo(&b->in[i].msg_hdr, &b->out[n].msg_hdr);
+	n++;
+    }
+
+    for (sent = 0; sent < (int) n;) {
+	r = sendmmsg(fd, b->out + sent, n - sent, 0);
+	if (r > 0)
+	    sent += r;
+	else if (r == -1 && errno == EINTR)
+	    continue;
+	else {
+	    /* skip the reply that failed */
+	    logmsg(LOG_CRIT, "unable to send RPC reply");
+	    sent++;
+	}
+    }
+}
+
+#else				       /* UNFS3_MMSG */
+
+void udp_batch(U(SVCXPRT * transp), U(unsigned int size))
+{
+}
+
+#ifdef HAVE_SVC_GETREQ_COMMON
+void udp_getreq(int fd)
+{
+    svc_getreq_common(fd);
+}
+#endif
+
+#endif				       /* UNFS3_MMSG */
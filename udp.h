@@ -0,0 +1,31 @@
+/*
+ * UNFS3 batched UDP transport
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_UDP_H
+#define UNFS3_UDP_H
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && \
+    defined(HAVE_SVC_GETREQ_COMMON)
+#define UNFS3_MMSG 1
+#endif
+
+/* maximum number of datagrams received or sent per system call */
+#define UDP_BATCH_MAX	64
+
+/* control data, address the request was sent to */
+#define UDP_CTL_SIZE	64
+
+typedef void (*udp_dispatch_t) (struct svc_req *, SVCXPRT *);
+
+struct msghdr;
+
+void udp_register(u_long prog, u_long vers, udp_dispatch_t dispatch);
+void udp_pktinfo_on(int fd);
+void udp_pktinfo(struct msghdr *in, struct msghdr *out);
+void udp_call(SVCXPRT * xprt, XDR * xdrs, u_int32_t * xid);
+void udp_batch(SVCXPRT * transp, unsigned int size);
+void udp_getreq(int fd);
+
+#endif
@@ -16,13 +16,32 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <rpc/rpc.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#if defined(SYS_setgroups32)
+#define UNFS3_SYS_SETGROUPS SYS_setgroups32
+#elif defined(SYS_setgroups)
+#define UNFS3_SYS_SETGROUPS SYS_setgroups
+#endif
+#if defined(SYS_setresuid32)
+#define UNFS3_SYS_SETRESUID SYS_setresuid32
+#define UNFS3_SYS_SETRESGID SYS_setresgid32
+#elif defined(SYS_setresuid)
+#define UNFS3_SYS_SETRESUID SYS_setresuid
+#define UNFS3_SYS_SETRESGID SYS_setresgid
+#endif
+#endif				       /* HAVE_SYS_SYSCALL_H */
 
 #include "nfs.h"
 #include "mount.h"
 #include "daemon.h"
 #include "user.h"
 #include "backend.h"
+#include "worker.h"
 #include "Config/exports.h"
 
 /* user and group id we squash to */
@@ -32,6 +51,43 @@ static gid_t squash_gid = 65534;
 /* whether we can use seteuid/setegid */
 static int can_switch = TRUE;
 
+/* request whose ids this thread switched to, NULL for root */
+static UNFS3_TLS struct svc_req *switch_req = NULL;
+
+#if defined(UNFS3_SYS_SETGROUPS) && defined(UNFS3_SYS_SETRESUID)
+/*
+ * on Linux, the effective ids are switched with the raw system calls,
+ * which only change the ids of the calling thread, while glibc's
+ * seteuid, setegid, and setgroups change the ids of all threads of the
+ * process by signalling each of them; nothing else may call those, or
+ * the ids remembered below no longer hold
+ *
+ * the ids in effect are remembered, so that consecutive requests from
+ * the same user do not change them again
+ */
+#define THREAD_IDS 1
+
+static UNFS3_TLS uid_t th_uid = 0;
+static UNFS3_TLS gid_t th_gid = 0;
+static UNFS3_TLS int th_ngroups = -1;	/* -1 if not known */
+static UNFS3_TLS gid_t th_groups[32];
+
+/*
+ * make this thread root again, only root may change its groups and ids
+ */
+static int thread_root(void)
+{
+    if (th_uid == 0)
+	return 0;
+
+    if (syscall(UNFS3_SYS_SETRESUID, -1, 0, -1) == -1)
+	return -1;
+
+    th_uid = 0;
+    return 0;
+}
+#endif
+
 /*
  * initialize group and user id used for squashing
  */
@@ -155,6 +211,45 @@ int has_group(int group, struct svc_req *req)
     return FALSE;
 }
 
+/*
+ * get the ids currently in use, for caches of objects that were opened
+ * or checked with the ids of one request and might be used for another
+ */
+void get_cred(user_cred_t * cred)
+{
+    struct authunix_parms *auth;
+    unsigned int i, max;
+
+    cred->uid = 0;
+    cred->gid = 0;
+    cred->groups = 0;
+
+    if (!can_switch || !switch_req)
+	return;
+
+    cred->uid = get_uid(switch_req);
+    cred->gid = get_gid(switch_req);
+
+    if (switch_req->rq_cred.oa_flavor != AUTH_UNIX)
+	return;
+
+    auth = (void *) switch_req->rq_clntcred;
+    max = (auth->aup_len <= 32) ? auth->aup_len : 32;
+
+    /* switch_groups has mangled the group ids already */
+    cred->groups = max;
+    for (i = 0; i < max; i++)
+	cred->groups = (cred->groups * 0x9E3779B1) ^ auth->aup_gids[i];
+}
+
+/*
+ * check whether two sets of ids are the same
+ */
+int same_cred(const user_cred_t * a, const user_cred_t * b)
+{
+    return a->uid == b->uid && a->gid == b->gid && a->groups == b->groups;
+}
+
 /*
  * switch to root
  */
@@ -163,8 +258,18 @@ void switch_to_root(void)
     if (!can_switch)
 	return;
 
+#ifdef THREAD_IDS
+    if (thread_root() == -1 ||
+	(th_gid != 0 && syscall(UNFS3_SYS_SETRESGID, -1, 0, -1) == -1)) {
+	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
+	daemon_exit(CRISIS);
+    }
+    th_gid = 0;
+#else
     backend_setegid(0);
     backend_seteuid(0);
+#endif
+    switch_req = NULL;
 }
 
 /*
@@ -181,9 +286,55 @@ static int switch_groups(struct svc_req *req)
 	auth->aup_gids[i] = mangle(auth->aup_gids[i], squash_gid);
     }
 
+#ifdef THREAD_IDS
+    if (th_ngroups == (int) max &&
+	memcmp(th_groups, auth->aup_gids, max * sizeof(gid_t)) == 0)
+	return 0;
+
+    /* the raw system call only sets the groups of this thread */
+    th_ngroups = -1;
+    if (thread_root() == -1 ||
+	syscall(UNFS3_SYS_SETGROUPS, max, auth->aup_gids) == -1)
+	return -1;
+
+    memcpy(th_groups, auth->aup_gids, max * sizeof(gid_t));
+    th_ngroups = max;
+    return 0;
+#else
     return backend_setgroups(max, auth->aup_gids);
+#endif
 }
 
+#ifdef THREAD_IDS
+/*
+ * switch effective ids of this thread, going through root if needed
+ *
+ * the real and saved user ids stay root, so that the thread can
+ * switch back
+ */
+static int switch_ids(uid_t uid, gid_t gid, struct svc_req *req)
+{
+    if (th_gid != gid) {
+	if (thread_root() == -1 ||
+	    syscall(UNFS3_SYS_SETRESGID, -1, gid, -1) == -1)
+	    return -1;
+	th_gid = gid;
+    }
+
+    if (switch_groups(req) == -1)
+	return -1;
+
+    if (th_uid != uid) {
+	if (thread_root() == -1 ||
+	    (uid != 0 && syscall(UNFS3_SYS_SETRESUID, -1, uid, -1) == -1))
+	    return -1;
+	th_uid = uid;
+    }
+
+    return 0;
+}
+#endif
+
 /*
  * switch user and group id to values listed in request
  */
@@ -208,16 +359,65 @@ void switch_user(struct svc_req *req)
 	return;
     }
 
+#ifdef THREAD_IDS
+    uid = gid = 0;
+    aid = switch_ids(get_uid(req), get_gid(req), req);
+#else
     backend_setegid(0);
     backend_seteuid(0);
     gid = backend_setegid(get_gid(req));
     aid = switch_groups(req);
     uid = backend_seteuid(get_uid(req));
+#endif
 
     if (uid == -1 || gid == -1 || aid == -1) {
 	logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
 	daemon_exit(CRISIS);
     }
+    switch_req = req;
+}
+
+/*
+ * switch to root for a moment, returns what switch_resume needs to
+ * switch back
+ */
+struct svc_req *switch_suspend(void)
+{
+    struct svc_req *req = switch_req;
+
+    switch_to_root();
+    return req;
+}
+
+/*
+ * switch back to the ids in effect before switch_suspend
+ */
+void switch_resume(struct svc_req *req)
+{
+    if (req)
+	switch_user(req);
+}
+
+/*
+ * switch back to the ids this thread used before dropping the server lock,
+ * another thread may have switched in the meantime
+ */
+void switch_restore(void)
+{
+#ifndef THREAD_IDS
+    int err = errno;
+
+    if (!worker_active() || !can_switch)
+	return;
+
+    if (switch_req)
+	switch_user(switch_req);
+    else
+	switch_to_root();
+
+    /* keep error of the operation done without the lock */
+    errno = err;
+#endif				       /* ids are per thread */
 }
 
 /*
@@ -238,10 +438,8 @@ void read_executable(struct svc_req *req, backend_statstruct buf)
 	    have_exec = 1;
     }
 
-    if (have_exec) {
-	backend_setegid(0);
-	backend_seteuid(0);
-    }
+    if (have_exec)
+	switch_to_root();
 }
 
 /*
@@ -262,10 +460,8 @@ void read_by_owner(struct svc_req *req, backend_statstruct buf)
 	have_read = 1;
     }
 
-    if (have_owner && !have_read) {
-	backend_setegid(0);
-	backend_seteuid(0);
-    }
+    if (have_owner && !have_read)
+	switch_to_root();
 }
 
 /*
@@ -286,8 +482,6 @@ void write_by_owner(struct svc_req *req, backend_statstruct buf)
 	have_write = 1;
     }
 
-    if (have_owner && !have_write) {
-	backend_setegid(0);
-	backend_seteuid(0);
-    }
+    if (have_owner && !have_write)
+	switch_to_root();
 }
@@ -9,6 +9,13 @@
 
 #include "backend.h"
 
+/* ids in effect for a thread, see get_cred */
+typedef struct {
+    int uid;
+    int gid;
+    unsigned int groups;	/* hash of the auxiliary group ids */
+} user_cred_t;
+
 int get_uid(struct svc_req *req);
 
 int mangle_uid(int id);
@@ -19,8 +26,14 @@ int has_group(int group, struct svc_req *req);
 
 void get_squash_ids(void);
 
+void get_cred(user_cred_t * cred);
+int same_cred(const user_cred_t * a, const user_cred_t * b);
+
 void switch_to_root(void);
 void switch_user(struct svc_req *req);
+void switch_restore(void);
+struct svc_req *switch_suspend(void);
+void switch_resume(struct svc_req *req);
 
 void read_executable(struct svc_req *req, backend_statstruct buf);
 void read_by_owner(struct svc_req *req, backend_statstruct buf);
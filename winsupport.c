@@ -483,15 +483,67 @@ void win_shutdown()
            res = res * i / m
        return 1 - res
 */
-int win_stat(const char *file_name, backend_statstruct * buf)
+/*
+ * full long name of a path, which identifies the object
+ */
+static int win_fullpath(const wchar_t * winpath, wchar_t * pathbuf,
+			size_t size)
 {
-    wchar_t *winpath;
-    int ret;
-    wchar_t pathbuf[4096];
     int retval;
+
+    retval = GetFullPathNameW(winpath, size, pathbuf, NULL);
+    if (!retval) {
+	errno = ENOENT;
+	return -1;
+    }
+
+    /* GetLongPathName fails if called with only x:\, and drive x is not
+       ready. So, only call it for other paths. */
+    if (pathbuf[0] && wcscmp(pathbuf + 1, L":\\")) {
+	retval = GetLongPathNameW(pathbuf, pathbuf, size);
+	if (!retval || (unsigned) retval > size) {
+	    /* Strangely enough, GetLongPathName returns
+	       ERROR_SHARING_VIOLATION for locked files, such as hiberfil.sys 
+	     */
+	    if (GetLastError() != ERROR_SHARING_VIOLATION) {
+		errno = ENAMETOOLONG;
+		return -1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * st_ino of an object with a given full long name
+ */
+static uint64 win_pathino(wchar_t * pathbuf)
+{
+    uint64 ino;
     size_t namelen;
     wchar_t *splitpoint;
     char savedchar;
+
+    /* Hash st_ino, by splitting in two halves */
+    namelen = wcslen(pathbuf);
+    splitpoint = &pathbuf[namelen / 2];
+    savedchar = *splitpoint;
+    *splitpoint = '\0';
+    ino = wfnv1a_32(pathbuf, 0);
+    assert(sizeof(ino) == 8);
+    ino = ino << 32;
+    *splitpoint = savedchar;
+    ino |= wfnv1a_32(splitpoint, 0);
+
+    return ino;
+}
+
+int win_stat(const char *file_name, backend_statstruct * buf)
+{
+    wchar_t *winpath;
+    int ret;
+    wchar_t pathbuf[4096];
     struct _stati64 win_statbuf;
 
     /* Special case: Our top-level virtual root, containing each drive
@@ -537,40 +589,14 @@ int win_stat(const char *file_name, backend_statstruct * buf)
     buf->st_ctime = win_statbuf.st_ctime;
     buf->st_blocks = win_statbuf.st_size / 512;
 
-    retval = GetFullPathNameW(winpath, wsizeof(pathbuf), pathbuf, NULL);
-    if (!retval) {
-	errno = ENOENT;
+    if (win_fullpath(winpath, pathbuf, wsizeof(pathbuf)) == -1) {
+	free(winpath);
 	return -1;
     }
 
     /* Set st_dev to the drive number */
     buf->st_dev = tolower(pathbuf[0]) - 'a';
-
-    /* GetLongPathName fails if called with only x:\, and drive x is not
-       ready. So, only call it for other paths. */
-    if (pathbuf[0] && wcscmp(pathbuf + 1, L":\\")) {
-	retval = GetLongPathNameW(pathbuf, pathbuf, wsizeof(pathbuf));
-	if (!retval || (unsigned) retval > wsizeof(pathbuf)) {
-	    /* Strangely enough, GetLongPathName returns
-	       ERROR_SHARING_VIOLATION for locked files, such as hiberfil.sys 
-	     */
-	    if (GetLastError() != ERROR_SHARING_VIOLATION) {
-		errno = ENAMETOOLONG;
-		return -1;
-	    }
-	}
-    }
-
-    /* Hash st_ino, by splitting in two halves */
-    namelen = wcslen(pathbuf);
-    splitpoint = &pathbuf[namelen / 2];
-    savedchar = *splitpoint;
-    *splitpoint = '\0';
-    buf->st_ino = wfnv1a_32(pathbuf, 0);
-    assert(sizeof(buf->st_ino) == 8);
-    buf->st_ino = buf->st_ino << 32;
-    *splitpoint = savedchar;
-    buf->st_ino |= wfnv1a_32(splitpoint, 0);
+    buf->st_ino = win_pathino(pathbuf);
 
 #if 0
     fprintf(stderr,
@@ -620,6 +646,110 @@ int win_fstat(int fd, backend_statstruct * buf)
     return win_stat(get_fdname(fd), buf);
 }
 
+/* Not declared by older headers */
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+#define WIN_FIND_BASIC ((FINDEX_INFO_LEVELS) 1)	/* FindExInfoBasic */
+
+/*
+  Directory enumeration through FindFirstFileEx, which returns the
+  attributes of entries along with their names, so that READDIR and
+  filehandle resolution need not stat each entry separately.
+*/
+struct win_find {
+    HANDLE handle;		/* INVALID_HANDLE_VALUE for empty directory */
+    WIN32_FIND_DATAW data;	/* entry returned last, or to return next */
+    int pending;		/* data not returned yet */
+    uint32 dev;			/* drive number */
+    int prefixlen;		/* length of full name of directory, 0 if
+				   unknown */
+    wchar_t prefix[4096];	/* full long name of directory */
+};
+
+static time_t win_filetime(const FILETIME * ft)
+{
+    ULARGE_INTEGER fti;
+
+    fti.LowPart = ft->dwLowDateTime;
+    fti.HighPart = ft->dwHighDateTime;
+    return (time_t) (fti.QuadPart / 10000000 - FT70SEC);
+}
+
+/*
+  Start enumerating a directory. Large fetches and leaving out short
+  names need Windows 7, older versions get a plain FindFirstFile.
+*/
+static struct win_find *win_findfirst(const wchar_t * winpath)
+{
+    struct win_find *find;
+    wchar_t pattern[4096];
+    size_t len;
+
+    len = wcslen(winpath);
+    if (len + 3 > wsizeof(pattern)) {
+	errno = ENAMETOOLONG;
+	return NULL;
+    }
+    wcscpy(pattern, winpath);
+    if (len == 0 || pattern[len - 1] != '\\')
+	pattern[len++] = '\\';
+    pattern[len++] = '*';
+    pattern[len] = '\0';
+
+    find = malloc(sizeof(struct win_find));
+    if (!find) {
+	logmsg(LOG_CRIT, "win_opendir: Unable to allocate memory");
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    find->handle = FindFirstFileExW(pattern, WIN_FIND_BASIC, &find->data,
+				    FindExSearchNameMatch, NULL,
+				    FIND_FIRST_EX_LARGE_FETCH);
+    if (find->handle == INVALID_HANDLE_VALUE &&
+	GetLastError() == ERROR_INVALID_PARAMETER)
+	find->handle = FindFirstFileW(pattern, &find->data);
+
+    if (find->handle == INVALID_HANDLE_VALUE) {
+	switch (GetLastError()) {
+	    case ERROR_FILE_NOT_FOUND:
+		/* no entries at all, as in an empty drive root */
+		find->pending = FALSE;
+		break;
+	    case ERROR_PATH_NOT_FOUND:
+		errno = ENOENT;
+		free(find);
+		return NULL;
+	    case ERROR_DIRECTORY:
+		errno = ENOTDIR;
+		free(find);
+		return NULL;
+	    case ERROR_ACCESS_DENIED:
+		errno = EACCES;
+		free(find);
+		return NULL;
+	    default:
+		errno = EIO;
+		free(find);
+		return NULL;
+	}
+    } else
+	find->pending = TRUE;
+
+    /* entries are identified by their full names, as in win_stat */
+    find->prefixlen = 0;
+    if (win_fullpath(winpath, find->prefix, wsizeof(find->prefix)) == 0) {
+	find->dev = tolower(find->prefix[0]) - 'a';
+	find->prefixlen = wcslen(find->prefix);
+	if (find->prefixlen && find->prefix[find->prefixlen - 1] != '\\')
+	    find->prefix[find->prefixlen++] = '\\';
+	find->prefix[find->prefixlen] = '\0';
+    }
+
+    return find;
+}
+
 /*
   opendir implementation which emulates a virtual root with the drive
   letters presented as directories. 
@@ -637,7 +767,7 @@ UNFS3_WIN_DIR *win_opendir(const char *name)
 
     if (!strcmp("/", name)) {
 	/* Emulate root */
-	ret->stream = NULL;
+	ret->find = NULL;
 	ret->currentdrive = 0;
 	ret->logdrives = GetLogicalDrives();
     } else {
@@ -648,9 +778,9 @@ UNFS3_WIN_DIR *win_opendir(const char *name)
 	    return NULL;
 	}
 
-	ret->stream = _wopendir(winpath);
+	ret->find = win_findfirst(winpath);
 	free(winpath);
-	if (ret->stream == NULL) {
+	if (ret->find == NULL) {
 	    free(ret);
 	    ret = NULL;
 	}
@@ -661,7 +791,9 @@ UNFS3_WIN_DIR *win_opendir(const char *name)
 
 struct dirent *win_readdir(UNFS3_WIN_DIR * dir)
 {
-    if (dir->stream == NULL) {
+    struct win_find *find = dir->find;
+
+    if (find == NULL) {
 	/* Emulate root */
 	for (; dir->currentdrive < MAX_NUM_DRIVES; dir->currentdrive++) {
 	    if (dir->logdrives & 1 << dir->currentdrive)
@@ -677,15 +809,20 @@ struct dirent *win_readdir(UNFS3_WIN_DIR * dir)
 	    return NULL;
 	}
     } else {
-	struct _wdirent *de;
+	if (find->handle == INVALID_HANDLE_VALUE) {
+	    return NULL;
+	}
 
-	de = _wreaddir(dir->stream);
-	if (!de) {
+	if (find->pending) {
+	    find->pending = FALSE;
+	} else if (!FindNextFileW(find->handle, &find->data)) {
+	    FindClose(find->handle);
+	    find->handle = INVALID_HANDLE_VALUE;
 	    return NULL;
 	}
 
 	if (!WideCharToMultiByte
-	    (CP_UTF8, 0, de->d_name, -1, dir->de.d_name,
+	    (CP_UTF8, 0, find->data.cFileName, -1, dir->de.d_name,
 	     sizeof(dir->de.d_name), NULL, NULL)) {
 	    logmsg(LOG_CRIT, "win_readdir: WideCharToMultiByte failed");
 	    return NULL;
@@ -696,12 +833,83 @@ struct dirent *win_readdir(UNFS3_WIN_DIR * dir)
 
 int win_closedir(UNFS3_WIN_DIR * dir)
 {
-    if (dir->stream == NULL) {
-	free(dir);
-	return 0;
-    } else {
-	return _wclosedir(dir->stream);
+    if (dir->find != NULL) {
+	if (dir->find->handle != INVALID_HANDLE_VALUE)
+	    FindClose(dir->find->handle);
+	free(dir->find);
     }
+    free(dir);
+    return 0;
+}
+
+/*
+  Attributes of the entry returned last by win_readdir, as win_stat
+  would report them, taken from the enumeration. Fails for the entries
+  that win_stat resolves differently, so that the caller can stat them.
+*/
+int win_dirstat(UNFS3_WIN_DIR * dir, const char *name,
+		backend_statstruct * buf)
+{
+    struct win_find *find = dir->find;
+    WIN32_FIND_DATAW *data;
+    wchar_t pathbuf[4096];
+    wchar_t *ext;
+    size_t namelen;
+
+    if (find == NULL || find->handle == INVALID_HANDLE_VALUE ||
+	find->pending || find->prefixlen == 0 ||
+	strcmp(name, dir->de.d_name) != 0)
+	return -1;
+
+    data = &find->data;
+
+    /* . and .. are other directories, reparse points are followed */
+    if (!wcscmp(data->cFileName, L".") || !wcscmp(data->cFileName, L"..") ||
+	(data->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+	return -1;
+
+    namelen = wcslen(data->cFileName);
+    if (find->prefixlen + namelen + 1 > wsizeof(pathbuf))
+	return -1;
+
+    /* same mode as computed by _wstati64 */
+    if (data->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+	buf->st_mode = S_IFDIR | S_IEXEC;
+    else
+	buf->st_mode = S_IFREG;
+    if (data->dwFileAttributes & FILE_ATTRIBUTE_READONLY)
+	buf->st_mode |= S_IREAD;
+    else
+	buf->st_mode |= S_IREAD | S_IWRITE;
+    ext = wcsrchr(data->cFileName, '.');
+    if (ext && (!_wcsicmp(ext, L".exe") || !_wcsicmp(ext, L".cmd") ||
+		!_wcsicmp(ext, L".bat") || !_wcsicmp(ext, L".com")))
+	buf->st_mode |= S_IEXEC;
+    buf->st_mode |= (buf->st_mode & 0700) >> 3;
+    buf->st_mode |= (buf->st_mode & 0700) >> 6;
+
+    buf->st_nlink = 1;
+    buf->st_uid = 0;
+    buf->st_gid = 0;
+    buf->st_rdev = find->dev;
+    buf->st_size = ((__int64) data->nFileSizeHigh << 32) | data->nFileSizeLow;
+    buf->st_mtime = win_filetime(&data->ftLastWriteTime);
+    buf->st_atime = win_filetime(&data->ftLastAccessTime);
+    buf->st_ctime = win_filetime(&data->ftCreationTime);
+    if (!data->ftLastAccessTime.dwLowDateTime &&
+	!data->ftLastAccessTime.dwHighDateTime)
+	buf->st_atime = buf->st_mtime;
+    if (!data->ftCreationTime.dwLowDateTime &&
+	!data->ftCreationTime.dwHighDateTime)
+	buf->st_ctime = buf->st_mtime;
+    buf->st_blocks = buf->st_size / 512;
+
+    buf->st_dev = find->dev;
+    wcscpy(pathbuf, find->prefix);
+    wcscpy(pathbuf + find->prefixlen, data->cFileName);
+    buf->st_ino = win_pathino(pathbuf);
+
+    return 0;
 }
 
 void openlog(U(const char *ident), U(int option), U(int facility))
@@ -83,7 +83,7 @@ typedef struct _backend_statvfsstruct
 
 typedef struct _UNFS3_WIN_DIR
 {
-    _WDIR *stream; /* Windows DIR stream. NULL means root emulation */
+    struct win_find *find; /* Directory enumeration. NULL means root emulation */
     uint32 currentdrive; /* Next drive to check/return */
     struct dirent de;
     DWORD logdrives;
@@ -107,6 +107,7 @@ int win_close(int fd);
 UNFS3_WIN_DIR *win_opendir(const char *name);
 struct dirent *win_readdir(UNFS3_WIN_DIR *dir);
 int win_closedir(UNFS3_WIN_DIR *dir);
+int win_dirstat(UNFS3_WIN_DIR *dir, const char *name, backend_statstruct *buf);
 int win_init();
 void openlog(const char *ident, int option, int facility);
 char *win_realpath(const char *path, char *resolved_path);
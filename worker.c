@@ -0,0 +1,1128 @@
+/*
+ * UNFS3 worker threads
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif				       /* WIN32 */
+
+#include "nfs.h"
+#include "fd_cache.h"
+#include "locate.h"
+#include "readdir.h"
+#include "daemon.h"
+#include "drc.h"
+#include "event.h"
+#include "stats.h"
+#include "udp.h"
+#include "worker.h"
+
+#ifdef UNFS3_WORKERS
+
+#include <pthread.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_RPC_SVC_MT_H
+#include <rpc/svc_mt.h>
+#endif
+
+/*
+ * in worker mode, the main thread reads the requests from all UDP
+ * sockets and TCP connections of the NFS and MOUNT services, without the
+ * server lock, and hands every single request with its reply address and
+ * xid to a free worker thread, which decodes it, handles it, and sends
+ * the reply; requests on one TCP connection or UDP socket are therefore
+ * handled at the same time
+ *
+ * like the batched UDP transport, requests are dispatched on a copy of a
+ * transport of the RPC library, whose operations decode the arguments
+ * from the request and encode the reply into a buffer of the worker;
+ * replies on one TCP connection are sent under a lock of the connection,
+ * so records do not mix
+ *
+ * the RPC library is left with accepting connections, destroying them
+ * when they end, and the statistics sockets
+ *
+ * all server state is protected by a single lock, which is taken once
+ * the arguments are decoded and dropped while sending replies and around
+ * blocking file I/O in READ, WRITE, and COMMIT, which is where time is
+ * spent waiting for disks; per-request state such as result structures
+ * and the stat cache is private to each thread
+ */
+
+/* kinds of sockets by fd */
+#define WORKER_OTHER	0	/* left to the RPC library */
+#define WORKER_LISTEN	1	/* TCP listening socket */
+#define WORKER_UDP	2	/* UDP socket of the services */
+#define WORKER_TCP	3	/* connection accepted from a listening socket */
+
+/* requests per worker that may be read ahead */
+#define WORKER_AHEAD	16
+
+/* bytes read from a connection at once */
+#define WORKER_READ	65536
+
+/* largest request accepted, the data of a WRITE and its RPC header */
+#define WORKER_RECORD	(opt_max_data + 4096)
+
+/* results of reading from a socket */
+#define WORKER_DONE	0	/* read what there was */
+#define WORKER_FULL	1	/* out of requests, tried again when one is free */
+#define WORKER_GONE	2	/* connection ended or sent a bad record */
+
+/* TCP connection */
+typedef struct {
+    pthread_mutex_t send;	/* held while sending a reply */
+    unsigned int gen;		/* incremented when the connection ends */
+    struct sockaddr_in addr;	/* of the client */
+    socklen_t addrlen;
+    char *buf;			/* data read, not yet handed to workers */
+    unsigned int len;
+    unsigned int size;
+    unsigned int want;		/* bytes of buf the next record needs */
+} worker_conn_t;
+
+/* request handed to a worker */
+typedef struct worker_req {
+    SVCXPRT xprt;		/* copy of a transport, must be first */
+#ifdef HAVE_RPC_SVC_MT_H
+    SVCXPRT_EXT ext;		/* written by _authenticate() */
+#endif
+    int kind;			/* WORKER_UDP or WORKER_TCP */
+    int fd;
+    unsigned int gen;		/* of the connection when it was read */
+    u_int32_t xid;
+    XDR xdrs;			/* decodes the request */
+    char *buf;
+    unsigned int len;
+    unsigned int size;
+    struct sockaddr_in addr;	/* of the client */
+    socklen_t addrlen;
+    long ctl[UDP_CTL_SIZE / sizeof(long)];	/* where a UDP request was sent */
+    socklen_t ctllen;
+    struct worker_req *next;
+} worker_req_t;
+
+/* the server lock */
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int worker_threads = 0;
+
+/* protects the free requests and the queue */
+static pthread_mutex_t worker_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+
+static worker_req_t *worker_free = NULL;
+
+/* requests waiting for a worker */
+static worker_req_t *worker_head = NULL;
+static worker_req_t *worker_tail = NULL;
+static unsigned int worker_queued = 0;
+
+/* workers handling a request */
+static unsigned int worker_busy = 0;
+
+/* the main thread ran out of requests and waits for a free one */
+static int worker_starved = FALSE;
+
+/* the following are only used by the main thread */
+static char worker_kind[FD_SETSIZE];
+static SVCXPRT *worker_xprts[FD_SETSIZE];	/* UDP transports */
+static SVCXPRT *worker_tcp = NULL;	/* copied for connections */
+static worker_conn_t *worker_conns[FD_SETSIZE];
+
+/* sockets not read for want of a free request */
+static int worker_stalled[FD_SETSIZE];
+static unsigned int worker_nstalled = 0;
+static char worker_waiting[FD_SETSIZE];
+
+/* operations of requests, wrapped for the duplicate request cache */
+static const struct xp_ops *worker_xops = NULL;
+
+/* encoded reply of the request handled by this thread */
+static UNFS3_TLS char *worker_out = NULL;
+static unsigned int worker_out_size = 0;
+
+/* wakes up the main thread */
+static int worker_pipe[2] = { -1, -1 };
+
+/* signals caught, handled by the main thread under the lock */
+static volatile sig_atomic_t worker_sighup = 0;
+static volatile sig_atomic_t worker_sigusr1 = 0;
+static volatile sig_atomic_t worker_sigexit = 0;
+
+/*
+ * take the server lock
+ */
+void worker_lock(void)
+{
+    if (worker_threads)
+	pthread_mutex_lock(&worker_mutex);
+}
+
+/*
+ * release the server lock
+ */
+void worker_unlock(void)
+{
+    if (worker_threads)
+	pthread_mutex_unlock(&worker_mutex);
+}
+
+/*
+ * check whether requests are handled by worker threads
+ */
+int worker_active(void)
+{
+    return worker_threads > 0;
+}
+
+/*
+ * report requests waiting for a worker and workers handling one
+ */
+void worker_stats(unsigned int *queued, unsigned int *busy)
+{
+    pthread_mutex_lock(&worker_qlock);
+    *queued = worker_queued;
+    *busy = worker_busy;
+    pthread_mutex_unlock(&worker_qlock);
+}
+
+/*
+ * note a TCP listening socket, connections are accepted by the main thread
+ */
+void worker_listen(int fd)
+{
+    if (fd >= 0 && fd < FD_SETSIZE)
+	worker_kind[fd] = WORKER_LISTEN;
+}
+
+/*
+ * note a UDP or TCP transport of the services, its requests and those of
+ * connections accepted from it are read by the main thread
+ */
+void worker_transport(SVCXPRT * transp)
+{
+    int fd, type;
+    socklen_t len = sizeof(type);
+
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    fd = transp->xp_fd;
+#else
+    fd = transp->xp_sock;
+#endif
+
+    if (fd < 0 || fd >= FD_SETSIZE ||
+	getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1)
+	return;
+
+    if (type == SOCK_DGRAM) {
+	worker_kind[fd] = WORKER_UDP;
+	worker_xprts[fd] = transp;
+    } else {
+	worker_kind[fd] = WORKER_LISTEN;
+	if (!worker_tcp)
+	    worker_tcp = transp;
+    }
+}
+
+/*
+ * wake up the main thread
+ */
+static void worker_wakeup(void)
+{
+    int res;
+
+    res = write(worker_pipe[1], "", 1);
+    (void) res;
+}
+
+/*
+ * signal handler in worker mode
+ */
+static void worker_signal(int sig)
+{
+    if (sig == SIGHUP)
+	worker_sighup = 1;
+    else if (sig == SIGUSR1)
+	worker_sigusr1 = 1;
+    else
+	worker_sigexit = sig;
+
+    worker_wakeup();
+}
+
+/*
+ * act on caught signals, called with the lock held
+ */
+static void worker_signals(void)
+{
+    if (worker_sigexit)
+	daemon_exit(worker_sigexit);
+
+    if (worker_sighup) {
+	worker_sighup = 0;
+	daemon_exit(SIGHUP);
+    }
+
+    if (worker_sigusr1) {
+	worker_sigusr1 = 0;
+	daemon_exit(SIGUSR1);
+    }
+}
+
+/*
+ * take a free request, NULL if there is none
+ */
+static worker_req_t *worker_get(void)
+{
+    worker_req_t *req;
+
+    pthread_mutex_lock(&worker_qlock);
+    req = worker_free;
+    if (req)
+	worker_free = req->next;
+    else
+	worker_starved = TRUE;
+    pthread_mutex_unlock(&worker_qlock);
+
+    return req;
+}
+
+/*
+ * return a request to the free ones, called with worker_qlock held
+ */
+static void worker_put(worker_req_t * req)
+{
+    req->next = worker_free;
+    worker_free = req;
+
+    if (worker_starved) {
+	worker_starved = FALSE;
+	worker_wakeup();
+    }
+}
+
+/*
+ * queue a request for the workers
+ */
+static void worker_push(worker_req_t * req)
+{
+    req->next = NULL;
+
+    pthread_mutex_lock(&worker_qlock);
+    if (worker_tail)
+	worker_tail->next = req;
+    else
+	worker_head = req;
+    worker_tail = req;
+    worker_queued++;
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_qlock);
+}
+
+/*
+ * make room for size bytes in the buffer of a request
+ */
+static int worker_reserve(worker_req_t * req, unsigned int size)
+{
+    if (size <= req->size)
+	return TRUE;
+
+    free(req->buf);
+    req->buf = malloc(size);
+    req->size = req->buf ? size : 0;
+    if (!req->buf)
+	logmsg(LOG_CRIT, "unable to allocate request buffer");
+
+    return req->buf != NULL;
+}
+
+/*
+ * set up the transport of a request read from fd
+ */
+static void worker_prepare(worker_req_t * req, int kind, int fd)
+{
+    req->xprt = kind == WORKER_UDP ? *worker_xprts[fd] : *worker_tcp;
+    req->xprt.xp_ops = worker_xops;
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    req->xprt.xp_fd = fd;
+#else
+    req->xprt.xp_sock = fd;
+#endif
+#ifdef HAVE_RPC_SVC_MT_H
+    memset(&req->ext, 0, sizeof(req->ext));
+    req->xprt.xp_p3 = &req->ext;
+#endif
+    memcpy(&req->xprt.xp_raddr, &req->addr, sizeof(struct sockaddr_in));
+    req->xprt.xp_addrlen = req->addrlen;
+    req->kind = kind;
+    req->fd = fd;
+}
+
+static bool_t worker_recv(U(SVCXPRT * xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+static enum xprt_stat worker_stat(U(SVCXPRT * xprt))
+{
+    return XPRT_IDLE;
+}
+
+static bool_t worker_getargs(SVCXPRT * xprt, xdrproc_t proc, void *args)
+{
+    worker_req_t *req = (worker_req_t *) xprt;
+
+    return proc(&req->xdrs, args);
+}
+
+/*
+ * send a UDP reply from the address the request was sent to
+ */
+static bool_t worker_send_udp(worker_req_t * req, char *buf,
+			      unsigned int len)
+{
+    struct msghdr in, out;
+    struct iovec iov;
+    ssize_t res;
+
+    memset(&in, 0, sizeof(in));
+    in.msg_control = req->ctl;
+    in.msg_controllen = req->ctllen;
+
+    memset(&out, 0, sizeof(out));
+    out.msg_name = &req->addr;
+    out.msg_namelen = req->addrlen;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    out.msg_iov = &iov;
+    out.msg_iovlen = 1;
+    udp_pktinfo(&in, &out);
+
+    do
+	res = sendmsg(req->fd, &out, 0);
+    while (res == -1 && errno == EINTR);
+
+    return res != -1;
+}
+
+/*
+ * send a TCP reply as a single record fragment
+ *
+ * replies for a connection that has ended meanwhile are dropped, the
+ * client sends the request again
+ */
+static bool_t worker_send_tcp(worker_req_t * req, char *buf,
+			      unsigned int len)
+{
+    u_int32_t mark;
+    ssize_t res;
+
+    mark = htonl(0x80000000 | len);
+    memcpy(buf - 4, &mark, 4);
+    buf -= 4;
+    len += 4;
+
+    if (!worker_send_begin(&req->xprt))
+	return TRUE;
+
+    while (len > 0) {
+	res = send(req->fd, buf, len, 0);
+	if (res == -1 && errno == EINTR)
+	    continue;
+	if (res <= 0) {
+	    shutdown(req->fd, SHUT_RDWR);
+	    break;
+	}
+	buf += res;
+	len -= res;
+    }
+
+    worker_send_end(&req->xprt);
+    return len == 0;
+}
+
+/*
+ * encode a reply into the buffer of this thread and send it
+ */
+static bool_t worker_reply(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    worker_req_t *req = (worker_req_t *) xprt;
+    XDR xdrs;
+    unsigned int len;
+
+    msg->rm_xid = req->xid;
+    xdrmem_create(&xdrs, worker_out + 4, worker_out_size - 4, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, msg)) {
+	xdr_destroy(&xdrs);
+	return FALSE;
+    }
+    len = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+
+    if (req->kind == WORKER_UDP)
+	return worker_send_udp(req, worker_out + 4, len);
+    else
+	return worker_send_tcp(req, worker_out + 4, len);
+}
+
+static bool_t worker_freeargs(U(SVCXPRT * xprt), xdrproc_t proc, void *args)
+{
+    xdr_free(proc, args);
+    return TRUE;
+}
+
+static void worker_destroy(U(SVCXPRT * xprt))
+{
+}
+
+static const struct xp_ops worker_ops = {
+    worker_recv, worker_stat, worker_getargs, worker_reply, worker_freeargs,
+    worker_destroy
+};
+
+/*
+ * get the right to write to the connection of a request, FALSE if the
+ * connection has ended meanwhile; always TRUE for other transports
+ */
+int worker_send_begin(SVCXPRT * xprt)
+{
+    worker_req_t *req = (worker_req_t *) xprt;
+    worker_conn_t *c;
+
+    if (!worker_threads || xprt->xp_ops != worker_xops ||
+	req->kind != WORKER_TCP)
+	return TRUE;
+
+    c = worker_conns[req->fd];
+    pthread_mutex_lock(&c->send);
+    if (c->gen == req->gen)
+	return TRUE;
+
+    pthread_mutex_unlock(&c->send);
+    return FALSE;
+}
+
+/*
+ * done writing to the connection of a request
+ */
+void worker_send_end(SVCXPRT * xprt)
+{
+    worker_req_t *req = (worker_req_t *) xprt;
+
+    if (!worker_threads || xprt->xp_ops != worker_xops ||
+	req->kind != WORKER_TCP)
+	return;
+
+    pthread_mutex_unlock(&worker_conns[req->fd]->send);
+}
+
+/*
+ * worker thread, handles queued requests
+ */
+static void *worker_main(void *arg)
+{
+    worker_req_t *req;
+
+    worker_out = arg;
+
+    for (;;) {
+	pthread_mutex_lock(&worker_qlock);
+	while (!worker_head)
+	    pthread_cond_wait(&worker_cond, &worker_qlock);
+
+	req = worker_head;
+	worker_head = req->next;
+	if (!worker_head)
+	    worker_tail = NULL;
+	worker_queued--;
+	worker_busy++;
+	pthread_mutex_unlock(&worker_qlock);
+
+	xdrmem_create(&req->xdrs, req->buf, req->len, XDR_DECODE);
+	udp_call(&req->xprt, &req->xdrs, &req->xid);
+	xdr_destroy(&req->xdrs);
+
+	/* buffers of large TCP requests are not kept */
+	if (req->size > NFS_MAX_UDP_PACKET) {
+	    free(req->buf);
+	    req->buf = NULL;
+	    req->size = 0;
+	}
+
+	pthread_mutex_lock(&worker_qlock);
+	worker_busy--;
+	worker_put(req);
+	pthread_mutex_unlock(&worker_qlock);
+    }
+
+    return NULL;
+}
+
+/*
+ * start worker threads
+ */
+void worker_init(void)
+{
+    struct sigaction act;
+    sigset_t set, old;
+    pthread_t thread;
+    SVCXPRT tmpl;
+    worker_req_t *reqs;
+    void *out;
+    unsigned int i;
+
+    if (opt_workers == 0)
+	return;
+
+    if (pipe(worker_pipe) == -1) {
+	logmsg(LOG_EMERG, "unable to create worker pipe, aborting");
+	daemon_exit(CRISIS);
+    }
+    fcntl(worker_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(worker_pipe[1], F_SETFL, O_NONBLOCK);
+
+    reqs = calloc(opt_workers * WORKER_AHEAD, sizeof(worker_req_t));
+    if (!reqs) {
+	logmsg(LOG_EMERG, "unable to allocate worker requests, aborting");
+	daemon_exit(CRISIS);
+    }
+    for (i = 0; i < opt_workers * WORKER_AHEAD; i++) {
+	reqs[i].next = worker_free;
+	worker_free = &reqs[i];
+    }
+
+    /* the xid of requests is noted for the duplicate request cache */
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.xp_ops = &worker_ops;
+    drc_watch(&tmpl);
+    worker_xops = tmpl.xp_ops;
+
+    /* replies may be as large as the largest request */
+    worker_out_size = 4 + WORKER_RECORD;
+    if (worker_out_size < 4 + NFS_MAX_UDP_PACKET)
+	worker_out_size = 4 + NFS_MAX_UDP_PACKET;
+
+    for (i = 0; i < FD_SETSIZE; i++)
+	if (worker_xprts[i])
+	    udp_pktinfo_on(i);
+
+    /* defer signals to the main thread, they touch shared state */
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = worker_signal;
+    act.sa_flags = 0;
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGQUIT, &act, NULL);
+    sigaction(SIGUSR1, &act, NULL);
+
+    /* workers start with all signals but SIGSEGV blocked */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    worker_threads = opt_workers;
+    for (i = 0; i < opt_workers; i++) {
+	out = malloc(worker_out_size);
+	if (!out || pthread_create(&thread, NULL, worker_main, out) != 0) {
+	    logmsg(LOG_EMERG, "unable to create worker thread, aborting");
+	    daemon_exit(CRISIS);
+	}
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * find out whether an unknown socket is a connection of the services
+ */
+static int worker_classify(int fd)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int type;
+    socklen_t tlen = sizeof(type);
+    worker_conn_t *c;
+
+    /* the local address works even after the client has gone */
+    if (!worker_tcp ||
+	getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &tlen) == -1 ||
+	type != SOCK_STREAM ||
+	getsockname(fd, (struct sockaddr *) &sin, &len) == -1 ||
+	sin.sin_family != AF_INET)
+	return WORKER_OTHER;
+
+    c = worker_conns[fd];
+    if (!c) {
+	c = calloc(1, sizeof(worker_conn_t));
+	if (!c) {
+	    /* the RPC library must not dispatch it, see worker_close() */
+	    logmsg(LOG_CRIT, "unable to allocate connection state");
+	    shutdown(fd, SHUT_RDWR);
+	    return WORKER_OTHER;
+	}
+	pthread_mutex_init(&c->send, NULL);
+	worker_conns[fd] = c;
+    }
+
+    memset(&c->addr, 0, sizeof(c->addr));
+    c->addrlen = sizeof(c->addr);
+    if (getpeername(fd, (struct sockaddr *) &c->addr, &c->addrlen) == -1)
+	c->addrlen = sizeof(c->addr);
+
+    return WORKER_TCP;
+}
+
+/*
+ * end a connection
+ *
+ * shutting the socket down wakes up workers sending to it; the RPC
+ * library then reads the end of the connection and destroys its
+ * transport, without the server lock in case it still finds a request
+ */
+static void worker_close(int fd)
+{
+    worker_conn_t *c = worker_conns[fd];
+
+    shutdown(fd, SHUT_RDWR);
+
+    pthread_mutex_lock(&c->send);
+    c->gen++;
+    pthread_mutex_unlock(&c->send);
+
+    free(c->buf);
+    c->buf = NULL;
+    c->len = 0;
+    c->size = 0;
+    worker_kind[fd] = WORKER_OTHER;
+
+    svc_getreq_common(fd);
+}
+
+/*
+ * read datagrams from a UDP socket
+ */
+static int worker_read_udp(int fd)
+{
+    worker_req_t *req;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n;
+    unsigned int i;
+
+    for (i = 0; i < WORKER_AHEAD; i++) {
+	req = worker_get();
+	if (!req)
+	    return WORKER_FULL;
+
+	if (!worker_reserve(req, NFS_MAX_UDP_PACKET))
+	    n = -1;
+	else {
+	    memset(&msg, 0, sizeof(msg));
+	    iov.iov_base = req->buf;
+	    iov.iov_len = NFS_MAX_UDP_PACKET;
+	    msg.msg_name = &req->addr;
+	    msg.msg_namelen = sizeof(req->addr);
+	    msg.msg_iov = &iov;
+	    msg.msg_iovlen = 1;
+	    msg.msg_control = req->ctl;
+	    msg.msg_controllen = UDP_CTL_SIZE;
+
+	    do
+		n = recvmsg(fd, &msg, MSG_DONTWAIT);
+	    while (n == -1 && errno == EINTR);
+	}
+
+	if (n < (ssize_t) (4 * sizeof(u_int32_t))) {
+	    pthread_mutex_lock(&worker_qlock);
+	    worker_put(req);
+	    pthread_mutex_unlock(&worker_qlock);
+	    if (n == -1)
+		return WORKER_DONE;
+	    continue;
+	}
+
+	req->len = n;
+	req->addrlen = msg.msg_namelen;
+	req->ctllen = msg.msg_controllen;
+	worker_prepare(req, WORKER_UDP, fd);
+	worker_push(req);
+    }
+
+    return WORKER_DONE;
+}
+
+/*
+ * hand the complete records read from a connection to workers
+ */
+static int worker_records(int fd, worker_conn_t * c)
+{
+    worker_req_t *req;
+    u_int32_t mark;
+    unsigned int base, pos, frag, total, res = WORKER_DONE;
+
+    c->want = 0;
+    for (base = 0;; base = pos) {
+	/* find the end of the next record */
+	for (pos = base, total = 0;; pos += 4 + frag) {
+	    if (c->len - pos < 4)
+		goto out;
+	    memcpy(&mark, c->buf + pos, 4);
+	    mark = ntohl(mark);
+	    frag = mark & 0x7fffffff;
+	    total += frag;
+	    if (frag > WORKER_RECORD || total > WORKER_RECORD) {
+		logmsg(LOG_WARNING, "oversized RPC record from %s",
+		       inet_ntoa(c->addr.sin_addr));
+		return WORKER_GONE;
+	    }
+	    if (c->len - pos - 4 < frag) {
+		c->want = pos + 4 + frag - base;
+		goto out;
+	    }
+	    if (mark & 0x80000000)
+		break;
+	}
+	pos += 4 + frag;
+
+	req = worker_get();
+	if (!req) {
+	    res = WORKER_FULL;
+	    pos = base;
+	    goto out;
+	}
+	if (!worker_reserve(req, total)) {
+	    pthread_mutex_lock(&worker_qlock);
+	    worker_put(req);
+	    pthread_mutex_unlock(&worker_qlock);
+	    return WORKER_GONE;
+	}
+
+	/* join the fragments */
+	for (req->len = 0; base < pos; base += 4 + frag) {
+	    memcpy(&mark, c->buf + base, 4);
+	    frag = ntohl(mark) & 0x7fffffff;
+	    memcpy(req->buf + req->len, c->buf + base + 4, frag);
+	    req->len += frag;
+	}
+
+	memcpy(&req->addr, &c->addr, sizeof(c->addr));
+	req->addrlen = c->addrlen;
+	req->gen = c->gen;
+	worker_prepare(req, WORKER_TCP, fd);
+	worker_push(req);
+    }
+
+  out:
+    /* keep the rest at the start of the buffer */
+    if (base > 0) {
+	memmove(c->buf, c->buf + base, c->len - base);
+	c->len -= base;
+    }
+
+    return res;
+}
+
+/*
+ * read from a TCP connection
+ */
+static int worker_read_tcp(int fd)
+{
+    worker_conn_t *c = worker_conns[fd];
+    unsigned int size;
+    ssize_t n;
+    char *buf;
+    int res;
+
+    /* records already read go first */
+    if (c->len > 0 && (res = worker_records(fd, c)) != WORKER_DONE)
+	return res;
+
+    /* room for the next record, large buffers go when they are empty */
+    size = c->size;
+    if (size == 0 || (c->len == 0 && size > WORKER_READ))
+	size = WORKER_READ;
+    if (c->want > size)
+	size = c->want;
+    if (c->len == size)
+	size *= 2;
+    if (size != c->size) {
+	if (size > 2 * WORKER_RECORD + WORKER_READ)
+	    return WORKER_GONE;
+	buf = realloc(c->buf, size);
+	if (!buf) {
+	    logmsg(LOG_CRIT, "unable to allocate connection buffer");
+	    return WORKER_GONE;
+	}
+	c->buf = buf;
+	c->size = size;
+    }
+
+    do
+	n = recv(fd, c->buf + c->len, c->size - c->len, MSG_DONTWAIT);
+    while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return WORKER_DONE;
+    if (n <= 0)
+	return WORKER_GONE;
+
+    c->len += n;
+    return worker_records(fd, c);
+}
+
+/*
+ * read requests from a readable socket without the server lock, and arm
+ * it again; FALSE for sockets left to the RPC library
+ */
+static int worker_readable(int fd)
+{
+    int res;
+
+    if (fd < 0 || fd >= FD_SETSIZE)
+	return FALSE;
+
+    if (worker_kind[fd] == WORKER_OTHER)
+	worker_kind[fd] = worker_classify(fd);
+
+    if (worker_kind[fd] == WORKER_UDP)
+	res = worker_read_udp(fd);
+    else if (worker_kind[fd] == WORKER_TCP)
+	res = worker_read_tcp(fd);
+    else
+	return FALSE;
+
+    if (res == WORKER_GONE)
+	worker_close(fd);
+    else if (res == WORKER_FULL) {
+	/* read again once a request is free */
+	worker_waiting[fd] = TRUE;
+	worker_stalled[worker_nstalled++] = fd;
+    } else
+	event_rearm(fd);
+
+    return TRUE;
+}
+
+/*
+ * go on with sockets that ran out of requests
+ */
+static void worker_resume(void)
+{
+    int fds[FD_SETSIZE];
+    unsigned int i, n = worker_nstalled;
+
+    memcpy(fds, worker_stalled, n * sizeof(int));
+    worker_nstalled = 0;
+
+    for (i = 0; i < n; i++) {
+	worker_waiting[fds[i]] = FALSE;
+	worker_readable(fds[i]);
+    }
+}
+
+/*
+ * empty the wakeup pipe
+ */
+static void worker_drain(void)
+{
+    char buf[64];
+
+    while (read(worker_pipe[0], buf, sizeof(buf)) > 0);
+    worker_resume();
+}
+
+#ifdef UNFS3_EPOLL
+/*
+ * event loop in worker mode with epoll
+ *
+ * a socket reports one event and is armed again once its requests have
+ * been read, so the main thread does not need to build a poll set of the
+ * idle sockets on every iteration
+ */
+static void worker_event_run(void)
+{
+    int fds[EVENT_BATCH];
+    int i, n, tick = FALSE, accepted;
+
+    for (;;) {
+	pthread_mutex_lock(&worker_mutex);
+	worker_signals();
+	if (tick) {
+	    fd_cache_close_inactive();
+	    readdir_close_inactive();
+	    stats_close_inactive();
+	}
+	locate_step();
+	pthread_mutex_unlock(&worker_mutex);
+
+	n = event_wait(fds, EVENT_BATCH, locate_active() ? 0 : -1, &tick);
+
+	if (n < 0 && errno != EINTR) {
+	    perror("worker_event_run: epoll_wait failed");
+	    return;
+	}
+
+	/* read requests first, without holding the server lock */
+	for (i = 0; i < n; i++) {
+	    if (fds[i] == worker_pipe[0]) {
+		worker_drain();
+		fds[i] = -1;
+	    } else if (worker_readable(fds[i]))
+		fds[i] = -1;
+	}
+
+	/* accept connections, and serve the statistics sockets */
+	pthread_mutex_lock(&worker_mutex);
+	for (i = 0, accepted = FALSE; i < n; i++) {
+	    if (fds[i] == -1)
+		continue;
+	    svc_getreq_common(fds[i]);
+	    if (event_listener(fds[i]))
+		accepted = TRUE;
+	    else
+		event_rearm(fds[i]);
+	}
+	if (accepted)
+	    event_sync();
+	pthread_mutex_unlock(&worker_mutex);
+    }
+}
+#endif				       /* UNFS3_EPOLL */
+
+/*
+ * event loop in worker mode
+ */
+void worker_svc_run(void)
+{
+    struct pollfd *set = NULL;
+    int i, n, r, fd, timeout, size = 0;
+
+#ifdef UNFS3_EPOLL
+    if (event_init(TRUE)) {
+	event_add(worker_pipe[0]);
+	worker_event_run();
+	return;
+    }
+#endif
+
+    for (;;) {
+	pthread_mutex_lock(&worker_mutex);
+	worker_signals();
+	fd_cache_close_inactive();
+	readdir_close_inactive();
+	stats_close_inactive();
+	locate_step();
+	pthread_mutex_unlock(&worker_mutex);
+
+	if (size < svc_max_pollfd + 1) {
+	    size = svc_max_pollfd + 1;
+	    set = realloc(set, sizeof(struct pollfd) * size);
+	    if (!set) {
+		logmsg(LOG_EMERG, "unable to allocate poll set, aborting");
+		daemon_exit(CRISIS);
+	    }
+	}
+
+	/* poll all sockets but those waiting for a free request */
+	set[0].fd = worker_pipe[0];
+	set[0].events = POLLIN;
+	set[0].revents = 0;
+	for (i = 0, n = 1; i < svc_max_pollfd; i++) {
+	    fd = svc_pollfd[i].fd;
+	    if (fd < 0 || (fd < FD_SETSIZE && worker_waiting[fd]))
+		continue;
+	    set[n] = svc_pollfd[i];
+	    set[n].revents = 0;
+	    n++;
+	}
+	timeout = locate_active() ? 0 : 2 * 1000;
+
+	r = poll(set, n, timeout);
+
+	if (r < 0 && errno != EINTR) {
+	    perror("worker_svc_run: poll failed");
+	    return;
+	}
+
+	/* read requests first, without holding the server lock */
+	if (r > 0 && set[0].revents)
+	    worker_drain();
+	for (i = 1; i < n && r > 0; i++)
+	    if (set[i].revents && worker_readable(set[i].fd))
+		set[i].revents = 0;
+
+	/* accepting a connection does not block */
+	pthread_mutex_lock(&worker_mutex);
+	for (i = 1; i < n && r > 0; i++)
+	    if (set[i].revents)
+		svc_getreq_common(set[i].fd);
+	pthread_mutex_unlock(&worker_mutex);
+    }
+}
+
+#else				       /* UNFS3_WORKERS */
+
+void worker_init(void)
+{
+    if (opt_workers > 0)
+	logmsg(LOG_WARNING, "worker threads not supported on this platform");
+}
+
+int worker_active(void)
+{
+    return FALSE;
+}
+
+void worker_stats(unsigned int *queued, unsigned int *busy)
+{
+    *queued = 0;
+    *busy = 0;
+}
+
+void worker_listen(U(int fd))
+{
+}
+
+void worker_transport(U(SVCXPRT * transp))
+{
+}
+
+int worker_send_begin(U(SVCXPRT * xprt))
+{
+    return TRUE;
+}
+
+void worker_send_end(U(SVCXPRT * xprt))
+{
+}
+
+void worker_svc_run(void)
+{
+}
+
+void worker_lock(void)
+{
+}
+
+void worker_unlock(void)
+{
+}
+
+#endif				       /* UNFS3_WORKERS */
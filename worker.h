@@ -0,0 +1,24 @@
+/*
+ * UNFS3 worker threads
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_WORKER_H
+#define UNFS3_WORKER_H
+
+/* maximum number of worker threads */
+#define WORKER_MAX 256
+
+void worker_init(void);
+int worker_active(void);
+void worker_stats(unsigned int *queued, unsigned int *busy);
+void worker_listen(int fd);
+void worker_transport(SVCXPRT * transp);
+int worker_send_begin(SVCXPRT * xprt);
+void worker_send_end(SVCXPRT * xprt);
+void worker_svc_run(void);
+
+void worker_lock(void);
+void worker_unlock(void);
+
+#endif
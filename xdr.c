@@ -7,6 +7,7 @@
 
 #include <sys/types.h>
 #include <rpc/rpc.h>
+#include <stdlib.h>
 #ifndef WIN32
 #include <netinet/in.h>
 #endif				       /* WIN32 */
@@ -20,6 +21,49 @@
 #include "mount.h"
 #include "nfs.h"
 #include "xdr.h"
+#include "arena.h"
+
+/*
+ * variable-length data of NFS arguments, decoded into the request arena
+ * if there is one, see arena.c; does the same as xdr_string() for a
+ * string, or xdr_bytes() otherwise
+ */
+static bool_t xdr_arena(XDR * xdrs, char **cpp, u_int * sizep, u_int maxsize)
+{
+    u_int size;
+    char *buf;
+
+    if (xdrs->x_op == XDR_FREE && arena_owns(*cpp)) {
+	*cpp = NULL;
+	return TRUE;
+    }
+    if (xdrs->x_op != XDR_DECODE || *cpp != NULL) {
+	if (!sizep)
+	    return xdr_string(xdrs, cpp, maxsize);
+	return xdr_bytes(xdrs, cpp, sizep, maxsize);
+    }
+
+    if (!xdr_u_int(xdrs, &size))
+	return FALSE;
+    if (size > maxsize)
+	return FALSE;
+
+    /* room for the terminating zero of a string */
+    buf = arena_alloc((size_t) size + 1);
+    if (!buf)
+	buf = malloc((size_t) size + 1);
+    if (!buf)
+	return FALSE;
+    *cpp = buf;
+
+    if (!xdr_opaque(xdrs, buf, size))
+	return FALSE;
+    if (sizep)
+	*sizep = size;
+    else
+	buf[size] = 0;
+    return TRUE;
+}
 
 bool_t xdr_fhandle3(XDR * xdrs, fhandle3 * objp)
 {
@@ -237,14 +281,14 @@ bool_t xdr_int32(XDR * xdrs, int32 * objp)
 
 bool_t xdr_filename3(XDR * xdrs, filename3 * objp)
 {
-    if (!xdr_string(xdrs, objp, ~0))
+    if (!xdr_arena(xdrs, objp, NULL, ~0))
 	return FALSE;
     return TRUE;
 }
 
 bool_t xdr_nfspath3(XDR * xdrs, nfspath3 * objp)
 {
-    if (!xdr_string(xdrs, objp, ~0))
+    if (!xdr_arena(xdrs, objp, NULL, ~0))
 	return FALSE;
     return TRUE;
 }
@@ -351,7 +395,7 @@ bool_t xdr_specdata3(XDR * xdrs, specdata3 * objp)
 
 bool_t xdr_nfs_fh3(XDR * xdrs, nfs_fh3 * objp)
 {
-    if (!xdr_bytes
+    if (!xdr_arena
 	(xdrs, (char **) &objp->data.data_val,
 	 (u_int *) & objp->data.data_len, NFS3_FHSIZE))
 	return FALSE;
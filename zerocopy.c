@@ -0,0 +1,194 @@
+/*
+ * UNFS3 zero-copy READ replies
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include "nfs.h"
+#include "mount.h"
+#include "xdr.h"
+#include "daemon.h"
+#include "drc.h"
+#include "worker.h"
+#include "zerocopy.h"
+
+/*
+ * encode successful READ3res up to the data, which is sent separately
+ */
+bool_t xdr_READ3res_head(XDR * xdrs, READ3res * objp)
+{
+    READ3resok *ok = &objp->READ3res_u.resok;
+
+    return xdr_nfsstat3(xdrs, &objp->status) &&
+	xdr_post_op_attr(xdrs, &ok->file_attributes) &&
+	xdr_count3(xdrs, &ok->count) &&
+	xdr_bool(xdrs, &ok->eof) && xdr_u_int(xdrs, &ok->data.data_len);
+}
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+
+/*
+ * on TCP, READ replies are written to the socket by the server itself:
+ * the record mark, RPC reply header, and READ3resok up to the length of
+ * the data are encoded into a small buffer, and the data then goes from
+ * the file to the socket with sendfile(), without passing through our
+ * read buffer and the send buffer of the RPC library
+ *
+ * the xid of the request is taken from the duplicate request cache,
+ * which notes it for all transports from their second request on
+ */
+
+/* record mark, RPC reply header with verifier, READ3res up to the data */
+#define ZEROCOPY_HEAD	(4 + 6 * 4 + MAX_AUTH_BYTES + 26 * 4)
+
+/*
+ * check whether a READ reply can be sent with zerocopy_read()
+ *
+ * must only be called for requests received over TCP
+ */
+int zerocopy_ready(struct svc_req *rqstp, count3 count)
+{
+    return count >= ZEROCOPY_MIN && drc_xid(rqstp->rq_xprt, NULL);
+}
+
+/*
+ * send buffer completely
+ */
+static int zerocopy_send(int sock, const char *buf, size_t len, int flags)
+{
+    ssize_t res;
+
+    while (len > 0) {
+	res = send(sock, buf, len, flags);
+	if (res == -1 && errno == EINTR)
+	    continue;
+	if (res <= 0)
+	    return -1;
+	buf += res;
+	len -= res;
+    }
+
+    return 0;
+}
+
+/*
+ * send successful READ reply for data.data_len bytes of fd at offset
+ *
+ * the data must be in the file, on failure the connection is shut down
+ * and the client sends the request again
+ */
+void zerocopy_read(struct svc_req *rqstp, READ3res * res, int fd,
+		   off64_t offset)
+{
+    SVCXPRT *xprt = rqstp->rq_xprt;
+    static const char zero[4] = { 0, 0, 0, 0 };
+    static const int cork = 1, uncork = 0;
+    char head[ZEROCOPY_HEAD];
+    struct rpc_msg reply;
+    XDR xdrs;
+    u_int32_t mark;
+    unsigned int hlen, len, pad;
+    off_t off = offset;
+    ssize_t sent;
+    int sock;
+
+#if HAVE_STRUCT___RPC_SVCXPRT_XP_FD == 1
+    sock = xprt->xp_fd;
+#else
+    sock = xprt->xp_sock;
+#endif
+
+    len = res->READ3res_u.resok.data.data_len;
+    pad = (4 - (len & 3)) & 3;
+
+    drc_xid(xprt, &reply.rm_xid);
+    reply.rm_direction = REPLY;
+    reply.rm_reply.rp_stat = MSG_ACCEPTED;
+    reply.acpted_rply.ar_verf = xprt->xp_verf;
+    reply.acpted_rply.ar_stat = SUCCESS;
+    reply.acpted_rply.ar_results.where = (caddr_t) res;
+    reply.acpted_rply.ar_results.proc = (xdrproc_t) xdr_READ3res_head;
+
+    xdrmem_create(&xdrs, head + 4, sizeof(head) - 4, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, &reply)) {
+	logmsg(LOG_CRIT, "unable to encode READ reply");
+	shutdown(sock, SHUT_RDWR);
+	return;
+    }
+
+    hlen = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+
+    /* the reply is a single record fragment */
+    mark = htonl(0x80000000 | (hlen + len + pad));
+    memcpy(head, &mark, 4);
+
+    /* replies of worker threads do not mix */
+    if (!worker_send_begin(xprt))
+	return;
+
+#ifdef TCP_CORK
+    /* send the padding along with the end of the data */
+    if (pad > 0)
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+#endif
+
+    if (zerocopy_send(sock, head, hlen + 4, len > 0 ? MSG_MORE : 0) == -1)
+	goto fail;
+
+    while (len > 0) {
+	sent = sendfile(sock, fd, &off, len);
+	if (sent == -1 && errno == EINTR)
+	    continue;
+
+	/* the file may have been truncated meanwhile */
+	if (sent <= 0)
+	    goto fail;
+	len -= sent;
+    }
+
+    if (pad > 0) {
+	if (zerocopy_send(sock, zero, pad, 0) == -1)
+	    goto fail;
+#ifdef TCP_CORK
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &uncork, sizeof(uncork));
+#endif
+    }
+
+    worker_send_end(xprt);
+    return;
+
+  fail:
+    shutdown(sock, SHUT_RDWR);
+    worker_send_end(xprt);
+}
+
+#else				       /* HAVE_SENDFILE */
+
+int zerocopy_ready(U(struct svc_req *rqstp), U(count3 count))
+{
+    return FALSE;
+}
+
+void zerocopy_read(U(struct svc_req *rqstp), U(READ3res * res), U(int fd),
+		   U(off64_t offset))
+{
+}
+
+#endif				       /* HAVE_SENDFILE */
@@ -0,0 +1,18 @@
+/*
+ * UNFS3 zero-copy READ replies
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_ZEROCOPY_H
+#define UNFS3_ZEROCOPY_H
+
+/* smaller READs are answered the normal way */
+#define ZEROCOPY_MIN	8192
+
+bool_t xdr_READ3res_head(XDR * xdrs, READ3res * objp);
+
+int zerocopy_ready(struct svc_req *rqstp, count3 count);
+void zerocopy_read(struct svc_req *rqstp, READ3res *res, int fd,
+		   off64_t offset);
+
+#endif